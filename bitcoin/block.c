@@ -3,14 +3,140 @@
 #include "bitcoin/tx.h"
 #include <ccan/str/hex/hex.h>
 
+/* Like pull_length in tx.c: a varint length which must fit. */
+static void skip_varint_blob(const u8 **cursor, size_t *max)
+{
+	u64 len = pull_varint(cursor, max);
+
+	if (len > *max) {
+		*cursor = NULL;
+		*max = 0;
+		return;
+	}
+	pull(cursor, max, NULL, len);
+}
+
+/* Same layout pull_bitcoin_tx expects, but we just remember where things
+ * are. */
+bool bitcoin_block_iter_next(struct bitcoin_block_iter *it,
+			     struct bitcoin_tx_ref *tx)
+{
+	u64 i, j, num;
+	u8 flag = 0;
+
+	if (!it->txs_left || !it->cursor)
+		return false;
+	it->txs_left--;
+
+	tx->raw = it->cursor;
+	pull_le32(&it->cursor, &it->max);
+	tx->body = it->cursor;
+	tx->input_count = pull_varint(&it->cursor, &it->max);
+	/* BIP 144 marker is 0 (impossible to have tx with 0 inputs) */
+	if (tx->input_count == 0) {
+		pull(&it->cursor, &it->max, &flag, 1);
+		if (flag != SEGREGATED_WITNESS_FLAG)
+			goto fail;
+		tx->body = it->cursor;
+		tx->input_count = pull_varint(&it->cursor, &it->max);
+	}
+
+	for (i = 0; i < tx->input_count && it->cursor; i++) {
+		/* txid, index */
+		pull(&it->cursor, &it->max, NULL, sizeof(struct sha256_double) + 4);
+		skip_varint_blob(&it->cursor, &it->max);
+		/* sequence_number */
+		pull(&it->cursor, &it->max, NULL, 4);
+	}
+
+	num = pull_varint(&it->cursor, &it->max);
+	for (i = 0; i < num && it->cursor; i++) {
+		/* amount */
+		pull(&it->cursor, &it->max, NULL, 8);
+		skip_varint_blob(&it->cursor, &it->max);
+	}
+	if (!it->cursor)
+		goto fail;
+	tx->body_len = it->cursor - tx->body;
+
+	if (flag & SEGREGATED_WITNESS_FLAG) {
+		for (i = 0; i < tx->input_count && it->cursor; i++) {
+			num = pull_varint(&it->cursor, &it->max);
+			for (j = 0; j < num && it->cursor; j++)
+				skip_varint_blob(&it->cursor, &it->max);
+		}
+	}
+	pull_le32(&it->cursor, &it->max);
+
+	if (!it->cursor)
+		goto fail;
+	tx->len = it->cursor - tx->raw;
+	return true;
+
+fail:
+	it->cursor = NULL;
+	it->max = 0;
+	return false;
+}
+
+void bitcoin_block_iter_init(struct bitcoin_block_iter *it,
+			     const struct bitcoin_block *b)
+{
+	it->cursor = b->txs;
+	it->max = b->txs_len;
+	it->txs_left = b->num_txs;
+}
+
+void bitcoin_tx_ref_input(const struct bitcoin_tx_ref *tx,
+			  const u8 **cursor,
+			  struct sha256_double *txid, u32 *index)
+{
+	size_t max;
+
+	if (!*cursor) {
+		*cursor = tx->body;
+		max = tx->body_len;
+		pull_varint(cursor, &max);
+	} else
+		max = tx->body + tx->body_len - *cursor;
+
+	pull(cursor, &max, txid, sizeof(*txid));
+	*index = pull_le32(cursor, &max);
+	skip_varint_blob(cursor, &max);
+	pull(cursor, &max, NULL, 4);
+}
+
+void bitcoin_tx_ref_txid(const struct bitcoin_tx_ref *tx,
+			 struct sha256_double *txid)
+{
+	struct sha256_ctx ctx = SHA256_INIT;
+
+	/* For TXID, we never use extended form: skip marker and witness. */
+	sha256_update(&ctx, tx->raw, 4);
+	sha256_update(&ctx, tx->body, tx->body_len);
+	sha256_update(&ctx, tx->raw + tx->len - 4, 4);
+	sha256_double_done(&ctx, txid);
+}
+
+struct bitcoin_tx *bitcoin_tx_ref_decode(const tal_t *ctx,
+					 const struct bitcoin_tx_ref *tx)
+{
+	const u8 *p = tx->raw;
+	size_t len = tx->len;
+
+	return pull_bitcoin_tx(ctx, &p, &len);
+}
+
 /* Encoding is <blockhdr> <varint-num-txs> <tx>... */
 struct bitcoin_block *bitcoin_block_from_hex(const tal_t *ctx,
 					     const char *hex, size_t hexlen)
 {
 	struct bitcoin_block *b;
-	u8 *linear_tx;
+	struct bitcoin_block_iter it;
+	struct bitcoin_tx_ref tx;
+	u8 *linear_block;
 	const u8 *p;
-	size_t len, i, num;
+	size_t len;
 
 	if (hexlen && hex[hexlen-1] == '\n')
 		hexlen--;
@@ -18,23 +144,25 @@ struct bitcoin_block *bitcoin_block_from_hex(const tal_t *ctx,
 	/* Set up the block for success. */
 	b = tal(ctx, struct bitcoin_block);
 
-	/* De-hex the array. */
+	/* De-hex the array: the block keeps it, and we walk it in place. */
 	len = hex_data_size(hexlen);
-	p = linear_tx = tal_arr(ctx, u8, len);
-	if (!hex_decode(hex, hexlen, linear_tx, len))
+	p = linear_block = tal_arr(b, u8, len);
+	if (!hex_decode(hex, hexlen, linear_block, len))
 		return tal_free(b);
 
 	pull(&p, &len, &b->hdr, sizeof(b->hdr));
-	num = pull_varint(&p, &len);
-	b->tx = tal_arr(b, struct bitcoin_tx *, num);
-	for (i = 0; i < num; i++)
-		b->tx[i] = pull_bitcoin_tx(b->tx, &p, &len);
+	b->num_txs = pull_varint(&p, &len);
+	if (!p)
+		return tal_free(b);
+	b->txs = p;
+	b->txs_len = len;
 
 	/* We should end up not overrunning, nor have extra */
-	if (!p || len)
+	bitcoin_block_iter_init(&it, b);
+	while (bitcoin_block_iter_next(&it, &tx));
+	if (!it.cursor || it.txs_left || it.max)
 		return tal_free(b);
 
-	tal_free(linear_tx);
 	return b;
 }
 
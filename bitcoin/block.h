@@ -2,6 +2,7 @@
 #define LIGHTNING_BITCOIN_BLOCK_H
 #include "config.h"
 #include "bitcoin/shadouble.h"
+#include "bitcoin/varint.h"
 #include <ccan/endian/endian.h>
 #include <ccan/short_types/short_types.h>
 #include <ccan/tal/tal.h>
@@ -18,13 +19,53 @@ struct bitcoin_block_hdr {
 
 struct bitcoin_block {
 	struct bitcoin_block_hdr hdr;
-	/* tal_count shows now many */
-	struct bitcoin_tx **tx;
+	/* Transactions are left serialized: use bitcoin_block_iter. */
+	u64 num_txs;
+	const u8 *txs;
+	size_t txs_len;
 };
 
+/* A transaction, as it sits inside a serialized block. */
+struct bitcoin_tx_ref {
+	/* The whole transaction, including any witness. */
+	const u8 *raw;
+	size_t len;
+	/* Input count to end of outputs: with version and locktime, this
+	 * is what the txid covers. */
+	const u8 *body;
+	size_t body_len;
+	varint_t input_count;
+};
+
+struct bitcoin_block_iter {
+	const u8 *cursor;
+	size_t max;
+	u64 txs_left;
+};
+
+/* Checks the transactions are well-formed, but doesn't decode them. */
 struct bitcoin_block *bitcoin_block_from_hex(const tal_t *ctx,
 					     const char *hex, size_t hexlen);
 
+/* Walk transactions in place: no allocations, nothing hashed. */
+void bitcoin_block_iter_init(struct bitcoin_block_iter *it,
+			     const struct bitcoin_block *b);
+bool bitcoin_block_iter_next(struct bitcoin_block_iter *it,
+			     struct bitcoin_tx_ref *tx);
+
+/* Outpoint spent by next input: set *cursor to NULL for the first. */
+void bitcoin_tx_ref_input(const struct bitcoin_tx_ref *tx,
+			  const u8 **cursor,
+			  struct sha256_double *txid, u32 *index);
+
+/* Hash the non-witness parts, without copying them. */
+void bitcoin_tx_ref_txid(const struct bitcoin_tx_ref *tx,
+			 struct sha256_double *txid);
+
+/* When you really want the whole thing. */
+struct bitcoin_tx *bitcoin_tx_ref_decode(const tal_t *ctx,
+					 const struct bitcoin_tx_ref *tx);
+
 /* Parse hex string to get blockid (reversed, a-la bitcoind). */
 bool bitcoin_blkid_from_hex(const char *hexstr, size_t hexstr_len,
 			    struct sha256_double *blockid);
@@ -261,11 +261,17 @@ void bitcoin_witness_p2sh_p2wpkh(const tal_t *ctx,
 u8 *scriptpubkey_p2wsh(const tal_t *ctx, const u8 *witnessscript)
 {
 	struct sha256 h;
+
+	sha256(&h, witnessscript, tal_count(witnessscript));
+	return scriptpubkey_p2wsh_hash(ctx, &h);
+}
+
+u8 *scriptpubkey_p2wsh_hash(const tal_t *ctx, const struct sha256 *h)
+{
 	u8 *script = tal_arr(ctx, u8, 0);
-	
+
 	add_op(&script, OP_0);
-	sha256(&h, witnessscript, tal_count(witnessscript));
-	add_push_bytes(&script, h.u.u8, sizeof(h.u.u8));
+	add_push_bytes(&script, h->u.u8, sizeof(h->u.u8));
 	return script;
 }
 
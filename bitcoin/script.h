@@ -82,6 +82,9 @@ u8 *bitcoin_redeem_htlc_recv(const tal_t *ctx,
 /* Create an output script for a 32-byte witness program. */
 u8 *scriptpubkey_p2wsh(const tal_t *ctx, const u8 *witnessscript);
 
+/* Same, given the sha256 of the witnessscript. */
+u8 *scriptpubkey_p2wsh_hash(const tal_t *ctx, const struct sha256 *h);
+
 /* Create an output script for a 20-byte witness program. */
 u8 *scriptpubkey_p2wpkh(const tal_t *ctx,
 			secp256k1_context *secpctx,
@@ -97,6 +97,17 @@ static void sha256_tx_one_input(struct bitcoin_tx *tx,
 
 	assert(input_num < tx->input_count);
 
+	/* BIP143 doesn't hash input scripts, so we ignore script (eg. a
+	 * P2SH-wrapped witness program's redeemscript) here. */
+	if (witness_script) {
+		struct bitcoin_tx_sighash sighash;
+
+		bitcoin_tx_sighash_init(&sighash, tx);
+		sha256_tx_input_for_sig(hash, &sighash, input_num, SIGHASH_ALL,
+					witness_script);
+		return;
+	}
+
 	/* You must have all inputs zeroed to start. */
 	for (i = 0; i < tx->input_count; i++)
 		assert(tx->input[i].script_length == 0);
@@ -128,6 +139,21 @@ void sign_tx_input(secp256k1_context *secpctx,
 	sign_hash(secpctx, privkey, &hash, sig);
 }
 
+void sign_sighash_input(secp256k1_context *secpctx,
+			const struct bitcoin_tx_sighash *sighash,
+			unsigned int in,
+			const u8 *witness_script,
+			const struct privkey *privkey, const struct pubkey *key,
+			struct signature *sig)
+{
+	struct sha256_double hash;
+
+	sha256_tx_input_for_sig(&hash, sighash, in, SIGHASH_ALL,
+				witness_script);
+	dump_tx("Signing", sighash->tx, in, NULL, 0, key, &hash);
+	sign_hash(secpctx, privkey, &hash, sig);
+}
+
 bool check_signed_hash(secp256k1_context *secpctx,
 		       const struct sha256_double *hash,
 		       const struct signature *signature,
@@ -167,6 +193,29 @@ bool check_tx_sig(secp256k1_context *secpctx,
 	return ret;
 }
 
+bool check_sighash_input_sig(secp256k1_context *secpctx,
+			     const struct bitcoin_tx_sighash *sighash,
+			     size_t input_num,
+			     const u8 *witness_script,
+			     const struct pubkey *key,
+			     const struct bitcoin_signature *sig)
+{
+	struct sha256_double hash;
+	bool ret;
+
+	/* We only use SIGHASH_ALL for the moment. */
+	if (sig->stype != SIGHASH_ALL)
+		return false;
+
+	sha256_tx_input_for_sig(&hash, sighash, input_num, SIGHASH_ALL,
+				witness_script);
+	ret = check_signed_hash(secpctx, &hash, &sig->sig, key);
+	if (!ret)
+		dump_tx("Sig failed", sighash->tx, input_num, NULL, 0,
+			key, &hash);
+	return ret;
+}
+
 /* Stolen direct from bitcoin/src/script/sign.cpp:
 // Copyright (c) 2009-2010 Satoshi Nakamoto
 // Copyright (c) 2009-2014 The Bitcoin Core developers
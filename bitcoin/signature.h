@@ -19,6 +19,7 @@ struct signature {
 
 struct sha256_double;
 struct bitcoin_tx;
+struct bitcoin_tx_sighash;
 struct pubkey;
 struct privkey;
 struct bitcoin_tx_output;
@@ -51,6 +52,21 @@ bool check_tx_sig(secp256k1_context *secpctx,
 		  const struct pubkey *key,
 		  const struct bitcoin_signature *sig);
 
+/* As above, for a segwit input with bitcoin_tx_sighash_init() done. */
+void sign_sighash_input(secp256k1_context *secpctx,
+			const struct bitcoin_tx_sighash *sighash,
+			unsigned int in,
+			const u8 *witness,
+			const struct privkey *privkey, const struct pubkey *pubkey,
+			struct signature *sig);
+
+bool check_sighash_input_sig(secp256k1_context *secpctx,
+			     const struct bitcoin_tx_sighash *sighash,
+			     size_t input_num,
+			     const u8 *witness,
+			     const struct pubkey *key,
+			     const struct bitcoin_signature *sig);
+
 /* Signature must have low S value. */
 bool sig_valid(secp256k1_context *secpctx, const struct signature *sig);
 
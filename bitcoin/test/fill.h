@@ -0,0 +1,15 @@
+#ifndef LIGHTNING_BITCOIN_TEST_FILL_H
+#define LIGHTNING_BITCOIN_TEST_FILL_H
+#include "config.h"
+#include <ccan/short_types/short_types.h>
+#include <stdlib.h>
+
+/* Shared by the unit tests: random bytes, repeatable after srandom(). */
+static inline void fill(void *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		((u8 *)p)[i] = random();
+}
+#endif /* LIGHTNING_BITCOIN_TEST_FILL_H */
@@ -0,0 +1,239 @@
+#include "bitcoin/block.c"
+#include "bitcoin/pullpush.c"
+#include "bitcoin/shadouble.c"
+#include "bitcoin/test/fill.h"
+#include "bitcoin/tx.c"
+#include "bitcoin/varint.c"
+#include "utils.c"
+#include <assert.h>
+#include <ccan/err/err.h>
+#include <ccan/str/str.h>
+#include <ccan/str/hex/hex.h>
+#include <ccan/structeq/structeq.h>
+#include <ccan/tal/grab_file/grab_file.h>
+#include <ccan/tal/str/str.h>
+#include <ccan/time/time.h>
+#include <inttypes.h>
+
+/* A mainnet-ish mix: p2pkh spends, and p2wpkh spends (with witness). */
+static struct bitcoin_tx *random_tx(const tal_t *ctx, bool segwit)
+{
+	struct bitcoin_tx *tx;
+	size_t i, j;
+
+	tx = bitcoin_tx(ctx, 1 + random() % 3, 2);
+	for (i = 0; i < tx->input_count; i++) {
+		fill(tx->input[i].txid.sha.u.u8, sizeof(tx->input[i].txid));
+		tx->input[i].index = random() % 4;
+		if (segwit) {
+			tx->input[i].witness = tal_arr(tx, u8 *, 2);
+			tx->input[i].witness[0] = tal_arr(tx, u8, 72);
+			tx->input[i].witness[1] = tal_arr(tx, u8, 33);
+			for (j = 0; j < 2; j++)
+				fill(tx->input[i].witness[j],
+				     tal_count(tx->input[i].witness[j]));
+		} else {
+			tx->input[i].script_length = 107;
+			tx->input[i].script = tal_arr(tx, u8, 107);
+			fill(tx->input[i].script, 107);
+		}
+	}
+	for (i = 0; i < tx->output_count; i++) {
+		tx->output[i].amount = random();
+		tx->output[i].script_length = segwit ? 22 : 25;
+		tx->output[i].script = tal_arr(tx, u8,
+					       tx->output[i].script_length);
+		fill(tx->output[i].script, tx->output[i].script_length);
+	}
+	return tx;
+}
+
+/* Returns hex of a block of about this size; fills in txs. */
+static char *random_block(const tal_t *ctx, size_t size,
+			  struct bitcoin_tx ***txs)
+{
+	struct bitcoin_block_hdr hdr;
+	u8 *body = tal_arr(ctx, u8, 0), *block;
+	size_t n = 0;
+	u8 varint[VARINT_MAX_LEN];
+	size_t varint_len;
+	char *hex;
+
+	*txs = tal_arr(ctx, struct bitcoin_tx *, 0);
+	while (tal_count(body) < size) {
+		u8 *lin;
+
+		tal_resize(txs, n+1);
+		(*txs)[n] = random_tx(*txs, n % 2);
+		lin = linearize_tx(body, (*txs)[n]);
+		push(lin, tal_count(lin), &body);
+		tal_free(lin);
+		n++;
+	}
+
+	fill((u8 *)&hdr, sizeof(hdr));
+	varint_len = varint_put(varint, n);
+	block = tal_arr(ctx, u8, 0);
+	push(&hdr, sizeof(hdr), &block);
+	push(varint, varint_len, &block);
+	push(body, tal_count(body), &block);
+	hex = tal_hexstr(ctx, block, tal_count(block));
+	tal_free(body);
+	tal_free(block);
+	return hex;
+}
+
+static void check_block(const char *hex, struct bitcoin_tx **txs)
+{
+	struct bitcoin_block *b;
+	struct bitcoin_block_iter it;
+	struct bitcoin_tx_ref ref;
+	size_t n = 0;
+
+	b = bitcoin_block_from_hex(NULL, hex, strlen(hex));
+	assert(b);
+	assert(b->num_txs == tal_count(txs));
+
+	bitcoin_block_iter_init(&it, b);
+	while (bitcoin_block_iter_next(&it, &ref)) {
+		struct sha256_double txid, expect;
+		struct bitcoin_tx *tx;
+		const u8 *cursor = NULL;
+		u8 *lin;
+		size_t i;
+
+		bitcoin_txid(txs[n], &expect);
+		bitcoin_tx_ref_txid(&ref, &txid);
+		assert(structeq(&txid, &expect));
+
+		assert(ref.input_count == txs[n]->input_count);
+		for (i = 0; i < ref.input_count; i++) {
+			u32 index;
+
+			bitcoin_tx_ref_input(&ref, &cursor, &txid, &index);
+			assert(structeq(&txid, &txs[n]->input[i].txid));
+			assert(index == txs[n]->input[i].index);
+		}
+
+		tx = bitcoin_tx_ref_decode(b, &ref);
+		lin = linearize_tx(tx, tx);
+		assert(tal_count(lin) == ref.len);
+		assert(memcmp(lin, ref.raw, ref.len) == 0);
+		tal_free(tx);
+		n++;
+	}
+	assert(it.cursor && it.max == 0);
+	assert(n == tal_count(txs));
+
+	/* Truncated, or with junk on the end, it fails. */
+	assert(!bitcoin_block_from_hex(NULL, hex, strlen(hex) - 2));
+	assert(!bitcoin_block_from_hex(NULL, tal_fmt(b, "%s00", hex),
+				       strlen(hex) + 2));
+	tal_free(b);
+}
+
+/* What connect_block used to do: decode every tx, then hash it. */
+static size_t decode_all(const struct bitcoin_block *b)
+{
+	const u8 *p = b->txs;
+	size_t len = b->txs_len, i, inputs = 0;
+	struct bitcoin_tx **txs;
+
+	txs = tal_arr(NULL, struct bitcoin_tx *, b->num_txs);
+	for (i = 0; i < b->num_txs; i++)
+		txs[i] = pull_bitcoin_tx(txs, &p, &len);
+	for (i = 0; i < b->num_txs; i++) {
+		struct sha256_double txid;
+		bitcoin_txid(txs[i], &txid);
+		inputs += txs[i]->input_count;
+	}
+	tal_free(txs);
+	return inputs;
+}
+
+static size_t scan_all(const struct bitcoin_block *b)
+{
+	struct bitcoin_block_iter it;
+	struct bitcoin_tx_ref ref;
+	size_t inputs = 0;
+
+	bitcoin_block_iter_init(&it, b);
+	while (bitcoin_block_iter_next(&it, &ref)) {
+		struct sha256_double txid;
+		const u8 *cursor = NULL;
+		u32 index;
+		size_t i;
+
+		for (i = 0; i < ref.input_count; i++)
+			bitcoin_tx_ref_input(&ref, &cursor, &txid, &index);
+		bitcoin_tx_ref_txid(&ref, &txid);
+		inputs += ref.input_count;
+	}
+	return inputs;
+}
+
+static void bench(const char *name, const char *hex)
+{
+	struct bitcoin_block *b;
+	struct timeabs start;
+	struct timerel hex_time, decode_time, scan_time;
+	size_t i, runs = 10;
+
+	start = time_now();
+	for (i = 0; i < runs; i++)
+		tal_free(bitcoin_block_from_hex(NULL, hex, strlen(hex)));
+	hex_time = time_between(time_now(), start);
+
+	b = bitcoin_block_from_hex(NULL, hex, strlen(hex));
+	if (!b)
+		errx(1, "%s: bad block", name);
+
+	start = time_now();
+	for (i = 0; i < runs; i++)
+		decode_all(b);
+	decode_time = time_between(time_now(), start);
+
+	start = time_now();
+	for (i = 0; i < runs; i++)
+		scan_all(b);
+	scan_time = time_between(time_now(), start);
+
+	assert(decode_all(b) == scan_all(b));
+	printf("%s (%zu bytes, %"PRIu64" txs): from_hex %"PRIu64"usec,"
+	       " then decode %"PRIu64"usec or scan %"PRIu64"usec per block\n",
+	       name, strlen(hex) / 2, b->num_txs,
+	       time_to_usec(hex_time) / runs,
+	       time_to_usec(decode_time) / runs,
+	       time_to_usec(scan_time) / runs);
+	tal_free(b);
+}
+
+/* With arguments, benchmarks on blocks in those files (as given by
+ * "bitcoin-cli getblock <hash> false"), or "gen" for a random 1MB one. */
+int main(int argc, char *argv[])
+{
+	struct bitcoin_tx **txs;
+	char *hex;
+	int i;
+
+	srandom(1);
+	hex = random_block(NULL, 20000, &txs);
+	check_block(hex, txs);
+	tal_free(hex);
+	tal_free(txs);
+
+	for (i = 1; i < argc; i++) {
+		if (streq(argv[i], "gen")) {
+			hex = random_block(NULL, 1000000, &txs);
+			tal_free(txs);
+		} else {
+			hex = grab_file(NULL, argv[i]);
+			if (!hex)
+				err(1, "Reading %s", argv[i]);
+			hex[strcspn(hex, "\n")] = '\0';
+		}
+		bench(argv[i], hex);
+		tal_free(hex);
+	}
+	return 0;
+}
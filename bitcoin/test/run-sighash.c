@@ -0,0 +1,135 @@
+#include "bitcoin/pullpush.c"
+#include "bitcoin/shadouble.c"
+#include "bitcoin/signature.c"
+#include "bitcoin/test/fill.h"
+#include "bitcoin/tx.c"
+#include "bitcoin/varint.c"
+#include "utils.c"
+#include <assert.h>
+#include <ccan/array_size/array_size.h>
+#include <ccan/structeq/structeq.h>
+#include <ccan/time/time.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+static secp256k1_context *secpctx;
+
+/* Like a steal tx: n segwit inputs, one output. */
+static struct bitcoin_tx *sweep_tx(const tal_t *ctx, size_t n)
+{
+	struct bitcoin_tx *tx = bitcoin_tx(ctx, n, 1);
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		fill(&tx->input[i].txid, sizeof(tx->input[i].txid));
+		tx->input[i].index = i;
+		tx->input[i].amount = tal(tx, u64);
+		*tx->input[i].amount = 1000 + i;
+	}
+	tx->output[0].amount = 1000 * n;
+	tx->output[0].script_length = 23;
+	tx->output[0].script = tal_arr(tx, u8, 23);
+	fill(tx->output[0].script, 23);
+	return tx;
+}
+
+/* The cached hashes give the same answer as doing it all each time. */
+static void check_sighash(size_t n)
+{
+	struct bitcoin_tx *tx = sweep_tx(NULL, n);
+	struct bitcoin_tx_sighash sighash;
+	struct privkey privkey;
+	struct pubkey pubkey;
+	u8 *wscript = tal_arr(tx, u8, 100);
+	u8 *redeemscript = tal_arr(tx, u8, 22);
+	size_t i;
+
+	fill(privkey.secret, sizeof(privkey.secret));
+	if (!secp256k1_ec_pubkey_create(secpctx, &pubkey.pubkey,
+					privkey.secret))
+		abort();
+	fill(wscript, tal_count(wscript));
+	fill(redeemscript, tal_count(redeemscript));
+
+	bitcoin_tx_sighash_init(&sighash, tx);
+	for (i = 0; i < n; i++) {
+		struct sha256_double h1, h2;
+		struct bitcoin_signature sig;
+
+		sha256_tx_for_sig(&h1, tx, i, SIGHASH_ALL, wscript);
+		sha256_tx_input_for_sig(&h2, &sighash, i, SIGHASH_ALL, wscript);
+		assert(structeq(&h1, &h2));
+
+		sig.stype = SIGHASH_ALL;
+		sign_sighash_input(secpctx, &sighash, i, wscript,
+				   &privkey, &pubkey, &sig.sig);
+		assert(check_tx_sig(secpctx, tx, i, NULL, 0, wscript,
+				    &pubkey, &sig));
+		assert(check_sighash_input_sig(secpctx, &sighash, i, wscript,
+					       &pubkey, &sig));
+		/* Like a P2SH-wrapped input (wallet_add_signed_input):
+		 * the redeemscript isn't part of the witness sighash. */
+		sign_tx_input(secpctx, tx, i,
+			      redeemscript, tal_count(redeemscript), wscript,
+			      &privkey, &pubkey, &sig.sig);
+		assert(check_tx_sig(secpctx, tx, i,
+				    redeemscript, tal_count(redeemscript),
+				    wscript, &pubkey, &sig));
+		assert(check_sighash_input_sig(secpctx, &sighash, i, wscript,
+					       &pubkey, &sig));
+
+		/* Not valid for any other input. */
+		assert(!check_sighash_input_sig(secpctx, &sighash,
+						(i + 1) % n, wscript,
+						&pubkey, &sig) || n == 1);
+	}
+	tal_free(tx);
+}
+
+/* Returns usec to hash every input of an n input tx. */
+static u64 time_sighash(size_t n, bool cached)
+{
+	struct bitcoin_tx *tx = sweep_tx(NULL, n);
+	struct bitcoin_tx_sighash sighash;
+	struct sha256_double h;
+	u8 *wscript = tal_arr(tx, u8, 100);
+	struct timeabs start;
+	size_t i;
+
+	fill(wscript, tal_count(wscript));
+	start = time_now();
+	if (cached) {
+		bitcoin_tx_sighash_init(&sighash, tx);
+		for (i = 0; i < n; i++)
+			sha256_tx_input_for_sig(&h, &sighash, i, SIGHASH_ALL,
+						wscript);
+	} else {
+		for (i = 0; i < n; i++)
+			sha256_tx_for_sig(&h, tx, i, SIGHASH_ALL, wscript);
+	}
+	tal_free(tx);
+	return time_to_usec(time_between(time_now(), start));
+}
+
+/* With an argument, benchmarks hashing 1 to 500 input txs. */
+int main(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 1, 2, 5, 10, 50, 100, 200, 500 };
+	size_t i;
+
+	secpctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN
+					   | SECP256K1_CONTEXT_VERIFY);
+	srandom(1);
+	check_sighash(1);
+	check_sighash(7);
+
+	if (argc > 1) {
+		for (i = 0; i < ARRAY_SIZE(sizes); i++)
+			printf("%zu inputs: %"PRIu64"usec (was %"PRIu64"usec)\n",
+			       sizes[i],
+			       time_sighash(sizes[i], true),
+			       time_sighash(sizes[i], false));
+	}
+	secp256k1_context_destroy(secpctx);
+	return 0;
+}
@@ -10,8 +10,6 @@
 #include <ccan/str/hex/hex.h>
 #include <stdio.h>
 
-#define SEGREGATED_WITNESS_FLAG 0x1
-
 static void push_tx_input(const struct bitcoin_tx_input *input,
 			 void (*push)(const void *, size_t, void *), void *pushp)
 {
@@ -176,12 +174,21 @@ static void hash_outputs(struct sha256_double *h, const struct bitcoin_tx *tx)
 	sha256_double_done(&ctx, h);
 }
 
+void bitcoin_tx_sighash_init(struct bitcoin_tx_sighash *sighash,
+			     const struct bitcoin_tx *tx)
+{
+	sighash->tx = tx;
+	hash_prevouts(&sighash->hash_prevouts, tx);
+	hash_sequence(&sighash->hash_sequence, tx);
+	hash_outputs(&sighash->hash_outputs, tx);
+}
+
 static void hash_for_segwit(struct sha256_ctx *ctx,
-			    const struct bitcoin_tx *tx,
+			    const struct bitcoin_tx_sighash *sighash,
 			    unsigned int input_num,
 			    const u8 *witness_script)
 {
-	struct sha256_double h;
+	const struct bitcoin_tx *tx = sighash->tx;
 
 	/* BIP143:
 	 *
@@ -191,12 +198,10 @@ static void hash_for_segwit(struct sha256_ctx *ctx,
 	push_le32(tx->version, push_sha, ctx);
 
 	/*     2. hashPrevouts (32-byte hash) */
-	hash_prevouts(&h, tx);
-	push_sha(&h, sizeof(h), ctx);
+	push_sha(&sighash->hash_prevouts, sizeof(sighash->hash_prevouts), ctx);
 
 	/*     3. hashSequence (32-byte hash) */
-	hash_sequence(&h, tx);
-	push_sha(&h, sizeof(h), ctx);
+	push_sha(&sighash->hash_sequence, sizeof(sighash->hash_sequence), ctx);
 
 	/*     4. outpoint (32-byte hash + 4-byte little endian)  */
 	push_sha(&tx->input[input_num].txid, sizeof(tx->input[input_num].txid),
@@ -213,8 +218,7 @@ static void hash_for_segwit(struct sha256_ctx *ctx,
 	push_le32(tx->input[input_num].sequence_number, push_sha, ctx);
 
 	/*     8. hashOutputs (32-byte hash) */
-	hash_outputs(&h, tx);
-	push_sha(&h, sizeof(h), ctx);
+	push_sha(&sighash->hash_outputs, sizeof(sighash->hash_outputs), ctx);
 
 	/*     9. nLocktime of the transaction (4-byte little endian) */
 	push_le32(tx->lock_time, push_sha, ctx);
@@ -237,8 +241,11 @@ void sha256_tx_for_sig(struct sha256_double *h, const struct bitcoin_tx *tx,
 			assert(tx->input[i].script_length == 0);
 
 	if (witness_script) {
+		struct bitcoin_tx_sighash sighash;
+
 		/* BIP143 hashing if OP_CHECKSIG is inside witness. */
-		hash_for_segwit(&ctx, tx, input_num, witness_script);
+		bitcoin_tx_sighash_init(&sighash, tx);
+		hash_for_segwit(&ctx, &sighash, input_num, witness_script);
 	} else {
 		/* Otherwise signature hashing never includes witness. */
 		push_tx(tx, push_sha, &ctx, false);
@@ -248,6 +255,22 @@ void sha256_tx_for_sig(struct sha256_double *h, const struct bitcoin_tx *tx,
 	sha256_double_done(&ctx, h);
 }
 
+void sha256_tx_input_for_sig(struct sha256_double *h,
+			     const struct bitcoin_tx_sighash *sighash,
+			     unsigned int input_num, enum sighash_type stype,
+			     const u8 *witness_script)
+{
+	struct sha256_ctx ctx = SHA256_INIT;
+
+	/* We only support this. */
+	assert(stype == SIGHASH_ALL);
+	assert(input_num < sighash->tx->input_count);
+
+	hash_for_segwit(&ctx, sighash, input_num, witness_script);
+	sha256_le32(&ctx, stype);
+	sha256_double_done(&ctx, h);
+}
+
 static void push_linearize(const void *data, size_t len, void *pptr_)
 {
 	u8 **pptr = pptr_;
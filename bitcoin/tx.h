@@ -7,6 +7,9 @@
 #include <ccan/short_types/short_types.h>
 #include <ccan/tal/tal.h>
 
+/* BIP 144: follows the zero "input count" marker. */
+#define SEGREGATED_WITNESS_FLAG 0x1
+
 struct bitcoin_tx {
 	u32 version;
 	varint_t input_count;
@@ -46,6 +49,24 @@ void sha256_tx_for_sig(struct sha256_double *h, const struct bitcoin_tx *tx,
 		       unsigned int input_num, enum sighash_type stype,
 		       const u8 *witness_script);
 
+/* BIP143 hashes which are the same for every input: if you're signing
+ * or checking several inputs, do these once.  Don't change the tx's
+ * inputs or outputs after this! */
+struct bitcoin_tx_sighash {
+	const struct bitcoin_tx *tx;
+	struct sha256_double hash_prevouts, hash_sequence, hash_outputs;
+};
+
+void bitcoin_tx_sighash_init(struct bitcoin_tx_sighash *sighash,
+			     const struct bitcoin_tx *tx);
+
+/* sha256_tx_for_sig for a segwit input, using the cached hashes
+ * (input scripts don't matter for BIP143). */
+void sha256_tx_input_for_sig(struct sha256_double *h,
+			     const struct bitcoin_tx_sighash *sighash,
+			     unsigned int input_num, enum sighash_type stype,
+			     const u8 *witness_script);
+
 /* Linear bytes of tx. */
 u8 *linearize_tx(const tal_t *ctx, const struct bitcoin_tx *tx);
 
@@ -1,4 +1,5 @@
-/* Code for talking to bitcoind.  We use bitcoin-cli. */
+/* Code for talking to bitcoind.  We speak JSON-RPC over HTTP directly,
+ * using a few keep-alive connections so requests can overlap. */
 #include "bitcoin/base58.h"
 #include "bitcoin/block.h"
 #include "bitcoin/shadouble.h"
@@ -8,9 +9,8 @@
 #include "lightningd.h"
 #include "log.h"
 #include "utils.h"
-#include <ccan/cast/cast.h>
 #include <ccan/io/io.h>
-#include <ccan/pipecmd/pipecmd.h>
+#include <ccan/io/io_plan.h>
 #include <ccan/str/hex/hex.h>
 #include <ccan/take/take.h>
 #include <ccan/tal/grab_file/grab_file.h>
@@ -19,182 +19,610 @@
 #include <ccan/tal/tal.h>
 #include <errno.h>
 #include <inttypes.h>
-
-#define BITCOIN_CLI "bitcoin-cli"
+#include <netdb.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
 
 char *bitcoin_datadir;
 
-static char **gather_args(struct lightningd_state *dstate,
-			  const tal_t *ctx, const char *cmd, va_list ap)
-{
-	size_t n = 0;
-	char **args = tal_arr(ctx, char *, 3);
+struct bitcoind {
+	struct lightningd_state *dstate;
 
-	args[n++] = BITCOIN_CLI;
-	if (dstate->config.regtest)
-		args[n++] = "-regtest=1";
-	else
-		args[n++] = tal_fmt(args, "-testnet=%u", dstate->testnet);
-	if (bitcoin_datadir) {
-		args[n++] = tal_fmt(args, "-datadir=%s", bitcoin_datadir);
-		tal_resize(&args, n + 1);
-	}
-	args[n++] = cast_const(char *, cmd);
-	tal_resize(&args, n + 1);
+	/* Where bitcoind's RPC server is, and how we log in. */
+	struct addrinfo *addr;
+	char *endpoint;
+	char *auth;
 
-	while ((args[n] = va_arg(ap, char *)) != NULL) {
-		args[n] = tal_strdup(args, args[n]);
-		n++;
-		tal_resize(&args, n + 1);
-	}
-	return args;
-}
+	/* Connections with nothing to do, and with a request in flight. */
+	struct list_head idle, busy;
+	size_t num_conns;
 
-struct bitcoin_cli {
+	/* Wakes us at the first request deadline.  It runs off the
+	 * monotonic clock, so --mocktime and dev-mocktime don't move it. */
+	int timerfd;
+
+	/* JSON-RPC id of next request. */
+	u64 next_id;
+};
+
+struct bitcoind_conn {
+	/* In bitcoind->busy if req is set, otherwise in bitcoind->idle
+	 * (if keepalive). */
+	struct list_node list;
+	struct bitcoind *bitcoind;
+	struct io_conn *conn;
+	struct bitcoin_req *req;
+	/* How many requests have been answered on this connection. */
+	size_t served;
+	/* False once bitcoind says it will close. */
+	bool keepalive;
+};
+
+struct bitcoin_req {
 	struct list_node list;
 	struct lightningd_state *dstate;
-	int fd;
-	int *exitstatus;
-	pid_t pid;
-	char **args;
+	const char *method;
+	char *params;
+
+	/* Complete HTTP request. */
+	char *http;
+	/* How long bitcoind has to answer: doubles each time it doesn't. */
+	struct timerel timeout;
+	struct timemono deadline;
+
+	/* HTTP response: once headers are parsed, body_off is non-zero. */
 	char *output;
 	size_t output_bytes;
 	size_t new_output;
-	void (*process)(struct bitcoin_cli *);
+	size_t body_off, content_len;
+	unsigned int status;
+	bool keepalive;
+
+	/* JSON-RPC response: result, or errmsg if error_ok. */
+	const jsmntok_t *result;
+	const char *errmsg;
+	bool error_ok;
+
+	void (*process)(struct bitcoin_req *);
 	void *cb;
 	void *cb_arg;
 };
 
-static struct io_plan *read_more(struct io_conn *conn, struct bitcoin_cli *bcli)
+/* For printing: method and params. */
+static char *req_desc(const struct bitcoin_req *req)
+{
+	return tal_fmt(req, "%s [%s]", req->method, req->params);
+}
+
+/* Strings come without their quotes, like bitcoin-cli gives them. */
+static char *tok_str(const struct bitcoin_req *req, const jsmntok_t *tok)
+{
+	return tal_strndup(req, req->output + tok->start,
+			   tok->end - tok->start);
+}
+
+static char *result_str(const struct bitcoin_req *req)
+{
+	return tok_str(req, req->result);
+}
+
+static char *base64(const tal_t *ctx, const char *str)
+{
+	static const char enc[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i, n = 0, len = strlen(str);
+	char *out = tal_arr(ctx, char, (len + 2) / 3 * 4 + 1);
+
+	for (i = 0; i < len; i += 3) {
+		u32 v = (u8)str[i] << 16;
+
+		if (i + 1 < len)
+			v |= (u8)str[i+1] << 8;
+		if (i + 2 < len)
+			v |= (u8)str[i+2];
+		out[n++] = enc[(v >> 18) & 63];
+		out[n++] = enc[(v >> 12) & 63];
+		out[n++] = i + 1 < len ? enc[(v >> 6) & 63] : '=';
+		out[n++] = i + 2 < len ? enc[v & 63] : '=';
+	}
+	out[n] = '\0';
+	return out;
+}
+
+/* Returns false if we don't have all the headers yet. */
+static bool parse_http_header(struct bitcoin_req *req)
 {
-	bcli->output_bytes += bcli->new_output;
-	if (bcli->output_bytes == tal_count(bcli->output))
-		tal_resize(&bcli->output, bcli->output_bytes * 2);
-	return io_read_partial(conn, bcli->output + bcli->output_bytes,
-			       tal_count(bcli->output) - bcli->output_bytes,
-			       &bcli->new_output, read_more, bcli);
+	const char *end, *p;
+	bool have_len = false;
+
+	end = memmem(req->output, req->output_bytes, "\r\n\r\n", 4);
+	if (!end)
+		return false;
+
+	if (!strstarts(req->output, "HTTP/1.")
+	    || (req->output[7] != '0' && req->output[7] != '1'))
+		fatal("%s: bad HTTP response '%.*s'", req_desc(req),
+		      (int)(end - req->output), req->output);
+	/* HTTP/1.1 defaults to keep-alive, HTTP/1.0 doesn't. */
+	req->keepalive = (req->output[7] == '1');
+	req->status = strtoul(req->output + 8, NULL, 10);
+
+	for (p = strstr(req->output, "\r\n") + 2; p < end;
+	     p = strstr(p, "\r\n") + 2) {
+		if (strncasecmp(p, "Content-Length:", 15) == 0) {
+			req->content_len = strtoul(p + 15, NULL, 10);
+			have_len = true;
+		} else if (strncasecmp(p, "Connection:", 11) == 0) {
+			size_t len = strcspn(p + 11, "\r");
+			if (memmem(p + 11, len, "close", 5))
+				req->keepalive = false;
+			else if (memmem(p + 11, len, "keep-alive", 10))
+				req->keepalive = true;
+		}
+	}
+
+	/* bitcoind always gives the length. */
+	if (!have_len)
+		fatal("%s: HTTP %u response without Content-Length",
+		      req_desc(req), req->status);
+
+	req->body_off = end + 4 - req->output;
+	return true;
 }
 
-static struct io_plan *output_init(struct io_conn *conn, struct bitcoin_cli *bcli)
+static void parse_rpc_response(struct bitcoin_req *req)
 {
-	bcli->output_bytes = bcli->new_output = 0;
-	bcli->output = tal_arr(bcli, char, 100);
-	return read_more(conn, bcli);
+	const jsmntok_t *toks, *error;
+	bool valid;
+
+	if (req->status == 401)
+		fatal("%s: bitcoind rejected our RPC credentials",
+		      req_desc(req));
+
+	/* Move body to the front: json_parse_input wants a tal pointer. */
+	memmove(req->output, req->output + req->body_off, req->content_len);
+	req->output_bytes = req->content_len;
+
+	toks = json_parse_input(req->output, req->output_bytes, &valid);
+	if (!toks)
+		fatal("%s: %s HTTP %u response '%.*s'",
+		      req_desc(req), valid ? "partial" : "invalid",
+		      req->status, (int)req->output_bytes, req->output);
+
+	error = json_get_member(req->output, toks, "error");
+	if (error && !json_tok_is_null(req->output, error)) {
+		const jsmntok_t *msg;
+
+		msg = json_get_member(req->output, error, "message");
+		if (!msg)
+			msg = error;
+		req->errmsg = tok_str(req, msg);
+		if (!req->error_ok)
+			fatal("%s: %s", req_desc(req), req->errmsg);
+		return;
+	}
+
+	req->result = json_get_member(req->output, toks, "result");
+	if (!req->result)
+		fatal("%s: no result in '%.*s'", req_desc(req),
+		      (int)req->output_bytes, req->output);
 }
 
 static void next_bcli(struct lightningd_state *dstate);
+static struct io_plan *read_more(struct io_conn *conn,
+				 struct bitcoind_conn *bc);
 
-/* For printing: simple string of args. */
-static char *bcli_args(struct bitcoin_cli *bcli)
+/* Only called once something is in busy. */
+static void set_deadline_timer(struct bitcoind *bitcoind)
 {
-	size_t i;
-	char *ret = tal_strdup(bcli, bcli->args[0]);
+	struct bitcoind_conn *bc;
+	struct timemono first, now = time_mono();
+	struct itimerspec its;
+
+	first = list_top(&bitcoind->busy, struct bitcoind_conn, list)
+		->req->deadline;
+	list_for_each(&bitcoind->busy, bc, list) {
+		if (time_less_(bc->req->deadline.ts, first.ts))
+			first = bc->req->deadline;
+	}
+
+	memset(&its, 0, sizeof(its));
+	if (time_less_(now.ts, first.ts))
+		its.it_value = timemono_between(first, now).ts;
+	else
+		/* All zeroes would disarm it. */
+		its.it_value.tv_nsec = 1;
+
+	if (timerfd_settime(bitcoind->timerfd, 0, &its, NULL) != 0)
+		fatal("Setting bitcoind timer: %s", strerror(errno));
+}
+
+static void start_req(struct bitcoind_conn *bc, struct bitcoin_req *req)
+{
+	bc->req = req;
+	req->deadline.ts = time_add_(time_mono().ts, req->timeout.ts);
+	list_add_tail(&bc->bitcoind->busy, &bc->list);
+	set_deadline_timer(bc->bitcoind);
+}
+
+static void req_timeout(struct bitcoind_conn *bc)
+{
+	struct bitcoin_req *req = bc->req;
+	struct lightningd_state *dstate = req->dstate;
+
+	log_unusual(dstate->base_log,
+		    "%s: bitcoind at %s didn't answer in %"PRIu64"ms, retrying",
+		    req_desc(req), bc->bitcoind->endpoint,
+		    time_to_msec(req->timeout));
+
+	/* Any late answer would confuse the next request: drop the
+	 * connection (conn_finished sees it has no request). */
+	list_del_from(&bc->bitcoind->busy, &bc->list);
+	bc->req = NULL;
+	bc->keepalive = false;
+	io_close(bc->conn);
+
+	/* Back off: it may just be busy (eg. verifying blocks). */
+	req->timeout = timerel_add(req->timeout, req->timeout);
+	list_add(&dstate->bitcoin_req, &req->list);
+}
+
+/* Spurious wakeups are harmless, so don't fail if it hasn't expired. */
+static int read_timerfd(int fd, struct io_plan_arg *arg)
+{
+	u64 expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0
+	    && errno != EAGAIN)
+		return -1;
+	return 1;
+}
+
+static struct io_plan *deadline_passed(struct io_conn *conn, void *arg);
+
+static struct io_plan *wait_for_deadline(struct io_conn *conn,
+					 struct bitcoind *bitcoind)
+{
+	io_plan_arg(conn, IO_IN);
+	return io_set_plan(conn, IO_IN, read_timerfd, deadline_passed,
+			   bitcoind);
+}
+
+static struct io_plan *deadline_passed(struct io_conn *conn, void *arg)
+{
+	struct bitcoind *bitcoind = arg;
+	struct bitcoind_conn *bc, *next;
+	struct timemono now = time_mono();
 
-	for (i = 1; bcli->args[i]; i++) {
-		ret = tal_strcat(bcli, take(ret), " ");
-		ret = tal_strcat(bcli, take(ret), bcli->args[i]);
+	list_for_each_safe(&bitcoind->busy, bc, next, list) {
+		if (!time_less_(now.ts, bc->req->deadline.ts))
+			req_timeout(bc);
 	}
-	return ret;
-}
-	
-static void bcli_finished(struct io_conn *conn, struct bitcoin_cli *bcli)
-{
-	int ret, status;
-	struct lightningd_state *dstate = bcli->dstate;
-
-	/* FIXME: If we waited for SIGCHILD, this could never hang! */
-	ret = waitpid(bcli->pid, &status, 0);
-	if (ret != bcli->pid)
-		fatal("%s %s", bcli_args(bcli),
-		      ret == 0 ? "not exited?" : strerror(errno));
-
-	if (!WIFEXITED(status))
-		fatal("%s died with signal %i",
-		      bcli_args(bcli),
-		      WTERMSIG(status));
-
-	if (!bcli->exitstatus) {
-		if (WEXITSTATUS(status) != 0) {
-			fatal("%s exited %u: '%.*s'", bcli_args(bcli),
-			      WEXITSTATUS(status),
-			      (int)bcli->output_bytes,
-			      bcli->output);
-		}
-	} else
-		*bcli->exitstatus = WEXITSTATUS(status);
 
-	log_debug(dstate->base_log, "reaped %u: %s", ret, bcli_args(bcli));
-	dstate->bitcoin_req_running = false;
-	bcli->process(bcli);
+	if (!list_empty(&bitcoind->busy))
+		set_deadline_timer(bitcoind);
+
+	return wait_for_deadline(conn, bitcoind);
+}
+
+static struct io_plan *send_req(struct io_conn *conn, struct bitcoind_conn *bc)
+{
+	struct bitcoin_req *req = bc->req;
+	struct lightningd_state *dstate = req->dstate;
+
+	log_debug(dstate->base_log, "starting: %s", req_desc(req));
+
+	req->output = tal_arrz(req, char, 1000);
+	req->output_bytes = req->new_output = 0;
+	req->body_off = 0;
+	return io_write(conn, req->http, strlen(req->http), read_more, bc);
+}
+
+static struct io_plan *req_done(struct io_conn *conn, struct bitcoind_conn *bc)
+{
+	struct bitcoin_req *req = bc->req;
+	struct lightningd_state *dstate = req->dstate;
+
+	parse_rpc_response(req);
+
+	bc->served++;
+	bc->keepalive = req->keepalive;
+	list_del_from(&bc->bitcoind->busy, &bc->list);
+	bc->req = NULL;
+	/* Callback may start another request: let it use us. */
+	if (bc->keepalive)
+		list_add(&bc->bitcoind->idle, &bc->list);
+
+	req->process(req);
+	tal_free(req);
+
+	if (!bc->keepalive)
+		return io_close(conn);
 
 	next_bcli(dstate);
+	if (bc->req)
+		return send_req(conn, bc);
+	return io_wait(conn, bc, send_req, bc);
 }
 
-static void next_bcli(struct lightningd_state *dstate)
+static struct io_plan *read_more(struct io_conn *conn,
+				 struct bitcoind_conn *bc)
 {
-	struct bitcoin_cli *bcli;
-	struct io_conn *conn;
+	struct bitcoin_req *req = bc->req;
+	size_t want;
+
+	req->output_bytes += req->new_output;
+	req->new_output = 0;
+	/* We always keep a spare byte, so headers are nul-terminated. */
+	req->output[req->output_bytes] = '\0';
+
+	if (!req->body_off && !parse_http_header(req))
+		want = req->output_bytes * 2;
+	else if (req->output_bytes >= req->body_off + req->content_len)
+		return req_done(conn, bc);
+	else
+		want = req->body_off + req->content_len;
 
-	if (dstate->bitcoin_req_running)
-		return;
+	if (tal_count(req->output) < want + 1)
+		tal_resize(&req->output, want + 1);
+
+	return io_read_partial(conn, req->output + req->output_bytes,
+			       tal_count(req->output) - req->output_bytes - 1,
+			       &req->new_output, read_more, bc);
+}
+
+static struct io_plan *init_conn(struct io_conn *conn,
+				 struct bitcoind_conn *bc)
+{
+	return io_connect(conn, bc->bitcoind->addr, send_req, bc);
+}
 
-	bcli = list_pop(&dstate->bitcoin_req, struct bitcoin_cli, list);
-	if (!bcli)
+static void conn_finished(struct io_conn *conn, struct bitcoind_conn *bc)
+{
+	struct bitcoind *bitcoind = bc->bitcoind;
+	struct bitcoin_req *req = bc->req;
+
+	/* We're shutting down. */
+	if (!bitcoind->dstate->bitcoind)
 		return;
 
-	log_debug(bcli->dstate->base_log, "starting: %s", bcli_args(bcli));
+	bitcoind->num_conns--;
+	if (!req) {
+		if (bc->keepalive)
+			list_del_from(&bitcoind->idle, &bc->list);
+	} else if (bc->served && req->output_bytes == 0) {
+		/* bitcoind can time out an idle connection just as we
+		 * reuse it; it never saw the request, so try again. */
+		log_debug(bitcoind->dstate->base_log,
+			  "bitcoind closed idle connection, retrying %s",
+			  req_desc(req));
+		list_del_from(&bitcoind->busy, &bc->list);
+		list_add(&bitcoind->dstate->bitcoin_req, &req->list);
+	} else
+		fatal("%s: connection to bitcoind at %s failed: %s",
+		      req_desc(req), bitcoind->endpoint, strerror(errno));
+
+	next_bcli(bitcoind->dstate);
+}
+
+static void new_bitcoind_conn(struct bitcoind *bitcoind,
+			      struct bitcoin_req *req)
+{
+	struct bitcoind_conn *bc = tal(bitcoind, struct bitcoind_conn);
+	struct io_conn *conn;
+	int fd;
 
-	bcli->pid = pipecmdarr(&bcli->fd, NULL, &bcli->fd, bcli->args);
-	if (bcli->pid < 0)
-		fatal("%s exec failed: %s", bcli->args[0], strerror(errno));
+	fd = socket(bitcoind->addr->ai_family, bitcoind->addr->ai_socktype,
+		    bitcoind->addr->ai_protocol);
+	if (fd < 0)
+		fatal("Creating socket for bitcoind: %s", strerror(errno));
+
+	bc->bitcoind = bitcoind;
+	bc->served = 0;
+	bc->keepalive = true;
+	bitcoind->num_conns++;
+	start_req(bc, req);
+
+	conn = io_new_conn(bitcoind, fd, init_conn, bc);
+	bc->conn = conn;
+	tal_steal(conn, bc);
+	io_set_finish(conn, conn_finished, bc);
+}
 
-	dstate->bitcoin_req_running = true;
-	conn = io_new_conn(dstate, bcli->fd, output_init, bcli);
-	tal_steal(conn, bcli);
-	io_set_finish(conn, bcli_finished, bcli);
+static void next_bcli(struct lightningd_state *dstate)
+{
+	struct bitcoind *bitcoind = dstate->bitcoind;
+
+	while (!list_empty(&dstate->bitcoin_req)) {
+		struct bitcoind_conn *bc;
+		struct bitcoin_req *req;
+
+		bc = list_pop(&bitcoind->idle, struct bitcoind_conn, list);
+		if (!bc
+		    && bitcoind->num_conns >= dstate->config.bitcoind_max_requests)
+			return;
+
+		req = list_pop(&dstate->bitcoin_req, struct bitcoin_req, list);
+		if (bc) {
+			start_req(bc, req);
+			io_wake(bc);
+		} else
+			new_bitcoind_conn(bitcoind, req);
+	}
 }
 
+/* Params are JSON literals (so strings must be quoted), ending in NULL.
+ * They may be take(). */
 static void
 start_bitcoin_cli(struct lightningd_state *dstate,
-		  void (*process)(struct bitcoin_cli *),
-		  bool nonzero_exit_ok,
+		  void (*process)(struct bitcoin_req *),
+		  bool error_ok,
 		  void *cb, void *cb_arg,
-		  char *cmd, ...)
+		  const char *method, ...)
 {
 	va_list ap;
-	struct bitcoin_cli *bcli = tal(dstate, struct bitcoin_cli);
-
-	bcli->dstate = dstate;
-	bcli->process = process;
-	bcli->cb = cb;
-	bcli->cb_arg = cb_arg;
-	if (nonzero_exit_ok)
-		bcli->exitstatus = tal(bcli, int);
-	else
-		bcli->exitstatus = NULL;
-	va_start(ap, cmd);
-	bcli->args = gather_args(dstate, bcli, cmd, ap);
+	const char *param, *body;
+	struct bitcoin_req *req = tal(dstate, struct bitcoin_req);
+
+	req->dstate = dstate;
+	req->process = process;
+	req->cb = cb;
+	req->cb_arg = cb_arg;
+	req->error_ok = error_ok;
+	req->errmsg = NULL;
+	req->result = NULL;
+	req->timeout = dstate->config.bitcoind_timeout;
+	req->method = method;
+	req->params = tal_strdup(req, "");
+	va_start(ap, method);
+	while ((param = va_arg(ap, const char *)) != NULL) {
+		tal_append_fmt(&req->params, "%s%s",
+			       req->params[0] ? "," : "", param);
+		if (taken(param))
+			tal_free(param);
+	}
 	va_end(ap);
 
-	list_add_tail(&dstate->bitcoin_req, &bcli->list);
+	body = tal_fmt(req, "{\"jsonrpc\":\"1.0\",\"id\":%"PRIu64","
+		       "\"method\":\"%s\",\"params\":[%s]}",
+		       dstate->bitcoind->next_id++, method, req->params);
+	req->http = tal_fmt(req,
+			    "POST / HTTP/1.1\r\n"
+			    "Host: %s\r\n"
+			    "Authorization: Basic %s\r\n"
+			    "Content-Type: application/json\r\n"
+			    "Content-Length: %zu\r\n"
+			    "\r\n"
+			    "%s",
+			    dstate->bitcoind->endpoint, dstate->bitcoind->auth,
+			    strlen(body), body);
+	tal_free(body);
+
+	list_add_tail(&dstate->bitcoin_req, &req->list);
 	next_bcli(dstate);
 }
 
-static void process_estimatefee_6(struct bitcoin_cli *bcli)
+/* Simple key=value lines, as bitcoind parses them. */
+static char *conf_get(const tal_t *ctx, char **lines, const char *key)
+{
+	size_t i, keylen = strlen(key);
+	char *val = NULL;
+
+	for (i = 0; lines && lines[i]; i++) {
+		const char *l = lines[i] + strspn(lines[i], " \t");
+
+		if (strncmp(l, key, keylen) == 0 && l[keylen] == '=')
+			val = tal_strndup(ctx, l + keylen + 1,
+					  strcspn(l + keylen + 1, "\r"));
+	}
+	return val;
+}
+
+static void destroy_bitcoind(struct bitcoind *bitcoind)
+{
+	bitcoind->dstate->bitcoind = NULL;
+	freeaddrinfo(bitcoind->addr);
+}
+
+void setup_bitcoind(struct lightningd_state *dstate)
+{
+	struct bitcoind *bitcoind = tal(dstate, struct bitcoind);
+	const char *datadir, *netdir, *host, *port, *user, *pass;
+	char *conf, **lines = NULL;
+	struct addrinfo hints;
+	int err;
+
+	if (bitcoin_datadir)
+		datadir = bitcoin_datadir;
+	else if (getenv("HOME"))
+		datadir = path_join(bitcoind, getenv("HOME"), ".bitcoin");
+	else
+		fatal("No --bitcoin-datadir, and no HOME to find ~/.bitcoin");
+
+	if (dstate->config.regtest)
+		netdir = "regtest";
+	else if (dstate->testnet)
+		netdir = "testnet3";
+	else
+		netdir = "";
+
+	conf = grab_file(bitcoind, path_join(bitcoind, datadir,
+					      "bitcoin.conf"));
+	if (conf)
+		lines = tal_strsplit(bitcoind, conf, "\n", STR_NO_EMPTY);
+
+	host = conf_get(bitcoind, lines, "rpcconnect");
+	if (!host)
+		host = "127.0.0.1";
+	port = conf_get(bitcoind, lines, "rpcport");
+	if (!port)
+		port = (dstate->config.regtest || dstate->testnet)
+			? "18332" : "8332";
+
+	/* Explicit credentials, otherwise the cookie bitcoind writes. */
+	user = conf_get(bitcoind, lines, "rpcuser");
+	pass = conf_get(bitcoind, lines, "rpcpassword");
+	if (pass)
+		bitcoind->auth = base64(bitcoind,
+					tal_fmt(bitcoind, "%s:%s",
+						user ? user : "", pass));
+	else {
+		char *cookie, *path;
+
+		path = path_join(bitcoind,
+				 path_join(bitcoind, datadir, netdir),
+				 ".cookie");
+		cookie = grab_file(bitcoind, path);
+		if (!cookie)
+			fatal("No rpcpassword in %s/bitcoin.conf, and"
+			      " reading %s: %s", datadir, path,
+			      strerror(errno));
+		cookie[strcspn(cookie, "\r\n")] = '\0';
+		bitcoind->auth = base64(bitcoind, cookie);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(host, port, &hints, &bitcoind->addr);
+	if (err)
+		fatal("Looking up bitcoind %s:%s: %s",
+		      host, port, gai_strerror(err));
+
+	bitcoind->dstate = dstate;
+	/* This is also our Host: header, so IPv6 literals need brackets. */
+	if (strchr(host, ':'))
+		bitcoind->endpoint = tal_fmt(bitcoind, "[%s]:%s", host, port);
+	else
+		bitcoind->endpoint = tal_fmt(bitcoind, "%s:%s", host, port);
+	list_head_init(&bitcoind->idle);
+	list_head_init(&bitcoind->busy);
+	bitcoind->num_conns = 0;
+	bitcoind->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (bitcoind->timerfd < 0)
+		fatal("Creating bitcoind timer: %s", strerror(errno));
+	io_new_conn(bitcoind, bitcoind->timerfd, wait_for_deadline, bitcoind);
+	bitcoind->next_id = 0;
+	dstate->bitcoind = bitcoind;
+	tal_add_destructor(bitcoind, destroy_bitcoind);
+
+	log_debug(dstate->base_log, "Using bitcoind at %s", bitcoind->endpoint);
+}
+
+static void process_estimatefee_6(struct bitcoin_req *req)
 {
 	double fee;
-	char *p, *end;
 	u64 fee_rate;
-	void (*cb)(struct lightningd_state *, u64, void *) = bcli->cb;
+	void (*cb)(struct lightningd_state *, u64, void *) = req->cb;
 
-	p = tal_strndup(bcli, bcli->output, bcli->output_bytes);
-	fee = strtod(p, &end);
-	if (end == p || *end != '\n')
+	if (!json_tok_double(req->output, req->result, &fee))
 		fatal("%s: gave non-numeric fee %s",
-		      bcli_args(bcli), p);
+		      req_desc(req), result_str(req));
 
 	if (fee < 0) {
-		log_unusual(bcli->dstate->base_log,
+		log_unusual(req->dstate->base_log,
 			    "Unable to estimate fee");
 		fee_rate = 0;
 	} else {
@@ -203,31 +631,28 @@ static void process_estimatefee_6(struct bitcoin_cli *bcli)
 		fee_rate = fee * 100000000;
 	}
 
-	cb(bcli->dstate, fee_rate, bcli->cb_arg);
+	cb(req->dstate, fee_rate, req->cb_arg);
 }
 
-static void process_estimatefee_2(struct bitcoin_cli *bcli)
+static void process_estimatefee_2(struct bitcoin_req *req)
 {
 	double fee;
-	char *p, *end;
 	u64 fee_rate;
-	void (*cb)(struct lightningd_state *, u64, void *) = bcli->cb;
+	void (*cb)(struct lightningd_state *, u64, void *) = req->cb;
 
-	p = tal_strndup(bcli, bcli->output, bcli->output_bytes);
-	fee = strtod(p, &end);
-	if (end == p || *end != '\n')
+	if (!json_tok_double(req->output, req->result, &fee))
 		fatal("%s: gave non-numeric fee %s",
-		      bcli_args(bcli), p);
+		      req_desc(req), result_str(req));
 
 	/* Don't know at 2?  Try 6... */
 	if (fee < 0) {
-		start_bitcoin_cli(bcli->dstate, process_estimatefee_6,
-				  false, bcli->cb, bcli->cb_arg,
+		start_bitcoin_cli(req->dstate, process_estimatefee_6,
+				  false, req->cb, req->cb_arg,
 				  "estimatefee", "6", NULL);
 		return;
 	}
 	fee_rate = fee * 100000000;
-	cb(bcli->dstate, fee_rate, bcli->cb_arg);
+	cb(req->dstate, fee_rate, req->cb_arg);
 }
 
 void bitcoind_estimate_fee_(struct lightningd_state *dstate,
@@ -239,17 +664,16 @@ void bitcoind_estimate_fee_(struct lightningd_state *dstate,
 			  "estimatefee", "2", NULL);
 }
 
-static void process_sendrawtx(struct bitcoin_cli *bcli)
+static void process_sendrawtx(struct bitcoin_req *req)
 {
 	void (*cb)(struct lightningd_state *dstate,
-		   const char *msg, void *) = bcli->cb;
-	const char *msg = tal_strndup(bcli, (char *)bcli->output,
-				      bcli->output_bytes);
+		   const char *msg, void *) = req->cb;
+	const char *msg = req->errmsg ? req->errmsg : result_str(req);
 
-	log_debug(bcli->dstate->base_log, "sendrawtx exit %u, gave %s",
-		  *bcli->exitstatus, msg);
+	log_debug(req->dstate->base_log, "sendrawtx %s %s",
+		  req->errmsg ? "failed" : "gave", msg);
 
-	cb(bcli->dstate, msg, bcli->cb_arg);
+	cb(req->dstate, msg, req->cb_arg);
 }
 
 void bitcoind_sendrawtx_(struct lightningd_state *dstate,
@@ -259,67 +683,59 @@ void bitcoind_sendrawtx_(struct lightningd_state *dstate,
 			 void *arg)
 {
 	start_bitcoin_cli(dstate, process_sendrawtx, true, cb, arg,
-			  "sendrawtransaction", hextx, NULL);
+			  "sendrawtransaction",
+			  take(tal_fmt(NULL, "\"%s\"", hextx)), NULL);
 }
 
-static void process_chaintips(struct bitcoin_cli *bcli)
+static void process_chaintips(struct bitcoin_req *req)
 {
-	const jsmntok_t *tokens, *t, *end;
+	const jsmntok_t *t, *end;
 	bool valid;
 	size_t i;
 	struct sha256_double tip;
 	void (*cb)(struct lightningd_state *dstate,
 		   struct sha256_double *tipid,
-		   void *arg) = bcli->cb;
+		   void *arg) = req->cb;
 
-	log_debug(bcli->dstate->base_log, "Got getchaintips result");
+	log_debug(req->dstate->base_log, "Got getchaintips result");
 
-	tokens = json_parse_input(bcli->output, bcli->output_bytes, &valid);
-	if (!tokens)
-		fatal("%s: %s response",
-		      bcli_args(bcli),
-		      valid ? "partial" : "invalid");
-
-	if (tokens[0].type != JSMN_ARRAY)
-		fatal("%s: gave non-array (%.*s)?",
-		      bcli_args(bcli),
-		      (int)bcli->output_bytes, bcli->output);
+	if (req->result->type != JSMN_ARRAY)
+		fatal("%s: gave non-array (%s)?",
+		      req_desc(req), result_str(req));
 
 	valid = false;
-	end = json_next(tokens);
-	for (i = 0, t = tokens + 1; t < end; t = json_next(t), i++) {
-		const jsmntok_t *status = json_get_member(bcli->output, t, "status");
-		const jsmntok_t *hash = json_get_member(bcli->output, t, "hash");
+	end = json_next(req->result);
+	for (i = 0, t = req->result + 1; t < end; t = json_next(t), i++) {
+		const jsmntok_t *status = json_get_member(req->output, t, "status");
+		const jsmntok_t *hash = json_get_member(req->output, t, "hash");
 
-		if (!json_tok_streq(bcli->output, status, "active")) {
-			log_debug(bcli->dstate->base_log,
+		if (!json_tok_streq(req->output, status, "active")) {
+			log_debug(req->dstate->base_log,
 				  "Ignoring chaintip %.*s status %.*s",
 				  hash->end - hash->start,
-				  bcli->output + hash->start,
+				  req->output + hash->start,
 				  status->end - status->start,
-				  bcli->output + status->start);
+				  req->output + status->start);
 			continue;
 		}
 		if (valid) {
-			log_unusual(bcli->dstate->base_log,
-				    "%s: Two active chaintips? %.*s",
-				    bcli_args(bcli),
-				    (int)bcli->output_bytes, bcli->output);
+			log_unusual(req->dstate->base_log,
+				    "%s: Two active chaintips? %s",
+				    req_desc(req), result_str(req));
 			continue;
 		}
-		if (!bitcoin_blkid_from_hex(bcli->output + hash->start,
+		if (!bitcoin_blkid_from_hex(req->output + hash->start,
 					    hash->end - hash->start,
 					    &tip))
-			fatal("%s: gave bad hash for %zu'th tip (%.*s)?",
-			      bcli_args(bcli), i,
-			      (int)bcli->output_bytes, bcli->output);
+			fatal("%s: gave bad hash for %zu'th tip (%s)?",
+			      req_desc(req), i, result_str(req));
 		valid = true;
 	}
 	if (!valid)
-		fatal("%s: gave no active chaintips (%.*s)?",
-		      bcli_args(bcli), (int)bcli->output_bytes, bcli->output);
+		fatal("%s: gave no active chaintips (%s)?",
+		      req_desc(req), result_str(req));
 
-	cb(bcli->dstate, &tip, bcli->cb_arg);
+	cb(req->dstate, &tip, req->cb_arg);
 }
 
 void bitcoind_get_chaintip_(struct lightningd_state *dstate,
@@ -332,35 +748,24 @@ void bitcoind_get_chaintip_(struct lightningd_state *dstate,
 			  "getchaintips", NULL);
 }
 
-struct normalizing {
-	u32 mediantime;
-	struct sha256_double prevblk, blkid;
-	struct sha256_double *txids;
-	size_t i;
-	void (*cb)(struct lightningd_state *dstate,
-		   struct sha256_double *blkid,
-		   struct sha256_double *prevblock,
-		   struct sha256_double *txids,
-		   u32 mediantime,
-		   void *arg);
-	void *cb_arg;
-};
-
-static void process_rawblock(struct bitcoin_cli *bcli)
+static void process_rawblock(struct bitcoin_req *req)
 {
 	struct bitcoin_block *blk;
 	void (*cb)(struct lightningd_state *dstate,
 		   struct bitcoin_block *blk,
-		   void *arg) = bcli->cb;
+		   void *arg) = req->cb;
 
 	/* FIXME: Just get header if we can't get full block. */
-	blk = bitcoin_block_from_hex(bcli, bcli->output, bcli->output_bytes);
+	blk = NULL;
+	if (req->result->type == JSMN_STRING)
+		blk = bitcoin_block_from_hex(req,
+					     req->output + req->result->start,
+					     req->result->end
+					     - req->result->start);
 	if (!blk)
-		fatal("%s: bad block '%.*s'?",
-		      bcli_args(bcli),
-		      (int)bcli->output_bytes, (char *)bcli->output);
+		fatal("%s: bad block '%s'?", req_desc(req), result_str(req));
 
-	cb(bcli->dstate, blk, bcli->cb_arg);
+	cb(req->dstate, blk, req->cb_arg);
 }
 
 void bitcoind_getrawblock_(struct lightningd_state *dstate,
@@ -370,28 +775,28 @@ void bitcoind_getrawblock_(struct lightningd_state *dstate,
 				      void *arg),
 			   void *arg)
 {
-	char hex[hex_str_size(sizeof(*blockid))];
+	char hex[hex_str_size(sizeof(*blockid)) + 2];
 
-	bitcoin_blkid_to_hex(blockid, hex, sizeof(hex));
+	/* Quoted, since it's a JSON string. */
+	hex[0] = '"';
+	bitcoin_blkid_to_hex(blockid, hex + 1, sizeof(hex) - 2);
+	strcat(hex, "\"");
 	start_bitcoin_cli(dstate, process_rawblock, false, cb, arg,
 			  "getblock", hex, "false", NULL);
 }
 
-static void process_getblockcount(struct bitcoin_cli *bcli)
+static void process_getblockcount(struct bitcoin_req *req)
 {
-	u32 blockcount;
-	char *p, *end;
+	unsigned int blockcount;
 	void (*cb)(struct lightningd_state *dstate,
 		   u32 blockcount,
-		   void *arg) = bcli->cb;
+		   void *arg) = req->cb;
 
-	p = tal_strndup(bcli, bcli->output, bcli->output_bytes);
-	blockcount = strtol(p, &end, 10);
-	if (end == p || *end != '\n')
+	if (!json_tok_number(req->output, req->result, &blockcount))
 		fatal("%s: gave non-numeric blockcount %s",
-		      bcli_args(bcli), p);
+		      req_desc(req), result_str(req));
 
-	cb(bcli->dstate, blockcount, bcli->cb_arg);
+	cb(req->dstate, blockcount, req->cb_arg);
 }
 
 void bitcoind_getblockcount_(struct lightningd_state *dstate,
@@ -404,21 +809,21 @@ void bitcoind_getblockcount_(struct lightningd_state *dstate,
 			  "getblockcount", NULL);
 }
 
-static void process_getblockhash(struct bitcoin_cli *bcli)
+static void process_getblockhash(struct bitcoin_req *req)
 {
 	struct sha256_double blkid;
 	void (*cb)(struct lightningd_state *dstate,
 		   const struct sha256_double *blkid,
-		   void *arg) = bcli->cb;
+		   void *arg) = req->cb;
 
-	if (bcli->output_bytes == 0
-	    || !bitcoin_blkid_from_hex(bcli->output, bcli->output_bytes-1,
+	if (req->result->type != JSMN_STRING
+	    || !bitcoin_blkid_from_hex(req->output + req->result->start,
+				       req->result->end - req->result->start,
 				       &blkid)) {
-		fatal("%s: bad blockid '%.*s'",
-		      bcli_args(bcli), (int)bcli->output_bytes, bcli->output);
+		fatal("%s: bad blockid '%s'", req_desc(req), result_str(req));
 	}
 
-	cb(bcli->dstate, &blkid, bcli->cb_arg);
+	cb(req->dstate, &blkid, req->cb_arg);
 }
 
 void bitcoind_getblockhash_(struct lightningd_state *dstate,
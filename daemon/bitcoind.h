@@ -11,9 +11,12 @@ struct ripemd160;
 struct bitcoin_tx;
 struct peer;
 struct bitcoin_block;
-/* -datadir arg for bitcoin-cli. */
+/* bitcoind's -datadir (for bitcoin.conf and the RPC cookie). */
 extern char *bitcoin_datadir;
 
+/* Find bitcoind's RPC port and credentials. */
+void setup_bitcoind(struct lightningd_state *dstate);
+
 void bitcoind_estimate_fee_(struct lightningd_state *dstate,
 			    void (*cb)(struct lightningd_state *dstate,
 				       u64, void *),
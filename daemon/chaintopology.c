@@ -35,34 +35,46 @@ struct block {
 	/* Transactions in this block we care about */
 	struct sha256_double *txids;
 
-	/* Full copy of txs (trimmed to txs list in connect_block) */
-	struct bitcoin_tx **full_txs;
+	/* Full block (until connect_block has looked through it) */
+	struct bitcoin_block *full;
 };
 
-/* Hash blocks by sha */
+/* Hash blocks by sha (keyed, like the txids in watch.c) */
 static const struct sha256_double *keyof_block_map(const struct block *b)
 {
 	return &b->blkid;
 }
 
-static size_t hash_sha(const struct sha256_double *key)
+static bool block_eq(const struct block *b, const struct sha256_double *key)
 {
-	size_t ret;
+	return structeq(&b->blkid, key);
+}
+HTABLE_DEFINE_TYPE(struct block, keyof_block_map, txid_hash, block_eq, block_map);
+
+/* Hash the txs we care about to the (main chain) block they're in. */
+struct block_tx {
+	struct sha256_double txid;
+	struct block *block;
+};
 
-	memcpy(&ret, key, sizeof(ret));
-	return ret;
+static const struct sha256_double *keyof_tx_map(const struct block_tx *bt)
+{
+	return &bt->txid;
 }
 
-static bool block_eq(const struct block *b, const struct sha256_double *key)
+static bool block_tx_eq(const struct block_tx *bt,
+			const struct sha256_double *key)
 {
-	return structeq(&b->blkid, key);
+	return structeq(&bt->txid, key);
 }
-HTABLE_DEFINE_TYPE(struct block, keyof_block_map, hash_sha, block_eq, block_map);
+HTABLE_DEFINE_TYPE(struct block_tx, keyof_tx_map, txid_hash, block_tx_eq,
+		   tx_map);
 
 struct topology {
 	struct block *root;
 	struct block *tip;
 	struct block_map block_map;
+	struct tx_map tx_map;
 	u64 feerate;
 	bool startup;
 };
@@ -105,12 +117,29 @@ static u32 get_mediantime(const struct topology *topo, const struct block *b)
 }
 
 /* FIXME: Remove tx from block when peer done. */
-static void add_tx_to_block(struct block *b, const struct sha256_double *txid)
+static void add_tx_to_block(struct topology *topo,
+			    struct block *b, const struct sha256_double *txid)
 {
 	size_t n = tal_count(b->txids);
+	struct block_tx *bt = tal(b, struct block_tx);
 
 	tal_resize(&b->txids, n+1);
 	b->txids[n] = *txid;
+
+	bt->txid = *txid;
+	bt->block = b;
+	tx_map_add(&topo->tx_map, bt);
+}
+
+static void remove_txs_from_map(struct topology *topo, struct block *b)
+{
+	size_t i, n = tal_count(b->txids);
+
+	for (i = 0; i < n; i++) {
+		struct block_tx *bt = tx_map_get(&topo->tx_map, &b->txids[i]);
+		if (bt && bt->block == b)
+			tx_map_del(&topo->tx_map, bt);
+	}
 }
 
 static bool we_broadcast(struct lightningd_state *dstate,
@@ -135,7 +164,8 @@ static void connect_block(struct lightningd_state *dstate,
 			  struct block *b)
 {
 	struct topology *topo = dstate->topology;
-	size_t i;
+	struct bitcoin_block_iter it;
+	struct bitcoin_tx_ref txref;
 
 	assert(b->height == -1);
 	assert(b->mediantime == 0);
@@ -148,56 +178,46 @@ static void connect_block(struct lightningd_state *dstate,
 
 	block_map_add(&topo->block_map, b);
 	
-	/* Now we see if any of those txs are interesting. */
-	for (i = 0; i < tal_count(b->full_txs); i++) {
-		struct bitcoin_tx *tx = b->full_txs[i];
+	/* Now we see if any of those txs are interesting: most aren't, so
+	 * we only decode those which spend a txo we're watching. */
+	bitcoin_block_iter_init(&it, b->full);
+	while (bitcoin_block_iter_next(&it, &txref)) {
+		struct bitcoin_tx *tx = NULL;
 		struct sha256_double txid;
+		const u8 *cursor = NULL;
 		size_t j;
 
 		/* Tell them if it spends a txo we care about. */
-		for (j = 0; j < tx->input_count; j++) {
+		for (j = 0; j < txref.input_count; j++) {
 			struct txwatch_output out;
 			struct txowatch *txo;
-			out.txid = tx->input[j].txid;
-			out.index = tx->input[j].index;
 
+			bitcoin_tx_ref_input(&txref, &cursor,
+					     &out.txid, &out.index);
 			txo = txowatch_hash_get(&dstate->txowatches, &out);
-			if (txo)
-				txowatch_fire(dstate, txo, tx, j);
+			if (!txo)
+				continue;
+			if (!tx)
+				tx = bitcoin_tx_ref_decode(b->full, &txref);
+			txowatch_fire(dstate, txo, tx, j);
 		}
 
 		/* We did spends first, in case that tells us to watch tx. */
-		bitcoin_txid(tx, &txid);
+		bitcoin_tx_ref_txid(&txref, &txid);
 		if (watching_txid(dstate, &txid) || we_broadcast(dstate, &txid))
-			add_tx_to_block(b, &txid);
+			add_tx_to_block(topo, b, &txid);
 	}
-	b->full_txs = tal_free(b->full_txs);
+	b->full = tal_free(b->full);
 }
 
-static bool tx_in_block(const struct block *b,
-			const struct sha256_double *txid)
-{
-	size_t i, n = tal_count(b->txids);
-
-	for (i = 0; i < n; i++) {
-		if (structeq(&b->txids[i], txid))
-			return true;
-	}
-	return false;
-}
-
-/* FIXME: Use hash table. */
 static struct block *block_for_tx(struct lightningd_state *dstate,
 				  const struct sha256_double *txid)
 {
-	struct topology *topo = dstate->topology;
-	struct block *b;
+	struct block_tx *bt = tx_map_get(&dstate->topology->tx_map, txid);
 
-	for (b = topo->tip; b; b = b->prev) {
-		if (tx_in_block(b, txid))
-			return b;
-	}
-	return NULL;
+	if (!bt)
+		return NULL;
+	return bt->block;
 }
 
 size_t get_tx_depth(struct lightningd_state *dstate,
@@ -296,11 +316,15 @@ void broadcast_tx(struct peer *peer, const struct bitcoin_tx *tx)
 
 static void free_blocks(struct lightningd_state *dstate, struct block *b)
 {
+	struct topology *topo = dstate->topology;
 	struct block *next;
 
 	while (b) {
 		size_t i, n = tal_count(b->txids);
 
+		block_map_del(&topo->block_map, b);
+		remove_txs_from_map(topo, b);
+
 		/* Notify that txs are kicked out. */
 		for (i = 0; i < n; i++)
 			txwatch_fire(dstate, &b->txids[i], 0);
@@ -334,7 +358,7 @@ static void topology_changed(struct lightningd_state *dstate,
 		b = b->next;
 	} while (b);
 
-	/* Tell watch code to re-evaluate all txs. */
+	/* Tell watch code about txs whose depth changed. */
 	watch_topology_changed(dstate);
 
 	/* Maybe need to rebroadcast. */
@@ -365,7 +389,7 @@ static struct block *new_block(struct lightningd_state *dstate,
 	b->hdr = blk->hdr;
 
 	b->txids = tal_arr(b, struct sha256_double, 0);
-	b->full_txs = tal_steal(b, blk->tx);
+	b->full = tal_steal(b, blk);
 
 	return b;
 }
@@ -518,6 +542,7 @@ void setup_topology(struct lightningd_state *dstate)
 {
 	dstate->topology = tal(dstate, struct topology);
 	block_map_init(&dstate->topology->block_map);
+	tx_map_init(&dstate->topology->tx_map);
 
 	dstate->topology->startup = true;
 	dstate->topology->feerate = 0;
@@ -14,6 +14,10 @@
 #include "remove_dust.h"
 #include "utils.h"
 #include <assert.h>
+#include <ccan/crypto/ripemd160/ripemd160.h>
+#include <ccan/crypto/siphash24/siphash24.h>
+#include <ccan/htable/htable_type.h>
+#include <ccan/mem/mem.h>
 #include <inttypes.h>
 
 u8 *wscript_for_htlc(const tal_t *ctx,
@@ -47,19 +51,6 @@ u8 *wscript_for_htlc(const tal_t *ctx,
 		  &h->expiry, &this_side->locktime, rhash, &h->rhash);
 }
 
-static size_t count_htlcs(const struct htlc_map *htlcs, int flag)
-{
-	struct htlc_map_iter it;
-	struct htlc *h;
-	size_t n = 0;
-
-	for (h = htlc_map_first(htlcs, &it); h; h = htlc_map_next(htlcs, &it)) {
-		if (htlc_has(h, flag))
-			n++;
-	}
-	return n;
-}
-
 u8 *commit_output_to_us(const tal_t *ctx,
 			const struct peer *peer,
 			const struct sha256 *rhash,
@@ -114,6 +105,147 @@ u8 *commit_output_to_them(const tal_t *ctx,
 	}
 }
 
+/* An HTLC output, kept between commitment txs for one side. */
+struct commit_htlc {
+	/* htlc_owner and id: never reused for this peer. */
+	u64 key;
+	const struct htlc *h;
+	u64 satoshis;
+	/* The last generation it was committed in. */
+	u64 gen;
+	/* wscript, with the last revocation hash we used... */
+	u8 *wscript;
+	/* ... whose ripemd160 is here. */
+	size_t revoke_off;
+	/* sha256 of the wscript up to revoke_off. */
+	struct sha256_ctx prefix;
+};
+
+static u64 commit_htlc_key(const struct commit_htlc *ch)
+{
+	return ch->key;
+}
+
+static bool commit_htlc_cmp(const struct commit_htlc *ch, u64 key)
+{
+	return ch->key == key;
+}
+
+static size_t commit_htlc_hash(u64 key)
+{
+	return siphash24(siphash_seed(), &key, sizeof(key));
+}
+HTABLE_DEFINE_TYPE(struct commit_htlc, commit_htlc_key, commit_htlc_hash,
+		   commit_htlc_cmp, commit_htlc_map);
+
+/* Everything but the revocation hash of an HTLC's wscript is fixed, and
+ * its amount decides most of its place in the tx: so we only build the
+ * scripts of new HTLCs, and only sort those with equal amounts. */
+struct commit_template {
+	/* Incremented for every commit tx. */
+	u64 gen;
+	struct commit_htlc_map map;
+	/* Those in map, sorted by amount (tal_count is capacity). */
+	struct commit_htlc **sorted;
+	size_t num;
+};
+
+static void destroy_commit_template(struct commit_template *t)
+{
+	commit_htlc_map_clear(&t->map);
+}
+
+static struct commit_template *get_commit_template(struct peer *peer,
+						   enum side side)
+{
+	struct commit_template **t;
+
+	if (side == LOCAL)
+		t = &peer->local.commit_template;
+	else
+		t = &peer->remote.commit_template;
+
+	if (!*t) {
+		*t = tal(peer, struct commit_template);
+		(*t)->gen = 0;
+		commit_htlc_map_init(&(*t)->map);
+		(*t)->sorted = tal_arr(*t, struct commit_htlc *, 16);
+		(*t)->num = 0;
+		tal_add_destructor(*t, destroy_commit_template);
+	}
+	return *t;
+}
+
+static struct commit_htlc *add_commit_htlc(struct commit_template *t,
+					   const struct peer *peer,
+					   const struct htlc *h,
+					   u64 key,
+					   const struct sha256 *rhash,
+					   const struct ripemd160 *revoke,
+					   enum side side)
+{
+	struct commit_htlc *ch = tal(t, struct commit_htlc);
+	const u8 *p;
+	size_t lo = 0, hi = t->num;
+
+	ch->key = key;
+	ch->satoshis = h->msatoshi / 1000;
+	ch->wscript = wscript_for_htlc(ch, peer, h, rhash, side);
+	p = memmem(ch->wscript, tal_count(ch->wscript),
+		   revoke, sizeof(*revoke));
+	assert(p);
+	ch->revoke_off = p - ch->wscript;
+	sha256_init(&ch->prefix);
+	sha256_update(&ch->prefix, ch->wscript, ch->revoke_off);
+	commit_htlc_map_add(&t->map, ch);
+
+	/* After any with the same amount. */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (t->sorted[mid]->satoshis <= ch->satoshis)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (t->num == tal_count(t->sorted))
+		tal_resize(&t->sorted, t->num * 2);
+	memmove(t->sorted + lo + 1, t->sorted + lo,
+		(t->num - lo) * sizeof(t->sorted[0]));
+	t->sorted[lo] = ch;
+	t->num++;
+	return ch;
+}
+
+/* Forget those not committed in this generation. */
+static void prune_commit_htlcs(struct commit_template *t)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < t->num; i++) {
+		struct commit_htlc *ch = t->sorted[i];
+		if (ch->gen != t->gen) {
+			commit_htlc_map_del(&t->map, ch);
+			tal_free(ch);
+		} else
+			t->sorted[n++] = ch;
+	}
+	t->num = n;
+}
+
+/* Put in this revocation hash, and return the p2wsh for the result. */
+static u8 *commit_htlc_p2wsh(const tal_t *ctx, struct commit_htlc *ch,
+			     const struct ripemd160 *revoke)
+{
+	struct sha256_ctx shactx = ch->prefix;
+	struct sha256 h;
+
+	memcpy(ch->wscript + ch->revoke_off, revoke, sizeof(*revoke));
+	sha256_update(&shactx, ch->wscript + ch->revoke_off,
+		      tal_count(ch->wscript) - ch->revoke_off);
+	sha256_done(&shactx, &h);
+	return scriptpubkey_p2wsh_hash(ctx, &h);
+}
+
 static bool add_output(struct bitcoin_tx *tx, u8 *script, u64 amount,
 		       u64 *total)
 {
@@ -128,6 +260,43 @@ static bool add_output(struct bitcoin_tx *tx, u8 *script, u64 amount,
 	return true;
 }
 
+/* Outputs [start, output_count) are in amount order: sort equal ones. */
+static void sort_equal_amounts(struct bitcoin_tx *tx, size_t start)
+{
+	size_t i, run = start;
+
+	for (i = start + 1; i <= tx->output_count; i++) {
+		if (i < tx->output_count
+		    && tx->output[i].amount == tx->output[run].amount)
+			continue;
+		if (i - run > 1)
+			permute_outputs(tx->output + run, i - run);
+		run = i;
+	}
+}
+
+/* Outputs before start are sorted: insert the rest among them. */
+static void insert_outputs(struct bitcoin_tx *tx, size_t start)
+{
+	size_t i;
+
+	for (i = start; i < tx->output_count; i++) {
+		struct bitcoin_tx_output out = tx->output[i];
+		size_t lo = 0, hi = i;
+
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (output_cmp(&tx->output[mid], &out) <= 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		memmove(tx->output + lo + 1, tx->output + lo,
+			(i - lo) * sizeof(out));
+		tx->output[lo] = out;
+	}
+}
+
 struct bitcoin_tx *create_commit_tx(const tal_t *ctx,
 				    struct peer *peer,
 				    const struct sha256 *rhash,
@@ -135,15 +304,42 @@ struct bitcoin_tx *create_commit_tx(const tal_t *ctx,
 				    enum side side,
 				    bool *otherside_only)
 {
+	struct commit_template *t = get_commit_template(peer, side);
 	struct bitcoin_tx *tx;
 	uint64_t total = 0;
 	struct htlc_map_iter it;
 	struct htlc *h;
+	struct ripemd160 revoke;
+	u8 *script[2];
+	size_t i, num_htlcs = 0;
 	bool pays_to[2];
 	int committed_flag = HTLC_FLAG(side,HTLC_F_COMMITTED);
 
+	ripemd160(&revoke, rhash->u.u8, sizeof(rhash->u));
+
+	/* Bring the template up to date: new HTLCs get their scripts. */
+	t->gen++;
+	for (h = htlc_map_first(&peer->htlcs, &it);
+	     h;
+	     h = htlc_map_next(&peer->htlcs, &it)) {
+		struct commit_htlc *ch;
+		u64 key = (h->id << 1) | htlc_owner(h);
+
+		if (!htlc_has(h, committed_flag))
+			continue;
+		ch = commit_htlc_map_get(&t->map, key);
+		if (!ch)
+			ch = add_commit_htlc(t, peer, h, key, rhash, &revoke,
+					     side);
+		ch->h = h;
+		ch->gen = t->gen;
+		num_htlcs++;
+	}
+	prune_commit_htlcs(t);
+	assert(t->num == num_htlcs);
+
 	/* Now create commitment tx: one input, two outputs (plus htlcs) */
-	tx = bitcoin_tx(ctx, 1, 2 + count_htlcs(&peer->htlcs, committed_flag));
+	tx = bitcoin_tx(ctx, 1, 2 + num_htlcs);
 
  	log_debug(peer->log, "Creating commitment tx:");
 	log_add_struct(peer->log, " rhash = %s", struct sha256, rhash);
@@ -161,28 +357,23 @@ struct bitcoin_tx *create_commit_tx(const tal_t *ctx,
 	tx->input[0].index = peer->anchor.index;
 	tx->input[0].amount = tal_dup(tx->input, u64, &peer->anchor.satoshis);
 
-	tx->output_count = 0;
-	pays_to[LOCAL] = add_output(tx, commit_output_to_us(tx, peer, rhash,
-							    side, NULL),
-				    cstate->side[LOCAL].pay_msat / 1000,
-				    &total);
+	script[LOCAL] = commit_output_to_us(tx, peer, rhash, side, NULL);
+	pays_to[LOCAL] = !is_dust(cstate->side[LOCAL].pay_msat / 1000);
 	if (pays_to[LOCAL])
 		log_debug(peer->log, "Pays %u to local: %s",
 			  cstate->side[LOCAL].pay_msat / 1000,
-			  tal_hexstr(tx, tx->output[tx->output_count-1].script,
-				     tx->output[tx->output_count-1].script_length));
+			  tal_hexstr(tx, script[LOCAL],
+				     tal_count(script[LOCAL])));
 	else
 		log_debug(peer->log, "DOES NOT pay %u to local",
 			  cstate->side[LOCAL].pay_msat / 1000);
-	pays_to[REMOTE] = add_output(tx, commit_output_to_them(tx, peer, rhash,
-							       side, NULL),
-				     cstate->side[REMOTE].pay_msat / 1000,
-				     &total);
+	script[REMOTE] = commit_output_to_them(tx, peer, rhash, side, NULL);
+	pays_to[REMOTE] = !is_dust(cstate->side[REMOTE].pay_msat / 1000);
 	if (pays_to[REMOTE])
 		log_debug(peer->log, "Pays %u to remote: %s",
 			  cstate->side[REMOTE].pay_msat / 1000,
-			  tal_hexstr(tx, tx->output[tx->output_count-1].script,
-				     tx->output[tx->output_count-1].script_length));
+			  tal_hexstr(tx, script[REMOTE],
+				     tal_count(script[REMOTE])));
 	else
 		log_debug(peer->log, "DOES NOT pay %u to remote",
 			  cstate->side[REMOTE].pay_msat / 1000);
@@ -190,33 +381,40 @@ struct bitcoin_tx *create_commit_tx(const tal_t *ctx,
 	/* If their tx doesn't pay to them, or our tx doesn't pay to us... */
 	*otherside_only = !pays_to[side];
 
-	/* First two outputs done, now for the HTLCs. */
-	for (h = htlc_map_first(&peer->htlcs, &it);
-	     h;
-	     h = htlc_map_next(&peer->htlcs, &it)) {
-		const u8 *wscript;
+	/* HTLCs go in first, already in amount order. */
+	tx->output_count = 0;
+	for (i = 0; i < t->num; i++) {
+		struct commit_htlc *ch = t->sorted[i];
+		u8 *p2wsh = commit_htlc_p2wsh(tx, ch, &revoke);
 
-		if (!htlc_has(h, committed_flag))
-			continue;
-		wscript = wscript_for_htlc(tx, peer, h, rhash, side);
 		/* If we pay any HTLC, it's txout is not just to other side. */
-		if (add_output(tx, scriptpubkey_p2wsh(tx, wscript),
-			       h->msatoshi / 1000, &total)) {
+		if (add_output(tx, p2wsh, ch->satoshis, &total)) {
 			*otherside_only = false;
 			log_debug(peer->log, "Pays %"PRIu64" to htlc %"PRIu64,
-				  h->msatoshi / 1000, h->id);
+				  ch->satoshis, ch->h->id);
 			log_add_struct(peer->log, " expiry %s",
-				       struct abs_locktime, &h->expiry);
+				       struct abs_locktime, &ch->h->expiry);
 			log_add_struct(peer->log, " rhash %s", struct sha256,
-				       &h->rhash);
+				       &ch->h->rhash);
 			log_debug(peer->log, "Script: %s",
-				  tal_hexstr(tx, wscript, tal_count(wscript)));
-		} else
+				  tal_hexstr(tx, ch->wscript,
+					     tal_count(ch->wscript)));
+		} else {
+			tal_free(p2wsh);
 			log_debug(peer->log, "DOES NOT pay %"PRIu64" to htlc %"PRIu64,
-				  h->msatoshi / 1000, h->id);
+				  ch->satoshis, ch->h->id);
+		}
 	}
+	sort_equal_amounts(tx, 0);
+
+	/* Then our two outputs go where they belong. */
+	i = tx->output_count;
+	add_output(tx, script[LOCAL], cstate->side[LOCAL].pay_msat / 1000,
+		   &total);
+	add_output(tx, script[REMOTE], cstate->side[REMOTE].pay_msat / 1000,
+		   &total);
+	insert_outputs(tx, i);
 	assert(total <= peer->anchor.satoshis);
 
-	permute_outputs(tx->output, tx->output_count);
 	return tx;
 }
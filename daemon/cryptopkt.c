@@ -22,6 +22,10 @@
 
 #define MAX_PKT_LEN (1024 * 1024)
 
+/* We don't keep an arena bigger than this: rarer packets use tal. */
+#define MAX_ARENA_LEN (64 * 1024)
+#define ARENA_ALIGN 16
+
 /* BOLT#1:
    `length` is a 4-byte little-endian field indicating the size of the unencrypted body.
  */
@@ -105,15 +109,34 @@ static void setup_crypto(struct dir_state *dir,
 	dir->enckey = enckey_from_secret(shared_secret, serial_pubkey);
 
 	dir->cpkt = NULL;
+	dir->pkt_len = 0;
 }
 
+/* Incoming packets are unpacked into this, and it's reset before we
+ * read the next one.  So anything kept from a packet must be copied! */
+struct pkt_arena {
+	char *buf;
+	size_t used;
+
+	/* Total this packet asked for, and what didn't fit in buf. */
+	size_t wanted;
+	char *overflow;
+};
+
 struct io_data {
 	/* Stuff we need to keep around to talk to peer. */
 	struct dir_state in, out;
 
+	/* Where the current incoming packet lives. */
+	struct pkt_arena arena;
+
 	/* Length we're currently reading. */
 	struct crypto_pkt hdr_in;
 
+	/* Encrypted packets to write (tal_count(outbuf) is capacity). */
+	u8 *outbuf;
+	size_t outbuf_len;
+
 	/* Callback once packet decrypted. */
 	struct io_plan *(*cb)(struct io_conn *, struct peer *);
 
@@ -121,14 +144,41 @@ struct io_data {
 	struct peer *peer;
 };
 
-static void *proto_tal_alloc(void *allocator_data, size_t size)
+static void *proto_arena_alloc(void *allocator_data, size_t size)
 {
-	return tal_arr(allocator_data, char, size);
+	struct pkt_arena *arena = allocator_data;
+	size_t off = (arena->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	arena->wanted += (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (off + size > tal_count(arena->buf)) {
+		if (!arena->overflow)
+			arena->overflow = tal(arena->buf, char);
+		return tal_arr(arena->overflow, char, size);
+	}
+	arena->used = off + size;
+	return arena->buf + off;
 }
 
-static void proto_tal_free(void *allocator_data, void *pointer)
+/* Only called if unpacking fails: arena_reset cleans up. */
+static void proto_arena_free(void *allocator_data, void *pointer)
 {
-	tal_free(pointer);
+}
+
+static void arena_init(const tal_t *ctx, struct pkt_arena *arena)
+{
+	arena->buf = tal_arr(ctx, char, 1024);
+	arena->used = arena->wanted = 0;
+	arena->overflow = NULL;
+}
+
+/* Forget the last packet; grow if it didn't fit. */
+static void arena_reset(struct pkt_arena *arena)
+{
+	arena->overflow = tal_free(arena->overflow);
+	if (arena->wanted > tal_count(arena->buf)
+	    && arena->wanted <= MAX_ARENA_LEN)
+		tal_resize(&arena->buf, arena->wanted);
+	arena->used = arena->wanted = 0;
 }
 
 static void le64_nonce(unsigned char *npub, u64 nonce)
@@ -188,7 +238,8 @@ static bool decrypt_in_place(void *data, size_t len,
 	return false;
 }
 
-static Pkt *decrypt_body(const tal_t *ctx, struct io_data *iod, struct log *log,
+/* Returned Pkt only lasts until the next arena_reset. */
+static Pkt *decrypt_body(struct io_data *iod, struct log *log,
 			 struct crypto_pkt *cpkt, size_t data_len)
 {
 	struct ProtobufCAllocator prototal;
@@ -199,21 +250,17 @@ static Pkt *decrypt_body(const tal_t *ctx, struct io_data *iod, struct log *log,
 		log_unusual(log, "Body decryption failed");
 		return NULL;
 	}
+	log_io(log, true, cpkt->data, data_len);
 
 	/* De-protobuf it. */
-	prototal.alloc = proto_tal_alloc;
-	prototal.free = proto_tal_free;
-	prototal.allocator_data = tal(ctx, char);
+	prototal.alloc = proto_arena_alloc;
+	prototal.free = proto_arena_free;
+	prototal.allocator_data = &iod->arena;
 
 	ret = pkt__unpack(&prototal, data_len, cpkt->data);
-	if (!ret) {
+	if (!ret)
 		log_unusual(log, "Packet failed to unpack!");
-		tal_free(prototal.allocator_data);
-	} else {
-		/* Make sure packet owns contents */
-		tal_steal(ctx, ret);
-		tal_steal(ret, prototal.allocator_data);
-
+	else {
 		log_debug(log, "Received packet LEN=%u, type=%s",
 			  le32_to_cpu(iod->hdr_in.length),
 			  ret->pkt_case == PKT__PKT_AUTH ? "PKT_AUTH"
@@ -222,27 +269,46 @@ static Pkt *decrypt_body(const tal_t *ctx, struct io_data *iod, struct log *log,
 	return ret;
 }
 
-static struct crypto_pkt *encrypt_pkt(struct io_data *iod, const Pkt *pkt,
-				      size_t *totlen)
+/* Packs and encrypts pkt in place on the end of iod->outbuf. */
+static void encrypt_pkt(struct io_data *iod, struct log *log, const Pkt *pkt)
 {
-	struct crypto_pkt *cpkt;
-	size_t len;
+	size_t len, totlen;
+	le32 length;
+	u8 *p;
+
+	/* outbuf isn't aligned for struct crypto_pkt: use offsets. */
+	BUILD_ASSERT(offsetof(struct crypto_pkt, data)
+		     == sizeof(length) + crypto_aead_chacha20poly1305_ABYTES);
 
 	len = pkt__get_packed_size(pkt);
-	*totlen = sizeof(*cpkt) + len + crypto_aead_chacha20poly1305_ABYTES;
+	totlen = sizeof(struct crypto_pkt) + len
+		+ crypto_aead_chacha20poly1305_ABYTES;
 
-	cpkt = (struct crypto_pkt *)tal_arr(iod, char, *totlen);
-	cpkt->length = cpu_to_le32(len);
+	if (iod->outbuf_len + totlen > tal_count(iod->outbuf))
+		tal_resize(&iod->outbuf, (iod->outbuf_len + totlen) * 2);
+	p = iod->outbuf + iod->outbuf_len;
+	iod->outbuf_len += totlen;
 
 	/* Encrypt header. */
-	encrypt_in_place(cpkt, sizeof(cpkt->length),
-			 &iod->out.nonce, &iod->out.enckey);
+	length = cpu_to_le32(len);
+	memcpy(p, &length, sizeof(length));
+	encrypt_in_place(p, sizeof(length), &iod->out.nonce, &iod->out.enckey);
 
 	/* Encrypt body. */
-	pkt__pack(pkt, cpkt->data);
-	encrypt_in_place(cpkt->data, len, &iod->out.nonce, &iod->out.enckey);
+	p += offsetof(struct crypto_pkt, data);
+	pkt__pack(pkt, p);
+	log_io(log, false, p, len);
+	encrypt_in_place(p, len, &iod->out.nonce, &iod->out.enckey);
+}
+
+/* Length of iod->outbuf to write: nothing more is added until that's
+ * done, so we can reset it now. */
+static size_t outbuf_take(struct io_data *iod)
+{
+	size_t len = iod->outbuf_len;
 
-	return cpkt;
+	iod->outbuf_len = 0;
+	return len;
 }
 
 static struct io_plan *recv_body(struct io_conn *conn, struct peer *peer)
@@ -250,7 +316,7 @@ static struct io_plan *recv_body(struct io_conn *conn, struct peer *peer)
 	struct io_data *iod = peer->io_data;
 
 	/* We have full packet. */
-	peer->inpkt = decrypt_body(iod, iod, peer->log, iod->in.cpkt,
+	peer->inpkt = decrypt_body(iod, peer->log, iod->in.cpkt,
 				   le32_to_cpu(iod->hdr_in.length));
 	if (!peer->inpkt)
 		return io_close(conn);
@@ -278,12 +344,16 @@ static bool decrypt_header(struct log *log, struct io_data *iod,
 		return false;
 	}
 
-	/* Allocate room for body, copy header. */
+	/* Make room for body (we reuse this), copy header. */
 	*body_len = le32_to_cpu(iod->hdr_in.length)
 		+ crypto_aead_chacha20poly1305_ABYTES;
 
-	iod->in.cpkt = (struct crypto_pkt *)
-		tal_arr(iod, char, sizeof(iod->hdr_in) + *body_len);
+	if (iod->in.pkt_len < sizeof(iod->hdr_in) + *body_len) {
+		iod->in.pkt_len = sizeof(iod->hdr_in) + *body_len;
+		tal_free(iod->in.cpkt);
+		iod->in.cpkt = (struct crypto_pkt *)
+			tal_arr(iod, char, iod->in.pkt_len);
+	}
 	*iod->in.cpkt = iod->hdr_in;
 	return true;
 }
@@ -306,28 +376,62 @@ struct io_plan *peer_read_packet(struct io_conn *conn,
 {
 	struct io_data *iod = peer->io_data;
 
+	/* Previous packet is gone now. */
+	arena_reset(&iod->arena);
+	peer->inpkt = NULL;
+
 	iod->cb = cb;
 	return io_read(conn, &iod->hdr_in, sizeof(iod->hdr_in),
 		       recv_header, peer);
 }
 
-/* Caller must free data! */
-struct io_plan *peer_write_packet(struct io_conn *conn,
-				  struct peer *peer,
-				  const Pkt *pkt,
-				  struct io_plan *(*next)(struct io_conn *,
-							  struct peer *))
+static Pkt **outpkt_slot(const struct peer *peer, size_t i)
 {
-	struct io_data *iod = peer->io_data;
-	size_t totlen;
+	return &peer->outpkt[(peer->outpkt_start + i)
+			     & (tal_count(peer->outpkt) - 1)];
+}
+
+void queue_outpkt(struct peer *peer, Pkt *pkt)
+{
+	size_t max = tal_count(peer->outpkt);
 
-	/* We free previous packet here, rather than doing indirection
-	 * via io_write */
-	tal_free(iod->out.cpkt);
+	/* Double the ring: anything wrapped around moves to the new half. */
+	if (peer->num_outpkt == max) {
+		tal_resize(&peer->outpkt, max * 2);
+		memcpy(peer->outpkt + max, peer->outpkt,
+		       peer->outpkt_start * sizeof(*peer->outpkt));
+	}
+	*outpkt_slot(peer, peer->num_outpkt++) = pkt;
+}
+
+Pkt *peek_outpkt(const struct peer *peer, size_t i)
+{
+	return *outpkt_slot(peer, i);
+}
 
-	iod->out.cpkt = encrypt_pkt(iod, pkt, &totlen);
+Pkt *dequeue_outpkt(struct peer *peer)
+{
+	Pkt *pkt = *outpkt_slot(peer, 0);
+
+	peer->outpkt_start = (peer->outpkt_start + 1)
+		& (tal_count(peer->outpkt) - 1);
+	peer->num_outpkt--;
+	return pkt;
+}
+
+void peer_encrypt_packet(struct peer *peer, const Pkt *pkt)
+{
+	encrypt_pkt(peer->io_data, peer->log, pkt);
+}
+
+struct io_plan *peer_write_packets(struct io_conn *conn,
+				   struct peer *peer,
+				   struct io_plan *(*next)(struct io_conn *,
+							   struct peer *))
+{
+	struct io_data *iod = peer->io_data;
 
-	return io_write(conn, iod->out.cpkt, totlen, next, peer);
+	return io_write(conn, iod->outbuf, outbuf_take(iod), next, peer);
 }
 
 static void *pkt_unwrap(Pkt *inpkt, struct log *log, Pkt__PktCase which)
@@ -426,7 +530,7 @@ static struct io_plan *recv_body_negotiate(struct io_conn *conn,
 	struct pubkey id;
 
 	/* We have full packet. */
-	pkt = decrypt_body(neg, iod, neg->log, iod->in.cpkt,
+	pkt = decrypt_body(iod, neg->log, iod->in.cpkt,
 			   le32_to_cpu(iod->hdr_in.length));
 	if (!pkt)
 		return io_close(conn);
@@ -489,7 +593,6 @@ static struct io_plan *keys_exchanged(struct io_conn *conn,
 	struct pubkey sessionkey;
 	struct signature sig;
 	Pkt *auth;
-	size_t totlen;
 
 	if (!pubkey_from_der(neg->dstate->secpctx,
 			     neg->their_sessionpubkey,
@@ -510,6 +613,9 @@ static struct io_plan *keys_exchanged(struct io_conn *conn,
 
 	/* Each side combines with their OWN session key to SENDING crypto. */
 	neg->iod = tal(neg, struct io_data);
+	neg->iod->outbuf = tal_arr(neg->iod, u8, 0);
+	neg->iod->outbuf_len = 0;
+	arena_init(neg->iod, &neg->iod->arena);
 	setup_crypto(&neg->iod->in, shared_secret, neg->their_sessionpubkey);
 	setup_crypto(&neg->iod->out, shared_secret, neg->our_sessionpubkey);
 
@@ -525,8 +631,9 @@ static struct io_plan *keys_exchanged(struct io_conn *conn,
 	auth = authenticate_pkt(neg, neg->dstate->secpctx,
 				&neg->dstate->id, &sig);
 
-	neg->iod->out.cpkt = encrypt_pkt(neg->iod, auth, &totlen);
-	return io_write(conn, neg->iod->out.cpkt, totlen, receive_proof, neg);
+	encrypt_pkt(neg->iod, neg->log, auth);
+	return io_write(conn, neg->iod->outbuf, outbuf_take(neg->iod),
+			receive_proof, neg);
 }
 
 /* Read and ignore any extra bytes... */
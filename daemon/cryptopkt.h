@@ -34,15 +34,28 @@ struct io_plan *peer_crypto_setup_(struct io_conn *conn,
 					       const struct pubkey *),	\
 			   (arg))
 
-/* Reads packet into peer->inpkt/peer->inpkt_len */
+/* Reads packet into peer->inpkt: it only lasts until the next call, so
+ * copy out anything you want to keep. */
 struct io_plan *peer_read_packet(struct io_conn *conn,
 				 struct peer *peer,
 				 struct io_plan *(*cb)(struct io_conn *,
 						       struct peer *));
 
-struct io_plan *peer_write_packet(struct io_conn *conn,
-				  struct peer *peer,
-				  const Pkt *pkt,
-				  struct io_plan *(*next)(struct io_conn *,
-							  struct peer *));
+/* Add pkt to the output queue (peer takes ownership). */
+void queue_outpkt(struct peer *peer, Pkt *pkt);
+
+/* The i'th queued packet (0 is the next out). */
+Pkt *peek_outpkt(const struct peer *peer, size_t i);
+
+/* Remove the next packet from the queue: caller frees it. */
+Pkt *dequeue_outpkt(struct peer *peer);
+
+/* Encrypts pkt onto the end of what peer_write_packets will send. */
+void peer_encrypt_packet(struct peer *peer, const Pkt *pkt);
+
+/* Writes out everything encrypted so far in one go. */
+struct io_plan *peer_write_packets(struct io_conn *conn,
+				   struct peer *peer,
+				   struct io_plan *(*next)(struct io_conn *,
+							   struct peer *));
 #endif /* LIGHTNING_DAEMON_CRYPTOPKT_H */
@@ -11,11 +11,13 @@
 #include "pay.h"
 #include "routing.h"
 #include "secrets.h"
+#include "timeout.h"
 #include "utils.h"
 #include "wallet.h"
 #include <ccan/array_size/array_size.h>
 #include <ccan/cast/cast.h>
 #include <ccan/cppmagic/cppmagic.h>
+#include <ccan/io/io.h>
 #include <ccan/mem/mem.h>
 #include <ccan/str/hex/hex.h>
 #include <ccan/tal/str/str.h>
@@ -29,14 +31,33 @@
 /* They don't use stdint types. */
 #define PRIuSQLITE64 "llu"
 
+/* A compiled statement, keyed by its (string literal) query. */
+struct db_stmt {
+	const char *query;
+	sqlite3_stmt *stmt;
+};
+
 struct db {
 	bool in_transaction;
+	/* With config.db_group_commit, the sqlite transaction holding peer
+	 * transactions which have committed, but aren't durable yet. */
+	bool group_open;
 	const char *err;
 	sqlite3 *sql;
+	/* Statements we've prepared so far: reused by db_prepare. */
+	struct db_stmt *stmts;
 };
 
 static void close_db(struct db *db)
 {
+	size_t i;
+
+	/* Nobody is waiting on it, but no reason to lose it. */
+	if (db->group_open)
+		sqlite3_exec(db->sql, "COMMIT;", NULL, NULL, NULL);
+
+	for (i = 0; i < tal_count(db->stmts); i++)
+		sqlite3_finalize(db->stmts[i].stmt);
 	sqlite3_close(db->sql);
 }
 
@@ -73,13 +94,6 @@ static const char *sqlite3_column_str(sqlite3_stmt *stmt, int iCol)
 #define TABLE(tablename, ...)					\
 	"CREATE TABLE " #tablename " (" CPPMAGIC_JOIN(", ", __VA_ARGS__) ");"
 
-static const char *sql_bool(bool b)
-{
-	/* SQL2003 says TRUE and FALSE are binary literal keywords.
-	 * sqlite3 barfs. */
-	return (b) ? "1" : "0";
-}
-
 static bool PRINTF_FMT(3,4)
 	db_exec(const char *caller,
 		struct lightningd_state *dstate, const char *fmt, ...)
@@ -110,19 +124,96 @@ static bool PRINTF_FMT(3,4)
 	return true;
 }
 
-static char *sql_hex_or_null(const tal_t *ctx, const void *buf, size_t len)
+/* Query must be a string literal: we look it up by pointer, and only
+ * compile it the first time. */
+static sqlite3_stmt *db_prepare(const char *caller,
+				struct lightningd_state *dstate,
+				const char *query)
 {
-	char *r;
+	struct db *db = dstate->db;
+	size_t i, n = tal_count(db->stmts);
+	sqlite3_stmt *stmt;
+	int err;
+
+	for (i = 0; i < n; i++)
+		if (db->stmts[i].query == query)
+			return db->stmts[i].stmt;
+
+	err = sqlite3_prepare_v2(db->sql, query, -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:prepare '%s' gave %s:%s", caller, query,
+		      sqlite3_errstr(err), sqlite3_errmsg(db->sql));
 
+	tal_resize(&db->stmts, n + 1);
+	db->stmts[n].query = query;
+	db->stmts[n].stmt = stmt;
+	return stmt;
+}
+
+/* Run a statement from db_prepare, and reset it for next time. */
+static bool db_exec_prepared(const char *caller,
+			     struct lightningd_state *dstate,
+			     sqlite3_stmt *stmt)
+{
+	struct db *db = dstate->db;
+	int err;
+	bool ok = true;
+
+	if (db->in_transaction && db->err) {
+		ok = false;
+		goto out;
+	}
+
+	err = sqlite3_step(stmt);
+	if (err != SQLITE_DONE) {
+		tal_free(db->err);
+		db->err = tal_fmt(db, "%s:%s:%s:%s",
+				  caller, sqlite3_errstr(err),
+				  sqlite3_sql(stmt), sqlite3_errmsg(db->sql));
+		log_broken(dstate->base_log, "%s", db->err);
+		ok = false;
+	}
+
+out:
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return ok;
+}
+
+/* NULL buf means SQL NULL.  Caller keeps buf alive until we execute. */
+static void sql_bind_blob(sqlite3_stmt *stmt, int idx,
+			  const void *buf, size_t len)
+{
 	if (!buf)
-		return "NULL";
-	r = tal_arr(ctx, char, 3 + hex_str_size(len));
-	r[0] = 'x';
-	r[1] = '\'';
-	hex_encode(buf, len, r+2, hex_str_size(len));
-	r[2+hex_str_size(len)-1] = '\'';
-	r[2+hex_str_size(len)] = '\0';
-	return r;
+		sqlite3_bind_null(stmt, idx);
+	else
+		sqlite3_bind_blob(stmt, idx, buf, len, SQLITE_STATIC);
+}
+
+/* Strings must be static (eg. state names). */
+static void sql_bind_str(sqlite3_stmt *stmt, int idx, const char *str)
+{
+	sqlite3_bind_text(stmt, idx, str, -1, SQLITE_STATIC);
+}
+
+static void sql_bind_u64(sqlite3_stmt *stmt, int idx, u64 v)
+{
+	sqlite3_bind_int64(stmt, idx, v);
+}
+
+static void sql_bind_bool(sqlite3_stmt *stmt, int idx, bool b)
+{
+	sqlite3_bind_int(stmt, idx, b);
+}
+
+static void sql_bind_pubkey(sqlite3_stmt *stmt, int idx,
+			    secp256k1_context *secpctx,
+			    const struct pubkey *key)
+{
+	u8 der[PUBKEY_DER_LEN];
+
+	pubkey_to_der(secpctx, der, key);
+	sqlite3_bind_blob(stmt, idx, der, sizeof(der), SQLITE_TRANSIENT);
 }
 
 static void from_sql_blob(sqlite3_stmt *stmt, int idx, void *p, size_t n)
@@ -172,19 +263,22 @@ static void sig_from_sql(secp256k1_context *secpctx,
 	sig->stype = SIGHASH_ALL;
 }
 
-static char *sig_to_sql(const tal_t *ctx,
-			secp256k1_context *secpctx,
-			const struct bitcoin_signature *sig)
+static void sql_bind_sig(sqlite3_stmt *stmt, int idx,
+			 secp256k1_context *secpctx,
+			 const struct bitcoin_signature *sig)
 {
 	u8 compact[64];
 
-	if (!sig)
-		return sql_hex_or_null(ctx, NULL, 0);
+	if (!sig) {
+		sqlite3_bind_null(stmt, idx);
+		return;
+	}
 
 	assert(sig->stype == SIGHASH_ALL);
 	secp256k1_ecdsa_signature_serialize_compact(secpctx, compact,
 						    &sig->sig.sig);
-	return sql_hex_or_null(ctx, compact, sizeof(compact));
+	sqlite3_bind_blob(stmt, idx, compact, sizeof(compact),
+			  SQLITE_TRANSIENT);
 }
 
 static void db_load_wallet(struct lightningd_state *dstate)
@@ -222,12 +316,12 @@ static void db_load_wallet(struct lightningd_state *dstate)
 void db_add_wallet_privkey(struct lightningd_state *dstate,
 			   const struct privkey *privkey)
 {
-	char *ctx = tal(dstate, char);
+	sqlite3_stmt *stmt;
 
 	log_debug(dstate->base_log, "%s", __func__);
-	if (!db_exec(__func__, dstate,
-		      "INSERT INTO wallet VALUES (x'%s');",
-		     tal_hexstr(ctx, privkey, sizeof(*privkey))))
+	stmt = db_prepare(__func__, dstate, "INSERT INTO wallet VALUES (?);");
+	sql_bind_blob(stmt, 1, privkey, sizeof(*privkey));
+	if (!db_exec_prepared(__func__, dstate, stmt))
 		fatal("db_add_wallet_privkey failed");
 }
 
@@ -700,7 +794,7 @@ static void connect_htlc_src(struct lightningd_state *dstate)
 			      sqlite3_column_int64(stmt, 1),
 			      sqlite3_column_str(stmt, 2));
 
-		pubkey_from_sql(dstate->secpctx, stmt, 4, &id);
+		pubkey_from_sql(dstate->secpctx, stmt, 3, &id);
 		peer = find_peer(dstate, &id);
 		if (!peer)
 			fatal("connect_htlc_src:unknown src peer %s",
@@ -722,12 +816,11 @@ static void connect_htlc_src(struct lightningd_state *dstate)
 	tal_free(ctx);
 }
 
-static const char *linearize_shachain(const tal_t *ctx,
-				      const struct shachain *shachain)
+static u8 *linearize_shachain(const tal_t *ctx,
+			      const struct shachain *shachain)
 {
 	size_t i;
 	u8 *p = tal_arr(ctx, u8, 0);
-	const char *str;
 
 	push_le64(shachain->min_index, push, &p);
 	push_le32(shachain->num_valid, push, &p);
@@ -743,9 +836,7 @@ static const char *linearize_shachain(const tal_t *ctx,
 	}
 		
 	assert(tal_count(p) == SHACHAIN_SIZE);
-	str = tal_hexstr(ctx, p, tal_count(p));
-	tal_free(p);
-	return str;
+	return p;
 }
 
 static bool delinearize_shachain(struct shachain *shachain,
@@ -860,6 +951,10 @@ static void load_peer_closing(struct peer *peer)
 		peer->closing.sigs_in = sqlite3_column_int64(stmt, 8);
 		closing_found = true;
 	}
+	err = sqlite3_finalize(stmt);
+	if (err != SQLITE_OK)
+		fatal("load_peer_closing:finalize gave %s:%s",
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
 	tal_free(ctx);
 }
 
@@ -947,7 +1042,7 @@ static void db_load_peers(struct lightningd_state *dstate)
 		peer = new_peer(dstate, l, state, sqlite3_column_int(stmt, 2) ?
 				CMD_OPEN_WITH_ANCHOR : CMD_OPEN_WITHOUT_ANCHOR);
 		peer->htlc_id_counter = 0;
-		peer->id = tal_dup(peer, struct pubkey, &id);
+		peer_set_id(peer, &id);
 		peer->local.commit_fee_rate = sqlite3_column_int64(stmt, 3);
 		log_debug(peer->log, "%s:%s",
 			  __func__, state_name(peer->state));
@@ -977,9 +1072,9 @@ static void db_load_peers(struct lightningd_state *dstate)
 }
 
 
-static const char *pubkeys_to_hex(const tal_t *ctx,
-				  secp256k1_context *secpctx,
-				  const struct pubkey *ids)
+static u8 *pubkeys_to_arr(const tal_t *ctx,
+			  secp256k1_context *secpctx,
+			  const struct pubkey *ids)
 {
 	u8 *ders = tal_arr(ctx, u8, PUBKEY_DER_LEN * tal_count(ids));
 	size_t i;
@@ -987,8 +1082,9 @@ static const char *pubkeys_to_hex(const tal_t *ctx,
 	for (i = 0; i < tal_count(ids); i++)
 		pubkey_to_der(secpctx, ders + i * PUBKEY_DER_LEN, &ids[i]);
 
-	return tal_hexstr(ctx, ders, tal_count(ders));
+	return ders;
 }
+
 static struct pubkey *pubkeys_from_arr(const tal_t *ctx,
 				       secp256k1_context *secpctx,
 				       const void *blob, size_t len)
@@ -1084,6 +1180,20 @@ static void db_load_invoice(struct lightningd_state *dstate)
 	sqlite3_stmt *stmt;
 	char *ctx = tal(dstate, char);
 
+	/* Size the invoice maps up front, rather than growing them. */
+	err = sqlite3_prepare_v2(dstate->db->sql,
+				 "SELECT COUNT(*) FROM invoice;", -1,
+				 &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("db_load_invoice:prepare gave %s:%s",
+		      sqlite3_errstr(err), sqlite3_errmsg(dstate->db->sql));
+	err = sqlite3_step(stmt);
+	if (err != SQLITE_ROW)
+		fatal("db_load_invoice:step gave %s:%s",
+		      sqlite3_errstr(err), sqlite3_errmsg(dstate->db->sql));
+	invoices_reserve(dstate, sqlite3_column_int64(stmt, 0));
+	sqlite3_finalize(stmt);
+
 	err = sqlite3_prepare_v2(dstate->db->sql, "SELECT * FROM invoice;", -1,
 				 &stmt, NULL);
 
@@ -1174,6 +1284,8 @@ void db_init(struct lightningd_state *dstate)
 		log_unusual(dstate->base_log,
 			    "Error opening %s (%s), trying to create",
 			    DB_FILE, sqlite3_errstr(err));
+		/* Even a failed open allocates a handle. */
+		sqlite3_close(dstate->db->sql);
 		err = sqlite3_open_v2(DB_FILE, &dstate->db->sql,
 				      SQLITE_OPEN_READWRITE
 				      | SQLITE_OPEN_CREATE, NULL);
@@ -1185,7 +1297,15 @@ void db_init(struct lightningd_state *dstate)
 
 	tal_add_destructor(dstate->db, close_db);
 	dstate->db->in_transaction = false;
+	dstate->db->group_open = false;
 	dstate->db->err = NULL;
+	dstate->db->stmts = tal_arr(dstate->db, struct db_stmt, 0);
+
+	if (!db_exec(__func__, dstate, "PRAGMA journal_mode=%s;",
+		     dstate->config.db_wal ? "WAL" : "DELETE")
+	    || !db_exec(__func__, dstate, "PRAGMA synchronous=%s;",
+			dstate->config.db_synchronous))
+		fatal("%s", dstate->db->err);
 
 	if (!created) {
 		db_load(dstate);
@@ -1268,482 +1388,592 @@ void db_init(struct lightningd_state *dstate)
 
 void db_set_anchor(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid;
-
-	assert(peer->dstate->db->in_transaction);
-	peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
-
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO anchors VALUES (x'%s', x'%s', %u, %"PRIu64", %i, %u, %s);",
-		peerid,
-		tal_hexstr(ctx, &peer->anchor.txid, sizeof(peer->anchor.txid)),
-		peer->anchor.index,
-		peer->anchor.satoshis,
-		peer->anchor.ok_depth,
-		peer->anchor.min_depth,
-		sql_bool(peer->anchor.ours));
-
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO commit_info VALUES(x'%s', '%s', 0, x'%s', %"PRIi64", %s, NULL);",
-		peerid,
-		side_to_str(LOCAL),
-		tal_hexstr(ctx, &peer->local.commit->revocation_hash,
-			   sizeof(peer->local.commit->revocation_hash)),
-		peer->local.commit->order,
-		sig_to_sql(ctx, peer->dstate->secpctx,
-			   peer->local.commit->sig));
-
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO commit_info VALUES(x'%s', '%s', 0, x'%s', %"PRIi64", %s, NULL);",
-		peerid,
-		side_to_str(REMOTE),
-		tal_hexstr(ctx, &peer->remote.commit->revocation_hash,
-			   sizeof(peer->remote.commit->revocation_hash)),
-		peer->remote.commit->order,
-		sig_to_sql(ctx, peer->dstate->secpctx,
-			   peer->remote.commit->sig));
-
-	db_exec(__func__, peer->dstate,
-		"INSERT INTO shachain VALUES (x'%s', x'%s');",
-		peerid,
-		linearize_shachain(ctx, &peer->their_preimages));
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
+	u8 *shachain;
 
-	tal_free(ctx);
+	assert(dstate->db->in_transaction);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO anchors VALUES (?, ?, ?, ?, ?, ?, ?);");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	sql_bind_blob(stmt, 2, &peer->anchor.txid, sizeof(peer->anchor.txid));
+	sql_bind_u64(stmt, 3, peer->anchor.index);
+	sql_bind_u64(stmt, 4, peer->anchor.satoshis);
+	sql_bind_u64(stmt, 5, peer->anchor.ok_depth);
+	sql_bind_u64(stmt, 6, peer->anchor.min_depth);
+	sql_bind_bool(stmt, 7, peer->anchor.ours);
+	db_exec_prepared(__func__, dstate, stmt);
+
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO commit_info VALUES(?, ?, 0, ?, ?, ?, NULL);");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	sql_bind_str(stmt, 2, side_to_str(LOCAL));
+	sql_bind_blob(stmt, 3, &peer->local.commit->revocation_hash,
+		      sizeof(peer->local.commit->revocation_hash));
+	sql_bind_u64(stmt, 4, peer->local.commit->order);
+	sql_bind_sig(stmt, 5, dstate->secpctx, peer->local.commit->sig);
+	db_exec_prepared(__func__, dstate, stmt);
+
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	sql_bind_str(stmt, 2, side_to_str(REMOTE));
+	sql_bind_blob(stmt, 3, &peer->remote.commit->revocation_hash,
+		      sizeof(peer->remote.commit->revocation_hash));
+	sql_bind_u64(stmt, 4, peer->remote.commit->order);
+	sql_bind_sig(stmt, 5, dstate->secpctx, peer->remote.commit->sig);
+	db_exec_prepared(__func__, dstate, stmt);
+
+	shachain = linearize_shachain(peer, &peer->their_preimages);
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO shachain VALUES (?, ?);");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	sql_bind_blob(stmt, 2, shachain, tal_count(shachain));
+	db_exec_prepared(__func__, dstate, stmt);
+	tal_free(shachain);
 }
 
 bool db_set_visible_state(struct peer *peer)
 {
-	const char *errmsg, *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
 	db_start_transaction(peer);
 
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO their_visible_state VALUES (x'%s', %s, x'%s', x'%s', %u, %u, %"PRIu64", x'%s');",
-		peerid,
-		sql_bool(peer->remote.offer_anchor == CMD_OPEN_WITH_ANCHOR),
-		pubkey_to_hexstr(ctx, peer->dstate->secpctx,
-				 &peer->remote.commitkey),
-		pubkey_to_hexstr(ctx, peer->dstate->secpctx,
-				 &peer->remote.finalkey),
-		peer->remote.locktime.locktime,
-		peer->remote.mindepth,
-		peer->remote.commit_fee_rate,
-		tal_hexstr(ctx, &peer->remote.next_revocation_hash,
-			   sizeof(peer->remote.next_revocation_hash)));
-
-	errmsg = db_commit_transaction(peer);
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO their_visible_state VALUES (?, ?, ?, ?, ?, ?, ?, ?);");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	sql_bind_bool(stmt, 2,
+		      peer->remote.offer_anchor == CMD_OPEN_WITH_ANCHOR);
+	sql_bind_pubkey(stmt, 3, dstate->secpctx, &peer->remote.commitkey);
+	sql_bind_pubkey(stmt, 4, dstate->secpctx, &peer->remote.finalkey);
+	sql_bind_u64(stmt, 5, peer->remote.locktime.locktime);
+	sql_bind_u64(stmt, 6, peer->remote.mindepth);
+	sql_bind_u64(stmt, 7, peer->remote.commit_fee_rate);
+	sql_bind_blob(stmt, 8, &peer->remote.next_revocation_hash,
+		      sizeof(peer->remote.next_revocation_hash));
+	db_exec_prepared(__func__, dstate, stmt);
 
-	tal_free(ctx);
-	return !errmsg;
+	return !db_commit_transaction(peer);
 }
 
 void db_update_next_revocation_hash(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
-
-	log_debug(peer->log, "%s(%s):%s", __func__, peerid,
-		tal_hexstr(ctx, &peer->remote.next_revocation_hash,
-			   sizeof(peer->remote.next_revocation_hash)));
-	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, 
-		"UPDATE their_visible_state SET next_revocation_hash=x'%s' WHERE peer=x'%s';",
-		tal_hexstr(ctx, &peer->remote.next_revocation_hash,
-			   sizeof(peer->remote.next_revocation_hash)),
-		peerid);
-	tal_free(ctx);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
+
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	log_add_struct(peer->log, ":%s", struct sha256,
+		       &peer->remote.next_revocation_hash);
+	assert(dstate->db->in_transaction);
+
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE their_visible_state SET next_revocation_hash=? WHERE peer=?;");
+	sql_bind_blob(stmt, 1, &peer->remote.next_revocation_hash,
+		      sizeof(peer->remote.next_revocation_hash));
+	sql_bind_pubkey(stmt, 2, dstate->secpctx, peer->id);
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 bool db_create_peer(struct peer *peer)
 {
-	const char *errmsg, *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
+	const void *commit, *final, *seed;
+	size_t commit_len, final_len, seed_len;
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
 	db_start_transaction(peer);
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO peers VALUES (x'%s', '%s', %s, %"PRIi64");",
-		peerid,
-		state_name(peer->state),
-		sql_bool(peer->local.offer_anchor == CMD_OPEN_WITH_ANCHOR),
-		peer->local.commit_fee_rate);
-
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO peer_secrets VALUES (x'%s', %s);",
-		peerid, peer_secrets_for_db(ctx, peer));
-
-	errmsg = db_commit_transaction(peer);
-	tal_free(ctx);
-	return !errmsg;
+
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO peers VALUES (?, ?, ?, ?);");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	sql_bind_str(stmt, 2, state_name(peer->state));
+	sql_bind_bool(stmt, 3,
+		      peer->local.offer_anchor == CMD_OPEN_WITH_ANCHOR);
+	sql_bind_u64(stmt, 4, peer->local.commit_fee_rate);
+	db_exec_prepared(__func__, dstate, stmt);
+
+	peer_secrets_for_db(peer, &commit, &commit_len, &final, &final_len,
+			    &seed, &seed_len);
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO peer_secrets VALUES (?, ?, ?, ?);");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	sql_bind_blob(stmt, 2, commit, commit_len);
+	sql_bind_blob(stmt, 3, final, final_len);
+	sql_bind_blob(stmt, 4, seed, seed_len);
+	db_exec_prepared(__func__, dstate, stmt);
+
+	return !db_commit_transaction(peer);
+}
+
+/* Make everything in the group durable, and let held output go. */
+static void db_group_commit(struct lightningd_state *dstate)
+{
+	struct db *db = dstate->db;
+	struct peer *peer;
+
+	assert(db->group_open);
+	assert(!db->in_transaction);
+
+	log_debug(dstate->base_log, "%s", __func__);
+	db->group_open = false;
+	/* We've already told peers' state machines it's done: can't undo. */
+	if (!db_exec_prepared(__func__, dstate,
+			      db_prepare(__func__, dstate, "COMMIT;")))
+		fatal("%s", db->err);
+
+	list_for_each(&dstate->peers, peer, list) {
+		if (peer->output_awaiting_db) {
+			peer->output_awaiting_db = false;
+			io_wake(peer);
+		}
+	}
+}
+
+/* If sqlite rolled back the whole group on error, we've lost it. */
+static void db_check_group(struct lightningd_state *dstate)
+{
+	if (dstate->db->group_open && sqlite3_get_autocommit(dstate->db->sql))
+		fatal("Database group commit rolled back: %s",
+		      dstate->db->err);
 }
 
 void db_start_transaction(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	struct db *db = dstate->db;
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
-	assert(!peer->dstate->db->in_transaction);
-	peer->dstate->db->in_transaction = true;
-	peer->dstate->db->err = tal_free(peer->dstate->db->err);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(!db->in_transaction);
+	db->in_transaction = true;
+	db->err = tal_free(db->err);
 
-	db_exec(__func__, peer->dstate, "BEGIN IMMEDIATE;");
-	tal_free(ctx);
+	if (!dstate->config.db_group_commit) {
+		db_exec_prepared(__func__, dstate,
+				 db_prepare(__func__, dstate,
+					    "BEGIN IMMEDIATE;"));
+		return;
+	}
+
+	/* First one this loop opens the group, and schedules its commit:
+	 * a zero timer fires once io_loop has handled what's ready now. */
+	if (!db->group_open) {
+		if (!db_exec_prepared(__func__, dstate,
+				      db_prepare(__func__, dstate,
+						 "BEGIN IMMEDIATE;")))
+			return;
+		db->group_open = true;
+		new_reltimer(dstate, db, time_from_sec(0),
+			     db_group_commit, dstate);
+	}
+	db_exec_prepared(__func__, dstate,
+			 db_prepare(__func__, dstate, "SAVEPOINT peer;"));
 }
 
 void db_abort_transaction(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	struct db *db = dstate->db;
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
-	assert(peer->dstate->db->in_transaction);
-	peer->dstate->db->in_transaction = false;
-	db_exec(__func__, peer->dstate, "ROLLBACK;");
-	tal_free(ctx);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(db->in_transaction);
+	db->in_transaction = false;
+
+	if (!db->group_open) {
+		db_exec_prepared(__func__, dstate,
+				 db_prepare(__func__, dstate, "ROLLBACK;"));
+		return;
+	}
+
+	/* Undo this peer's changes, leaving the rest of the group. */
+	db_check_group(dstate);
+	db_exec_prepared(__func__, dstate,
+			 db_prepare(__func__, dstate,
+				    "ROLLBACK TO SAVEPOINT peer;"));
+	db_exec_prepared(__func__, dstate,
+			 db_prepare(__func__, dstate,
+				    "RELEASE SAVEPOINT peer;"));
 }
 
+/* With group commit, success here means it will be durable once
+ * db_group_commit runs; db_hold_output() holds packets until then. */
 const char *db_commit_transaction(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	const char *commit;
+
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(dstate->db->in_transaction);
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
-	assert(peer->dstate->db->in_transaction);
-	if (!db_exec(__func__, peer->dstate, "COMMIT;"))
+	if (dstate->db->group_open)
+		commit = "RELEASE SAVEPOINT peer;";
+	else
+		commit = "COMMIT;";
+
+	if (!db_exec_prepared(__func__, dstate,
+			      db_prepare(__func__, dstate, commit)))
 		db_abort_transaction(peer);
 	else
-		peer->dstate->db->in_transaction = false;
-	tal_free(ctx);
+		dstate->db->in_transaction = false;
 
-	return peer->dstate->db->err;
+	return dstate->db->err;
+}
+
+void db_hold_output(struct peer *peer)
+{
+	if (peer->dstate->db->group_open)
+		peer->output_awaiting_db = true;
 }
 
 void db_new_htlc(struct peer *peer, const struct htlc *htlc)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
-	assert(peer->dstate->db->in_transaction);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(dstate->db->in_transaction);
 
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO htlcs VALUES"
+			  " (?, ?, ?, ?, ?, ?, NULL, ?, ?, ?, NULL);");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	sql_bind_u64(stmt, 2, htlc->id);
+	sql_bind_str(stmt, 3, htlc_state_name(htlc->state));
+	sql_bind_u64(stmt, 4, htlc->msatoshi);
+	sql_bind_u64(stmt, 5, abs_locktime_to_blocks(&htlc->expiry));
+	sql_bind_blob(stmt, 6, &htlc->rhash, sizeof(htlc->rhash));
+	sql_bind_blob(stmt, 7, htlc->routing, tal_count(htlc->routing));
 	if (htlc->src) {
-		db_exec(__func__, peer->dstate, 
-			"INSERT INTO htlcs VALUES"
-			" (x'%s', %"PRIu64", '%s', %"PRIu64", %u, x'%s', NULL, x'%s', x'%s', %"PRIu64", NULL);",
-			pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id),
-			htlc->id,
-			htlc_state_name(htlc->state),
-			htlc->msatoshi,
-			abs_locktime_to_blocks(&htlc->expiry),
-			tal_hexstr(ctx, &htlc->rhash, sizeof(htlc->rhash)),
-			tal_hexstr(ctx, htlc->routing, tal_count(htlc->routing)),
-			peerid,
-			htlc->src->id);
-	} else {
-		db_exec(__func__, peer->dstate, 
-			"INSERT INTO htlcs VALUES"
-			" (x'%s', %"PRIu64", '%s', %"PRIu64", %u, x'%s', NULL, x'%s', NULL, NULL, NULL);",
-			peerid,
-			htlc->id,
-			htlc_state_name(htlc->state),
-			htlc->msatoshi,
-			abs_locktime_to_blocks(&htlc->expiry),
-			tal_hexstr(ctx, &htlc->rhash, sizeof(htlc->rhash)),
-			tal_hexstr(ctx, htlc->routing, tal_count(htlc->routing)));
+		sql_bind_pubkey(stmt, 8, dstate->secpctx, htlc->src->peer->id);
+		sql_bind_u64(stmt, 9, htlc->src->id);
 	}
-
-	tal_free(ctx);
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 void db_new_feechange(struct peer *peer, const struct feechange *feechange)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
-
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
-	assert(peer->dstate->db->in_transaction);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO feechanges VALUES"
-		" (x'%s', '%s', %"PRIu64");",
-		peerid,
-		feechange_state_name(feechange->state),
-		feechange->fee_rate);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(dstate->db->in_transaction);
 
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO feechanges VALUES (?, ?, ?);");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	sql_bind_str(stmt, 2, feechange_state_name(feechange->state));
+	sql_bind_u64(stmt, 3, feechange->fee_rate);
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 void db_update_htlc_state(struct peer *peer, const struct htlc *htlc,
 			  enum htlc_state oldstate)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	log_debug(peer->log, "%s(%s): %"PRIu64" %s->%s", __func__, peerid,
-		  htlc->id, htlc_state_name(oldstate),
-		  htlc_state_name(htlc->state));
-	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, 
-		"UPDATE htlcs SET state='%s' WHERE peer=x'%s' AND id=%"PRIu64" AND state='%s';",
-		htlc_state_name(htlc->state), peerid,
-		htlc->id, htlc_state_name(oldstate));
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	log_add(peer->log, ": %"PRIu64" %s->%s",
+		htlc->id, htlc_state_name(oldstate),
+		htlc_state_name(htlc->state));
+	assert(dstate->db->in_transaction);
 
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE htlcs SET state=? WHERE peer=? AND id=? AND state=?;");
+	sql_bind_str(stmt, 1, htlc_state_name(htlc->state));
+	sql_bind_pubkey(stmt, 2, dstate->secpctx, peer->id);
+	sql_bind_u64(stmt, 3, htlc->id);
+	sql_bind_str(stmt, 4, htlc_state_name(oldstate));
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 void db_update_feechange_state(struct peer *peer,
 			       const struct feechange *f,
 			       enum htlc_state oldstate)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	log_debug(peer->log, "%s(%s): %s->%s", __func__, peerid,
-		  feechange_state_name(oldstate),
-		  feechange_state_name(f->state));
-	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, 
-		"UPDATE feechanges SET state='%s' WHERE peer=x'%s' AND state='%s';",
-		feechange_state_name(f->state), peerid,
-		feechange_state_name(oldstate));
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	log_add(peer->log, ": %s->%s",
+		feechange_state_name(oldstate),
+		feechange_state_name(f->state));
+	assert(dstate->db->in_transaction);
 
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE feechanges SET state=? WHERE peer=? AND state=?;");
+	sql_bind_str(stmt, 1, feechange_state_name(f->state));
+	sql_bind_pubkey(stmt, 2, dstate->secpctx, peer->id);
+	sql_bind_str(stmt, 3, feechange_state_name(oldstate));
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 void db_remove_feechange(struct peer *peer, const struct feechange *feechange,
 			 enum htlc_state oldstate)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
-
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
-	assert(peer->dstate->db->in_transaction);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	db_exec(__func__, peer->dstate, 
-		"DELETE FROM feechanges WHERE peer=x'%s' AND state='%s';",
-		peerid, feechange_state_name(oldstate));
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(dstate->db->in_transaction);
 
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "DELETE FROM feechanges WHERE peer=? AND state=?;");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	sql_bind_str(stmt, 2, feechange_state_name(oldstate));
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 void db_update_state(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(dstate->db->in_transaction);
 
-	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, 
-		"UPDATE peers SET state='%s' WHERE peer=x'%s';",
-		state_name(peer->state), peerid);
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE peers SET state=? WHERE peer=?;");
+	sql_bind_str(stmt, 1, state_name(peer->state));
+	sql_bind_pubkey(stmt, 2, dstate->secpctx, peer->id);
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 void db_htlc_fulfilled(struct peer *peer, const struct htlc *htlc)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
-
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, 
-		"UPDATE htlcs SET r=x'%s' WHERE peer=x'%s' AND id=%"PRIu64" AND state='%s';",
-		tal_hexstr(ctx, htlc->r, sizeof(*htlc->r)),
-		peerid,
-		htlc->id,
-		htlc_state_name(htlc->state));
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(dstate->db->in_transaction);
 
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE htlcs SET r=? WHERE peer=? AND id=? AND state=?;");
+	sql_bind_blob(stmt, 1, htlc->r, sizeof(*htlc->r));
+	sql_bind_pubkey(stmt, 2, dstate->secpctx, peer->id);
+	sql_bind_u64(stmt, 3, htlc->id);
+	sql_bind_str(stmt, 4, htlc_state_name(htlc->state));
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 void db_htlc_failed(struct peer *peer, const struct htlc *htlc)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
-
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, 
-		"UPDATE htlcs SET fail=x'%s' WHERE peer=x'%s' AND id=%"PRIu64" AND state='%s';",
-		tal_hexstr(ctx, htlc->fail, sizeof(*htlc->fail)),
-		peerid,
-		htlc->id,
-		htlc_state_name(htlc->state));
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(dstate->db->in_transaction);
 
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE htlcs SET fail=? WHERE peer=? AND id=? AND state=?;");
+	sql_bind_blob(stmt, 1, htlc->fail, tal_count(htlc->fail));
+	sql_bind_pubkey(stmt, 2, dstate->secpctx, peer->id);
+	sql_bind_u64(stmt, 3, htlc->id);
+	sql_bind_str(stmt, 4, htlc_state_name(htlc->state));
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 void db_new_commit_info(struct peer *peer, enum side side,
 			const struct sha256 *prev_rhash)
 {
+	struct lightningd_state *dstate = peer->dstate;
 	struct commit_info *ci;
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	sqlite3_stmt *stmt;
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(dstate->db->in_transaction);
 
-	assert(peer->dstate->db->in_transaction);
 	if (side == LOCAL) {
 		ci = peer->local.commit;
 	} else {
 		ci = peer->remote.commit;
 	}
 
-	db_exec(__func__, peer->dstate, "UPDATE commit_info SET commit_num=%"PRIu64", revocation_hash=x'%s', sig=%s, xmit_order=%"PRIi64", prev_revocation_hash=%s WHERE peer=x'%s' AND side='%s';",
-		ci->commit_num,
-		tal_hexstr(ctx, &ci->revocation_hash,
-			   sizeof(ci->revocation_hash)),
-		sig_to_sql(ctx, peer->dstate->secpctx, ci->sig),
-		ci->order,
-		sql_hex_or_null(ctx, prev_rhash, sizeof(*prev_rhash)),
-		peerid, side_to_str(side));
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE commit_info SET commit_num=?, revocation_hash=?, sig=?, xmit_order=?, prev_revocation_hash=? WHERE peer=? AND side=?;");
+	sql_bind_u64(stmt, 1, ci->commit_num);
+	sql_bind_blob(stmt, 2, &ci->revocation_hash,
+		      sizeof(ci->revocation_hash));
+	sql_bind_sig(stmt, 3, dstate->secpctx, ci->sig);
+	sql_bind_u64(stmt, 4, ci->order);
+	sql_bind_blob(stmt, 5, prev_rhash, sizeof(*prev_rhash));
+	sql_bind_pubkey(stmt, 6, dstate->secpctx, peer->id);
+	sql_bind_str(stmt, 7, side_to_str(side));
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 /* FIXME: Is this strictly necessary? */
 void db_remove_their_prev_revocation_hash(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
-
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	assert(peer->dstate->db->in_transaction);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(dstate->db->in_transaction);
 
-	db_exec(__func__, peer->dstate, "UPDATE commit_info SET prev_revocation_hash=NULL WHERE peer=x'%s' AND side='REMOTE' and prev_revocation_hash IS NOT NULL;",
-			 peerid);
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE commit_info SET prev_revocation_hash=NULL WHERE peer=? AND side='REMOTE' and prev_revocation_hash IS NOT NULL;");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	db_exec_prepared(__func__, dstate, stmt);
 }
-	
 
 void db_save_shachain(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
+	u8 *shachain;
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(dstate->db->in_transaction);
 
-	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, "UPDATE shachain SET shachain=x'%s' WHERE peer=x'%s';",
-		linearize_shachain(ctx, &peer->their_preimages),
-		peerid);
-	tal_free(ctx);
+	shachain = linearize_shachain(peer, &peer->their_preimages);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE shachain SET shachain=? WHERE peer=?;");
+	sql_bind_blob(stmt, 1, shachain, tal_count(shachain));
+	sql_bind_pubkey(stmt, 2, dstate->secpctx, peer->id);
+	db_exec_prepared(__func__, dstate, stmt);
+	tal_free(shachain);
 }
 
 void db_add_commit_map(struct peer *peer,
 		       const struct sha256_double *txid, u64 commit_num)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	log_debug(peer->log, "%s(%s),commit_num=%"PRIu64, __func__, peerid,
-		  commit_num);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	log_add(peer->log, ",commit_num=%"PRIu64, commit_num);
+	assert(dstate->db->in_transaction);
 
-	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate,
-		"INSERT INTO their_commitments VALUES (x'%s', x'%s', %"PRIu64");",
-		peerid,
-		tal_hexstr(ctx, txid, sizeof(*txid)),
-		commit_num);
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO their_commitments VALUES (?, ?, ?);");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	sql_bind_blob(stmt, 2, txid, sizeof(*txid));
+	sql_bind_u64(stmt, 3, commit_num);
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 /* FIXME: Clean out old ones! */
 bool db_add_peer_address(struct lightningd_state *dstate,
 			 const struct peer_address *addr)
 {
-	const char *ctx = tal(dstate, char);
+	sqlite3_stmt *stmt;
+	u8 *blob;
 	bool ok;
 
 	log_debug(dstate->base_log, "%s", __func__);
-
 	assert(!dstate->db->in_transaction);
-	ok = db_exec(__func__, dstate,
-		     "INSERT OR REPLACE INTO peer_address VALUES (x'%s', x'%s');",
-		     pubkey_to_hexstr(ctx, dstate->secpctx, &addr->id),
-		     netaddr_to_hex(ctx, &addr->addr));
 
-	tal_free(ctx);
+	blob = netaddr_to_blob(dstate, &addr->addr);
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT OR REPLACE INTO peer_address VALUES (?, ?);");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, &addr->id);
+	sql_bind_blob(stmt, 2, blob, tal_count(blob));
+	ok = db_exec_prepared(__func__, dstate, stmt);
+	tal_free(blob);
 	return ok;
 }
 
 void db_forget_peer(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
 	size_t i;
-	const char *const tables[] = { "anchors", "htlcs", "commit_info", "shachain", "their_visible_state", "their_commitments", "peer_secrets", "closing", "peers" };
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
-
+	const char *const deletes[] = {
+		"DELETE from anchors WHERE peer=?;",
+		"DELETE from htlcs WHERE peer=?;",
+		"DELETE from commit_info WHERE peer=?;",
+		"DELETE from shachain WHERE peer=?;",
+		"DELETE from their_visible_state WHERE peer=?;",
+		"DELETE from their_commitments WHERE peer=?;",
+		"DELETE from peer_secrets WHERE peer=?;",
+		"DELETE from closing WHERE peer=?;",
+		"DELETE from peers WHERE peer=?;"
+	};
+
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
 	assert(peer->state == STATE_CLOSED);
 
 	db_start_transaction(peer);
 
-	for (i = 0; i < ARRAY_SIZE(tables); i++) {
-		db_exec(__func__, peer->dstate,
-			"DELETE from %s WHERE peer=x'%s';",
-			tables[i], peerid);
+	for (i = 0; i < ARRAY_SIZE(deletes); i++) {
+		sqlite3_stmt *stmt = db_prepare(__func__, dstate, deletes[i]);
+		sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+		db_exec_prepared(__func__, dstate, stmt);
 	}
 	if (db_commit_transaction(peer) != NULL)
 		fatal("%s:db_commi_transaction failed", __func__);
-
-	tal_free(ctx);
 }
 
 void db_begin_shutdown(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(dstate->db->in_transaction);
 
-	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate,
-		"INSERT INTO closing VALUES (x'%s', 0, 0, NULL, NULL, NULL, 0, 0, 0);",
-		peerid);
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO closing VALUES (?, 0, 0, NULL, NULL, NULL, 0, 0, 0);");
+	sql_bind_pubkey(stmt, 1, dstate->secpctx, peer->id);
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 void db_set_our_closing_script(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(dstate->db->in_transaction);
 
-	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, "UPDATE closing SET our_script=x'%s',shutdown_order=%"PRIu64" WHERE peer=x'%s';",
-		tal_hexstr(ctx, peer->closing.our_script,
-			   tal_count(peer->closing.our_script)),
-		peer->closing.shutdown_order,
-		peerid);
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE closing SET our_script=?,shutdown_order=? WHERE peer=?;");
+	sql_bind_blob(stmt, 1, peer->closing.our_script,
+		      tal_count(peer->closing.our_script));
+	sql_bind_u64(stmt, 2, peer->closing.shutdown_order);
+	sql_bind_pubkey(stmt, 3, dstate->secpctx, peer->id);
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 bool db_set_their_closing_script(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	bool ok;
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(!dstate->db->in_transaction);
 
-	assert(!peer->dstate->db->in_transaction);
-	ok = db_exec(__func__, peer->dstate,
-		     "UPDATE closing SET their_script=x'%s' WHERE peer=x'%s';",
-		     tal_hexstr(ctx, peer->closing.their_script,
-				tal_count(peer->closing.their_script)),
-		     peerid);
-	tal_free(ctx);
-	return ok;
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE closing SET their_script=? WHERE peer=?;");
+	sql_bind_blob(stmt, 1, peer->closing.their_script,
+		      tal_count(peer->closing.their_script));
+	sql_bind_pubkey(stmt, 2, dstate->secpctx, peer->id);
+	return db_exec_prepared(__func__, dstate, stmt);
 }
 
 /* For first time, we are in transaction to make it atomic with peer->state
@@ -1751,37 +1981,36 @@ bool db_set_their_closing_script(struct peer *peer)
 /* FIXME: make caller wrap in transaction. */
 void db_update_our_closing(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
 
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
 
-	db_exec(__func__, peer->dstate,
-		"UPDATE closing SET our_fee=%"PRIu64", closing_order=%"PRIi64" WHERE peer=x'%s';",
-		peer->closing.our_fee,
-		peer->closing.closing_order,
-		peerid);
-	tal_free(ctx);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE closing SET our_fee=?, closing_order=? WHERE peer=?;");
+	sql_bind_u64(stmt, 1, peer->closing.our_fee);
+	sql_bind_u64(stmt, 2, peer->closing.closing_order);
+	sql_bind_pubkey(stmt, 3, dstate->secpctx, peer->id);
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 bool db_update_their_closing(struct peer *peer)
 {
-	const char *ctx = tal(peer, char);
-	bool ok;
-	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
-
-	log_debug(peer->log, "%s(%s)", __func__, peerid);
-
-	assert(!peer->dstate->db->in_transaction);
-	ok = db_exec(__func__, peer->dstate,
-		     "UPDATE closing SET their_fee=%"PRIu64", their_sig=x'%s', sigs_in=%u WHERE peer=x'%s';",
-		     peer->closing.their_fee,
-		     tal_hexstr(ctx, peer->closing.their_sig,
-				tal_count(peer->closing.their_sig)),
-		     peer->closing.sigs_in,
-		     peerid);
-	tal_free(ctx);
-	return ok;
+	struct lightningd_state *dstate = peer->dstate;
+	sqlite3_stmt *stmt;
+
+	log_debug(peer->log, "%s", __func__);
+	log_add_struct(peer->log, "(%s)", struct pubkey, peer->id);
+	assert(!dstate->db->in_transaction);
+
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE closing SET their_fee=?, their_sig=?, sigs_in=? WHERE peer=?;");
+	sql_bind_u64(stmt, 1, peer->closing.their_fee);
+	sql_bind_sig(stmt, 2, dstate->secpctx, peer->closing.their_sig);
+	sql_bind_u64(stmt, 3, peer->closing.sigs_in);
+	sql_bind_pubkey(stmt, 4, dstate->secpctx, peer->id);
+	return db_exec_prepared(__func__, dstate, stmt);
 }
 
 bool db_new_pay_command(struct lightningd_state *dstate,
@@ -1790,21 +2019,24 @@ bool db_new_pay_command(struct lightningd_state *dstate,
 			u64 msatoshi,
 			const struct htlc *htlc)
 {
-	const char *ctx = tal(dstate, char);
+	sqlite3_stmt *stmt;
+	u8 *idarr;
 	bool ok;
 
 	log_debug(dstate->base_log, "%s", __func__);
 	log_add_struct(dstate->base_log, "(%s)", struct sha256, rhash);
-
 	assert(!dstate->db->in_transaction);
-	ok = db_exec(__func__, dstate,
-		     "INSERT INTO pay VALUES (x'%s', %"PRIu64", x'%s', x'%s', %"PRIu64", NULL, NULL);",
-		     tal_hexstr(ctx, rhash, sizeof(*rhash)),
-		     msatoshi,
-		     pubkeys_to_hex(ctx, dstate->secpctx, ids),
-		     pubkey_to_hexstr(ctx, dstate->secpctx, htlc->peer->id),
-		     htlc->id);
-	tal_free(ctx);
+
+	idarr = pubkeys_to_arr(dstate, dstate->secpctx, ids);
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO pay VALUES (?, ?, ?, ?, ?, NULL, NULL);");
+	sql_bind_blob(stmt, 1, rhash, sizeof(*rhash));
+	sql_bind_u64(stmt, 2, msatoshi);
+	sql_bind_blob(stmt, 3, idarr, tal_count(idarr));
+	sql_bind_pubkey(stmt, 4, dstate->secpctx, htlc->peer->id);
+	sql_bind_u64(stmt, 5, htlc->id);
+	ok = db_exec_prepared(__func__, dstate, stmt);
+	tal_free(idarr);
 	return ok;
 }
 
@@ -1814,45 +2046,47 @@ bool db_replace_pay_command(struct lightningd_state *dstate,
 			    u64 msatoshi,
 			    const struct htlc *htlc)
 {
-	const char *ctx = tal(dstate, char);
+	sqlite3_stmt *stmt;
+	u8 *idarr;
 	bool ok;
 
 	log_debug(dstate->base_log, "%s", __func__);
 	log_add_struct(dstate->base_log, "(%s)", struct sha256, rhash);
-
 	assert(!dstate->db->in_transaction);
-	ok = db_exec(__func__, dstate,
-		     "UPDATE pay SET msatoshi=%"PRIu64", ids=x'%s', htlc_peer=x'%s', htlc_id=%"PRIu64", r=NULL, fail=NULL WHERE rhash=x'%s';",
-		     msatoshi,
-		     pubkeys_to_hex(ctx, dstate->secpctx, ids),
-		     pubkey_to_hexstr(ctx, dstate->secpctx, htlc->peer->id),
-		     htlc->id,
-		     tal_hexstr(ctx, rhash, sizeof(*rhash)));
-	tal_free(ctx);
+
+	idarr = pubkeys_to_arr(dstate, dstate->secpctx, ids);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE pay SET msatoshi=?, ids=?, htlc_peer=?, htlc_id=?, r=NULL, fail=NULL WHERE rhash=?;");
+	sql_bind_u64(stmt, 1, msatoshi);
+	sql_bind_blob(stmt, 2, idarr, tal_count(idarr));
+	sql_bind_pubkey(stmt, 3, dstate->secpctx, htlc->peer->id);
+	sql_bind_u64(stmt, 4, htlc->id);
+	sql_bind_blob(stmt, 5, rhash, sizeof(*rhash));
+	ok = db_exec_prepared(__func__, dstate, stmt);
+	tal_free(idarr);
 	return ok;
 }
 
 void db_complete_pay_command(struct lightningd_state *dstate,
 			     const struct htlc *htlc)
 {
-	const char *ctx = tal(dstate, char);
+	sqlite3_stmt *stmt;
 
 	log_debug(dstate->base_log, "%s", __func__);
 	log_add_struct(dstate->base_log, "(%s)", struct sha256, &htlc->rhash);
-
 	assert(dstate->db->in_transaction);
-	if (htlc->r)
-		db_exec(__func__, dstate,
-			"UPDATE pay SET r=x'%s', htlc_peer=NULL WHERE rhash=x'%s';",
-			tal_hexstr(ctx, htlc->r, sizeof(*htlc->r)),
-			tal_hexstr(ctx, &htlc->rhash, sizeof(htlc->rhash)));
-	else
-		db_exec(__func__, dstate,
-			"UPDATE pay SET fail=x'%s', htlc_peer=NULL WHERE rhash=x'%s';",
-			tal_hexstr(ctx, htlc->fail, tal_count(htlc->fail)),
-			tal_hexstr(ctx, &htlc->rhash, sizeof(htlc->rhash)));
 
-	tal_free(ctx);
+	if (htlc->r) {
+		stmt = db_prepare(__func__, dstate,
+				  "UPDATE pay SET r=?, htlc_peer=NULL WHERE rhash=?;");
+		sql_bind_blob(stmt, 1, htlc->r, sizeof(*htlc->r));
+	} else {
+		stmt = db_prepare(__func__, dstate,
+				  "UPDATE pay SET fail=?, htlc_peer=NULL WHERE rhash=?;");
+		sql_bind_blob(stmt, 1, htlc->fail, tal_count(htlc->fail));
+	}
+	sql_bind_blob(stmt, 2, &htlc->rhash, sizeof(htlc->rhash));
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 bool db_new_invoice(struct lightningd_state *dstate,
@@ -1860,50 +2094,45 @@ bool db_new_invoice(struct lightningd_state *dstate,
 		    const char *label,
 		    const struct rval *r)
 {
-	const char *ctx = tal(dstate, char);
-	bool ok;
-	
-	log_debug(dstate->base_log, "%s", __func__);
+	sqlite3_stmt *stmt;
 
+	log_debug(dstate->base_log, "%s", __func__);
 	assert(!dstate->db->in_transaction);
 
-	/* Insert label as hex; suspect injection attacks. */
-	ok = db_exec(__func__, dstate,
-		     "INSERT INTO invoice VALUES (x'%s', %"PRIu64", x'%s', %s);",
-		     tal_hexstr(ctx, r, sizeof(*r)),
-		     msatoshi,
-		     tal_hexstr(ctx, label, strlen(label)),
-		     sql_bool(false));
-	tal_free(ctx);
-	return ok;
+	/* Label is bound as a blob, as it always has been. */
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO invoice VALUES (?, ?, ?, 0);");
+	sql_bind_blob(stmt, 1, r, sizeof(*r));
+	sql_bind_u64(stmt, 2, msatoshi);
+	sql_bind_blob(stmt, 3, label, strlen(label));
+	return db_exec_prepared(__func__, dstate, stmt);
 }
 
 void db_resolve_invoice(struct lightningd_state *dstate,
 			const char *label, u64 paid_num)
 {
-	const char *ctx = tal(dstate, char);
+	sqlite3_stmt *stmt;
 
 	log_debug(dstate->base_log, "%s", __func__);
-
 	assert(dstate->db->in_transaction);
-	
-	db_exec(__func__, dstate, "UPDATE invoice SET paid_num=%"PRIu64" WHERE label=x'%s';",
-		paid_num, tal_hexstr(ctx, label, strlen(label)));
-	tal_free(ctx);
+
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE invoice SET paid_num=? WHERE label=?;");
+	sql_bind_u64(stmt, 1, paid_num);
+	sql_bind_blob(stmt, 2, label, strlen(label));
+	db_exec_prepared(__func__, dstate, stmt);
 }
 
 bool db_remove_invoice(struct lightningd_state *dstate,
 		       const char *label)
 {
-	const char *ctx = tal(dstate, char);
-	bool ok;
+	sqlite3_stmt *stmt;
 
 	log_debug(dstate->base_log, "%s", __func__);
-
 	assert(!dstate->db->in_transaction);
-	
-	ok = db_exec(__func__, dstate, "DELETE FROM invoice WHERE label=x'%s';",
-			 tal_hexstr(ctx, label, strlen(label)));
-	tal_free(ctx);
-	return ok;
+
+	stmt = db_prepare(__func__, dstate,
+			  "DELETE FROM invoice WHERE label=?;");
+	sql_bind_blob(stmt, 1, label, strlen(label));
+	return db_exec_prepared(__func__, dstate, stmt);
 }
@@ -13,6 +13,9 @@ void db_start_transaction(struct peer *peer);
 void db_abort_transaction(struct peer *peer);
 const char *db_commit_transaction(struct peer *peer);
 
+/* Don't send peer anything more until committed changes are durable. */
+void db_hold_output(struct peer *peer);
+
 void db_add_wallet_privkey(struct lightningd_state *dstate,
 			   const struct privkey *privkey);
 
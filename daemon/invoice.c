@@ -2,6 +2,9 @@
 #include "invoice.h"
 #include "jsonrpc.h"
 #include "lightningd.h"
+#include "pseudorand.h"
+#include <ccan/crypto/siphash24/siphash24.h>
+#include <ccan/htable/htable_type.h>
 #include <ccan/str/hex/hex.h>
 #include <ccan/structeq/structeq.h>
 #include <ccan/tal/str/str.h>
@@ -12,42 +15,166 @@ struct invoice_waiter {
 	struct command *cmd;
 };
 
-static struct invoice *find_inv(const struct list_head *list,
-				const struct sha256 *rhash)
+struct invoice_subscriber {
+	/* On invoices->subscribers once it has sent everything. */
+	struct list_node list;
+	bool caught_up;
+	struct command *cmd;
+	struct invoices *invs;
+	/* Last one we sent. */
+	u64 paid_num;
+};
+
+static const struct sha256 *keyof_invoice_rhash(const struct invoice *i)
 {
-	struct invoice *i;
+	return &i->rhash;
+}
 
-	list_for_each(list, i, list) {
-		if (structeq(rhash, &i->rhash))
-			return i;
-	}
-	return NULL;
+static size_t hash_invoice_rhash(const struct sha256 *rhash)
+{
+	return siphash24(siphash_seed(), rhash, sizeof(*rhash));
 }
 
-struct invoice *find_unpaid(struct lightningd_state *dstate,
+static bool invoice_rhash_eq(const struct invoice *i,
 			     const struct sha256 *rhash)
 {
-	return find_inv(&dstate->unpaid, rhash);
+	return structeq(&i->rhash, rhash);
+}
+
+HTABLE_DEFINE_TYPE(struct invoice, keyof_invoice_rhash, hash_invoice_rhash,
+		   invoice_rhash_eq, invoice_rhash_map);
+
+static const char *keyof_invoice_label(const struct invoice *i)
+{
+	return i->label;
+}
+
+static size_t hash_invoice_label(const char *label)
+{
+	return siphash24(siphash_seed(), label, strlen(label));
+}
+
+static bool invoice_label_eq(const struct invoice *i, const char *label)
+{
+	return streq(i->label, label);
+}
+
+HTABLE_DEFINE_TYPE(struct invoice, keyof_invoice_label, hash_invoice_label,
+		   invoice_label_eq, invoice_label_map);
+
+struct invoices {
+	/* Every invoice, paid or not. */
+	struct invoice_rhash_map by_rhash;
+	struct invoice_label_map by_label;
+	struct list_head unpaid;
+	/* paid[n-1] has paid_num n (NULL if deleted from db). */
+	struct invoice **paid;
+	u64 num_paid;
+	/* Waiting for new invoices to be paid. */
+	struct list_head waiters;
+	struct list_head subscribers;
+};
+
+static void destroy_invoices(struct invoices *invs)
+{
+	struct invoice_subscriber *sub;
+
+	invoice_rhash_map_clear(&invs->by_rhash);
+	invoice_label_map_clear(&invs->by_label);
+
+	/* Their commands may be freed after us. */
+	while ((sub = list_pop(&invs->subscribers,
+			       struct invoice_subscriber,
+			       list)) != NULL)
+		sub->caught_up = false;
 }
 
-static struct invoice *find_paid(struct lightningd_state *dstate,
-				 const struct sha256 *rhash)
+struct invoices *invoices_init(const tal_t *ctx)
 {
-	return find_inv(&dstate->paid, rhash);
+	struct invoices *invs = tal(ctx, struct invoices);
+
+	invoice_rhash_map_init(&invs->by_rhash);
+	invoice_label_map_init(&invs->by_label);
+	list_head_init(&invs->unpaid);
+	invs->paid = tal_arr(invs, struct invoice *, 0);
+	invs->num_paid = 0;
+	list_head_init(&invs->waiters);
+	list_head_init(&invs->subscribers);
+	tal_add_destructor(invs, destroy_invoices);
+	return invs;
 }
 
-static struct invoice *find_invoice_by_label(const struct list_head *list,
+void invoices_reserve(struct lightningd_state *dstate, size_t num)
+{
+	struct invoices *invs = dstate->invoices;
+
+	assert(invs->by_rhash.raw.elems == 0);
+	invoice_rhash_map_clear(&invs->by_rhash);
+	invoice_label_map_clear(&invs->by_label);
+	invoice_rhash_map_init_sized(&invs->by_rhash, num);
+	invoice_label_map_init_sized(&invs->by_label, num);
+}
+
+struct invoice *find_unpaid(struct lightningd_state *dstate,
+			     const struct sha256 *rhash)
+{
+	struct invoice *i = invoice_rhash_map_get(&dstate->invoices->by_rhash,
+						  rhash);
+
+	if (i && i->paid_num)
+		return NULL;
+	return i;
+}
+
+static struct invoice *find_invoice_by_label(struct invoices *invs,
 					     const char *label)
 {
-	struct invoice *i;
+	return invoice_label_map_get(&invs->by_label, label);
+}
 
-	list_for_each(list, i, list) {
-		if (streq(i->label, label))
-			return i;
+/* First paid invoice with paid_num > this. */
+static struct invoice *next_paid(struct invoices *invs, u64 paid_num)
+{
+	while (paid_num < invs->num_paid) {
+		if (invs->paid[paid_num])
+			return invs->paid[paid_num];
+		paid_num++;
 	}
 	return NULL;
 }
 
+static void add_paid(struct invoices *invs, struct invoice *invoice)
+{
+	size_t max = tal_count(invs->paid);
+
+	if (invoice->paid_num > max) {
+		max = max * 2 > invoice->paid_num ? max * 2 : invoice->paid_num;
+		tal_resize(&invs->paid, max);
+	}
+	/* The database needn't give them to us in order. */
+	while (invs->num_paid < invoice->paid_num)
+		invs->paid[invs->num_paid++] = NULL;
+	assert(!invs->paid[invoice->paid_num - 1]);
+	invs->paid[invoice->paid_num - 1] = invoice;
+}
+
+static void add_invoice(struct invoices *invs, struct invoice *invoice)
+{
+	invoice_rhash_map_add(&invs->by_rhash, invoice);
+	invoice_label_map_add(&invs->by_label, invoice);
+	if (invoice->paid_num)
+		add_paid(invs, invoice);
+	else
+		list_add(&invs->unpaid, &invoice->list);
+}
+
+static void del_unpaid(struct invoices *invs, struct invoice *invoice)
+{
+	invoice_rhash_map_del(&invs->by_rhash, invoice);
+	invoice_label_map_del(&invs->by_label, invoice);
+	list_del_from(&invs->unpaid, &invoice->list);
+}
+
 void invoice_add(struct lightningd_state *dstate,
 		 const struct rval *r,
 		 u64 msatoshi,
@@ -61,13 +188,7 @@ void invoice_add(struct lightningd_state *dstate,
 	invoice->paid_num = paid_num;
 	invoice->label = tal_strdup(invoice, label);
 	sha256(&invoice->rhash, invoice->r.r, sizeof(invoice->r.r));
-
-	if (paid_num) {
-		list_add(&dstate->paid, &invoice->list);
-		if (paid_num > dstate->invoices_completed)
-			dstate->invoices_completed = paid_num;
-	} else
-		list_add(&dstate->unpaid, &invoice->list);
+	add_invoice(dstate->invoices, invoice);
 }
 
 static void tell_waiter(struct command *cmd, const struct invoice *paid)
@@ -85,18 +206,28 @@ static void tell_waiter(struct command *cmd, const struct invoice *paid)
 void resolve_invoice(struct lightningd_state *dstate,
 		     struct invoice *invoice)
 {
+	struct invoices *invs = dstate->invoices;
 	struct invoice_waiter *w;
+	struct invoice_subscriber *sub;
 
-	invoice->paid_num = ++dstate->invoices_completed;
-	list_del_from(&dstate->unpaid, &invoice->list);
-	list_add_tail(&dstate->paid, &invoice->list);
+	list_del_from(&invs->unpaid, &invoice->list);
+	invoice->paid_num = invs->num_paid + 1;
+	add_paid(invs, invoice);
 
 	/* Tell all the waiters about the new paid invoice */
-	while ((w = list_pop(&dstate->invoice_waiters,
+	while ((w = list_pop(&invs->waiters,
 			     struct invoice_waiter,
 			     list)) != NULL)
 		tell_waiter(w->cmd, invoice);
 
+	/* Subscribers which are behind will get to it anyway. */
+	while ((sub = list_pop(&invs->subscribers,
+			       struct invoice_subscriber,
+			       list)) != NULL) {
+		sub->caught_up = false;
+		command_stream_more(sub->cmd);
+	}
+
 	db_resolve_invoice(dstate, invoice->label, invoice->paid_num);
 }
 	
@@ -128,8 +259,8 @@ static void json_invoice(struct command *cmd,
 		randombytes_buf(invoice->r.r, sizeof(invoice->r.r));
 
 	sha256(&invoice->rhash, invoice->r.r, sizeof(invoice->r.r));
-	if (find_unpaid(cmd->dstate, &invoice->rhash)
-	    || find_paid(cmd->dstate, &invoice->rhash)) {
+	if (invoice_rhash_map_get(&cmd->dstate->invoices->by_rhash,
+				  &invoice->rhash)) {
 		command_fail(cmd, "Duplicate r value '%.*s'",
 			     r->end - r->start, buffer + r->start);
 		return;
@@ -145,8 +276,7 @@ static void json_invoice(struct command *cmd,
 
 	invoice->label = tal_strndup(invoice, buffer + label->start,
 				     label->end - label->start);
-	if (find_invoice_by_label(&cmd->dstate->paid, invoice->label)
-	    || find_invoice_by_label(&cmd->dstate->unpaid, invoice->label)) {
+	if (find_invoice_by_label(cmd->dstate->invoices, invoice->label)) {
 		command_fail(cmd, "Duplicate label '%s'", invoice->label);
 		return;
 	}
@@ -164,7 +294,7 @@ static void json_invoice(struct command *cmd,
 	}		
 	/* OK, connect it to main state, respond with hash */
 	tal_steal(cmd->dstate, invoice);
-	list_add(&cmd->dstate->unpaid, &invoice->list);
+	add_invoice(cmd->dstate->invoices, invoice);
 
 	json_object_start(response, NULL);
 	json_add_hex(response, "rhash",
@@ -181,22 +311,37 @@ const struct json_command invoice_command = {
 	"Returns the {rhash} on success. "
 };
 
+static void json_add_invoice(struct json_result *response,
+			     const struct invoice *i)
+{
+	json_object_start(response, NULL);
+	json_add_string(response, "label", i->label);
+	json_add_hex(response, "rhash", &i->rhash, sizeof(i->rhash));
+	json_add_u64(response, "msatoshi", i->msatoshi);
+	json_add_bool(response, "complete", i->paid_num != 0);
+	json_object_end(response);
+}
+
 static void json_add_invoices(struct json_result *response,
-			      const struct list_head *list,
+			      struct invoices *invs,
 			      const char *buffer, const jsmntok_t *label)
 {
 	struct invoice *i;
 
-	list_for_each(list, i, list) {
-		if (label && !json_tok_streq(buffer, label, i->label))
-			continue;
-		json_object_start(response, NULL);
-		json_add_string(response, "label", i->label);
-		json_add_hex(response, "rhash", &i->rhash, sizeof(i->rhash));
-		json_add_u64(response, "msatoshi", i->msatoshi);
-		json_add_bool(response, "complete", i->paid_num != 0);
-		json_object_end(response);
+	if (label) {
+		char *l = tal_strndup(response, buffer + label->start,
+				      label->end - label->start);
+		i = find_invoice_by_label(invs, l);
+		if (i)
+			json_add_invoice(response, i);
+		tal_free(l);
+		return;
 	}
+
+	for (i = next_paid(invs, 0); i; i = next_paid(invs, i->paid_num))
+		json_add_invoice(response, i);
+	list_for_each(&invs->unpaid, i, list)
+		json_add_invoice(response, i);
 }
 
 static void json_listinvoice(struct command *cmd,
@@ -215,8 +360,7 @@ static void json_listinvoice(struct command *cmd,
 	
 	json_object_start(response, NULL);
 	json_array_start(response, NULL);
-	json_add_invoices(response, &cmd->dstate->paid, buffer, label);
-	json_add_invoices(response, &cmd->dstate->unpaid, buffer, label);
+	json_add_invoices(response, cmd->dstate->invoices, buffer, label);
 	json_array_end(response);
 	json_object_end(response);
 	command_success(cmd, response);
@@ -246,8 +390,8 @@ static void json_delinvoice(struct command *cmd,
 
 	label = tal_strndup(cmd, buffer + labeltok->start,
 			    labeltok->end - labeltok->start);
-	i = find_invoice_by_label(&cmd->dstate->unpaid, label);
-	if (!i) {
+	i = find_invoice_by_label(cmd->dstate->invoices, label);
+	if (!i || i->paid_num) {
 		command_fail(cmd, "Unknown invoice");
 		return;
 	}
@@ -255,8 +399,8 @@ static void json_delinvoice(struct command *cmd,
 		command_fail(cmd, "Database error");
 		return;
 	}
-	list_del_from(&cmd->dstate->unpaid, &i->list);
-	
+	del_unpaid(cmd->dstate->invoices, i);
+
 	json_object_start(response, NULL);
 	json_add_string(response, "label", i->label);
 	json_add_hex(response, "rhash", &i->rhash, sizeof(i->rhash));
@@ -280,6 +424,7 @@ static void json_waitinvoice(struct command *cmd,
 	jsmntok_t *labeltok;
 	const char *label = NULL;
 	struct invoice_waiter *w;
+	struct invoices *invs = cmd->dstate->invoices;
 
 	if (!json_get_params(buffer, params,
 			     "?label", &labeltok,
@@ -289,16 +434,16 @@ static void json_waitinvoice(struct command *cmd,
 	}
 
 	if (!labeltok)
-		i = list_top(&cmd->dstate->paid, struct invoice, list);
+		i = next_paid(invs, 0);
 	else {
 		label = tal_strndup(cmd, buffer + labeltok->start,
 				    labeltok->end - labeltok->start);
-		i = find_invoice_by_label(&cmd->dstate->paid, label);
-		if (!i) {
+		i = find_invoice_by_label(invs, label);
+		if (!i || !i->paid_num) {
 			command_fail(cmd, "Label not found");
 			return;
 		}
-		i = list_next(&cmd->dstate->paid, i, list);
+		i = next_paid(invs, i->paid_num);
 	}
 
 	/* If we found one, return it. */
@@ -311,7 +456,7 @@ static void json_waitinvoice(struct command *cmd,
 	/* FIXME: Better to use io_wait directly? */
 	w = tal(cmd, struct invoice_waiter);
 	w->cmd = cmd;
-	list_add_tail(&cmd->dstate->invoice_waiters, &w->list);
+	list_add_tail(&invs->waiters, &w->list);
 }
 
 const struct json_command waitinvoice_command = {
@@ -320,3 +465,72 @@ const struct json_command waitinvoice_command = {
 	"Wait for the next invoice to be paid, after {label} (if supplied)))",
 	"Returns {label}, {rhash} and {msatoshi} on success. "
 };
+
+static void destroy_subscriber(struct invoice_subscriber *sub)
+{
+	if (sub->caught_up)
+		list_del_from(&sub->invs->subscribers, &sub->list);
+}
+
+static struct json_result *next_subscribed(struct command *cmd,
+					   struct invoice_subscriber *sub)
+{
+	struct json_result *response;
+	struct invoice *i;
+
+	i = next_paid(sub->invs, sub->paid_num);
+	if (!i) {
+		if (!sub->caught_up) {
+			list_add_tail(&sub->invs->subscribers, &sub->list);
+			sub->caught_up = true;
+		}
+		return NULL;
+	}
+
+	sub->paid_num = i->paid_num;
+	response = new_json_result(cmd);
+	json_object_start(response, NULL);
+	json_add_string(response, "label", i->label);
+	json_add_hex(response, "rhash", &i->rhash, sizeof(i->rhash));
+	json_add_u64(response, "msatoshi", i->msatoshi);
+	json_add_u64(response, "paid_num", i->paid_num);
+	json_object_end(response);
+	return response;
+}
+
+static void json_subscribeinvoices(struct command *cmd,
+				   const char *buffer, const jsmntok_t *params)
+{
+	struct invoice_subscriber *sub;
+	jsmntok_t *paidtok;
+
+	if (!json_get_params(buffer, params,
+			     "?paid_num", &paidtok,
+			     NULL)) {
+		command_fail(cmd, "Invalid arguments");
+		return;
+	}
+
+	sub = tal(cmd, struct invoice_subscriber);
+	sub->paid_num = 0;
+	if (paidtok && !json_tok_u64(buffer, paidtok, &sub->paid_num)) {
+		command_fail(cmd, "'%.*s' is not a valid number",
+			     paidtok->end - paidtok->start,
+			     buffer + paidtok->start);
+		return;
+	}
+	sub->cmd = cmd;
+	sub->invs = cmd->dstate->invoices;
+	sub->caught_up = false;
+	tal_add_destructor(sub, destroy_subscriber);
+
+	command_stream(cmd, null_response(cmd),
+		       "invoice_paid", next_subscribed, sub);
+}
+
+const struct json_command subscribeinvoices_command = {
+	"subscribeinvoices",
+	json_subscribeinvoices,
+	"Stream every invoice paid after {paid_num} (if supplied)",
+	"Returns an empty result, then sends an invoice_paid notification with {label}, {rhash}, {msatoshi} and {paid_num} for each, until the connection closes. "
+};
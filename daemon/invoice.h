@@ -6,6 +6,7 @@
 struct lightningd_state;
 
 struct invoice {
+	/* On invoices->unpaid, if not paid yet. */
 	struct list_node list;
 	const char *label;
 	u64 msatoshi;
@@ -16,6 +17,11 @@ struct invoice {
 
 #define INVOICE_MAX_LABEL_LEN 128
 
+struct invoices *invoices_init(const tal_t *ctx);
+
+/* Before loading from database: we're about to add this many. */
+void invoices_reserve(struct lightningd_state *dstate, size_t num);
+
 /* From database */
 void invoice_add(struct lightningd_state *dstate,
 		 const struct rval *r,
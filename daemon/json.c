@@ -13,8 +13,13 @@
 
 struct json_result {
 	unsigned int indent;
-	/* tal_count() of this is strlen() + 1 */
+	/* Does the next member need a comma before it? */
+	bool comma;
+	/* Chunks already full (see json_result_chunks). */
+	char **chunks;
+	/* The current chunk: len used, tal_count() allocated. */
 	char *s;
+	size_t len;
 };
 
 const char *json_tok_contents(const char *buffer, const jsmntok_t *t)
@@ -303,48 +308,206 @@ again:
 	return toks;
 }
 
-static void result_append(struct json_result *res, const char *str)
+struct json_parser {
+	jsmn_parser jsmn;
+	/* Tokens parsed so far (one spare on the end). */
+	jsmntok_t *toks;
+	/* jsmn's toks[0] is our toks[first]: the ones before are done. */
+	size_t first;
+	/* Where in the buffer the next value starts. */
+	size_t start;
+	/* Number of tokens in the value we returned, if any. */
+	size_t done;
+};
+
+struct json_parser *new_json_parser(const tal_t *ctx)
 {
-	size_t len = tal_count(res->s) - 1;
+	struct json_parser *jp = tal(ctx, struct json_parser);
 
-	tal_resize(&res->s, len + strlen(str) + 1);
-	strcpy(res->s + len, str);
+	jsmn_init(&jp->jsmn);
+	jp->toks = tal_arr(jp, jsmntok_t, 16);
+	jp->first = 0;
+	jp->start = 0;
+	jp->done = 0;
+	return jp;
 }
 
-static void PRINTF_FMT(2,3)
-result_append_fmt(struct json_result *res, const char *fmt, ...)
+/* Only move tokens down when we're out of room, like the buffer. */
+static void parser_token_room(struct json_parser *jp)
 {
-	size_t len = tal_count(res->s) - 1, fmtlen;
-	va_list ap;
+	if (jp->first) {
+		memmove(jp->toks, jp->toks + jp->first,
+			jp->jsmn.toknext * sizeof(jp->toks[0]));
+		jp->first = 0;
+	}
+	if (jp->jsmn.toknext * 2 >= tal_count(jp->toks))
+		tal_resize(&jp->toks, tal_count(jp->toks) * 2);
+}
 
-	va_start(ap, fmt);
-	fmtlen = vsnprintf(NULL, 0, fmt, ap);
-	va_end(ap);
+const jsmntok_t *json_parser_next(struct json_parser *jp,
+				  const char *buffer, size_t len,
+				  bool *valid)
+{
+	jsmntok_t *toks;
+	int ret;
 
-	tal_resize(&res->s, len + fmtlen + 1);
-	va_start(ap, fmt);
-	vsprintf(res->s + len, fmt, ap);
-	va_end(ap);
+	assert(!jp->done);
+	*valid = true;
+
+	/* We may have parsed the whole of the next one last time. */
+	if (jp->jsmn.toknext && jp->toks[jp->first].end != -1)
+		goto complete;
+
+again:
+	/* Carries on from where it got to last time. */
+	ret = jsmn_parse(&jp->jsmn, buffer, len, jp->toks + jp->first,
+			 tal_count(jp->toks) - jp->first - 1);
+	switch (ret) {
+	case JSMN_ERROR_INVAL:
+		*valid = false;
+		return NULL;
+	case JSMN_ERROR_NOMEM:
+		parser_token_room(jp);
+		goto again;
+	}
+
+	/* Nothing but whitespace so far? */
+	if (jp->jsmn.toknext == 0) {
+		jp->start = jp->jsmn.pos;
+		return NULL;
+	}
+
+	/* PART may just mean the one after this is incomplete. */
+	if (jp->toks[jp->first].end == -1)
+		return NULL;
+
+complete:
+	toks = jp->toks + jp->first;
+	jp->done = json_next(toks) - toks;
+	/* Make sure the one after is always referencable. */
+	if (jp->done == jp->jsmn.toknext) {
+		toks[jp->done].type = -1;
+		toks[jp->done].start = toks[jp->done].end = 0;
+		toks[jp->done].size = 0;
+	}
+	return toks;
 }
 
-static bool result_ends_with(struct json_result *res, const char *str)
+void json_parser_consume(struct json_parser *jp)
 {
-	size_t len = tal_count(res->s) - 1;
+	const jsmntok_t *toks = jp->toks + jp->first;
+	size_t n = jp->done;
 
-	if (strlen(str) > len)
-		return false;
-	return streq(res->s + len - strlen(str), str);
+	assert(n);
+	/* A string's end doesn't include the closing quote. */
+	jp->start = toks[0].end + (toks[0].type == JSMN_STRING);
+
+	/* We keep what we've parsed of the ones after. */
+	jp->jsmn.toknext -= n;
+	if (jp->jsmn.toknext == 0)
+		jp->first = 0;
+	else
+		jp->first += n;
+	if (jp->jsmn.toksuper < (int)n)
+		jp->jsmn.toksuper = -1;
+	else
+		jp->jsmn.toksuper -= n;
+	jp->done = 0;
+}
+
+size_t json_parser_start(const struct json_parser *jp)
+{
+	return jp->start;
+}
+
+void json_parser_moved(struct json_parser *jp, size_t off)
+{
+	jsmntok_t *toks = jp->toks + jp->first;
+	size_t i;
+
+	assert(!jp->done);
+	assert(off <= jp->start);
+	jp->start -= off;
+	jp->jsmn.pos -= off;
+	for (i = 0; i < jp->jsmn.toknext; i++) {
+		if (toks[i].start != -1)
+			toks[i].start -= off;
+		if (toks[i].end != -1)
+			toks[i].end -= off;
+	}
+}
+
+/* Room for another len bytes (and a nul). */
+static char *result_room(struct json_result *res, size_t len)
+{
+	size_t max = tal_count(res->s);
+
+	if (res->len + len + 1 > max) {
+		while (res->len + len + 1 > max)
+			max *= 2;
+		tal_resize(&res->s, max);
+	}
+	return res->s + res->len;
+}
+
+/* Big results become a series of chunks, never one huge string. */
+static void result_added(struct json_result *res, size_t len)
+{
+	size_t n;
+
+	res->len += len;
+	res->s[res->len] = '\0';
+	if (res->len < JSON_CHUNK_SIZE)
+		return;
+
+	tal_resize(&res->s, res->len + 1);
+	n = tal_count(res->chunks);
+	tal_resize(&res->chunks, n + 1);
+	res->chunks[n] = tal_steal(res->chunks, res->s);
+	res->s = tal_arr(res, char, 64);
+	res->len = 0;
+	res->s[0] = '\0';
+}
+
+static void result_append_len(struct json_result *res,
+			      const char *str, size_t len)
+{
+	memcpy(result_room(res, len), str, len);
+	result_added(res, len);
+}
+
+static void result_append(struct json_result *res, const char *str)
+{
+	result_append_len(res, str, strlen(str));
+}
+
+static void result_append_u64(struct json_result *res, u64 v)
+{
+	char buf[20];
+	size_t i = sizeof(buf);
+
+	do {
+		buf[--i] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	result_append_len(res, buf + i, sizeof(buf) - i);
 }
 
 static void json_start_member(struct json_result *result, const char *fieldname)
 {
 	/* Prepend comma if required. */
-	if (result->s[0]
-	    && !result_ends_with(result, "{ ")
-	    && !result_ends_with(result, "[ "))
-		result_append(result, ", ");
-	if (fieldname)
-		result_append_fmt(result, "\"%s\" : ", fieldname);
+	if (result->comma)
+		result_append_len(result, ", ", 2);
+	if (fieldname) {
+		size_t len = strlen(fieldname);
+		char *p = result_room(result, len + 5);
+
+		p[0] = '"';
+		memcpy(p + 1, fieldname, len);
+		memcpy(p + 1 + len, "\" : ", 4);
+		result_added(result, len + 5);
+	}
+	result->comma = true;
 }
 
 void json_array_start(struct json_result *result, const char *fieldname)
@@ -356,7 +519,8 @@ void json_array_start(struct json_result *result, const char *fieldname)
 		for (i = 0; i < result->indent; i++)
 			result_append(result, "\t");
 	}
-	result_append(result, "[ ");
+	result_append_len(result, "[ ", 2);
+	result->comma = false;
 	result->indent++;
 }
 
@@ -364,7 +528,8 @@ void json_array_end(struct json_result *result)
 {
 	assert(result->indent);
 	result->indent--;
-	result_append(result, " ]");
+	result_append_len(result, " ]", 2);
+	result->comma = true;
 }
 
 void json_object_start(struct json_result *result, const char *fieldname)
@@ -376,7 +541,8 @@ void json_object_start(struct json_result *result, const char *fieldname)
 		for (i = 0; i < result->indent; i++)
 			result_append(result, "\t");
 	}
-	result_append(result, "{ ");
+	result_append_len(result, "{ ", 2);
+	result->comma = false;
 	result->indent++;
 }
 
@@ -384,33 +550,41 @@ void json_object_end(struct json_result *result)
 {
 	assert(result->indent);
 	result->indent--;
-	result_append(result, " }");
+	result_append_len(result, " }", 2);
+	result->comma = true;
 }
 
 void json_add_num(struct json_result *result, const char *fieldname, unsigned int value)
 {
 	json_start_member(result, fieldname);
-	result_append_fmt(result, "%u", value);
+	result_append_u64(result, value);
 }
 
 void json_add_u64(struct json_result *result, const char *fieldname,
 		  uint64_t value)
 {
 	json_start_member(result, fieldname);
-	result_append_fmt(result, "%"PRIu64, value);
+	result_append_u64(result, value);
 }
 	
 void json_add_literal(struct json_result *result, const char *fieldname,
 		      const char *literal, int len)
 {
 	json_start_member(result, fieldname);
-	result_append_fmt(result, "%.*s", len, literal);
+	result_append_len(result, literal, len);
 }
 
 void json_add_string(struct json_result *result, const char *fieldname, const char *value)
 {
+	size_t len = strlen(value);
+	char *p;
+
 	json_start_member(result, fieldname);
-	result_append_fmt(result, "\"%s\"", value);
+	p = result_room(result, len + 2);
+	p[0] = '"';
+	memcpy(p + 1, value, len);
+	p[len + 1] = '"';
+	result_added(result, len + 2);
 }
 
 void json_add_bool(struct json_result *result, const char *fieldname, bool value)
@@ -428,10 +602,16 @@ void json_add_null(struct json_result *result, const char *fieldname)
 void json_add_hex(struct json_result *result, const char *fieldname,
 		  const void *data, size_t len)
 {
-	char hex[hex_str_size(len)];
+	size_t hexlen = hex_str_size(len);
+	char *p;
 
-	hex_encode(data, len, hex, sizeof(hex));
-	json_add_string(result, fieldname, hex);
+	/* Encode straight into the result. */
+	json_start_member(result, fieldname);
+	p = result_room(result, hexlen + 1);
+	p[0] = '"';
+	hex_encode(data, len, p + 1, hexlen);
+	p[hexlen] = '"';
+	result_added(result, hexlen + 1);
 }
 
 void json_add_pubkey(struct json_result *response,
@@ -469,14 +649,50 @@ struct json_result *new_json_result(const tal_t *ctx)
 	struct json_result *r = tal(ctx, struct json_result);
 
 	/* Using tal_arr means that it has a valid count. */
-	r->s = tal_arrz(r, char, 1);
+	r->s = tal_arrz(r, char, 64);
+	r->len = 0;
+	r->chunks = tal_arr(r, char *, 0);
 	r->indent = 0;
+	r->comma = false;
 	return r;
 }
-	
-const char *json_result_string(const struct json_result *result)
+
+char **json_result_chunks(const tal_t *ctx, struct json_result *result)
+{
+	char **chunks = tal_steal(ctx, result->chunks);
+	size_t n = tal_count(chunks);
+
+	assert(!result->indent);
+	if (result->len) {
+		tal_resize(&result->s, result->len + 1);
+		tal_resize(&chunks, n + 1);
+		chunks[n] = tal_steal(chunks, result->s);
+		result->s = tal_arrz(result, char, 64);
+		result->len = 0;
+	}
+	result->chunks = tal_arr(result, char *, 0);
+	return chunks;
+}
+
+const char *json_result_string(struct json_result *result)
 {
 	assert(!result->indent);
-	assert(tal_count(result->s) == strlen(result->s) + 1);
+	/* Join any chunks back up: only for small results! */
+	if (tal_count(result->chunks)) {
+		char **chunks = json_result_chunks(result, result);
+		size_t i;
+
+		/* Each has its own nul terminator. */
+		tal_resize(&chunks[0], tal_count(chunks[0]) - 1);
+		for (i = 1; i < tal_count(chunks); i++)
+			tal_expand(&chunks[0], chunks[i],
+				   tal_count(chunks[i]) - 1);
+		tal_expand(&chunks[0], "", 1);
+		tal_free(result->s);
+		result->s = tal_steal(result, chunks[0]);
+		result->len = tal_count(result->s) - 1;
+		tal_free(chunks);
+	}
+	assert(strlen(result->s) == result->len);
 	return result->s;
 }
@@ -10,6 +10,7 @@
 #define JSMN_STRICT 1
 # include "jsmn/jsmn.h"
 
+struct json_parser;
 struct json_result;
 
 /* Include " if it's a string. */
@@ -69,6 +70,25 @@ const jsmntok_t *json_delve(const char *buffer,
 /* If input is complete and valid, return tokens. */
 jsmntok_t *json_parse_input(const char *input, int len, bool *valid);
 
+/* For a buffer of JSON values which arrives a piece at a time. */
+struct json_parser *new_json_parser(const tal_t *ctx);
+
+/* Parse what's been added to buffer since last time: returns the tokens
+ * for the first value once it's complete, otherwise NULL (with *valid
+ * false if it never will be). */
+const jsmntok_t *json_parser_next(struct json_parser *jp,
+				  const char *buffer, size_t len,
+				  bool *valid);
+
+/* Done with what json_parser_next returned: on to the next value. */
+void json_parser_consume(struct json_parser *jp);
+
+/* Buffer before this offset is no longer needed. */
+size_t json_parser_start(const struct json_parser *jp);
+
+/* The buffer contents were moved down by off bytes. */
+void json_parser_moved(struct json_parser *jp, size_t off);
+
 /* Creating JSON strings */
 
 /* '"fieldname" : [ ' or '[ ' if fieldname is NULL */
@@ -109,5 +129,13 @@ void json_add_pubkey(struct json_result *response,
 
 void json_add_object(struct json_result *result, ...);
 
-const char *json_result_string(const struct json_result *result);
+/* Once a result reaches this size, it's split into another chunk. */
+#define JSON_CHUNK_SIZE 65536
+
+/* Take the result so far as tal strings (tal_count() is strlen() + 1),
+ * each about JSON_CHUNK_SIZE, and leave it empty. */
+char **json_result_chunks(const tal_t *ctx, struct json_result *result);
+
+/* The whole result as one string: for small results. */
+const char *json_result_string(struct json_result *result);
 #endif /* LIGHTNING_DAEMON_JSON_H */
@@ -24,14 +24,24 @@
 struct json_output {
 	struct list_node list;
 	const char *json;
+	size_t len;
 };
 
 static void finish_jcon(struct io_conn *conn, struct json_connection *jcon)
 {
+	struct command *cmd, *next;
+
 	log_debug(jcon->log, "Closing (%s)", strerror(errno));
-	if (jcon->current) {
-		log_unusual(jcon->log, "Abandoning current command");
-		jcon->current->jcon = NULL;
+	list_for_each_safe(&jcon->commands, cmd, next, list) {
+		/* Nobody left to stream to. */
+		if (cmd->stream_next) {
+			tal_free(cmd);
+			continue;
+		}
+		log_unusual(jcon->log, "Abandoning command %s", cmd->id);
+		list_del_from(&jcon->commands, &cmd->list);
+		jcon->num_commands--;
+		cmd->jcon = NULL;
 	}
 }
 
@@ -295,6 +305,7 @@ static const struct json_command *cmdlist[] = {
 	&listinvoice_command,
 	&delinvoice_command,
 	&waitinvoice_command,
+	&subscribeinvoices_command,
 	&getchannels_command,
 	&getroute_command,
 	&sendpay_command,
@@ -349,22 +360,86 @@ static const struct json_command *find_cmd(const char *buffer,
 	return NULL;
 }
 
-static void json_result(struct json_connection *jcon,
-			const char *id, const char *res, const char *err)
+/* Queue for writing (takes json), and wake writer (and maybe reader). */
+static void json_queue(struct json_connection *jcon,
+		       const char *json, size_t len)
 {
 	struct json_output *out = tal(jcon, struct json_output);
 
-	out->json = tal_fmt(out,
-			    "{ \"result\" : %s,"
-			    " \"error\" : %s,"
-			    " \"id\" : %s }\n",
-			    res, err, id);
-
-	/* Queue for writing, and wake writer (and maybe reader). */
+	out->json = tal_steal(out, json);
+	out->len = len;
 	list_add_tail(&jcon->output, &out->list);
 	io_wake(jcon);
 }
 
+/* Copy str (of len bytes) to p, and return the end. */
+static char *json_put(char *p, const char *str, size_t len)
+{
+	memcpy(p, str, len);
+	return p + len;
+}
+
+/* Put together by hand: we know how long res is, so there's no need to
+ * format it twice (snprintf) or guess its way up (tal_fmt). */
+static void json_result_len(struct json_connection *jcon, const char *id,
+			    const char *res, size_t reslen, const char *err)
+{
+	static const char head[] = "{ \"result\" : ";
+	static const char errfield[] = ", \"error\" : ";
+	static const char idfield[] = ", \"id\" : ";
+	static const char tail[] = " }\n";
+	size_t errlen = strlen(err), idlen = strlen(id), len;
+	char *json, *p;
+
+	len = sizeof(head) - 1 + reslen + sizeof(errfield) - 1 + errlen
+		+ sizeof(idfield) - 1 + idlen + sizeof(tail) - 1;
+	p = json = tal_arr(jcon, char, len + 1);
+	p = json_put(p, head, sizeof(head) - 1);
+	p = json_put(p, res, reslen);
+	p = json_put(p, errfield, sizeof(errfield) - 1);
+	p = json_put(p, err, errlen);
+	p = json_put(p, idfield, sizeof(idfield) - 1);
+	p = json_put(p, id, idlen);
+	p = json_put(p, tail, sizeof(tail) - 1);
+	*p = '\0';
+	assert(p == json + len);
+	json_queue(jcon, json, len);
+}
+
+static void json_result(struct json_connection *jcon,
+			const char *id, const char *res, const char *err)
+{
+	json_result_len(jcon, id, res, strlen(res), err);
+}
+
+/* Big results go out chunk by chunk, rather than being copied into one
+ * huge string.  We only start once the command has finished its result,
+ * rather than flushing each chunk as it fills: the command can still
+ * fail after that, and by then we'd have sent the start of a result. */
+static void json_result_chunked(struct json_connection *jcon,
+				const char *id, struct json_result *result)
+{
+	char **chunks = json_result_chunks(jcon, result);
+	char *json;
+	size_t i;
+
+	/* Usually it's small enough to just copy. */
+	if (tal_count(chunks) == 1) {
+		json_result_len(jcon, id, chunks[0], tal_count(chunks[0]) - 1,
+				"null");
+		tal_free(chunks);
+		return;
+	}
+
+	json = tal_strdup(jcon, "{ \"result\" : ");
+	json_queue(jcon, json, strlen(json));
+	for (i = 0; i < tal_count(chunks); i++)
+		json_queue(jcon, chunks[i], tal_count(chunks[i]) - 1);
+	json = tal_fmt(jcon, ", \"error\" : null, \"id\" : %s }\n", id);
+	json_queue(jcon, json, strlen(json));
+	tal_free(chunks);
+}
+
 struct json_result *null_response(const tal_t *ctx)
 {
 	struct json_result *response;
@@ -385,10 +460,9 @@ void command_success(struct command *cmd, struct json_result *result)
 		tal_free(cmd);
 		return;
 	}
-	assert(jcon->current == cmd);
-	json_result(jcon, cmd->id, json_result_string(result), "null");
+	json_result_chunked(jcon, cmd->id, result);
 	log_debug(jcon->log, "Success");
-	jcon->current = tal_free(cmd);
+	tal_free(cmd);
 }
 
 void command_fail(struct command *cmd, const char *fmt, ...)
@@ -417,9 +491,77 @@ void command_fail(struct command *cmd, const char *fmt, ...)
 	/* Now surround in quotes. */
 	quote = tal_fmt(cmd, "\"%s\"", error);
 
-	assert(jcon->current == cmd);
 	json_result(jcon, cmd->id, "null", quote);
-	jcon->current = tal_free(cmd);
+	tal_free(cmd);
+}
+
+void command_stream_(struct command *cmd, struct json_result *result,
+		     const char *method,
+		     struct json_result *(*next)(struct command *cmd,
+						 void *arg),
+		     void *arg)
+{
+	log_debug(cmd->jcon->log, "Streaming %s", method);
+	/* This goes out (waking the writer) before any notifications. */
+	json_result_chunked(cmd->jcon, cmd->id, result);
+	tal_free(result);
+	cmd->stream_method = method;
+	cmd->stream_next = next;
+	cmd->stream_arg = arg;
+}
+
+void command_stream_more(struct command *cmd)
+{
+	io_wake(cmd->jcon);
+}
+
+/* Gather what the stream has ready, but don't make the write too big. */
+static struct json_output *stream_output(struct json_connection *jcon,
+					 struct command *cmd)
+{
+	struct json_result *params;
+	struct json_output *out;
+	char *json = NULL;
+
+	while (!json || strlen(json) < 4096) {
+		params = cmd->stream_next(cmd, cmd->stream_arg);
+		if (!params)
+			break;
+		if (!json)
+			json = tal_strdup(jcon, "");
+		tal_append_fmt(&json,
+			       "{ \"method\" : \"%s\","
+			       " \"params\" : %s,"
+			       " \"id\" : null }\n",
+			       cmd->stream_method, json_result_string(params));
+		tal_free(params);
+	}
+
+	if (!json)
+		return NULL;
+	out = tal(jcon, struct json_output);
+	out->json = tal_steal(out, json);
+	out->len = strlen(json);
+	return out;
+}
+
+/* Take turns between any streams. */
+static struct json_output *streams_output(struct json_connection *jcon)
+{
+	struct command *cmd;
+	struct json_output *out;
+
+	list_for_each(&jcon->commands, cmd, list) {
+		if (!cmd->stream_next)
+			continue;
+		out = stream_output(jcon, cmd);
+		if (out) {
+			list_del_from(&jcon->commands, &cmd->list);
+			list_add_tail(&jcon->commands, &cmd->list);
+			return out;
+		}
+	}
+	return NULL;
 }
 
 static void json_command_malformed(struct json_connection *jcon,
@@ -429,12 +571,24 @@ static void json_command_malformed(struct json_connection *jcon,
 	return json_result(jcon, id, "null", error);
 }
 
+static void destroy_command(struct command *cmd)
+{
+	struct json_connection *jcon = cmd->jcon;
+
+	if (!jcon)
+		return;
+	list_del_from(&jcon->commands, &cmd->list);
+	/* Reader may be waiting for room. */
+	if (jcon->num_commands-- == JSONRPC_MAX_COMMANDS)
+		io_wake(jcon);
+}
+
 static void parse_request(struct json_connection *jcon, const jsmntok_t tok[])
 {
 	const jsmntok_t *method, *id, *params;
 	const struct json_command *cmd;
+	struct command *c;
 
-	assert(!jcon->current);
 	if (tok[0].type != JSMN_OBJECT) {
 		json_command_malformed(jcon, "null",
 				       "Expected {} for json command");
@@ -457,26 +611,30 @@ static void parse_request(struct json_connection *jcon, const jsmntok_t tok[])
 
 	/* This is a convenient tal parent for durarion of command
 	 * (which may outlive the conn!). */
-	jcon->current = tal(jcon->dstate, struct command);
-	jcon->current->jcon = jcon;
-	jcon->current->dstate = jcon->dstate;
-	jcon->current->id = tal_strndup(jcon->current,
-					json_tok_contents(jcon->buffer, id),
-					json_tok_len(id));
+	c = tal(jcon->dstate, struct command);
+	c->jcon = jcon;
+	c->dstate = jcon->dstate;
+	c->stream_next = NULL;
+	c->id = tal_strndup(c,
+			    json_tok_contents(jcon->buffer, id),
+			    json_tok_len(id));
+	list_add_tail(&jcon->commands, &c->list);
+	jcon->num_commands++;
+	tal_add_destructor(c, destroy_command);
 
 	if (!method || !params) {
-		command_fail(jcon->current, method ? "No params" : "No method");
+		command_fail(c, method ? "No params" : "No method");
 		return;
 	}
 
 	if (method->type != JSMN_STRING) {
-		command_fail(jcon->current, "Expected string for method");
+		command_fail(c, "Expected string for method");
 		return;
 	}
 
 	cmd = find_cmd(jcon->buffer, method);
 	if (!cmd) {
-		command_fail(jcon->current,
+		command_fail(c,
 			     "Unknown command '%.*s'",
 			     (int)(method->end - method->start),
 			     jcon->buffer + method->start);
@@ -484,20 +642,24 @@ static void parse_request(struct json_connection *jcon, const jsmntok_t tok[])
 	}
 
 	if (params->type != JSMN_ARRAY && params->type != JSMN_OBJECT) {
-		command_fail(jcon->current,
-			     "Expected array or object for params");
+		command_fail(c, "Expected array or object for params");
 		return;
 	}
 
-	cmd->dispatch(jcon->current, jcon->buffer, params);
+	/* Its response may come later, and others' may come first: the
+	 * client tells them apart by id. */
+	cmd->dispatch(c, jcon->buffer, params);
 }
 
 static struct io_plan *write_json(struct io_conn *conn,
 				  struct json_connection *jcon)
 {
 	struct json_output *out;
-	
+	size_t len;
+
 	out = list_pop(&jcon->output, struct json_output, list);
+	if (!out)
+		out = streams_output(jcon);
 	if (!out) {
 		if (jcon->stop) {
 			log_unusual(jcon->log, "JSON-RPC shutdown");
@@ -511,56 +673,52 @@ static struct io_plan *write_json(struct io_conn *conn,
 		return io_out_wait(conn, jcon, write_json, jcon);
 	}
 
+	tal_free(jcon->outbuf);
 	jcon->outbuf = tal_steal(jcon, out->json);
+	len = out->len;
 	tal_free(out);
 
-	log_io(jcon->log, false, jcon->outbuf, strlen(jcon->outbuf));
-	return io_write(conn,
-			jcon->outbuf, strlen(jcon->outbuf), write_json, jcon);
+	log_io(jcon->log, false, jcon->outbuf, len);
+	return io_write(conn, jcon->outbuf, len, write_json, jcon);
 }
 
 static struct io_plan *read_json(struct io_conn *conn,
 				 struct json_connection *jcon)
 {
-	jsmntok_t *toks;
+	const jsmntok_t *toks;
+	size_t start;
 	bool valid;
 
-	log_io(jcon->log, true, jcon->buffer + jcon->used, jcon->len_read);
+	/* Woken, but still too busy? */
+	if (jcon->num_commands >= JSONRPC_MAX_COMMANDS) {
+		assert(jcon->len_read == 0);
+		return io_wait(conn, jcon, read_json, jcon);
+	}
 
-	/* Resize larger if we're full. */
+	log_io(jcon->log, true, jcon->buffer + jcon->used, jcon->len_read);
 	jcon->used += jcon->len_read;
-	if (jcon->used == tal_count(jcon->buffer))
-		tal_resize(&jcon->buffer, jcon->used * 2);
 
 again:
-	toks = json_parse_input(jcon->buffer, jcon->used, &valid);
+	/* This only looks at what's new since last time. */
+	toks = json_parser_next(jcon->parser, jcon->buffer, jcon->used, &valid);
 	if (!toks) {
 		if (!valid) {
+			start = json_parser_start(jcon->parser);
 			log_unusual(jcon->dstate->base_log,
 				    "Invalid token in json input: '%.*s'",
-				    (int)jcon->used, jcon->buffer);
+				    (int)(jcon->used - start),
+				    jcon->buffer + start);
 			return io_close(conn);
 		}
 		/* We need more. */
 		goto read_more;
 	}
 
-	/* Empty buffer? (eg. just whitespace). */
-	if (tal_count(toks) == 1) {
-		jcon->used = 0;
-		goto read_more;
-	}
-
 	parse_request(jcon, toks);
+	json_parser_consume(jcon->parser);
 
-	/* Remove first {}. */
-	memmove(jcon->buffer, jcon->buffer + toks[0].end,
-		tal_count(jcon->buffer) - toks[0].end);
-	jcon->used -= toks[0].end;
-	tal_free(toks);
-
-	/* Need to wait for command to finish? */
-	if (jcon->current) {
+	/* Need to wait for some commands to finish? */
+	if (jcon->num_commands >= JSONRPC_MAX_COMMANDS) {
 		jcon->len_read = 0;
 		return io_wait(conn, jcon, read_json, jcon);
 	}
@@ -569,7 +727,24 @@ again:
 	goto again;
 
 read_more:
-	tal_free(toks);
+	/* Everything before start is done with, but we only move the rest
+	 * down when we're out of room. */
+	start = json_parser_start(jcon->parser);
+	if (start == jcon->used) {
+		json_parser_moved(jcon->parser, start);
+		jcon->used = 0;
+	} else if (jcon->used == tal_count(jcon->buffer)) {
+		if (start) {
+			memmove(jcon->buffer, jcon->buffer + start,
+				jcon->used - start);
+			json_parser_moved(jcon->parser, start);
+			jcon->used -= start;
+		}
+		/* Resize larger if we're still more than half full. */
+		if (jcon->used * 2 > tal_count(jcon->buffer))
+			tal_resize(&jcon->buffer, tal_count(jcon->buffer) * 2);
+	}
+
 	return io_read_partial(conn, jcon->buffer + jcon->used,
 			       tal_count(jcon->buffer) - jcon->used,
 			       &jcon->len_read, read_json, jcon);
@@ -584,8 +759,11 @@ static struct io_plan *jcon_connected(struct io_conn *conn,
 	jcon->dstate = dstate;
 	jcon->used = 0;
 	jcon->buffer = tal_arr(jcon, char, 64);
+	jcon->parser = new_json_parser(jcon);
 	jcon->stop = false;
-	jcon->current = NULL;
+	list_head_init(&jcon->commands);
+	jcon->num_commands = 0;
+	jcon->outbuf = NULL;
 	jcon->log = new_log(jcon, dstate->log_record, "%sjcon fd %i:",
 			    log_prefix(dstate->base_log), io_conn_fd(conn));
 	list_head_init(&jcon->output);
@@ -3,6 +3,7 @@
 #include "config.h"
 #include "json.h"
 #include <ccan/list/list.h>
+#include <ccan/typesafe_cb/typesafe_cb.h>
 
 /* Context for a command (from JSON, but might outlive the connection!)
  * You can allocate off this for temporary objects. */
@@ -13,8 +14,17 @@ struct command {
 	const char *id;
 	/* The connection, or NULL if it closed. */
 	struct json_connection *jcon;
+	/* On jcon->commands, while jcon is non-NULL. */
+	struct list_node list;
+	/* If it's a stream, what to send next (see command_stream). */
+	const char *stream_method;
+	struct json_result *(*stream_next)(struct command *cmd, void *arg);
+	void *stream_arg;
 };
 
+/* We stop reading a connection's requests while it has this many. */
+#define JSONRPC_MAX_COMMANDS 64
+
 struct json_connection {
 	/* The global state */
 	struct lightningd_state *dstate;
@@ -30,12 +40,15 @@ struct json_connection {
 	size_t used;
 	/* How much has just been filled. */
 	size_t len_read;
+	/* Tokenizer state, and how much of buffer it's done with. */
+	struct json_parser *parser;
 
 	/* We've been told to stop. */
 	bool stop;
 
-	/* Current command. */
-	struct command *current;
+	/* Commands which haven't finished yet. */
+	struct list_head commands;
+	size_t num_commands;
 
 	struct list_head output;
 	const char *outbuf;
@@ -53,6 +66,25 @@ struct json_result *null_response(const tal_t *ctx);
 void command_success(struct command *cmd, struct json_result *response);
 void PRINTF_FMT(2, 3) command_fail(struct command *cmd, const char *fmt, ...);
 
+/* Instead of completing, answer with result, then send "method"
+ * notifications until the connection closes (then cmd is freed).  next()
+ * is only called when the connection can take more; it returns NULL when
+ * it has nothing, and you call command_stream_more() once it has. */
+void command_stream_(struct command *cmd, struct json_result *result,
+		     const char *method,
+		     struct json_result *(*next)(struct command *cmd,
+						 void *arg),
+		     void *arg);
+
+#define command_stream(cmd, result, method, next, arg)			\
+	command_stream_((cmd), (result), (method),			\
+			typesafe_cb_preargs(struct json_result *, void *, \
+					    (next), (arg),		\
+					    struct command *),		\
+			(arg))
+
+void command_stream_more(struct command *cmd);
+
 /* For initialization */
 void setup_jsonrpc(struct lightningd_state *dstate, const char *rpc_filename);
 
@@ -69,6 +101,7 @@ extern const struct json_command invoice_command;
 extern const struct json_command listinvoice_command;
 extern const struct json_command delinvoice_command;
 extern const struct json_command waitinvoice_command;
+extern const struct json_command subscribeinvoices_command;
 
 /* Payment management. */
 extern const struct json_command getroute_command;
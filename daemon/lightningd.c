@@ -3,6 +3,7 @@
 #include "configdir.h"
 #include "controlled_time.h"
 #include "db.h"
+#include "invoice.h"
 #include "irc_announce.h"
 #include "jsonrpc.h"
 #include "lightningd.h"
@@ -11,6 +12,8 @@
 #include "peer.h"
 #include "routing.h"
 #include "secrets.h"
+#include "sigverify.h"
+#include "sphinx.h"
 #include "timeout.h"
 #include <ccan/container_of/container_of.h>
 #include <ccan/err/err.h>
@@ -23,6 +26,7 @@
 #include <ccan/timer/timer.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -142,6 +146,15 @@ static void config_register_opts(struct lightningd_state *dstate)
 	opt_register_arg("--bitcoind-poll", opt_set_time, opt_show_time,
 			 &dstate->config.poll_time,
 			 "Time between polling for new transactions");
+	opt_register_arg("--bitcoind-max-requests", opt_set_u32, opt_show_u32,
+			 &dstate->config.bitcoind_max_requests,
+			 "Maximum concurrent RPC requests to bitcoind");
+	opt_register_arg("--bitcoind-timeout", opt_set_time, opt_show_time,
+			 &dstate->config.bitcoind_timeout,
+			 "Time bitcoind has to answer before we ask again");
+	opt_register_arg("--sigverify-threads", opt_set_u32, opt_show_u32,
+			 &dstate->config.sigverify_threads,
+			 "Threads to check peer signatures on (0 = inline)");
 	opt_register_arg("--commit-time", opt_set_time, opt_show_time,
 			 &dstate->config.commit_time,
 			 "Time after changes before sending out COMMIT");
@@ -158,6 +171,16 @@ static void config_register_opts(struct lightningd_state *dstate)
 	opt_register_noarg("--disable-irc", opt_set_invbool,
 			   &dstate->config.use_irc,
 			   "Disable IRC peer discovery for routing");
+	opt_register_noarg("--db-wal", opt_set_bool,
+			   &dstate->config.db_wal,
+			   "Use write-ahead logging for the database");
+	opt_register_arg("--db-synchronous=<off|normal|full>",
+			 opt_set_charp, opt_show_charp,
+			 &dstate->config.db_synchronous,
+			 "How hard the database tries to sync to disk");
+	opt_register_noarg("--db-group-commit", opt_set_bool,
+			   &dstate->config.db_group_commit,
+			   "Sync database changes from all peers together, once per loop");
 }
 
 static void dev_register_opts(struct lightningd_state *dstate)
@@ -212,6 +235,15 @@ static const struct config testnet_config = {
 	/* How often to bother bitcoind. */
 	.poll_time = TIME_FROM_SEC(10),
 
+	/* bitcoind serves 4 RPC threads by default. */
+	.bitcoind_max_requests = 4,
+
+	/* bitcoind can be slow (eg. while verifying blocks), but not this. */
+	.bitcoind_timeout = TIME_FROM_SEC(60),
+
+	/* Keep signature checks off the main loop. */
+	.sigverify_threads = 2,
+
 	/* Send commit 10msec after receiving; almost immediately. */
 	.commit_time = TIME_FROM_MSEC(10),
 
@@ -222,6 +254,11 @@ static const struct config testnet_config = {
 
 	/* Discover new peers using IRC */
 	.use_irc = true,
+
+	/* Every commit is durable before we send anything. */
+	.db_wal = false,
+	.db_synchronous = "full",
+	.db_group_commit = false,
 };
 
 /* aka. "Dude, where's my coins?" */
@@ -270,6 +307,15 @@ static const struct config mainnet_config = {
 	/* How often to bother bitcoind. */
 	.poll_time = TIME_FROM_SEC(30),
 
+	/* bitcoind serves 4 RPC threads by default. */
+	.bitcoind_max_requests = 4,
+
+	/* bitcoind can be slow (eg. while verifying blocks), but not this. */
+	.bitcoind_timeout = TIME_FROM_SEC(60),
+
+	/* Keep signature checks off the main loop. */
+	.sigverify_threads = 2,
+
 	/* Send commit 10msec after receiving; almost immediately. */
 	.commit_time = TIME_FROM_MSEC(10),
 
@@ -280,6 +326,11 @@ static const struct config mainnet_config = {
 
 	/* Discover new peers using IRC */
 	.use_irc = true,
+
+	/* Every commit is durable before we send anything. */
+	.db_wal = false,
+	.db_synchronous = "full",
+	.db_group_commit = false,
 };
 
 static void check_config(struct lightningd_state *dstate)
@@ -299,6 +350,9 @@ static void check_config(struct lightningd_state *dstate)
 
 	if (dstate->config.anchor_confirms == 0)
 		fatal("anchor-confirms must be greater than zero");
+
+	if (dstate->config.bitcoind_max_requests == 0)
+		fatal("bitcoind-max-requests must be greater than zero");
 		
 	/* BOLT #2:
 	 *
@@ -309,6 +363,19 @@ static void check_config(struct lightningd_state *dstate)
 		fatal("Deadline %u can't be more than minimum expiry %u",
 		      dstate->config.deadline_blocks,
 		      dstate->config.min_htlc_expiry);
+
+	if (!streq(dstate->config.db_synchronous, "off")
+	    && !streq(dstate->config.db_synchronous, "normal")
+	    && !streq(dstate->config.db_synchronous, "full"))
+		fatal("Unknown db-synchronous '%s'",
+		      dstate->config.db_synchronous);
+
+	if (!dstate->config.db_wal
+	    && !streq(dstate->config.db_synchronous, "full"))
+		log_unusual(dstate->base_log,
+			    "Warning: db-synchronous=%s without db-wal"
+			    " can corrupt the database on power loss",
+			    dstate->config.db_synchronous);
 }
 
 static struct lightningd_state *lightningd_state(void)
@@ -320,24 +387,27 @@ static struct lightningd_state *lightningd_state(void)
 				   "lightningd(%u):", (int)getpid());
 
 	list_head_init(&dstate->peers);
+	dstate->peers_by_id = empty_peer_id_map(dstate);
+	dstate->peers_by_pkhash = empty_peer_pkhash_map(dstate);
 	list_head_init(&dstate->pay_commands);
 	dstate->portnum = 0;
 	dstate->testnet = true;
 	timers_init(&dstate->timers, controlled_time());
 	txwatch_hash_init(&dstate->txwatches);
 	txowatch_hash_init(&dstate->txowatches);
+	dstate->txwatches_added = NULL;
 	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY
 						   | SECP256K1_CONTEXT_SIGN);
 	list_head_init(&dstate->bitcoin_req);
 	list_head_init(&dstate->wallet);
-	list_head_init(&dstate->unpaid);
-	list_head_init(&dstate->paid);
-	dstate->invoices_completed = 0;
-	list_head_init(&dstate->invoice_waiters);
+	dstate->invoices = invoices_init(dstate);
 	list_head_init(&dstate->addresses);
 	dstate->dev_never_routefail = false;
-	dstate->bitcoin_req_running = false;
+	dstate->bitcoind = NULL;
 	dstate->nodes = empty_node_map(dstate);
+	dstate->route_graph = NULL;
+	dstate->route_query = NULL;
+	dstate->sphinx_ws = new_sphinx_workspace(dstate);
 	dstate->reexec = NULL;
 	return dstate;
 }
@@ -458,7 +528,7 @@ int main(int argc, char *argv[])
 			 "Port to bind to (otherwise, dynamic port is used)");
 	opt_register_arg("--bitcoin-datadir", opt_set_charp, NULL,
 			 &bitcoin_datadir,
-			 "-datadir arg for bitcoin-cli");
+			 "bitcoind's -datadir (for bitcoin.conf and RPC cookie)");
 	opt_register_logging(dstate->base_log);
 	opt_register_version();
 
@@ -493,6 +563,13 @@ int main(int argc, char *argv[])
 		errx(1, "no arguments accepted");
 
 	check_config(dstate);
+
+	/* Start signature checking threads. */
+	dstate->sigverify = new_sigverify(dstate, dstate->secpctx,
+					  dstate->config.sigverify_threads);
+	if (!dstate->sigverify)
+		fatal("Could not start signature checking: %s",
+		      strerror(errno));
 	
 	/* Set up node ID and private key. */
 	secrets_init(dstate);
@@ -501,6 +578,9 @@ int main(int argc, char *argv[])
 	/* Read or create database. */
 	db_init(dstate);
 
+	/* Find bitcoind's RPC server. */
+	setup_bitcoind(dstate);
+
 	/* Initialize block topology. */
 	setup_topology(dstate);
 
@@ -514,6 +594,10 @@ int main(int argc, char *argv[])
 	if (dstate->config.use_irc)
 		setup_irc_connection(dstate);
 
+	/* A closed socket (eg. bitcoind dropping a keep-alive connection)
+	 * should give us EPIPE, not kill us. */
+	signal(SIGPIPE, SIG_IGN);
+
 	/* Make sure we use the artificially-controlled time for timers */
 	io_time_override(controlled_time);
 	
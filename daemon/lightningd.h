@@ -54,11 +54,29 @@ struct config {
 	/* How long between polling bitcoind. */
 	struct timerel poll_time;
 
+	/* Maximum concurrent requests (and connections) to bitcoind. */
+	u32 bitcoind_max_requests;
+
+	/* How long bitcoind has to answer before we ask again (it doubles). */
+	struct timerel bitcoind_timeout;
+
+	/* Threads checking peers' signatures (0 means check inline). */
+	u32 sigverify_threads;
+
 	/* How long between changing commit and sending COMMIT message. */
 	struct timerel commit_time;
 
 	/* Whether to enable IRC peer discovery. */
 	bool use_irc;
+
+	/* Use sqlite's write-ahead log instead of a rollback journal. */
+	bool db_wal;
+
+	/* sqlite's PRAGMA synchronous: "off", "normal" or "full". */
+	char *db_synchronous;
+
+	/* Make peer db transactions durable once per io_loop iteration. */
+	bool db_group_commit;
 };
 
 /* Here's where the global variables hide! */
@@ -93,6 +111,10 @@ struct lightningd_state {
 	/* Our peers. */
 	struct list_head peers;
 
+	/* Peers which know their id, indexed by id and hash160 of id. */
+	struct peer_id_map *peers_by_id;
+	struct peer_pkhash_map *peers_by_pkhash;
+
 	/* Addresses to contact peers. */
 	struct list_head addresses;
 
@@ -102,6 +124,9 @@ struct lightningd_state {
 	/* Crypto tables for global use. */
 	secp256k1_context *secpctx;
 
+	/* Worker threads to check signatures off the io_loop. */
+	struct sigverify *sigverify;
+
 	/* Our private key */
 	struct secret *secret;
 
@@ -111,23 +136,31 @@ struct lightningd_state {
 	/* Transactions/txos we are watching. */
 	struct txwatch_hash txwatches;
 	struct txowatch_hash txowatches;
+	/* txids of watches added while watch_topology_changed runs. */
+	struct sha256_double *txwatches_added;
 
-	/* Outstanding bitcoind requests. */
+	/* bitcoind requests waiting for a connection. */
 	struct list_head bitcoin_req;
-	bool bitcoin_req_running;
+	struct bitcoind *bitcoind;
 
 	/* Wallet addresses we maintain. */
 	struct list_head wallet;
 
 	/* Payments for r values we know about. */
-	struct list_head paid, unpaid;
-	u64 invoices_completed;
-	/* Waiting for new invoices to be paid. */
-	struct list_head invoice_waiters;
+	struct invoices *invoices;
 	
 	/* All known nodes. */
 	struct node_map *nodes;
 
+	/* Compact copy of nodes for find_route (NULL if out of date). */
+	struct route_graph *route_graph;
+
+	/* Spare scratch space for find_route. */
+	struct route_query *route_query;
+
+	/* Scratch space for create_onionpacket. */
+	struct sphinx_workspace *sphinx_ws;
+
 	/* For testing: don't fail if we can't route. */
 	bool dev_never_routefail;
 
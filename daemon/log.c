@@ -8,7 +8,6 @@
 #include "log.h"
 #include "peer.h"
 #include "protobuf_convert.h"
-#include "pseudorand.h"
 #include "utils.h"
 #include <ccan/array_size/array_size.h>
 #include <ccan/list/list.h>
@@ -26,18 +25,53 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-struct log_entry {
-	struct list_node list;
-	struct timeabs time;
-	enum log_level level;
-	unsigned int skipped;
+/* Records live in a ring buffer, and are only formatted when someone
+ * looks at them.  Each is a log_hdr followed by its arguments. */
+#define LOG_ALIGN 8
+
+enum log_kind {
+	/* Fills the end of the buffer when the next record won't fit. */
+	LOG_KIND_PAD,
+	/* Arguments as fmt describes them. */
+	LOG_KIND_FMT,
+	/* Raw bytes, printed in hex where fmt has %s. */
+	LOG_KIND_BLOB,
+	/* A snapshot of struct number arg, printed where fmt has %s. */
+	LOG_KIND_STRUCT,
+	/* Raw bytes, arg is the direction. */
+	LOG_KIND_IO
+};
+
+struct log_hdr {
+	/* Including this header, and padding to LOG_ALIGN. */
+	u32 len;
+	u8 kind;
+	u8 level;
+	/* Appended to the previous record by log_add. */
+	bool continued;
+	u8 arg;
+	/* Since lr->init_time. */
+	u64 nsec;
 	const char *prefix;
-	char *log;
+	const char *fmt;
 };
 
 struct log_record {
-	size_t mem_used;
+	/* max_mem bytes of ring. */
+	u8 *buf;
 	size_t max_mem;
+	/* Positions of the oldest record, and the next one: never wrap. */
+	u64 head, tail;
+	/* What log_add appends to, and whether we kept it. */
+	enum log_level last_level;
+	bool last_kept;
+	/* Entries below this aren't kept (unless they're printed). */
+	enum log_level record_level;
+	/* Except for logs named like these. */
+	struct log_level_for *level_for;
+	/* Records we've overwritten. */
+	unsigned int skipped;
+
 	struct lightningd_state *dstate;
 	void (*print)(const char *prefix,
 		      enum log_level level,
@@ -46,60 +80,532 @@ struct log_record {
 	void *print_arg;
 	enum log_level print_level;
 	struct timeabs init_time;
+};
 
-	struct list_head log;
+struct log_level_for {
+	const char *prefix;
+	enum log_level level;
 };
 
 struct log {
 	struct log_record *lr;
 	const char *prefix;
+	/* From lr->level_for, or -1 to use lr->record_level. */
+	int level;
 };
 
-static void log_default_print(const char *prefix,
-			      enum log_level level,
-			      bool continued,
-			      const char *str, void *arg)
+/* What we snapshot for log_struct_: these must match loggable_structs. */
+enum log_struct {
+	LOG_PUBKEY,
+	LOG_SHA256_DOUBLE,
+	LOG_SHA256,
+	LOG_REL_LOCKTIME,
+	LOG_ABS_LOCKTIME,
+	LOG_BITCOIN_TX,
+	LOG_HTLC,
+	LOG_RVAL,
+	LOG_CHANNEL_STATE,
+	LOG_CHANNEL_ONESIDE
+};
+
+static const char *log_structs[] = {
+	[LOG_PUBKEY] = "struct pubkey",
+	[LOG_SHA256_DOUBLE] = "struct sha256_double",
+	[LOG_SHA256] = "struct sha256",
+	[LOG_REL_LOCKTIME] = "struct rel_locktime",
+	[LOG_ABS_LOCKTIME] = "struct abs_locktime",
+	[LOG_BITCOIN_TX] = "struct bitcoin_tx",
+	[LOG_HTLC] = "struct htlc",
+	[LOG_RVAL] = "struct rval",
+	[LOG_CHANNEL_STATE] = "struct channel_state",
+	[LOG_CHANNEL_ONESIDE] = "struct channel_oneside"
+};
+
+/* The parts of an htlc we print. */
+struct log_htlc {
+	u64 id, msatoshi;
+	struct abs_locktime expiry;
+	struct sha256 rhash;
+	struct rval r;
+	u8 src[PUBKEY_DER_LEN];
+	bool have_r, have_src;
+};
+
+/* What a printf conversion takes from its va_list. */
+enum arg_type {
+	ARG_NONE,
+	ARG_INT,
+	ARG_LONG,
+	ARG_LLONG,
+	ARG_SIZE,
+	ARG_INTMAX,
+	ARG_PTRDIFF,
+	ARG_DOUBLE,
+	ARG_LDOUBLE,
+	ARG_STR,
+	ARG_PTR
+};
+
+struct conv {
+	/* From the % to the conversion character. */
+	size_t len;
+	bool star_width, star_prec;
+	int prec;
+	enum arg_type type;
+};
+
+/* Returns false for conversions we don't store (eg. %n, %ls). */
+static bool parse_conv(const char *fmt, struct conv *c)
 {
-	if (!continued) {
-		printf("%s %s\n", prefix, str);
+	const char *p = fmt + 1;
+	char mod = 0;
+
+	c->star_width = c->star_prec = false;
+	c->prec = -1;
+
+	p += strspn(p, "-+ #0'");
+	if (*p == '*') {
+		c->star_width = true;
+		p++;
+	} else
+		p += strspn(p, "0123456789");
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			c->star_prec = true;
+			p++;
+		} else {
+			c->prec = atoi(p);
+			p += strspn(p, "0123456789");
+		}
+	}
+
+	switch (*p) {
+	case 'h':
+		p += (p[1] == 'h') ? 2 : 1;
+		break;
+	case 'l':
+		if (p[1] == 'l') {
+			mod = 'L';
+			p += 2;
+		} else
+			mod = *p++;
+		break;
+	case 'L':
+		mod = 'D';
+		p++;
+		break;
+	case 'q':
+		mod = 'L';
+		p++;
+		break;
+	case 'z':
+	case 'j':
+	case 't':
+		mod = *p++;
+		break;
+	}
+
+	switch (*p) {
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'c':
+		c->type = mod == 'l' ? ARG_LONG
+			: mod == 'L' ? ARG_LLONG
+			: mod == 'z' ? ARG_SIZE
+			: mod == 'j' ? ARG_INTMAX
+			: mod == 't' ? ARG_PTRDIFF
+			: ARG_INT;
+		if (mod == 'D' || (*p == 'c' && mod))
+			return false;
+		break;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		c->type = mod == 'D' ? ARG_LDOUBLE : ARG_DOUBLE;
+		break;
+	case 's':
+		c->type = ARG_STR;
+		if (mod)
+			return false;
+		break;
+	case 'p':
+		c->type = ARG_PTR;
+		break;
+	case '%':
+		c->type = ARG_NONE;
+		break;
+	default:
+		return false;
+	}
+	c->len = p + 1 - fmt;
+
+	/* We rebuild it into a small buffer to print. */
+	return c->len < 16;
+}
+
+/* If p is NULL, we just count. */
+static void put(u8 **p, const void *v, size_t len, size_t *total)
+{
+	if (*p) {
+		memcpy(*p, v, len);
+		*p += len;
+	}
+	*total += len;
+}
+
+#define put_arg(p, ap, type, total)			\
+	do {						\
+		type v_ = va_arg((ap), type);		\
+		put((p), &v_, sizeof(v_), (total));	\
+	} while (0)
+
+/* Copies the arguments fmt uses into p (if non-NULL): returns the length,
+ * or -1 if there's a conversion we can't handle.  Strings are copied, but
+ * no longer than strmax. */
+static ssize_t encode_args(const char *fmt, u8 *p, size_t strmax, va_list ap)
+{
+	size_t total = 0;
+	struct conv c;
+
+	while ((fmt = strchr(fmt, '%')) != NULL) {
+		int prec;
+
+		if (!parse_conv(fmt, &c))
+			return -1;
+		fmt += c.len;
+
+		if (c.star_width)
+			put_arg(&p, ap, int, &total);
+		prec = c.prec;
+		if (c.star_prec) {
+			prec = va_arg(ap, int);
+			put(&p, &prec, sizeof(prec), &total);
+		}
+
+		switch (c.type) {
+		case ARG_NONE:
+			break;
+		case ARG_INT:
+			put_arg(&p, ap, int, &total);
+			break;
+		case ARG_LONG:
+			put_arg(&p, ap, long, &total);
+			break;
+		case ARG_LLONG:
+			put_arg(&p, ap, long long, &total);
+			break;
+		case ARG_SIZE:
+			put_arg(&p, ap, size_t, &total);
+			break;
+		case ARG_INTMAX:
+			put_arg(&p, ap, intmax_t, &total);
+			break;
+		case ARG_PTRDIFF:
+			put_arg(&p, ap, ptrdiff_t, &total);
+			break;
+		case ARG_DOUBLE:
+			put_arg(&p, ap, double, &total);
+			break;
+		case ARG_LDOUBLE:
+			put_arg(&p, ap, long double, &total);
+			break;
+		case ARG_PTR:
+			put_arg(&p, ap, void *, &total);
+			break;
+		case ARG_STR: {
+			const char *s = va_arg(ap, const char *);
+			u32 len;
+
+			if (!s)
+				s = "(null)";
+			len = prec >= 0 ? strnlen(s, prec) : strlen(s);
+			if (len > strmax)
+				len = strmax;
+			put(&p, &len, sizeof(len), &total);
+			put(&p, s, len, &total);
+			put(&p, "", 1, &total);
+			break;
+		}
+		}
+	}
+	return total;
+}
+
+/* Formatting goes to a tal string, or if that's NULL, straight to fd
+ * (without allocating: we may be in a signal handler). */
+struct log_out {
+	char *str;
+	int fd;
+};
+
+static void out_str(struct log_out *o, const void *s, size_t len)
+{
+	if (o->str) {
+		size_t off = tal_count(o->str) - 1;
+
+		tal_resize(&o->str, off + len + 1);
+		memcpy(o->str + off, s, len);
+		o->str[off + len] = '\0';
+	} else
+		write_all(o->fd, s, len);
+}
+
+static void PRINTF_FMT(2,3) out_fmt(struct log_out *o, const char *fmt, ...)
+{
+	char buf[128];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (len < 0)
+		return;
+	if (len < sizeof(buf))
+		out_str(o, buf, len);
+	else if (o->str) {
+		char *s;
+
+		va_start(ap, fmt);
+		s = tal_vfmt(NULL, fmt, ap);
+		va_end(ap);
+		out_str(o, s, len);
+		tal_free(s);
+	} else
+		out_str(o, buf, sizeof(buf) - 1);
+}
+
+static void out_hex(struct log_out *o, const void *data, size_t len)
+{
+	char buf[101];
+	size_t off, used;
+
+	for (off = 0; off < len; off += used) {
+		used = len - off;
+		if (hex_str_size(used) > sizeof(buf))
+			used = hex_data_size(sizeof(buf));
+		hex_encode((const u8 *)data + off, used, buf, hex_str_size(used));
+		out_str(o, buf, strlen(buf));
+	}
+}
+
+static void get(const u8 **p, void *v, size_t len)
+{
+	memcpy(v, *p, len);
+	*p += len;
+}
+
+#define out_arg(o, p, spec, type)			\
+	do {						\
+		type v_;				\
+		get((p), &v_, sizeof(v_));		\
+		out_fmt((o), (spec), v_);		\
+	} while (0)
+
+static void out_locktime(struct log_out *o, const struct log_hdr *h,
+			 const u8 *p)
+{
+	if (h->arg == LOG_REL_LOCKTIME) {
+		struct rel_locktime rel;
+
+		memcpy(&rel, p, sizeof(rel));
+		if (rel_locktime_is_seconds(&rel))
+			out_fmt(o, "+%usec", rel_locktime_to_seconds(&rel));
+		else
+			out_fmt(o, "+%ublocks", rel_locktime_to_blocks(&rel));
 	} else {
-		printf("%s \t%s\n", prefix, str);
+		struct abs_locktime abs;
+
+		memcpy(&abs, p, sizeof(abs));
+		if (abs_locktime_is_seconds(&abs))
+			out_fmt(o, "%usec", abs_locktime_to_seconds(&abs));
+		else
+			out_fmt(o, "%ublocks", abs_locktime_to_blocks(&abs));
 	}
 }
 
-static size_t log_bufsize(const struct log_entry *e)
+static void out_oneside(struct log_out *o, const struct channel_oneside *s)
 {
-	if (e->level == LOG_IO)
-		return tal_count(e->log);
-	else
-		return strlen(e->log) + 1;
+	out_fmt(o, "{ pay_msat=%u fee_msat=%u num_htlcs=%u }",
+		s->pay_msat, s->fee_msat, s->num_htlcs);
 }
 
-static size_t prune_log(struct log_record *log)
+static void out_struct(struct log_out *o, const struct log_hdr *h,
+		       const u8 *p, size_t len)
 {
-	struct log_entry *i, *next, *tail;
-	size_t skipped = 0, deleted = 0;
+	switch ((enum log_struct)h->arg) {
+	case LOG_PUBKEY:
+	case LOG_SHA256_DOUBLE:
+	case LOG_SHA256:
+	case LOG_BITCOIN_TX:
+	case LOG_RVAL:
+		out_hex(o, p, len);
+		return;
+	case LOG_REL_LOCKTIME:
+	case LOG_ABS_LOCKTIME:
+		out_locktime(o, h, p);
+		return;
+	case LOG_HTLC: {
+		struct log_htlc lh;
+		struct log_hdr abs = *h;
+
+		memcpy(&lh, p, sizeof(lh));
+		abs.arg = LOG_ABS_LOCKTIME;
+		out_fmt(o, "{ id=%"PRIu64" msatoshi=%"PRIu64" expiry=",
+			lh.id, lh.msatoshi);
+		out_locktime(o, &abs, (const u8 *)&lh.expiry);
+		out_fmt(o, " rhash=");
+		out_hex(o, &lh.rhash, sizeof(lh.rhash));
+		out_fmt(o, " rval=");
+		if (lh.have_r)
+			out_hex(o, &lh.r, sizeof(lh.r));
+		else
+			out_fmt(o, "UNKNOWN");
+		out_fmt(o, " src=");
+		if (lh.have_src)
+			out_hex(o, lh.src, sizeof(lh.src));
+		else
+			out_fmt(o, "local");
+		out_fmt(o, " }");
+		return;
+	}
+	case LOG_CHANNEL_ONESIDE: {
+		struct channel_oneside s;
 
-	/* Never delete the last one. */
-	tail = list_tail(&log->log, struct log_entry, list);
+		memcpy(&s, p, sizeof(s));
+		out_oneside(o, &s);
+		return;
+	}
+	case LOG_CHANNEL_STATE: {
+		struct channel_state cstate;
+
+		memcpy(&cstate, p, sizeof(cstate));
+		out_fmt(o, "{ anchor=%"PRIu64" fee_rate=%"PRIu64
+			" num_nondust=%u ours=",
+			cstate.anchor, cstate.fee_rate, cstate.num_nondust);
+		out_oneside(o, &cstate.side[LOCAL]);
+		out_fmt(o, " theirs=");
+		out_oneside(o, &cstate.side[REMOTE]);
+		out_fmt(o, " }");
+		return;
+	}
+	}
+	abort();
+}
 
-	list_for_each_safe(&log->log, i, next, list) {
-		/* 50% chance of deleting debug, 25% inform, 12.5% unusual. */
-		if (i == tail || !pseudorand(2 << i->level)) {
-			i->skipped += skipped;
-			skipped = 0;
-			continue;
+/* The reverse of encode_args.  For blobs and structs, the %s is them. */
+static void format_record(struct log_out *o, const struct log_hdr *h)
+{
+	const u8 *p = (const u8 *)(h + 1);
+	const char *fmt = h->fmt, *pct;
+	struct conv c;
+
+	while ((pct = strchr(fmt, '%')) != NULL) {
+		char spec[48];
+		int width = 0, prec = 0;
+
+		out_str(o, fmt, pct - fmt);
+		/* We parsed it fine when we stored it. */
+		parse_conv(pct, &c);
+		fmt = pct + c.len;
+
+		if (c.star_width)
+			get(&p, &width, sizeof(width));
+		if (c.star_prec)
+			get(&p, &prec, sizeof(prec));
+
+		/* Replace any * with what they were. */
+		if (c.star_width || c.star_prec) {
+			const char *star = memchr(pct, '*', c.len);
+			char *s = spec;
+
+			memcpy(s, pct, star - pct);
+			s += star - pct;
+			s += sprintf(s, "%i", c.star_width ? width : prec);
+			if (c.star_width && c.star_prec) {
+				*(s++) = '.';
+				s += sprintf(s, "%i", prec);
+				star = memchr(star + 1, '*', pct + c.len - star);
+			}
+			memcpy(s, star + 1, pct + c.len - star - 1);
+			s[pct + c.len - star - 1] = '\0';
+		} else {
+			memcpy(spec, pct, c.len);
+			spec[c.len] = '\0';
 		}
 
-		list_del_from(&log->log, &i->list);
-		log->mem_used -= sizeof(*i) + log_bufsize(i);
-		tal_free(i);
-		skipped++;
-		deleted++;
+		switch (c.type) {
+		case ARG_NONE:
+			out_str(o, "%", 1);
+			break;
+		case ARG_INT:
+			out_arg(o, &p, spec, int);
+			break;
+		case ARG_LONG:
+			out_arg(o, &p, spec, long);
+			break;
+		case ARG_LLONG:
+			out_arg(o, &p, spec, long long);
+			break;
+		case ARG_SIZE:
+			out_arg(o, &p, spec, size_t);
+			break;
+		case ARG_INTMAX:
+			out_arg(o, &p, spec, intmax_t);
+			break;
+		case ARG_PTRDIFF:
+			out_arg(o, &p, spec, ptrdiff_t);
+			break;
+		case ARG_DOUBLE:
+			out_arg(o, &p, spec, double);
+			break;
+		case ARG_LDOUBLE:
+			out_arg(o, &p, spec, long double);
+			break;
+		case ARG_PTR:
+			out_arg(o, &p, spec, void *);
+			break;
+		case ARG_STR: {
+			u32 len;
+
+			get(&p, &len, sizeof(len));
+			if (h->kind == LOG_KIND_BLOB)
+				out_hex(o, p, len);
+			else if (h->kind == LOG_KIND_STRUCT)
+				out_struct(o, h, p, len);
+			else if (streq(spec, "%s"))
+				out_str(o, p, len);
+			else
+				out_fmt(o, spec, (const char *)p);
+			p += len + (h->kind == LOG_KIND_FMT);
+			break;
+		}
+		}
 	}
+	out_str(o, fmt, strlen(fmt));
+}
 
-	assert(!skipped);
-	return deleted;
+static void log_default_print(const char *prefix,
+			      enum log_level level,
+			      bool continued,
+			      const char *str, void *arg)
+{
+	if (!continued) {
+		printf("%s %s\n", prefix, str);
+	} else {
+		printf("%s \t%s\n", prefix, str);
+	}
 }
 
 struct log_record *new_log_record(struct lightningd_state *dstate,
@@ -109,18 +615,33 @@ struct log_record *new_log_record(struct lightningd_state *dstate,
 	struct log_record *lr = tal(dstate, struct log_record);
 
 	/* Give a reasonable size for memory limit! */
-	assert(max_mem > sizeof(struct log) * 2);
-	lr->mem_used = 0;
-	lr->max_mem = max_mem;
+	assert(max_mem >= 4 * sizeof(struct log_hdr));
+	lr->max_mem = max_mem / LOG_ALIGN * LOG_ALIGN;
+	lr->buf = tal_arr(lr, u8, lr->max_mem);
+	lr->head = lr->tail = 0;
+	lr->last_level = LOG_INFORM;
+	lr->last_kept = false;
+	lr->record_level = LOG_DBG;
+	lr->level_for = tal_arr(lr, struct log_level_for, 0);
+	lr->skipped = 0;
 	lr->dstate = dstate;
 	lr->print = log_default_print;
 	lr->print_level = printlevel;
 	lr->init_time = time_now();
-	list_head_init(&lr->log);
 
 	return lr;
 }
 
+static int prefix_level(const struct log_record *lr, const char *prefix)
+{
+	size_t i;
+
+	for (i = 0; i < tal_count(lr->level_for); i++)
+		if (strstr(prefix, lr->level_for[i].prefix))
+			return lr->level_for[i].level;
+	return -1;
+}
+
 /* With different entry points */
 struct log *PRINTF_FMT(3,4)
 new_log(const tal_t *ctx, struct log_record *record, const char *fmt, ...)
@@ -133,6 +654,7 @@ new_log(const tal_t *ctx, struct log_record *record, const char *fmt, ...)
 	/* log->lr owns this, since its entries keep a pointer to it. */
 	log->prefix = tal_vfmt(log->lr, fmt, ap);
 	va_end(ap);
+	log->level = prefix_level(log->lr, log->prefix);
 
 	return log;
 }
@@ -142,10 +664,44 @@ void set_log_level(struct log_record *lr, enum log_level level)
 	lr->print_level = level;
 }
 
+void set_log_record_level(struct log_record *lr, enum log_level level)
+{
+	lr->record_level = level;
+}
+
+void set_log_level_for(struct log_record *lr, const char *prefix,
+		       enum log_level level)
+{
+	size_t n = tal_count(lr->level_for);
+
+	tal_resize(&lr->level_for, n + 1);
+	lr->level_for[n].prefix = tal_strdup(lr->level_for, prefix);
+	lr->level_for[n].level = level;
+}
+
 void set_log_prefix(struct log *log, const char *prefix)
 {
 	/* log->lr owns this, since it keeps a pointer to it. */
 	log->prefix = tal_strdup(log->lr, prefix);
+	log->level = prefix_level(log->lr, log->prefix);
+}
+
+bool log_enabled(struct log *log, int level)
+{
+	struct log_record *lr = log->lr;
+	int keep = log->level >= 0 ? log->level : lr->record_level;
+
+	if (level == -1)
+		return lr->last_kept;
+
+	lr->last_kept = (level >= keep || level >= (int)lr->print_level);
+	return lr->last_kept;
+}
+
+bool log_compiled_out(struct log *log)
+{
+	log->lr->last_kept = false;
+	return false;
 }
 
 void set_log_outfn_(struct log_record *lr,
@@ -171,7 +727,7 @@ size_t log_max_mem(const struct log_record *lr)
 
 size_t log_used(const struct log_record *lr)
 {
-	return lr->mem_used;
+	return lr->tail - lr->head;
 }
 
 const struct timeabs *log_init_time(const struct log_record *lr)
@@ -179,82 +735,157 @@ const struct timeabs *log_init_time(const struct log_record *lr)
 	return &lr->init_time;
 }
 
-static void add_entry(struct log *log, struct log_entry *l)
+static struct log_hdr *hdr_at(const struct log_record *lr, u64 pos)
 {
-	log->lr->mem_used += sizeof(*l) + log_bufsize(l);
-	list_add_tail(&log->lr->log, &l->list);
+	return (struct log_hdr *)(lr->buf + pos % lr->max_mem);
+}
 
-	if (log->lr->mem_used > log->lr->max_mem) {
-		size_t old_mem = log->lr->mem_used, deleted;
-		deleted = prune_log(log->lr);
-		log_debug(log, "Log pruned %zu entries (mem %zu -> %zu)",
-			  deleted, old_mem, log->lr->mem_used);
+/* Throw away the oldest records until len bytes are free. */
+static void make_room(struct log_record *lr, size_t len)
+{
+	while (lr->tail + len - lr->head > lr->max_mem) {
+		const struct log_hdr *h = hdr_at(lr, lr->head);
+
+		if (h->kind != LOG_KIND_PAD && !h->continued)
+			lr->skipped++;
+		lr->head += h->len;
 	}
 }
 
-static struct log_entry *new_log_entry(struct log *log, enum log_level level)
+/* Level -1 means append to the last record. */
+static struct log_hdr *new_record(struct log *log, int level,
+				  enum log_kind kind, size_t arglen)
 {
-	struct log_entry *l = tal(log->lr, struct log_entry);
+	struct log_record *lr = log->lr;
+	size_t len = sizeof(struct log_hdr) + arglen, off;
+	struct log_hdr *h;
+
+	len = (len + LOG_ALIGN - 1) / LOG_ALIGN * LOG_ALIGN;
+	assert(len <= lr->max_mem);
+
+	/* Records don't wrap: pad out the end and start at the beginning. */
+	off = lr->tail % lr->max_mem;
+	if (off + len > lr->max_mem) {
+		make_room(lr, lr->max_mem - off);
+		h = hdr_at(lr, lr->tail);
+		h->len = lr->max_mem - off;
+		h->kind = LOG_KIND_PAD;
+		lr->tail += h->len;
+	}
 
-	l->time = time_now();
-	l->level = level;
-	l->skipped = 0;
-	l->prefix = log->prefix;
+	make_room(lr, len);
+	h = hdr_at(lr, lr->tail);
+	lr->tail += len;
 
-	return l;
+	h->len = len;
+	h->kind = kind;
+	h->continued = (level == -1);
+	if (h->continued)
+		h->level = lr->last_level;
+	else
+		h->level = lr->last_level = level;
+	h->arg = 0;
+	h->nsec = time_to_nsec(time_between(time_now(), lr->init_time));
+	h->prefix = log->prefix;
+	h->fmt = NULL;
+	return h;
 }
 
-void logv(struct log *log, enum log_level level, const char *fmt, va_list ap)
+/* Formatting is the expensive part, so only do it if we're printing. */
+static void maybe_print(struct log *log, const struct log_hdr *h)
 {
-	struct log_entry *l = new_log_entry(log, level);
+	struct log_out o;
 
-	l->log = tal_vfmt(l, fmt, ap);
-
-	if (level >= log->lr->print_level)
-		log->lr->print(log->prefix, level, false, l->log,
-			       log->lr->print_arg);
+	if (h->level < log->lr->print_level)
+		return;
 
-	add_entry(log, l);
+	o.str = tal_arrz(log, char, 1);
+	if (h->kind == LOG_KIND_IO) {
+		u32 len;
+
+		memcpy(&len, h + 1, sizeof(len));
+		out_fmt(&o, "%s", h->arg ? "[IN]" : "[OUT]");
+		out_hex(&o, (const u8 *)(h + 1) + sizeof(len), len);
+	} else
+		format_record(&o, h);
+	log->lr->print(log->prefix, h->level, h->continued, o.str,
+		       log->lr->print_arg);
+	tal_free(o.str);
 }
 
-void log_io(struct log *log, bool in, const void *data, size_t len)
+static void do_logv(struct log *log, int level, const char *fmt, va_list ap)
 {
-	int save_errno = errno;
-	struct log_entry *l = new_log_entry(log, LOG_IO);
-
-	l->log = tal_arr(l, char, 1 + len);
-	l->log[0] = in;
-	memcpy(l->log + 1, data, len);
-
-	if (LOG_IO >= log->lr->print_level) {
-		const char *dir = in ? "[IN]" : "[OUT]";
-		char *hex = tal_arr(l, char, strlen(dir) + hex_str_size(len));
-		strcpy(hex, dir);
-		hex_encode(data, len, hex + strlen(dir), hex_str_size(len));
-		log->lr->print(log->prefix, LOG_IO, false, l->log,
-			       log->lr->print_arg);
-		tal_free(hex);
+	size_t strmax = log->lr->max_mem / 8;
+	struct log_hdr *h;
+	ssize_t len;
+	va_list ap2;
+
+	if (!log_enabled(log, level))
+		return;
+
+	va_copy(ap2, ap);
+	len = encode_args(fmt, NULL, strmax, ap2);
+	va_end(ap2);
+
+	/* Something we can't store (or huge)?  Format it now. */
+	if (len < 0 || len > log->lr->max_mem / 2) {
+		char *s = tal_vfmt(log, fmt, ap);
+		if (level == -1)
+			log_add_(log, "%s", s);
+		else
+			log_(log, level, "%s", s);
+		tal_free(s);
+		return;
 	}
 
-	add_entry(log, l);
-	errno = save_errno;
+	h = new_record(log, level, LOG_KIND_FMT, len);
+	h->fmt = fmt;
+	encode_args(fmt, (u8 *)(h + 1), strmax, ap);
+	maybe_print(log, h);
 }
 
-static void do_log_add(struct log *log, const char *fmt, va_list ap)
+/* Blobs, structs and IO are all a length and some bytes. */
+static struct log_hdr *new_bytes_record(struct log *log, int level,
+					enum log_kind kind, const char *fmt,
+					size_t *len)
 {
-	struct log_entry *l = list_tail(&log->lr->log, struct log_entry, list);
-	size_t oldlen = strlen(l->log);
+	struct log_hdr *h;
+	u32 len32;
+
+	/* Too big?  Keep the start. */
+	if (*len > log->lr->max_mem / 2)
+		*len = log->lr->max_mem / 2;
+	len32 = *len;
+
+	h = new_record(log, level, kind, sizeof(len32) + len32);
+	h->fmt = fmt;
+	memcpy(h + 1, &len32, sizeof(len32));
+	return h;
+}
 
-	/* Remove from list, so it doesn't get pruned. */
-	log->lr->mem_used -= sizeof(*l) + oldlen + 1;
-	list_del_from(&log->lr->log, &l->list);
+static u8 *record_bytes(const struct log_hdr *h)
+{
+	return (u8 *)(h + 1) + sizeof(u32);
+}
+
+void logv(struct log *log, enum log_level level, const char *fmt, va_list ap)
+{
+	do_logv(log, level, fmt, ap);
+}
 
-	tal_append_vfmt(&l->log, fmt, ap);
-	add_entry(log, l);
+void log_io(struct log *log, bool in, const void *data, size_t len)
+{
+	int save_errno = errno;
+	struct log_hdr *h;
 
-	if (l->level >= log->lr->print_level)
-		log->lr->print(log->prefix, l->level, true, l->log + oldlen,
-			       log->lr->print_arg);
+	if (!log_enabled(log, LOG_IO))
+		return;
+
+	h = new_bytes_record(log, LOG_IO, LOG_KIND_IO, NULL, &len);
+	h->arg = in;
+	memcpy(record_bytes(h), data, len);
+	maybe_print(log, h);
+	errno = save_errno;
 }
 
 void log_(struct log *log, enum log_level level, const char *fmt, ...)
@@ -262,123 +893,118 @@ void log_(struct log *log, enum log_level level, const char *fmt, ...)
 	va_list ap;
 
 	va_start(ap, fmt);
-	logv(log, level, fmt, ap);
+	do_logv(log, level, fmt, ap);
 	va_end(ap);
 }
 
-void log_add(struct log *log, const char *fmt, ...)
+void log_add_(struct log *log, const char *fmt, ...)
 {
 	va_list ap;
 
 	va_start(ap, fmt);
-	do_log_add(log, fmt, ap);
+	do_logv(log, -1, fmt, ap);
 	va_end(ap);
 }
 
-#define to_string(ctx, lr, structtype, ptr)				\
-	to_string_((ctx), lr, stringify(structtype),			\
-		   ((void)sizeof((ptr) == (structtype *)NULL),		\
-		    ((union loggable_structs)((const structtype *)ptr))))
-
-static char *to_string_(const tal_t *ctx,
-			struct log_record *lr,
-			const char *structname,
-			union loggable_structs u)
+static size_t struct_len(enum log_struct type)
 {
-	char *s = NULL;
-
-	/* GCC checks we're one of these, so we should be. */
-	if (streq(structname, "struct pubkey"))
-		s = pubkey_to_hexstr(ctx, lr->dstate->secpctx, u.pubkey);
-	else if (streq(structname, "struct sha256_double"))
-		s = tal_hexstr(ctx, u.sha256_double, sizeof(*u.sha256_double));
-	else if (streq(structname, "struct sha256"))
-		s = tal_hexstr(ctx, u.sha256, sizeof(*u.sha256));
-	else if (streq(structname, "struct rel_locktime")) {
-		if (rel_locktime_is_seconds(u.rel_locktime))
-			s = tal_fmt(ctx, "+%usec",
-				    rel_locktime_to_seconds(u.rel_locktime));
-		else
-			s = tal_fmt(ctx, "+%ublocks",
-				    rel_locktime_to_blocks(u.rel_locktime));
-	} else if (streq(structname, "struct abs_locktime")) {
-		if (abs_locktime_is_seconds(u.abs_locktime))
-			s = tal_fmt(ctx, "%usec",
-				    abs_locktime_to_seconds(u.abs_locktime));
-		else
-			s = tal_fmt(ctx, "%ublocks",
-				    abs_locktime_to_blocks(u.abs_locktime));
-	} else if (streq(structname, "struct bitcoin_tx")) {
-		u8 *lin = linearize_tx(ctx, u.bitcoin_tx);
-		s = tal_hexstr(ctx, lin, tal_count(lin));
-	} else if (streq(structname, "struct htlc")) {
-		const struct htlc *h = u.htlc;
-		s = tal_fmt(ctx, "{ id=%"PRIu64
-			    " msatoshi=%"PRIu64
-			    " expiry=%s"
-			    " rhash=%s"
-			    " rval=%s"
-			    " src=%s }",
-			    h->id, h->msatoshi,
-			    to_string(ctx, lr, struct abs_locktime, &h->expiry),
-			    to_string(ctx, lr, struct sha256, &h->rhash),
-			    h->r ? tal_hexstr(ctx, h->r, sizeof(*h->r))
-			    : "UNKNOWN",
-			    h->src ? to_string(ctx, lr, struct pubkey,
-					       h->src->peer->id)
-			    : "local");
-	} else if (streq(structname, "struct rval")) {
-		s = tal_hexstr(ctx, u.rval, sizeof(*u.rval));
-	} else if (streq(structname, "struct channel_oneside")) {
-		s = tal_fmt(ctx, "{ pay_msat=%u"
-			    " fee_msat=%u"
-			    " num_htlcs=%u }",
-			    u.channel_oneside->pay_msat,
-			    u.channel_oneside->fee_msat,
-			    u.channel_oneside->num_htlcs);
-	} else if (streq(structname, "struct channel_state")) {
-		s = tal_fmt(ctx, "{ anchor=%"PRIu64
-			    " fee_rate=%"PRIu64
-			    " num_nondust=%u"
-			    " ours=%s"
-			    " theirs=%s }",
-			    u.cstate->anchor,
-			    u.cstate->fee_rate,
-			    u.cstate->num_nondust,
-			    to_string(ctx, lr, struct channel_oneside,
-				      &u.cstate->side[LOCAL]),
-			    to_string(ctx, lr, struct channel_oneside,
-				      &u.cstate->side[REMOTE]));
+	switch (type) {
+	case LOG_PUBKEY:
+		return PUBKEY_DER_LEN;
+	case LOG_SHA256_DOUBLE:
+		return sizeof(struct sha256_double);
+	case LOG_SHA256:
+		return sizeof(struct sha256);
+	case LOG_REL_LOCKTIME:
+		return sizeof(struct rel_locktime);
+	case LOG_ABS_LOCKTIME:
+		return sizeof(struct abs_locktime);
+	case LOG_HTLC:
+		return sizeof(struct log_htlc);
+	case LOG_RVAL:
+		return sizeof(struct rval);
+	case LOG_CHANNEL_STATE:
+		return sizeof(struct channel_state);
+	case LOG_CHANNEL_ONESIDE:
+		return sizeof(struct channel_oneside);
+	case LOG_BITCOIN_TX:
+		/* Variable: we linearize it first. */
+		break;
 	}
+	abort();
+}
 
-	return s;
+/* Just enough to print it later: keys are kept as raw DER. */
+static void snapshot_struct(struct log_record *lr, u8 *p, size_t len,
+			    enum log_struct type, union loggable_structs u)
+{
+	switch (type) {
+	case LOG_PUBKEY:
+		pubkey_to_der(lr->dstate->secpctx, p, u.pubkey);
+		return;
+	case LOG_HTLC: {
+		struct log_htlc lh;
+
+		memset(&lh, 0, sizeof(lh));
+		lh.id = u.htlc->id;
+		lh.msatoshi = u.htlc->msatoshi;
+		lh.expiry = u.htlc->expiry;
+		lh.rhash = u.htlc->rhash;
+		lh.have_r = (u.htlc->r != NULL);
+		if (lh.have_r)
+			lh.r = *u.htlc->r;
+		lh.have_src = (u.htlc->src != NULL);
+		if (lh.have_src)
+			pubkey_to_der(lr->dstate->secpctx, lh.src,
+				      u.htlc->src->peer->id);
+		memcpy(p, &lh, sizeof(lh));
+		return;
+	}
+	default:
+		memcpy(p, u.charp_, len);
+		return;
+	}
 }
 
 void log_struct_(struct log *log, int level,
 		 const char *structname,
 		 const char *fmt, ...)
 {
-	tal_t *ctx = tal(log, char);
-	char *s;
 	union loggable_structs u;
+	struct log_hdr *h;
+	size_t type, len;
+	u8 *lin = NULL;
 	va_list ap;
 
+	if (!log_enabled(log, level))
+		return;
+
 	/* Macro wrappers ensure we only have one arg. */
 	va_start(ap, fmt);
 	u.charp_ = va_arg(ap, const char *);
 	va_end(ap);
 
 	/* GCC checks we're one of these, so we should be. */
-	s = to_string_(ctx, log->lr, structname, u);
-	if (!s)
+	for (type = 0; type < ARRAY_SIZE(log_structs); type++)
+		if (streq(structname, log_structs[type]))
+			break;
+	if (type == ARRAY_SIZE(log_structs))
 		fatal("Logging unknown type %s", structname);
 
-	if (level == -1)
-		log_add(log, fmt, s);
-	else
-		log_(log, level, fmt, s);
-
-	tal_free(ctx);
+	if (type == LOG_BITCOIN_TX) {
+		lin = linearize_tx(log, u.bitcoin_tx);
+		len = tal_count(lin);
+	} else
+		len = struct_len(type);
+
+	h = new_bytes_record(log, level, LOG_KIND_STRUCT, fmt, &len);
+	h->arg = type;
+	if (lin) {
+		memcpy(record_bytes(h), lin, len);
+		tal_free(lin);
+	} else
+		snapshot_struct(log->lr, record_bytes(h), len, type, u);
+	maybe_print(log, h);
 }
 
 void log_blob_(struct log *log, enum log_level level, const char *fmt,
@@ -386,87 +1012,96 @@ void log_blob_(struct log *log, enum log_level level, const char *fmt,
 {
 	va_list ap;
 	const void *blob;
-	const char *hex;
+	struct log_hdr *h;
+
+	if (!log_enabled(log, level))
+		return;
 
 	/* Macro wrappers ensure we only have one arg. */
 	va_start(ap, len);
 	blob = va_arg(ap, void *);
 	va_end(ap);
 
-	hex = tal_hexstr(log, blob, len);
-	if (level == -1)
-		log_add(log, fmt, hex);
-	else
-		log_(log, level, fmt, hex);
-	tal_free(hex);
+	h = new_bytes_record(log, level, LOG_KIND_BLOB, fmt, &len);
+	memcpy(record_bytes(h), blob, len);
+	maybe_print(log, h);
 }
 
-void log_each_line_(const struct log_record *lr,
-		    void (*func)(unsigned int skipped,
-				 struct timerel time,
-				 enum log_level level,
-				 const char *prefix,
-				 const char *log,
-				 void *arg),
-		    void *arg)
+/* Returns the first record of the next line, and sets *end past any
+ * records log_add appended to it. */
+static const struct log_hdr *next_line(const struct log_record *lr,
+				       u64 pos, u64 *end)
 {
-	const struct log_entry *i;
+	const struct log_hdr *h;
 
-	list_for_each(&lr->log, i, list) {
-		func(i->skipped, time_between(i->time, lr->init_time),
-		     i->level, i->prefix, i->log, arg);
+	do {
+		if (pos == lr->tail)
+			return NULL;
+		h = hdr_at(lr, pos);
+		pos += h->len;
+	} while (h->kind == LOG_KIND_PAD);
+
+	*end = pos;
+	if (h->kind == LOG_KIND_IO)
+		return h;
+
+	while (pos != lr->tail) {
+		const struct log_hdr *next = hdr_at(lr, pos);
+
+		if (next->kind != LOG_KIND_PAD && !next->continued)
+			break;
+		pos += next->len;
+		if (next->kind != LOG_KIND_PAD)
+			*end = pos;
 	}
+	return h;
 }
 
-struct log_data {
-	int fd;
-	const char *prefix;
-};
-
-static void log_one_line(unsigned int skipped,
-			 struct timerel diff,
-			 enum log_level level,
-			 const char *prefix,
-			 const char *log,
-			 struct log_data *data)
+static void format_line(struct log_out *o, const struct log_record *lr,
+			u64 pos, u64 end)
 {
-	char buf[101];
+	while (pos != end) {
+		const struct log_hdr *h = hdr_at(lr, pos);
 
-	if (skipped) {
-		sprintf(buf, "%s... %u skipped...", data->prefix, skipped);
-		write_all(data->fd, buf, strlen(buf));
-		data->prefix = "\n";
+		if (h->kind != LOG_KIND_PAD)
+			format_record(o, h);
+		pos += h->len;
 	}
+}
 
-	sprintf(buf, "%s+%lu.%09u %s%s: ",
-		data->prefix,
-		(unsigned long)diff.ts.tv_sec,
-		(unsigned)diff.ts.tv_nsec,
-		prefix,
-		level == LOG_IO ? (log[0] ? "IO-IN" : "IO-OUT")
-		: level == LOG_DBG ? "DEBUG"
-		: level == LOG_INFORM ? "INFO"
-		: level == LOG_UNUSUAL ? "UNUSUAL"
-		: level == LOG_BROKEN ? "BROKEN"
-		: "**INVALID**");
-
-	write_all(data->fd, buf, strlen(buf));
-	if (level == LOG_IO) {
-		size_t off, used, len = tal_count(log)-1;
-
-		/* No allocations, may be in signal handler. */
-		for (off = 0; off < len; off += used) {
-			used = len - off;
-			if (hex_str_size(used) > sizeof(buf))
-				used = hex_data_size(sizeof(buf));
-			hex_encode(log + 1 + off, used, buf, hex_str_size(used));
-			write_all(data->fd, buf, strlen(buf));
+void log_each_line_(const struct log_record *lr,
+		    void (*func)(unsigned int skipped,
+				 struct timerel time,
+				 enum log_level level,
+				 const char *prefix,
+				 const char *log,
+				 void *arg),
+		    void *arg)
+{
+	const struct log_hdr *h;
+	unsigned int skipped = lr->skipped;
+	u64 pos, end;
+
+	for (pos = lr->head; (h = next_line(lr, pos, &end)) != NULL; pos = end) {
+		struct log_out o;
+
+		/* IO is passed as direction byte then raw data. */
+		if (h->kind == LOG_KIND_IO) {
+			u32 len;
+
+			memcpy(&len, h + 1, sizeof(len));
+			o.str = tal_arr(lr, char, 1 + len);
+			o.str[0] = h->arg;
+			memcpy(o.str + 1, record_bytes(h), len);
+		} else {
+			o.str = tal_arrz(lr, char, 1);
+			format_line(&o, lr, pos, end);
 		}
-	} else {
-		write_all(data->fd, log, strlen(log));
+		func(skipped, time_from_nsec(h->nsec), h->level, h->prefix,
+		     o.str, arg);
+		skipped = 0;
+		tal_free(o.str);
 	}
-
-	data->prefix = "\n";
 }
 
 static struct {
@@ -480,17 +1115,50 @@ static struct {
 	{ "BROKEN", LOG_BROKEN }
 };
 
-static char *arg_log_level(const char *arg, struct log *log)
+static bool get_log_level(const char *name, size_t len,
+			  enum log_level *level)
 {
 	size_t i;
 
 	for (i = 0; i < ARRAY_SIZE(log_levels); i++) {
-		if (strcasecmp(arg, log_levels[i].name) == 0) {
-			set_log_level(log->lr, log_levels[i].level);
-			return NULL;
+		if (strlen(log_levels[i].name) == len
+		    && strncasecmp(name, log_levels[i].name, len) == 0) {
+			*level = log_levels[i].level;
+			return true;
 		}
 	}
-	return tal_fmt(NULL, "unknown log level");
+	return false;
+}
+
+static char *arg_log_level(const char *arg, struct log *log)
+{
+	enum log_level level;
+
+	if (!get_log_level(arg, strlen(arg), &level))
+		return tal_fmt(NULL, "unknown log level");
+	set_log_level(log->lr, level);
+	return NULL;
+}
+
+static char *arg_log_record_level(const char *arg, struct log *log)
+{
+	enum log_level level;
+
+	if (!get_log_level(arg, strlen(arg), &level))
+		return tal_fmt(NULL, "unknown log level");
+	set_log_record_level(log->lr, level);
+	return NULL;
+}
+
+static char *arg_log_level_for(const char *arg, struct log *log)
+{
+	const char *colon = strchr(arg, ':');
+	enum log_level level;
+
+	if (!colon || !get_log_level(arg, colon - arg, &level))
+		return tal_fmt(NULL, "expected <level>:<prefix>");
+	set_log_level_for(log->lr, colon + 1, level);
+	return NULL;
 }
 
 static char *arg_log_prefix(const char *arg, struct log *log)
@@ -525,6 +1193,12 @@ void opt_register_logging(struct log *log)
 {
 	opt_register_arg("--log-level", arg_log_level, NULL, log,
 			 "log level (debug, info, unusual, broken)");
+	opt_register_arg("--log-record-level", arg_log_record_level, NULL, log,
+			 "keep in memory from this level (io, debug, info, ...):"
+			 " default debug, so getlog io needs io");
+	opt_register_arg("--log-level-for=<level>:<prefix>",
+			 arg_log_level_for, NULL, log,
+			 "keep from <level> for logs with <prefix> in theirs");
 	opt_register_arg("--log-prefix", arg_log_prefix, NULL, log,
 			 "log prefix");
 	opt_register_arg("--log-file=<file>", arg_log_to_file, NULL, log,
@@ -584,27 +1258,62 @@ void crashlog_activate(struct log *log)
 	sigaction(SIGBUS, &sa, NULL);
 }
 
+static const char *level_name(const struct log_hdr *h)
+{
+	return h->level == LOG_IO ? (h->arg ? "IO-IN" : "IO-OUT")
+		: h->level == LOG_DBG ? "DEBUG"
+		: h->level == LOG_INFORM ? "INFO"
+		: h->level == LOG_UNUSUAL ? "UNUSUAL"
+		: h->level == LOG_BROKEN ? "BROKEN"
+		: "**INVALID**";
+}
+
+/* No allocations, may be in signal handler. */
 void log_dump_to_file(int fd, const struct log_record *lr)
 {
-	const struct log_entry *i;
+	const struct log_hdr *h;
+	struct log_out o;
 	char buf[100];
-	struct log_data data;
+	const char *prefix;
 	time_t start;
+	u64 pos, end;
 
-	i = list_top(&lr->log, const struct log_entry, list);
-	if (!i) {
+	if (lr->head == lr->tail) {
 		write_all(fd, "0 bytes:\n\n", strlen("0 bytes:\n\n"));
 		return;
 	}
 
 	start = lr->init_time.ts.tv_sec;
-	sprintf(buf, "%zu bytes, %s", lr->mem_used, ctime(&start));
+	sprintf(buf, "%zu bytes, %s", log_used(lr), ctime(&start));
 	write_all(fd, buf, strlen(buf));
 
 	/* ctime includes \n... WTF? */
-	data.prefix = "";
-	data.fd = fd;
-	log_each_line(lr, log_one_line, &data);
+	prefix = "";
+	if (lr->skipped) {
+		sprintf(buf, "... %u skipped...", lr->skipped);
+		write_all(fd, buf, strlen(buf));
+		prefix = "\n";
+	}
+
+	o.str = NULL;
+	o.fd = fd;
+	for (pos = lr->head; (h = next_line(lr, pos, &end)) != NULL; pos = end) {
+		struct timerel diff = time_from_nsec(h->nsec);
+
+		write_all(fd, prefix, strlen(prefix));
+		out_fmt(&o, "+%lu.%09u %s%s: ",
+			(unsigned long)diff.ts.tv_sec,
+			(unsigned)diff.ts.tv_nsec,
+			h->prefix, level_name(h));
+		if (h->kind == LOG_KIND_IO) {
+			u32 len;
+
+			memcpy(&len, h + 1, sizeof(len));
+			out_hex(&o, record_bytes(h), len);
+		} else
+			format_line(&o, lr, pos, end);
+		prefix = "\n";
+	}
 	write_all(fd, "\n\n", strlen("\n\n"));
 }
 
@@ -21,7 +21,7 @@ enum log_level {
 	LOG_BROKEN
 };
 
-/* We have a single record. */
+/* We have a single record: a ring buffer of max_mem bytes. */
 struct log_record *new_log_record(struct lightningd_state *dstate,
 				  size_t max_mem,
 				  enum log_level printlevel);
@@ -30,40 +30,89 @@ struct log_record *new_log_record(struct lightningd_state *dstate,
 struct log *PRINTF_FMT(3,4)
 new_log(const tal_t *ctx, struct log_record *record, const char *fmt, ...);
 
-#define log_debug(log, ...) log_((log), LOG_DBG, __VA_ARGS__)
-#define log_info(log, ...) log_((log), LOG_INFORM, __VA_ARGS__)
-#define log_unusual(log, ...) log_((log), LOG_UNUSUAL, __VA_ARGS__)
-#define log_broken(log, ...) log_((log), LOG_BROKEN, __VA_ARGS__)
+/* Build with -DLOG_COMPILE_LEVEL=LOG_INFORM to compile out debug logging. */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_IO
+#endif
+
+/* Is this level kept (or printed) for this log?  -1 asks whether the entry
+ * log_add would append to was. */
+bool log_enabled(struct log *log, int level);
+
+/* A compiled-out entry is never kept, so log_add mustn't append to the
+ * one before it.  Returns false. */
+bool log_compiled_out(struct log *log);
+
+/* The macros below only evaluate their arguments if it's worth it: below
+ * LOG_COMPILE_LEVEL that's decided at compile time. */
+#define log_wanted_(lg, level)						\
+	((level) == -1 || (level) >= LOG_COMPILE_LEVEL			\
+	 ? log_enabled((lg), (level)) : log_compiled_out(lg))
+
+#define log_gated_(lg, level, ...)					\
+	do {								\
+		struct log *l_ = (lg);					\
+		if (log_wanted_(l_, (level)))				\
+			log_(l_, (level), __VA_ARGS__);			\
+	} while (0)
+
+#define log_debug(log, ...) log_gated_((log), LOG_DBG, __VA_ARGS__)
+#define log_info(log, ...) log_gated_((log), LOG_INFORM, __VA_ARGS__)
+#define log_unusual(log, ...) log_gated_((log), LOG_UNUSUAL, __VA_ARGS__)
+#define log_broken(log, ...) log_gated_((log), LOG_BROKEN, __VA_ARGS__)
+
+#define log_add(lg, ...)						\
+	do {								\
+		struct log *l_ = (lg);					\
+		if (log_wanted_(l_, -1))				\
+			log_add_(l_, __VA_ARGS__);			\
+	} while (0)
 
 void log_io(struct log *log, bool in, const void *data, size_t len);
 
+/* fmt is kept, and only used when the entry is printed: it must be a
+ * string literal. */
 void log_(struct log *log, enum log_level level, const char *fmt, ...)
 	PRINTF_FMT(3,4);
-void log_add(struct log *log, const char *fmt, ...) PRINTF_FMT(2,3);
+void log_add_(struct log *log, const char *fmt, ...) PRINTF_FMT(2,3);
 void logv(struct log *log, enum log_level level, const char *fmt, va_list ap);
 
 void log_blob_(struct log *log, enum log_level level, const char *fmt,
 	       size_t len, ...)
 	PRINTF_FMT(3,5);
 
+#define log_blob_gated_(lg, level, fmt, blob, len)			\
+	do {								\
+		struct log *l_ = (lg);					\
+		if (log_wanted_(l_, (level)))				\
+			log_blob_(l_, (level), (fmt), (len),		\
+				  (char *)(blob));			\
+	} while (0)
+
 /* These must have %s where the blob is to go. */
 #define log_add_blob(log, fmt, blob, len)			\
-	log_blob_((log), -1, (fmt), (len), (char *)(blob))
+	log_blob_gated_((log), -1, (fmt), (blob), (len))
 
 #define log_debug_blob(log, fmt, blob, len)			\
-	log_blob_((log), LOG_DBG, (fmt), (len), (char *)(blob))
+	log_blob_gated_((log), LOG_DBG, (fmt), (blob), (len))
 #define log_info_blob(log, fmt, blob, len)				\
-	log_blob_((log), LOG_INFORM, (fmt), (len), (char *)(blob))
+	log_blob_gated_((log), LOG_INFORM, (fmt), (blob), (len))
 #define log_unusual_blob(log, fmt, blob, len)				\
-	log_blob_((log), LOG_UNUSUAL, (fmt), (len), (char *)(blob))
+	log_blob_gated_((log), LOG_UNUSUAL, (fmt), (blob), (len))
 #define log_broken_blob(log, fmt, blob, len)				\
-	log_blob_((log), LOG_BROKEN, (fmt), (len), (char *)(blob))
+	log_blob_gated_((log), LOG_BROKEN, (fmt), (blob), (len))
 
 /* Makes sure ptr is a 'structtype', makes sure it's in loggable_structs. */
-#define log_struct_check_(log, loglevel, fmt, structtype, ptr)		\
-	log_struct_((log), (loglevel), stringify(structtype), (fmt), 	\
-		    ((void)sizeof((ptr) == (structtype *)NULL),		\
-		     ((union loggable_structs)((const structtype *)ptr)).charp_))
+#define log_struct_check_(lg, loglevel, fmt, structtype, ptr)		\
+	do {								\
+		struct log *l_ = (lg);					\
+		if (log_wanted_(l_, (loglevel)))			\
+			log_struct_(l_, (loglevel), stringify(structtype), \
+				    (fmt),				\
+				    ((void)sizeof((ptr) == (structtype *)NULL), \
+				     ((union loggable_structs)		\
+				      ((const structtype *)ptr)).charp_)); \
+	} while (0)
 
 /* These must have %s where the struct is to go. */
 #define log_add_struct(log, fmt, structtype, ptr)			\
@@ -97,7 +146,13 @@ void PRINTF_FMT(4,5) log_struct_(struct log *log, int level,
 				 const char *structname,
 				 const char *fmt, ...);
 
+/* Print entries at this level or above. */
 void set_log_level(struct log_record *lr, enum log_level level);
+/* Keep entries at this level or above (default LOG_DBG, so no IO). */
+void set_log_record_level(struct log_record *lr, enum log_level level);
+/* Logs named after this, with prefix in their prefix, keep this level. */
+void set_log_level_for(struct log_record *lr, const char *prefix,
+		       enum log_level level);
 void set_log_prefix(struct log *log, const char *prefix);
 const char *log_prefix(const struct log *log);
 #define set_log_outfn(lr, print, arg)					\
@@ -1,6 +1,7 @@
 #ifndef LIGHTNING_DAEMON_NETADDR_H
 #define LIGHTNING_DAEMON_NETADDR_H
 #include "config.h"
+#include <ccan/short_types/short_types.h>
 #include <ccan/tal/tal.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -29,6 +30,6 @@ void netaddr_to_addrinfo(struct addrinfo *ai, const struct netaddr *a);
 bool netaddr_from_fd(int fd, int type, int protocol, struct netaddr *a);
 
 bool netaddr_from_blob(const void *linear, size_t len, struct netaddr *a);
-char *netaddr_to_hex(const tal_t *ctx, const struct netaddr *a);
+u8 *netaddr_to_blob(const tal_t *ctx, const struct netaddr *a);
 
 #endif /* LIGHTNING_DAEMON_NETADDR_H */
@@ -1,16 +1,42 @@
 #include "commit_tx.h"
 #include "output_to_htlc.h"
 #include "peer.h"
+#include <ccan/crypto/siphash24/siphash24.h>
+#include <ccan/htable/htable_type.h>
+#include <ccan/structeq/structeq.h>
 
-/* FIXME: Array makes this O(n^2).  Use a hash table. */
 struct wscript_by_wpkh {
 	struct htlc *h;
 	const u8 *wscript;
 	struct sha256 hash;
 };
 
+static const struct sha256 *wpkh_key(const struct wscript_by_wpkh *wpkh)
+{
+	return &wpkh->hash;
+}
+
+static bool wpkh_cmp(const struct wscript_by_wpkh *wpkh,
+		     const struct sha256 *hash)
+{
+	return structeq(&wpkh->hash, hash);
+}
+
+static size_t wpkh_hash(const struct sha256 *hash)
+{
+	return siphash24(siphash_seed(), hash, sizeof(*hash));
+}
+HTABLE_DEFINE_TYPE(struct wscript_by_wpkh, wpkh_key, wpkh_hash, wpkh_cmp,
+		   wpkh_map);
+
 struct htlc_output_map {
-	struct wscript_by_wpkh *wpkh;
+	const struct peer *peer;
+	struct sha256 rhash;
+	enum side side;
+	/* Only HTLCs with this flag can be in the tx. */
+	int flag;
+	/* NULL until the first lookup. */
+	struct wpkh_map *wpkh;
 };
 
 struct htlc_output_map *get_htlc_output_map(const tal_t *ctx,
@@ -19,49 +45,74 @@ struct htlc_output_map *get_htlc_output_map(const tal_t *ctx,
 					    enum side side,
 					    unsigned int commit_num)
 {
-	struct htlc_map_iter it;
-	struct htlc *h;
-	size_t i;
 	struct htlc_output_map *omap = tal(ctx, struct htlc_output_map);
+	u64 current;
 
-	/* FIXME: use commit_num to filter htlcs. */
 	if (side == LOCAL)
-		assert(commit_num <= peer->local.commit->commit_num);
+		current = peer->local.commit->commit_num;
 	else
-		assert(commit_num <= peer->remote.commit->commit_num);
+		current = peer->remote.commit->commit_num;
+	assert(commit_num <= current);
+
+	/* We don't know exactly which HTLCs were in older commits: only
+	 * that they were in one at some point. */
+	if (commit_num == current)
+		omap->flag = HTLC_FLAG(side, HTLC_F_COMMITTED);
+	else
+		omap->flag = HTLC_FLAG(side, HTLC_F_WAS_COMMITTED);
+
+	omap->peer = peer;
+	omap->rhash = *rhash;
+	omap->side = side;
+	omap->wpkh = NULL;
+	return omap;
+}
+
+static void destroy_wpkh_map(struct wpkh_map *wpkh)
+{
+	wpkh_map_clear(wpkh);
+}
+
+/* Generate the wscript hashes for every HTLC which could be there. */
+static void build_wpkh_map(struct htlc_output_map *omap)
+{
+	struct htlc_map_iter it;
+	struct htlc *h;
 
-	omap->wpkh = tal_arr(omap, struct wscript_by_wpkh,
-			     htlc_map_count(&peer->htlcs));
+	omap->wpkh = tal(omap, struct wpkh_map);
+	wpkh_map_init(omap->wpkh);
+	tal_add_destructor(omap->wpkh, destroy_wpkh_map);
 
-	for (i = 0, h = htlc_map_first(&peer->htlcs, &it);
+	for (h = htlc_map_first(&omap->peer->htlcs, &it);
 	     h;
-	     h = htlc_map_next(&peer->htlcs, &it)) {
-		omap->wpkh[i].h = h;
-		omap->wpkh[i].wscript = wscript_for_htlc(omap, peer, h, rhash,
-							 side);
-		sha256(&omap->wpkh[i].hash,
-		       omap->wpkh[i].wscript,
-		       tal_count(omap->wpkh[i].wscript));
-		i++;
+	     h = htlc_map_next(&omap->peer->htlcs, &it)) {
+		struct wscript_by_wpkh *wpkh;
+
+		if (!htlc_has(h, omap->flag))
+			continue;
+
+		wpkh = tal(omap->wpkh, struct wscript_by_wpkh);
+		wpkh->h = h;
+		wpkh->wscript = wscript_for_htlc(omap, omap->peer, h,
+						 &omap->rhash, omap->side);
+		sha256(&wpkh->hash, wpkh->wscript, tal_count(wpkh->wscript));
+		wpkh_map_add(omap->wpkh, wpkh);
 	}
-	tal_resize(&omap->wpkh, i);
-	return omap;
 }
 
 static struct wscript_by_wpkh *get_wpkh(struct htlc_output_map *omap,
 					const u8 *script, size_t script_len)
 {
-	size_t i;
+	struct sha256 hash;
 
 	if (!is_p2wsh(script, script_len))
 		return NULL;
 
-	for (i = 0; i < tal_count(omap->wpkh); i++) {
-		if (!memcmp(script + 2, omap->wpkh[i].hash.u.u8,
-			    sizeof(omap->wpkh[i].hash)))
-			return &omap->wpkh[i];
-	}
-	return NULL;
+	if (!omap->wpkh)
+		build_wpkh_map(omap);
+
+	memcpy(&hash, script + 2, sizeof(hash));
+	return wpkh_map_get(omap->wpkh, &hash);
 }
 
 /* Which wscript does this pay to? */
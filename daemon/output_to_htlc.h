@@ -6,7 +6,8 @@
 struct peer;
 struct sha256;
 
-/* Get a map of HTLCs (including at least those at the given commit_num). */
+/* Get a map of HTLCs (including at least those at the given commit_num).
+ * Their scripts are only generated when first needed. */
 struct htlc_output_map *get_htlc_output_map(const tal_t *ctx,
 					    const struct peer *peer,
 					    const struct sha256 *rhash,
@@ -5,6 +5,7 @@
 #include "commit_tx.h"
 #include "controlled_time.h"
 #include "cryptopkt.h"
+#include "db.h"
 #include "htlc.h"
 #include "lightningd.h"
 #include "log.h"
@@ -56,9 +57,7 @@ static Pkt *make_pkt(const tal_t *ctx, Pkt__PktCase type, const void *msg)
 
 static void queue_raw_pkt(struct peer *peer, Pkt *pkt)
 {
-	size_t n = tal_count(peer->outpkt);
-	tal_resize(&peer->outpkt, n+1);
-	peer->outpkt[n] = pkt;
+	queue_outpkt(peer, pkt);
 
 	log_debug(peer->log, "Queued pkt %s (order=%"PRIu64")",
 		  pkt_name(pkt->pkt_case), peer->order_counter);
@@ -203,6 +202,8 @@ void queue_pkt_commit(struct peer *peer, const struct bitcoin_signature *sig)
 	else
 		u->sig = NULL;
 
+	/* They can act on this, so it must survive us crashing. */
+	db_hold_output(peer);
 	queue_pkt(peer, PKT__PKT_UPDATE_COMMIT, u);
 }
 
@@ -219,6 +220,7 @@ void queue_pkt_revocation(struct peer *peer,
 
 	u->revocation_preimage = sha256_to_proto(u, preimage);
 	u->next_revocation_hash	= sha256_to_proto(u, next_hash);
+	db_hold_output(peer);
 	queue_pkt(peer, PKT__PKT_UPDATE_REVOCATION, u);
 }
 
@@ -446,7 +446,8 @@ static void json_sendpay(struct command *cmd,
 
 	/* Onion will carry us from first peer onwards. */
 	packet = create_onionpacket(
-		cmd, cmd->dstate->secpctx, ids, hoppayloads,
+		cmd, cmd->dstate->secpctx, cmd->dstate->sphinx_ws,
+		ids, hoppayloads,
 		sessionkey, (u8*)"", 0);
 	onion = serialize_onionpacket(cmd, cmd->dstate->secpctx, packet);
 
@@ -23,6 +23,7 @@
 #include "remove_dust.h"
 #include "routing.h"
 #include "secrets.h"
+#include "sigverify.h"
 #include "sphinx.h"
 #include "state.h"
 #include "timeout.h"
@@ -33,6 +34,8 @@
 #include <bitcoin/tx.h>
 #include <ccan/array_size/array_size.h>
 #include <ccan/cast/cast.h>
+#include <ccan/crypto/siphash24/siphash24.h>
+#include <ccan/htable/htable_type.h>
 #include <ccan/io/io.h>
 #include <ccan/list/list.h>
 #include <ccan/mem/mem.h>
@@ -189,28 +192,75 @@ static u64 commit_tx_fee(const struct bitcoin_tx *commit, u64 anchor_satoshis)
 	return anchor_satoshis - total;
 }
 
-struct peer *find_peer(struct lightningd_state *dstate, const struct pubkey *id)
+static const struct pubkey *keyof_peer_id(const struct peer *peer)
 {
-	struct peer *peer;
+	return peer->id;
+}
 
-	list_for_each(&dstate->peers, peer, list) {
-		if (peer->id && pubkey_eq(peer->id, id))
-			return peer;
-	}
-	return NULL;
+/* Like node_map, hash the whole unpacked key. */
+static size_t hash_peer_id(const struct pubkey *id)
+{
+	return siphash24(siphash_seed(), &id->pubkey, sizeof(id->pubkey));
 }
 
-struct peer *find_peer_by_pkhash(struct lightningd_state *dstate, const u8 *pkhash)
+static bool peer_id_eq(const struct peer *peer, const struct pubkey *id)
 {
-	struct peer *peer;
-	u8 addr[20];
+	return pubkey_eq(peer->id, id);
+}
 
-	list_for_each(&dstate->peers, peer, list) {
-		pubkey_hash160(dstate->secpctx, addr, peer->id);
-		if (memcmp(addr, pkhash, sizeof(addr)) == 0)
-			return peer;
-	}
-	return NULL;
+HTABLE_DEFINE_TYPE(struct peer, keyof_peer_id, hash_peer_id, peer_id_eq,
+		   peer_id_map);
+
+static const u8 *keyof_peer_pkhash(const struct peer *peer)
+{
+	return peer->pkhash;
+}
+
+static size_t hash_peer_pkhash(const u8 *pkhash)
+{
+	/* It's a hash160. */
+	return siphash24(siphash_seed(), pkhash, 20);
+}
+
+static bool peer_pkhash_eq(const struct peer *peer, const u8 *pkhash)
+{
+	return memcmp(peer->pkhash, pkhash, sizeof(peer->pkhash)) == 0;
+}
+
+HTABLE_DEFINE_TYPE(struct peer, keyof_peer_pkhash, hash_peer_pkhash,
+		   peer_pkhash_eq, peer_pkhash_map);
+
+struct peer_id_map *empty_peer_id_map(struct lightningd_state *dstate)
+{
+	struct peer_id_map *map = tal(dstate, struct peer_id_map);
+	peer_id_map_init(map);
+	return map;
+}
+
+struct peer_pkhash_map *empty_peer_pkhash_map(struct lightningd_state *dstate)
+{
+	struct peer_pkhash_map *map = tal(dstate, struct peer_pkhash_map);
+	peer_pkhash_map_init(map);
+	return map;
+}
+
+void peer_set_id(struct peer *peer, const struct pubkey *id)
+{
+	assert(!peer->id);
+	peer->id = tal_dup(peer, struct pubkey, id);
+	pubkey_hash160(peer->dstate->secpctx, peer->pkhash, peer->id);
+	peer_id_map_add(peer->dstate->peers_by_id, peer);
+	peer_pkhash_map_add(peer->dstate->peers_by_pkhash, peer);
+}
+
+struct peer *find_peer(struct lightningd_state *dstate, const struct pubkey *id)
+{
+	return peer_id_map_get(dstate->peers_by_id, id);
+}
+
+struct peer *find_peer_by_pkhash(struct lightningd_state *dstate, const u8 *pkhash)
+{
+	return peer_pkhash_map_get(dstate->peers_by_pkhash, pkhash);
 }
 
 void debug_dump_peers(struct lightningd_state *dstate)
@@ -841,6 +891,30 @@ static const char *changestates(struct peer *peer,
 	return NULL;
 }
 
+/* Is sig their signature of tx?  If we checked it off the io_loop before
+ * processing this packet, and the tx is the one we predicted, that answer
+ * stands. */
+static bool check_their_sig(const struct peer *peer,
+			    const struct bitcoin_tx *tx,
+			    const struct bitcoin_signature *sig)
+{
+	struct sha256_double digest;
+
+	/* We only use SIGHASH_ALL for the moment. */
+	if (sig->stype != SIGHASH_ALL)
+		return false;
+
+	sha256_tx_for_sig(&digest, tx, 0, SIGHASH_ALL,
+			  peer->anchor.witnessscript);
+	if (peer->sigcheck.done
+	    && structeq(&digest, &peer->sigcheck.digest)
+	    && structeq(&sig->sig, &peer->sigcheck.sig))
+		return peer->sigcheck.ok;
+
+	return check_signed_hash(peer->dstate->secpctx, &digest, &sig->sig,
+				 &peer->remote.commitkey);
+}
+
 /* This is the io loop while we're negotiating closing tx. */
 static bool closing_pkt_in(struct peer *peer, const Pkt *pkt)
 {
@@ -899,10 +973,7 @@ static bool closing_pkt_in(struct peer *peer, const Pkt *pkt)
 				      pkt_err(peer, "Invalid signature format"));
 
 	close_tx = peer_create_close_tx(peer, c->close_fee);
-	if (!check_tx_sig(peer->dstate->secpctx, close_tx, 0,
-			  NULL, 0,
-			  peer->anchor.witnessscript,
-			  &peer->remote.commitkey, &theirsig))
+	if (!close_tx || !check_their_sig(peer, close_tx, &theirsig))
 		return peer_comms_err(peer,
 				      pkt_err(peer, "Invalid signature"));
 
@@ -966,6 +1037,82 @@ static bool closing_pkt_in(struct peer *peer, const Pkt *pkt)
 	return true;
 }
 
+static const struct htlcs_table commit_changes[] = {
+	{ RCVD_ADD_REVOCATION, RCVD_ADD_ACK_COMMIT },
+	{ RCVD_REMOVE_HTLC, RCVD_REMOVE_COMMIT },
+	{ RCVD_ADD_HTLC, RCVD_ADD_COMMIT },
+	{ RCVD_REMOVE_REVOCATION, RCVD_REMOVE_ACK_COMMIT }
+};
+
+/* The commit handle_pkt_commit switches to, given cstate. */
+static struct commit_info *new_local_commit(struct peer *peer,
+					    const struct channel_state *cstate)
+{
+	struct commit_info *ci;
+	bool to_them_only;
+
+	ci = new_commit_info(peer, peer->local.commit->commit_num + 1);
+	ci->revocation_hash = peer->local.next_revocation_hash;
+	ci->cstate = copy_cstate(ci, cstate);
+	ci->tx = create_commit_tx(ci, peer, &ci->revocation_hash,
+				  ci->cstate, LOCAL, &to_them_only);
+	bitcoin_txid(ci->tx, &ci->txid);
+
+	/* BOLT #2:
+	 *
+	 * If the commitment transaction has only a single output which pays
+	 * to the other node, `sig` MUST be unset.  Otherwise, a sending node
+	 * MUST apply all remote acked and unacked changes except unacked fee
+	 * changes to the remote commitment before generating `sig`.
+	 */
+	if (!to_them_only)
+		ci->sig = tal(ci, struct bitcoin_signature);
+	return ci;
+}
+
+/* The commit handle_pkt_commit would switch to if update_commit arrived
+ * now, without changing anything.  NULL if it would fail. */
+static struct commit_info *predict_local_commit(struct peer *peer)
+{
+	struct channel_state *cstate;
+	struct htlc **changed = tal_arr(peer, struct htlc *, 0);
+	enum htlc_state *oldstate = tal_arr(changed, enum htlc_state, 0);
+	struct htlc_map_iter it;
+	struct htlc *h;
+	struct commit_info *ci = NULL;
+	size_t i, n = 0;
+
+	/* Fee changes only move the remote side here, so we can ignore
+	 * commit_feechanges. */
+	cstate = copy_cstate(changed, peer->local.staging_cstate);
+	for (h = htlc_map_first(&peer->htlcs, &it);
+	     h;
+	     h = htlc_map_next(&peer->htlcs, &it)) {
+		for (i = 0; i < ARRAY_SIZE(commit_changes); i++) {
+			if (h->state != commit_changes[i].from)
+				continue;
+			if (!adjust_cstate_side(cstate, h,
+						commit_changes[i].from,
+						commit_changes[i].to, LOCAL))
+				goto restore;
+			h->state = commit_changes[i].to;
+			tal_resize(&changed, n + 1);
+			tal_resize(&oldstate, n + 1);
+			changed[n] = h;
+			oldstate[n++] = commit_changes[i].from;
+			break;
+		}
+	}
+
+	ci = new_local_commit(peer, cstate);
+
+restore:
+	for (i = 0; i < n; i++)
+		changed[i]->state = oldstate[i];
+	tal_free(changed);
+	return ci;
+}
+
 /* We can get update_commit in both normal and shutdown states. */
 static Pkt *handle_pkt_commit(struct peer *peer, const Pkt *pkt)
 {
@@ -975,12 +1122,6 @@ static Pkt *handle_pkt_commit(struct peer *peer, const Pkt *pkt)
 	struct commit_info *ci;
 	bool to_them_only;
 	/* FIXME: We can actually merge these two... */
-	static const struct htlcs_table commit_changes[] = {
-		{ RCVD_ADD_REVOCATION, RCVD_ADD_ACK_COMMIT },
-		{ RCVD_REMOVE_HTLC, RCVD_REMOVE_COMMIT },
-		{ RCVD_ADD_HTLC, RCVD_ADD_COMMIT },
-		{ RCVD_REMOVE_REVOCATION, RCVD_REMOVE_ACK_COMMIT }
-	};
 	static const struct feechanges_table commit_feechanges[] = {
 		{ RCVD_FEECHANGE_REVOCATION, RCVD_FEECHANGE_ACK_COMMIT },
 		{ RCVD_FEECHANGE, RCVD_FEECHANGE_COMMIT }
@@ -996,7 +1137,9 @@ static Pkt *handle_pkt_commit(struct peer *peer, const Pkt *pkt)
 		{ RCVD_FEECHANGE_COMMIT, SENT_FEECHANGE_REVOCATION }
 	};
 
-	ci = new_commit_info(peer, peer->local.commit->commit_num + 1);
+	/* If pkt_in had its sig checked, this is the commit it built. */
+	ci = peer->sigcheck.ci;
+	peer->sigcheck.ci = NULL;
 
 	db_start_transaction(peer);
 	
@@ -1010,12 +1153,20 @@ static Pkt *handle_pkt_commit(struct peer *peer, const Pkt *pkt)
 			      commit_feechanges, ARRAY_SIZE(commit_feechanges),
 			      true);
 	if (errmsg) {
+		tal_free(ci);
 		db_abort_transaction(peer);
 		return pkt_err(peer, "%s", errmsg);
 	}
 
-	/* Create new commit info for this commit tx. */
-	ci->revocation_hash = peer->local.next_revocation_hash;
+	/* Should never happen, since input waited for the check. */
+	if (ci && (ci->commit_num != peer->local.commit->commit_num + 1
+		   || !structeq(&ci->revocation_hash,
+				&peer->local.next_revocation_hash)
+		   || !structeq(ci->cstate, peer->local.staging_cstate))) {
+		log_broken(peer->log, "Predicted commit %"PRIu64" is stale",
+			   ci->commit_num);
+		ci = tal_free(ci);
+	}
 
 	/* BOLT #2:
 	 *
@@ -1023,25 +1174,14 @@ static Pkt *handle_pkt_commit(struct peer *peer, const Pkt *pkt)
 	 * changes except unacked fee changes to the local commitment
 	 */
 	/* (We already applied them to staging_cstate as we went) */
-	ci->cstate = copy_cstate(ci, peer->local.staging_cstate);
-	ci->tx = create_commit_tx(ci, peer, &ci->revocation_hash,
-				  ci->cstate, LOCAL, &to_them_only);
-	bitcoin_txid(ci->tx, &ci->txid);
+	if (!ci)
+		ci = new_local_commit(peer, peer->local.staging_cstate);
+	to_them_only = !ci->sig;
 
 	log_debug(peer->log, "Check tx %"PRIu64" sig", ci->commit_num);
 	log_add_struct(peer->log, " for %s", struct channel_state, ci->cstate);
 	log_add_struct(peer->log, " (txid %s)", struct sha256_double, &ci->txid);
 
-	/* BOLT #2:
-	 *
-	 * If the commitment transaction has only a single output which pays
-	 * to the other node, `sig` MUST be unset.  Otherwise, a sending node
-	 * MUST apply all remote acked and unacked changes except unacked fee
-	 * changes to the remote commitment before generating `sig`.
-	 */
-	if (!to_them_only)
-		ci->sig = tal(ci, struct bitcoin_signature);
-
 	err = accept_pkt_commit(peer, pkt, ci->sig);
 	if (err)
 		return err;
@@ -1052,12 +1192,7 @@ static Pkt *handle_pkt_commit(struct peer *peer, const Pkt *pkt)
 	 * except unacked fee changes to the local commitment, then it MUST
 	 * check `sig` is valid for that transaction.
 	 */
-	if (ci->sig && !check_tx_sig(peer->dstate->secpctx,
-				     ci->tx, 0,
-				     NULL, 0,
-				     peer->anchor.witnessscript,
-				     &peer->remote.commitkey,
-				     ci->sig)) {
+	if (ci->sig && !check_their_sig(peer, ci->tx, ci->sig)) {
 		db_abort_transaction(peer);
 		return pkt_err(peer, "Bad signature");
 	}
@@ -1524,7 +1659,7 @@ static void state_single(struct peer *peer,
 {
 	const struct bitcoin_tx *broadcast;
 	enum state newstate;
-	size_t old_outpkts = tal_count(peer->outpkt);
+	size_t old_outpkts = peer->num_outpkt;
 
 	newstate = state(peer, input, pkt, &broadcast);
 	set_peer_state(peer, newstate, input_name(input), false);
@@ -1544,8 +1679,8 @@ static void state_single(struct peer *peer,
 	if (peer_uncommitted_changes(peer))
 		assert(peer->commit_timer);
 	
-	if (tal_count(peer->outpkt) > old_outpkts) {
-		Pkt *outpkt = peer->outpkt[old_outpkts];
+	if (peer->num_outpkt > old_outpkts) {
+		Pkt *outpkt = peek_outpkt(peer, old_outpkts);
 		log_add(peer->log, " (out %s)", pkt_name(outpkt->pkt_case));
 	}
 	if (broadcast)
@@ -1808,10 +1943,7 @@ const char *command_htlc_add(struct peer *peer, u64 msatoshi,
 
 static struct io_plan *pkt_out(struct io_conn *conn, struct peer *peer)
 {
-	Pkt *out;
-	size_t n = tal_count(peer->outpkt);
-
-	if (n == 0) {
+	if (peer->num_outpkt == 0) {
 		/* We close the connection once we've sent everything. */
 		if (!state_can_io(peer->state)) {
 			log_debug(peer->log, "pkt_out: no IO possible, closing");
@@ -1820,28 +1952,98 @@ static struct io_plan *pkt_out(struct io_conn *conn, struct peer *peer)
 		return io_out_wait(conn, peer, pkt_out, peer);
 	}
 
-	if (peer->fake_close || !peer->output_enabled)
+	if (peer->fake_close || !peer->output_enabled
+	    || peer->output_awaiting_db)
 		return io_out_wait(conn, peer, pkt_out, peer);
 
-	out = peer->outpkt[0];
-	memmove(peer->outpkt, peer->outpkt + 1, (sizeof(*peer->outpkt)*(n-1)));
-	tal_resize(&peer->outpkt, n-1);
-	log_debug(peer->log, "pkt_out: writing %s", pkt_name(out->pkt_case));
-	return peer_write_packet(conn, peer, out, pkt_out);
+	/* Encrypt everything queued, then send it in one write. */
+	while (peer->num_outpkt) {
+		Pkt *out = dequeue_outpkt(peer);
+
+		log_debug(peer->log, "pkt_out: writing %s",
+			  pkt_name(out->pkt_case));
+		peer_encrypt_packet(peer, out);
+		tal_free(out);
+	}
+	return peer_write_packets(conn, peer, pkt_out);
 }
 
 static void clear_output_queue(struct peer *peer)
 {
-	size_t i, n = tal_count(peer->outpkt);
-	for (i = 0; i < n; i++)
-		tal_free(peer->outpkt[i]);
-	tal_resize(&peer->outpkt, 0);
+	while (peer->num_outpkt)
+		tal_free(dequeue_outpkt(peer));
+}
+
+static void their_sig_checked(bool ok, struct peer *peer)
+{
+	peer->sigcheck.ok = ok;
+	peer->sigcheck.done = true;
+	io_wake(&peer->sigcheck);
+}
+
+/* If pkt carries a sig over a tx we can predict, start checking it on a
+ * sigverify thread.  Returns true if input should wait for the answer.
+ * For update_commit, the commit we built is left in peer->sigcheck.ci
+ * for handle_pkt_commit. */
+static bool start_sigcheck(struct io_conn *conn, struct peer *peer,
+			   const Pkt *pkt)
+{
+	const Signature *sig;
+	struct commit_info *ci;
+	struct bitcoin_tx *tx;
+
+	if (peer->fake_close || !state_can_io(peer->state))
+		return false;
+
+	if (pkt->pkt_case == PKT__PKT_UPDATE_COMMIT
+	    && (state_is_normal(peer->state) || state_is_shutdown(peer->state))
+	    && pkt->update_commit->sig)
+		sig = pkt->update_commit->sig;
+	else if (pkt->pkt_case == PKT__PKT_CLOSE_SIGNATURE
+		 && peer->state == STATE_MUTUAL_CLOSING)
+		sig = pkt->close_signature->sig;
+	else
+		return false;
+
+	if (!proto_to_signature(peer->dstate->secpctx, sig,
+				&peer->sigcheck.sig))
+		return false;
+
+	if (pkt->pkt_case == PKT__PKT_UPDATE_COMMIT) {
+		ci = predict_local_commit(peer);
+		if (!ci || !ci->sig) {
+			tal_free(ci);
+			return false;
+		}
+		sha256_tx_for_sig(&peer->sigcheck.digest, ci->tx, 0,
+				  SIGHASH_ALL, peer->anchor.witnessscript);
+		tal_free(peer->sigcheck.ci);
+		peer->sigcheck.ci = ci;
+	} else {
+		tx = peer_create_close_tx(peer,
+					  pkt->close_signature->close_fee);
+		if (!tx)
+			return false;
+		sha256_tx_for_sig(&peer->sigcheck.digest, tx, 0,
+				  SIGHASH_ALL, peer->anchor.witnessscript);
+		tal_free(tx);
+	}
+
+	/* If conn dies, so does the callback. */
+	sigverify_check(peer->dstate->sigverify, conn,
+			&peer->sigcheck.digest, &peer->remote.commitkey,
+			&peer->sigcheck.sig, their_sig_checked, peer);
+	return true;
 }
 
 static struct io_plan *pkt_in(struct io_conn *conn, struct peer *peer)
 {
 	bool keep_going;
 
+	/* Check their sig off the io_loop first: other peers carry on. */
+	if (!peer->sigcheck.done && start_sigcheck(conn, peer, peer->inpkt))
+		return io_wait(conn, &peer->sigcheck, pkt_in, peer);
+
 	/* We ignore packets if they tell us to, or we're closing already */
 	if (peer->fake_close || !state_can_io(peer->state))
 		keep_going = true;
@@ -1855,8 +2057,9 @@ static struct io_plan *pkt_in(struct io_conn *conn, struct peer *peer)
 		state_event(peer, peer->inpkt->pkt_case, peer->inpkt);
 		keep_going = true;
 	}
+	peer->sigcheck.done = false;
+	peer->sigcheck.ci = tal_free(peer->sigcheck.ci);
 
-	peer->inpkt = tal_free(peer->inpkt);
 	if (keep_going)
 		return peer_read_packet(conn, peer, pkt_in);
 	else
@@ -2171,6 +2374,7 @@ static u64 peer_revocations_received(struct peer *peer)
 static struct io_plan *peer_send_init(struct io_conn *conn, struct peer *peer)
 {
 	u64 sigs, revokes, shutdown, closing;
+	Pkt *init;
 
 	sigs = peer_commitsigs_received(peer);
 	revokes = peer_revocations_received(peer);
@@ -2189,10 +2393,10 @@ static struct io_plan *peer_send_init(struct io_conn *conn, struct peer *peer)
 	 * previously-processed messages of types `open_commit_sig`,
 	 * `update_commit`, `update_revocation`, `close_shutdown` and
 	 * `close_signature`. */
-	return peer_write_packet(conn, peer,
-				 pkt_init(peer, sigs + revokes
-					  + shutdown + closing),
-				 read_init_pkt);
+	init = pkt_init(peer, sigs + revokes + shutdown + closing);
+	peer_encrypt_packet(peer, init);
+	tal_free(init);
+	return peer_write_packets(conn, peer, read_init_pkt);
 }
 
 /* Crypto is on, we are live. */
@@ -2219,6 +2423,10 @@ static void destroy_peer(struct peer *peer)
 	if (peer->conn)
 		io_close(peer->conn);
 	list_del_from(&peer->dstate->peers, &peer->list);
+	if (peer->id) {
+		peer_id_map_del(peer->dstate->peers_by_id, peer);
+		peer_pkhash_map_del(peer->dstate->peers_by_pkhash, peer);
+	}
 }
 
 static void try_reconnect(struct peer *peer);
@@ -2398,7 +2606,6 @@ static bool peer_reconnected(struct peer *peer,
 
 	peer->io_data = tal_steal(peer, iod);
 
-	/* FIXME: Attach IO logging for this peer. */
 	if (!netaddr_from_fd(io_conn_fd(conn), addr_type, addr_protocol, &addr))
 		return false;
 
@@ -2432,7 +2639,8 @@ struct peer *new_peer(struct lightningd_state *dstate,
 	peer->io_data = NULL;
 	peer->secrets = NULL;
 	list_head_init(&peer->watches);
-	peer->outpkt = tal_arr(peer, Pkt *, 0);
+	peer->outpkt = tal_arr(peer, Pkt *, 8);
+	peer->outpkt_start = peer->num_outpkt = 0;
 	peer->open_jsoncmd = NULL;
 	peer->commit_jsoncmd = NULL;
 	list_head_init(&peer->outgoing_txs);
@@ -2457,6 +2665,9 @@ struct peer *new_peer(struct lightningd_state *dstate,
 	peer->conn = NULL;
 	peer->fake_close = false;
 	peer->output_enabled = true;
+	peer->output_awaiting_db = false;
+	peer->sigcheck.done = false;
+	peer->sigcheck.ci = NULL;
 	peer->local.offer_anchor = offer_anchor;
 	if (!blocks_to_rel_locktime(dstate->config.locktime_blocks,
 				    &peer->local.locktime))
@@ -2464,6 +2675,7 @@ struct peer *new_peer(struct lightningd_state *dstate,
 	peer->local.mindepth = dstate->config.anchor_confirms;
 	peer->local.commit = peer->remote.commit = NULL;
 	peer->local.staging_cstate = peer->remote.staging_cstate = NULL;
+	peer->local.commit_template = peer->remote.commit_template = NULL;
 	peer->log = tal_steal(peer, log);
 	log_debug(peer->log, "New peer %p", peer);
 	
@@ -2515,7 +2727,7 @@ static bool peer_first_connected(struct peer *peer,
 	struct netaddr addr;
 
 	peer->io_data = tal_steal(peer, iod);
-	peer->id = tal_dup(peer, struct pubkey, id);
+	peer_set_id(peer, id);
 	peer->local.commit_fee_rate = desired_commit_feerate(peer->dstate);
 
 	peer->htlc_id_counter = 0;
@@ -2527,7 +2739,6 @@ static bool peer_first_connected(struct peer *peer,
 	
 	peer->anchor.min_depth = get_block_height(peer->dstate);
 
-	/* FIXME: Attach IO logging for this peer. */
 	if (!netaddr_from_fd(io_conn_fd(conn), addr_type, addr_protocol, &addr))
 		return false;
 
@@ -2656,8 +2867,6 @@ static struct io_plan *crypto_on_out(struct io_conn *conn,
 			     connect->name, connect->port);
 		return io_close(conn);
 	}
-	peer->io_data = tal_steal(peer, iod);
-	peer->id = tal_dup(peer, struct pubkey, id);
 	peer->anchor.input = tal_steal(peer, connect->input);
 	peer->open_jsoncmd = connect->cmd;
 	return peer_crypto_on(conn, peer);
@@ -3680,6 +3889,7 @@ static void resolve_their_steal(struct peer *peer,
 	int i, n;
 	const struct bitcoin_tx *tx = peer->onchain.tx;
 	struct bitcoin_tx *steal_tx;
+	struct bitcoin_tx_sighash sighash;
 	size_t wsize = 0;
 	u64 input_total = 0, fee;
 
@@ -3748,11 +3958,12 @@ static void resolve_their_steal(struct peer *peer,
 	steal_tx->output[0].script_length = tal_count(steal_tx->output[0].script);
 
 	/* Now, we can sign them all (they're all of same form). */
+	bitcoin_tx_sighash_init(&sighash, steal_tx);
 	for (i = 0; i < n; i++) {
 		struct bitcoin_signature sig;
 
 		sig.stype = SIGHASH_ALL;
-		peer_sign_steal_input(peer, steal_tx, i,
+		peer_sign_steal_input(peer, &sighash, i,
 				      peer->onchain.wscripts[i],
 				      &sig.sig);
 
@@ -4445,6 +4656,7 @@ static void json_newhtlc(struct command *cmd,
 	packet = create_onionpacket(
 		cmd,
 		cmd->dstate->secpctx,
+		cmd->dstate->sphinx_ws,
 		path,
 		hoppayloads, sessionkey, (u8*)"", 0);
 	onion = serialize_onionpacket(cmd, cmd->dstate->secpctx, packet);
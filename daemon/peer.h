@@ -6,6 +6,7 @@
 #include "bitcoin/pubkey.h"
 #include "bitcoin/script.h"
 #include "bitcoin/shadouble.h"
+#include "bitcoin/signature.h"
 #include "channel.h"
 #include "failure.h"
 #include "feechange.h"
@@ -74,6 +75,9 @@ struct peer_visible_state {
 
 	/* cstate to generate next commitment tx. */
 	struct channel_state *staging_cstate;
+
+	/* HTLC outputs kept between commitment txs (see commit_tx.c). */
+	struct commit_template *commit_template;
 };
 
 /* Off peer->outgoing_txs */
@@ -105,17 +109,21 @@ struct peer {
 	/* Global state. */
 	struct lightningd_state *dstate;
 
-	/* Their ID. */
+	/* Their ID (set by peer_set_id). */
 	struct pubkey *id;
 
+	/* Cached hash160 of their ID, for find_peer_by_pkhash. */
+	u8 pkhash[20];
+
 	/* Order counter for transmission of revocations/commitments. */
 	s64 order_counter;
 	
-	/* Current received packet. */
+	/* Current received packet (in io_data's arena: copy to keep!) */
 	Pkt *inpkt;
 
-	/* Queue of output packets. */
+	/* Ring of output packets (tal_count(outpkt) is a power of 2). */
 	Pkt **outpkt;
+	size_t outpkt_start, num_outpkt;
 
 	/* Their commitments we have signed (which could appear on chain). */
 	struct list_head their_commits;
@@ -220,6 +228,19 @@ struct peer {
 	bool fake_close;
 	bool output_enabled;
 
+	/* Output waits until the database group commit is done. */
+	bool output_awaiting_db;
+
+	/* Their sig in the packet we're about to process, checked by
+	 * dstate->sigverify while input waited.  For update_commit, ci
+	 * is the commit it was checked against. */
+	struct {
+		bool done, ok;
+		struct sha256_double digest;
+		struct signature sig;
+		struct commit_info *ci;
+	} sigcheck;
+
 	/* Stuff we have in common. */
 	struct peer_visible_state local, remote;
 
@@ -239,6 +260,12 @@ struct peer_address {
 
 void setup_listeners(struct lightningd_state *dstate, unsigned int portnum);
 
+struct peer_id_map *empty_peer_id_map(struct lightningd_state *dstate);
+struct peer_pkhash_map *empty_peer_pkhash_map(struct lightningd_state *dstate);
+
+/* Once we know who they are, so find_peer* can find them. */
+void peer_set_id(struct peer *peer, const struct pubkey *id);
+
 struct peer *find_peer(struct lightningd_state *dstate, const struct pubkey *id);
 struct peer *find_peer_by_pkhash(struct lightningd_state *dstate, const u8 *pkhash);
 
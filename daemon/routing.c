@@ -8,25 +8,27 @@
 #include <ccan/array_size/array_size.h>
 #include <ccan/crypto/siphash24/siphash24.h>
 #include <ccan/htable/htable_type.h>
-#include <ccan/structeq/structeq.h>
 #include <inttypes.h>
 
 /* 365.25 * 24 * 60 / 10 */
 #define BLOCKS_PER_YEAR 52596
 
-static const secp256k1_pubkey *keyof_node(const struct node *n)
+static const struct pubkey *keyof_node(const struct node *n)
 {
-	return &n->id.pubkey;
+	return &n->id;
 }
 
-static size_t hash_key(const secp256k1_pubkey *key)
+/* The unpacked pubkey is a 1:1 mapping of the 33-byte compressed id, and
+ * this way we don't need to serialize on every lookup.  We hash it all:
+ * ids are chosen by (possibly hostile) peers. */
+static size_t hash_key(const struct pubkey *key)
 {
-	return siphash24(siphash_seed(), key, sizeof(key));
+	return siphash24(siphash_seed(), &key->pubkey, sizeof(key->pubkey));
 }
 
-static bool node_eq(const struct node *n, const secp256k1_pubkey *key)
+static bool node_eq(const struct node *n, const struct pubkey *key)
 {
-	return structeq(&n->id.pubkey, key);
+	return pubkey_eq(&n->id, key);
 }
 
 HTABLE_DEFINE_TYPE(struct node, keyof_node, hash_key, node_eq, node_map);
@@ -41,7 +43,71 @@ struct node_map *empty_node_map(struct lightningd_state *dstate)
 struct node *get_node(struct lightningd_state *dstate,
 		      const struct pubkey *id)
 {
-	return node_map_get(dstate->nodes, &id->pubkey);
+	return node_map_get(dstate->nodes, id);
+}
+
+/* A compact copy of the graph: nodes numbered densely, with all the
+ * incoming edges for each node contiguous in one array. */
+struct route_edge {
+	/* Ordinal of c->src */
+	u32 src;
+	struct node_connection *c;
+};
+
+struct route_graph {
+	/* nodes[n->index] == n */
+	struct node **nodes;
+	/* Edges into node i are edges[in_start[i]] to edges[in_start[i+1]-1] */
+	u32 *in_start;
+	struct route_edge *edges;
+};
+
+/* Called whenever nodes or connections are added or removed. */
+static void route_graph_invalidate(struct lightningd_state *dstate)
+{
+	dstate->route_graph = tal_free(dstate->route_graph);
+}
+
+static struct route_graph *route_graph_get(struct lightningd_state *dstate)
+{
+	struct route_graph *g;
+	struct node *n;
+	struct node_map_iter it;
+	size_t num_nodes = 0, num_edges = 0, j;
+
+	if (dstate->route_graph)
+		return dstate->route_graph;
+
+	for (n = node_map_first(dstate->nodes, &it);
+	     n;
+	     n = node_map_next(dstate->nodes, &it)) {
+		n->index = num_nodes++;
+		num_edges += tal_count(n->in);
+	}
+
+	g = tal(dstate, struct route_graph);
+	g->nodes = tal_arr(g, struct node *, num_nodes);
+	g->in_start = tal_arr(g, u32, num_nodes + 1);
+	g->edges = tal_arr(g, struct route_edge, num_edges);
+
+	num_edges = 0;
+	for (n = node_map_first(dstate->nodes, &it);
+	     n;
+	     n = node_map_next(dstate->nodes, &it)) {
+		g->nodes[n->index] = n;
+		g->in_start[n->index] = num_edges;
+		for (j = 0; j < tal_count(n->in); j++) {
+			g->edges[num_edges].src = n->in[j]->src->index;
+			g->edges[num_edges].c = n->in[j];
+			num_edges++;
+		}
+	}
+	g->in_start[num_nodes] = num_edges;
+
+	log_debug(dstate->base_log, "Routing graph: %zu nodes, %zu edges",
+		  num_nodes, num_edges);
+	dstate->route_graph = g;
+	return g;
 }
 
 static void destroy_node(struct node *node)
@@ -66,6 +132,7 @@ struct node *new_node(struct lightningd_state *dstate,
 	n->out = tal_arr(n, struct node_connection *, 0);
 	n->port = 0;
 	node_map_add(dstate->nodes, n);
+	route_graph_invalidate(dstate);
 	tal_add_destructor(n, destroy_node);
 
 	return n;
@@ -161,6 +228,7 @@ get_or_make_connection(struct lightningd_state *dstate,
 	from->out[i] = nc;
 
 	tal_add_destructor(nc, destroy_connection);
+	route_graph_invalidate(dstate);
 	return nc;
 }
 
@@ -172,6 +240,7 @@ struct node_connection *add_connection(struct lightningd_state *dstate,
 				       u32 delay, u32 min_blocks)
 {
 	struct node_connection *c = get_or_make_connection(dstate, from, to);
+
 	c->base_fee = base_fee;
 	c->proportional_fee = proportional_fee;
 	c->delay = delay;
@@ -207,6 +276,7 @@ void remove_connection(struct lightningd_state *dstate,
 			i, num_edges);
 		/* Destructor makes it delete itself */
 		tal_free(from->out[i]);
+		route_graph_invalidate(dstate);
 		return;
 	}
 	log_add(dstate->base_log, " None of %zu routes matched", num_edges);
@@ -215,31 +285,28 @@ void remove_connection(struct lightningd_state *dstate,
 /* Too big to reach, but don't overflow if added. */
 #define INFINITE 0x3FFFFFFFFFFFFFFFULL
 
-static void clear_bfg(struct node_map *nodes)
-{
-	struct node *n;
-	struct node_map_iter it;
-
-	for (n = node_map_first(nodes, &it); n; n = node_map_next(nodes, &it)) {
-		size_t i;
-		for (i = 0; i < ARRAY_SIZE(n->bfg); i++) {
-			n->bfg[i].total = INFINITE;
-			n->bfg[i].risk = 0;
-		}
-	}
-}
-
 s64 connection_fee(const struct node_connection *c, u64 msatoshi)
 {
 	s64 fee;
 
 	if (mul_overflows_s64(c->proportional_fee, msatoshi))
 		return INFINITE;
-	fee = (c->proportional_fee * msatoshi) / 1000000;
+	/* Signed multiply: proportional_fee may be negative. */
+	fee = ((s64)c->proportional_fee * (s64)msatoshi) / 1000000;
 	/* This can't overflow: c->base_fee is a u32 */
 	return c->base_fee + fee;
 }
 
+/* The search needs fees which never shrink a total, so it treats a
+ * negative proportional fee as zero.  That only makes such a route look
+ * dearer than it is: the real fee is still what we pay. */
+static s64 search_fee(const struct node_connection *c, u64 msatoshi)
+{
+	if (c->proportional_fee < 0)
+		return c->base_fee;
+	return connection_fee(c, msatoshi);
+}
+
 /* Risk of passing through this channel.  We insert a tiny constant here
  * in order to prefer shorter routes, all things equal. */
 static u64 risk_fee(s64 amount, u32 delay, double riskfactor)
@@ -251,26 +318,233 @@ static u64 risk_fee(s64 amount, u32 delay, double riskfactor)
 	return 1 + amount * delay * riskfactor / BLOCKS_PER_YEAR / 10000;
 }
 
-/* We track totals, rather than costs.  That's because the fee depends
- * on the current amount passing through. */
-static void bfg_one_edge(struct node *node, size_t edgenum, double riskfactor)
-{
-	struct node_connection *c = node->in[edgenum];
-	size_t h;
-
-	assert(c->dst == node);
-	for (h = 0; h < ROUTING_MAX_HOPS; h++) {
-		/* FIXME: Bias against smaller channels. */
-		s64 fee = connection_fee(c, node->bfg[h].total);
-		u64 risk = node->bfg[h].risk + risk_fee(node->bfg[h].total + fee,
-							c->delay, riskfactor);
-		if (node->bfg[h].total + (s64)fee + (s64)risk
-		    < c->src->bfg[h+1].total + (s64)c->src->bfg[h+1].risk) {
-			c->src->bfg[h+1].total = node->bfg[h].total + fee;
-			c->src->bfg[h+1].risk = risk;
-			c->src->bfg[h+1].prev = c;
+/* A (partial) route from the target back to some node. */
+struct route_label {
+	/* Total to get to here from target. */
+	s64 total;
+	/* Total risk premium of this route. */
+	u64 risk;
+	/* Which node, and how many hops from the target. */
+	u32 node, hops;
+	/* Label we extended (towards target), and the connection used. */
+	u32 prev;
+	struct node_connection *c;
+};
+
+/* No label settled for this node yet. */
+#define NO_LABEL 0xFFFFFFFF
+
+struct route_node_scratch {
+	u32 gen;
+	/* First (cheapest) label popped for this node at each hop count. */
+	u32 settled[ROUTING_MAX_HOPS + 1];
+};
+
+/* Per-query scratch space, reused across queries so we don't reallocate
+ * (or clear!) anything proportional to the graph size each time. */
+struct route_query {
+	/* Bumped every query: node scratch from older queries is stale. */
+	u32 gen;
+	/* Indexed by node ordinal. */
+	struct route_node_scratch *nodes;
+	struct route_label *labels;
+	size_t num_labels;
+	/* Binary min-heap of label indices, by total + risk. */
+	u32 *heap;
+	size_t heap_len;
+};
+
+static struct route_query *route_query_start(struct lightningd_state *dstate,
+					     const struct route_graph *g)
+{
+	struct route_query *rq = dstate->route_query;
+	size_t num_nodes = tal_count(g->nodes);
+
+	/* Normally we reuse the spare one, but we might be nested. */
+	if (rq)
+		dstate->route_query = NULL;
+	else {
+		rq = tal(dstate, struct route_query);
+		rq->gen = 0;
+		rq->nodes = tal_arr(rq, struct route_node_scratch, 0);
+		rq->labels = tal_arr(rq, struct route_label, 64);
+		rq->heap = tal_arr(rq, u32, 64);
+	}
+
+	if (++rq->gen == 0 || tal_count(rq->nodes) < num_nodes) {
+		tal_resize(&rq->nodes, num_nodes);
+		memset(rq->nodes, 0, sizeof(rq->nodes[0]) * num_nodes);
+		rq->gen = 1;
+	}
+	rq->num_labels = 0;
+	rq->heap_len = 0;
+	return rq;
+}
+
+static void route_query_done(struct lightningd_state *dstate,
+			     struct route_query *rq)
+{
+	if (dstate->route_query)
+		tal_free(rq);
+	else
+		dstate->route_query = rq;
+}
+
+static u32 settled_label(const struct route_query *rq, u32 node, u32 hops)
+{
+	if (rq->nodes[node].gen != rq->gen)
+		return NO_LABEL;
+	return rq->nodes[node].settled[hops];
+}
+
+static void settle_label(struct route_query *rq, u32 li)
+{
+	struct route_node_scratch *n = &rq->nodes[rq->labels[li].node];
+	size_t i;
+
+	if (n->gen != rq->gen) {
+		n->gen = rq->gen;
+		for (i = 0; i < ARRAY_SIZE(n->settled); i++)
+			n->settled[i] = NO_LABEL;
+	}
+	n->settled[rq->labels[li].hops] = li;
+}
+
+static s64 label_cost(const struct route_label *l)
+{
+	return l->total + (s64)l->risk;
+}
+
+static bool heap_less(const struct route_query *rq, u32 a, u32 b)
+{
+	return label_cost(&rq->labels[a]) < label_cost(&rq->labels[b]);
+}
+
+static void heap_push(struct route_query *rq, u32 label)
+{
+	size_t i = rq->heap_len++;
+
+	if (rq->heap_len > tal_count(rq->heap))
+		tal_resize(&rq->heap, rq->heap_len * 2);
+
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!heap_less(rq, label, rq->heap[parent]))
+			break;
+		rq->heap[i] = rq->heap[parent];
+		i = parent;
+	}
+	rq->heap[i] = label;
+}
+
+static u32 heap_pop(struct route_query *rq)
+{
+	u32 top = rq->heap[0], last = rq->heap[--rq->heap_len];
+	size_t i = 0;
+
+	for (;;) {
+		size_t child = i * 2 + 1;
+		if (child >= rq->heap_len)
+			break;
+		if (child + 1 < rq->heap_len
+		    && heap_less(rq, rq->heap[child + 1], rq->heap[child]))
+			child++;
+		if (!heap_less(rq, rq->heap[child], last))
+			break;
+		rq->heap[i] = rq->heap[child];
+		i = child;
+	}
+	rq->heap[i] = last;
+	return top;
+}
+
+/* Is @l no better than what we've already settled at that node?  A
+ * settled label with no more hops, total or risk will always extend at
+ * least as well, so there's no point exploring this one.  We also keep
+ * only the first label at each hop count, which bounds the search to
+ * nodes * (ROUTING_MAX_HOPS + 1) settled labels. */
+static bool label_dominated(const struct route_query *rq,
+			    const struct route_label *l)
+{
+	u32 h, si;
+
+	for (h = 0; h <= l->hops; h++) {
+		const struct route_label *s;
+
+		si = settled_label(rq, l->node, h);
+		if (si == NO_LABEL)
+			continue;
+		if (h == l->hops)
+			return true;
+		s = &rq->labels[si];
+		if (s->total <= l->total && s->risk <= l->risk)
+			return true;
+	}
+	return false;
+}
+
+static void add_label(struct route_query *rq,
+		      s64 total, u64 risk, u32 node, u32 hops,
+		      u32 prev, struct node_connection *c)
+{
+	struct route_label *l;
+
+	if (rq->num_labels == tal_count(rq->labels))
+		tal_resize(&rq->labels, rq->num_labels * 2);
+
+	l = &rq->labels[rq->num_labels];
+	l->total = total;
+	l->risk = risk;
+	l->node = node;
+	l->hops = hops;
+	l->prev = prev;
+	l->c = c;
+	if (label_dominated(rq, l))
+		return;
+	heap_push(rq, rq->num_labels++);
+}
+
+/* Dijkstra from @src back to @dst: we track totals rather than costs
+ * since the fee depends on the current amount passing through.  Each
+ * extension adds a positive risk and search_fee is never negative, so
+ * the first time we pop @dst it's the cheapest route.
+ * Returns label index, or NO_LABEL. */
+static u32 route_search(struct route_query *rq,
+			const struct route_graph *g,
+			const struct node *src, const struct node *dst,
+			u64 msatoshi, double riskfactor)
+{
+	add_label(rq, msatoshi, 0, src->index, 0, NO_LABEL, NULL);
+
+	while (rq->heap_len) {
+		u32 li = heap_pop(rq), i;
+		struct route_label l = rq->labels[li];
+
+		if (label_dominated(rq, &l))
+			continue;
+		settle_label(rq, li);
+
+		if (l.node == dst->index && l.hops != 0)
+			return li;
+
+		if (l.hops == ROUTING_MAX_HOPS)
+			continue;
+
+		for (i = g->in_start[l.node]; i < g->in_start[l.node+1]; i++) {
+			const struct route_edge *e = &g->edges[i];
+			/* FIXME: Bias against smaller channels. */
+			s64 fee = search_fee(e->c, l.total);
+			u64 risk;
+
+			if (l.total + fee >= (s64)INFINITE)
+				continue;
+			risk = l.risk + risk_fee(l.total + fee,
+						 e->c->delay, riskfactor);
+			add_label(rq, l.total + fee, risk, e->src, l.hops + 1,
+				  li, e->c);
 		}
 	}
+	return NO_LABEL;
 }
 
 struct peer *find_route(struct lightningd_state *dstate,
@@ -280,89 +554,69 @@ struct peer *find_route(struct lightningd_state *dstate,
 			s64 *fee,
 			struct node_connection ***route)
 {
-	struct node *n, *src, *dst;
-	struct node_map_iter it;
+	struct node *src, *dst;
+	const struct route_graph *g;
+	struct route_query *rq;
+	const struct route_label *l;
 	struct peer *first;
-	int runs, i, best;
+	u64 total;
+	u32 li;
+	int i, best;
 
 	/* Note: we map backwards, since we know the amount of satoshi we want
 	 * at the end, and need to derive how much we need to send. */
 	dst = get_node(dstate, &dstate->id);
 	src = get_node(dstate, to);
-	if (!src) {
+	if (!src || !dst) {
 		log_info_struct(dstate->base_log, "find_route: cannot find %s",
-				struct pubkey, to);
+				struct pubkey, src ? &dstate->id : to);
 		return NULL;
 	}
 
-	/* Reset all the information. */
-	clear_bfg(dstate->nodes);
-
-	/* Bellman-Ford-Gibson: like Bellman-Ford, but keep values for
-	 * every path length. */
-	src->bfg[0].total = msatoshi;
-	src->bfg[0].risk = 0;
-
-	for (runs = 0; runs < ROUTING_MAX_HOPS; runs++) {
-		log_debug(dstate->base_log, "Run %i", runs);
-		/* Run through every edge. */
-		for (n = node_map_first(dstate->nodes, &it);
-		     n;
-		     n = node_map_next(dstate->nodes, &it)) {
-			size_t num_edges = tal_count(n->in);
-			for (i = 0; i < num_edges; i++) {
-				bfg_one_edge(n, i, riskfactor);
-				log_debug(dstate->base_log, "We seek %p->%p, this is %p -> %p",
-					  dst, src, n->in[i]->src, n->in[i]->dst);
-				log_debug_struct(dstate->base_log,
-						 "Checking from %s",
-						 struct pubkey,
-						 &n->in[i]->src->id);
-				log_add_struct(dstate->base_log,
-					       " to %s",
-					       struct pubkey,
-					       &n->in[i]->dst->id);
-			}
-		}
-	}
-
-	best = 0;
-	for (i = 1; i <= ROUTING_MAX_HOPS; i++) {
-		if (dst->bfg[i].total < dst->bfg[best].total)
-			best = i;
-	}
+	g = route_graph_get(dstate);
+	rq = route_query_start(dstate, g);
+	li = route_search(rq, g, src, dst, msatoshi, riskfactor);
 
 	/* No route? */
-	if (dst->bfg[best].total >= INFINITE) {
+	if (li == NO_LABEL) {
 		log_info_struct(dstate->base_log, "find_route: No route to %s",
 				struct pubkey, to);
+		route_query_done(dstate, rq);
 		return NULL;
 	}
 
 	/* Save route from *next* hop (we return first hop as peer).
 	 * Note that we take our own fees into account for routing, even
 	 * though we don't pay them: it presumably effects preference. */
-	dst = dst->bfg[best].prev->dst;
-	best--;
+	l = &rq->labels[li];
+	best = l->hops - 1;
+	dst = l->c->dst;
+	l = &rq->labels[l->prev];
 
-	*fee = dst->bfg[best].total - msatoshi;
 	*route = tal_arr(dstate, struct node_connection *, best);
-	for (i = 0, n = dst;
-	     i < best;
-	     n = n->bfg[best-i].prev->dst, i++) {
-		(*route)[i] = n->bfg[best-i].prev;
+	for (i = 0; i < best; i++) {
+		(*route)[i] = l->c;
+		l = &rq->labels[l->prev];
 	}
-	assert(n == src);
+	assert(g->nodes[l->node] == src);
+	route_query_done(dstate, rq);
+
+	/* The search overestimates negative fees: report what we'll pay. */
+	total = msatoshi;
+	for (i = best - 1; i >= 0; i--)
+		total += connection_fee((*route)[i], total);
+	*fee = total - msatoshi;
 
 	/* We should only add routes if we have a peer. */
 	first = find_peer(dstate, &dst->id);
 	if (!first) {
 		log_broken_struct(dstate->base_log, "No peer %s?",
-				  struct pubkey, &(*route)[0]->src->id);
+				  struct pubkey, &dst->id);
 		return NULL;
 	}
 
 	msatoshi += *fee;
+	total = msatoshi;
 	log_info(dstate->base_log, "find_route:");
 	log_add_struct(dstate->base_log, "via %s", struct pubkey, first->id);
 	/* If there are intermidiaries, dump them, and total fees. */
@@ -376,8 +630,8 @@ struct peer *find_route(struct lightningd_state *dstate,
 				connection_fee((*route)[i], msatoshi));
 			msatoshi -= connection_fee((*route)[i], msatoshi);
 		}
-		log_add(dstate->base_log, "=%"PRIi64"(%+"PRIi64")",
-			(*route)[best-1]->dst->bfg[best-1].total, *fee);
+		log_add(dstate->base_log, "=%"PRIu64"(%+"PRIi64")",
+			total, *fee);
 	}
 	return first;
 }
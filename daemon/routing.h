@@ -28,15 +28,8 @@ struct node {
 	/* Routes connecting to us, from us. */
 	struct node_connection **in, **out;
 
-	/* Temporary data for routefinding. */
-	struct {
-		/* Total to get to here from target. */
-		s64 total;
-		/* Total risk premium of this route. */
-		u64 risk;
-		/* Where that came from. */
-		struct node_connection *prev;
-	} bfg[ROUTING_MAX_HOPS+1];
+	/* Our ordinal in the routing graph (see find_route). */
+	u32 index;
 };
 
 struct lightningd_state;
@@ -129,19 +129,18 @@ void peer_sign_mutual_close(const struct peer *peer,
 }
 
 void peer_sign_steal_input(const struct peer *peer,
-			   struct bitcoin_tx *spend,
+			   const struct bitcoin_tx_sighash *sighash,
 			   size_t i,
 			   const u8 *witnessscript,
 			   struct signature *sig)
 {
-	/* Spend tx only has one input: that of the commit tx. */
-	sign_tx_input(peer->dstate->secpctx,
-		      spend, i,
-		      NULL, 0,
-		      witnessscript,
-		      &peer->secrets->final,
-		      &peer->local.finalkey,
-		      sig);
+	/* Steal tx spends every output of the commit tx we can. */
+	sign_sighash_input(peer->dstate->secpctx,
+			   sighash, i,
+			   witnessscript,
+			   &peer->secrets->final,
+			   &peer->local.finalkey,
+			   sig);
 }
 
 static void new_keypair(struct lightningd_state *dstate,
@@ -177,14 +176,22 @@ void peer_get_revocation_hash(const struct peer *peer, u64 index,
 	sha256(rhash, preimage.u.u8, sizeof(preimage.u.u8));
 }
 
-const char *peer_secrets_for_db(const tal_t *ctx, struct peer *peer)
+void peer_secrets_for_db(const struct peer *peer,
+			 const void **commit_privkey,
+			 size_t *commit_privkey_len,
+			 const void **final_privkey,
+			 size_t *final_privkey_len,
+			 const void **revocation_seed,
+			 size_t *revocation_seed_len)
 {
 	const struct peer_secrets *ps = peer->secrets;
-	return tal_fmt(ctx, "x'%s', x'%s', x'%s'",
-		       tal_hexstr(ctx, &ps->commit, sizeof(ps->commit)),
-		       tal_hexstr(ctx, &ps->final, sizeof(ps->final)),
-		       tal_hexstr(ctx, &ps->revocation_seed,
-				  sizeof(ps->revocation_seed)));
+
+	*commit_privkey = &ps->commit;
+	*commit_privkey_len = sizeof(ps->commit);
+	*final_privkey = &ps->final;
+	*final_privkey_len = sizeof(ps->final);
+	*revocation_seed = &ps->revocation_seed;
+	*revocation_seed_len = sizeof(ps->revocation_seed);
 }
 
 void peer_set_secrets_from_db(struct peer *peer,
@@ -6,6 +6,7 @@
 
 struct peer;
 struct lightningd_state;
+struct bitcoin_tx_sighash;
 struct signature;
 struct sha256;
 
@@ -40,12 +41,18 @@ void peer_sign_mutual_close(const struct peer *peer,
 			    struct signature *sig);
 
 void peer_sign_steal_input(const struct peer *peer,
-			   struct bitcoin_tx *spend,
+			   const struct bitcoin_tx_sighash *sighash,
 			   size_t i,
 			   const u8 *witnessscript,
 			   struct signature *sig);
 
-const char *peer_secrets_for_db(const tal_t *ctx, struct peer *peer);
+void peer_secrets_for_db(const struct peer *peer,
+			 const void **commit_privkey,
+			 size_t *commit_privkey_len,
+			 const void **final_privkey,
+			 size_t *final_privkey_len,
+			 const void **revocation_seed,
+			 size_t *revocation_seed_len);
 
 void peer_set_secrets_from_db(struct peer *peer,
 			      const void *commit_privkey,
@@ -0,0 +1,228 @@
+#include "sigverify.h"
+#include <ccan/io/io.h>
+#include <ccan/list/list.h>
+#include <ccan/read_write_all/read_write_all.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Workers never allocate or free: tal isn't thread-safe.  They only
+ * move jobs from todo to done, under the lock. */
+struct sigverify {
+	secp256k1_context *secpctx;
+
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stopping;
+
+	/* Protected by lock. */
+	struct list_head todo, done;
+
+	/* Workers write a byte when done becomes non-empty. */
+	int fds[2];
+	struct io_conn *conn;
+	u8 buf[64];
+	size_t len;
+
+	/* Submitted but not yet delivered (io_loop only). */
+	size_t pending;
+};
+
+struct sigverify_req;
+
+struct sigverify_job {
+	struct list_node list;
+	struct sha256_double digest;
+	struct pubkey key;
+	struct signature sig;
+	bool ok;
+
+	/* NULL if they freed the ctx (only io_loop touches this). */
+	struct sigverify_req *req;
+};
+
+struct sigverify_req {
+	struct sigverify_job *job;
+	void (*cb)(bool ok, void *arg);
+	void *arg;
+};
+
+/* Called with lock held. */
+static void job_done(struct sigverify *sv, struct sigverify_job *job)
+{
+	u8 byte = 0;
+
+	if (list_empty(&sv->done))
+		write_all(sv->fds[1], &byte, 1);
+	list_add_tail(&sv->done, &job->list);
+}
+
+static void check_job(struct sigverify *sv, struct sigverify_job *job)
+{
+	job->ok = check_signed_hash(sv->secpctx, &job->digest, &job->sig,
+				    &job->key);
+}
+
+static void *worker(void *arg)
+{
+	struct sigverify *sv = arg;
+	struct sigverify_job *job;
+
+	pthread_mutex_lock(&sv->lock);
+	for (;;) {
+		while (!sv->stopping
+		       && !(job = list_pop(&sv->todo, struct sigverify_job,
+					   list)))
+			pthread_cond_wait(&sv->cond, &sv->lock);
+		if (sv->stopping)
+			break;
+
+		pthread_mutex_unlock(&sv->lock);
+		check_job(sv, job);
+		pthread_mutex_lock(&sv->lock);
+		job_done(sv, job);
+	}
+	pthread_mutex_unlock(&sv->lock);
+	return NULL;
+}
+
+static void destroy_req(struct sigverify_req *req)
+{
+	req->job->req = NULL;
+}
+
+static struct io_plan *read_done(struct io_conn *conn, struct sigverify *sv);
+
+static struct io_plan *deliver_done(struct io_conn *conn,
+				    struct sigverify *sv)
+{
+	struct list_head done;
+	struct sigverify_job *job;
+
+	list_head_init(&done);
+	pthread_mutex_lock(&sv->lock);
+	list_append_list(&done, &sv->done);
+	pthread_mutex_unlock(&sv->lock);
+
+	while ((job = list_pop(&done, struct sigverify_job, list)) != NULL) {
+		struct sigverify_req *req = job->req;
+
+		sv->pending--;
+		if (req) {
+			tal_del_destructor(req, destroy_req);
+			req->cb(job->ok, req->arg);
+			tal_free(req);
+		}
+		tal_free(job);
+	}
+	return read_done(conn, sv);
+}
+
+static struct io_plan *read_done(struct io_conn *conn, struct sigverify *sv)
+{
+	return io_read_partial(conn, sv->buf, sizeof(sv->buf), &sv->len,
+			       deliver_done, sv);
+}
+
+static void destroy_sigverify(struct sigverify *sv)
+{
+	struct sigverify_job *job;
+	size_t i;
+
+	pthread_mutex_lock(&sv->lock);
+	sv->stopping = true;
+	pthread_cond_broadcast(&sv->cond);
+	pthread_mutex_unlock(&sv->lock);
+
+	for (i = 0; i < tal_count(sv->threads); i++)
+		pthread_join(sv->threads[i], NULL);
+
+	/* Jobs are freed with us: their callbacks never happen. */
+	list_append_list(&sv->todo, &sv->done);
+	list_for_each(&sv->todo, job, list) {
+		if (job->req)
+			tal_del_destructor(job->req, destroy_req);
+	}
+	pthread_cond_destroy(&sv->cond);
+	pthread_mutex_destroy(&sv->lock);
+	close(sv->fds[1]);
+
+	/* io_loop closes fds[0] and frees conn next time around. */
+	io_close(sv->conn);
+}
+
+struct sigverify *new_sigverify(const tal_t *ctx,
+				secp256k1_context *secpctx,
+				unsigned int nthreads)
+{
+	struct sigverify *sv = tal(ctx, struct sigverify);
+	size_t i;
+
+	sv->secpctx = secpctx;
+	sv->stopping = false;
+	sv->pending = 0;
+	list_head_init(&sv->todo);
+	list_head_init(&sv->done);
+	if (pipe(sv->fds) != 0)
+		return tal_free(sv);
+	sv->conn = io_new_conn(NULL, sv->fds[0], read_done, sv);
+	if (!sv->conn) {
+		close(sv->fds[1]);
+		return tal_free(sv);
+	}
+
+	pthread_mutex_init(&sv->lock, NULL);
+	pthread_cond_init(&sv->cond, NULL);
+	sv->threads = tal_arr(sv, pthread_t, 0);
+	tal_add_destructor(sv, destroy_sigverify);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_t t;
+
+		if (pthread_create(&t, NULL, worker, sv) != 0)
+			break;
+		tal_resize(&sv->threads, i + 1);
+		sv->threads[i] = t;
+	}
+	return sv;
+}
+
+void sigverify_check_(struct sigverify *sv,
+		      const tal_t *ctx,
+		      const struct sha256_double *digest,
+		      const struct pubkey *key,
+		      const struct signature *sig,
+		      void (*cb)(bool ok, void *arg),
+		      void *arg)
+{
+	struct sigverify_job *job = tal(sv, struct sigverify_job);
+
+	job->digest = *digest;
+	job->key = *key;
+	job->sig = *sig;
+	job->req = tal(ctx, struct sigverify_req);
+	job->req->job = job;
+	job->req->cb = cb;
+	job->req->arg = arg;
+	tal_add_destructor(job->req, destroy_req);
+	sv->pending++;
+
+	/* No workers?  Do it now, but answer from io_loop all the same. */
+	if (tal_count(sv->threads) == 0) {
+		check_job(sv, job);
+		pthread_mutex_lock(&sv->lock);
+		job_done(sv, job);
+		pthread_mutex_unlock(&sv->lock);
+		return;
+	}
+
+	pthread_mutex_lock(&sv->lock);
+	list_add_tail(&sv->todo, &job->list);
+	pthread_cond_signal(&sv->cond);
+	pthread_mutex_unlock(&sv->lock);
+}
+
+size_t sigverify_pending(const struct sigverify *sv)
+{
+	return sv->pending;
+}
@@ -0,0 +1,39 @@
+#ifndef LIGHTNING_DAEMON_SIGVERIFY_H
+#define LIGHTNING_DAEMON_SIGVERIFY_H
+#include "config.h"
+#include "bitcoin/pubkey.h"
+#include "bitcoin/shadouble.h"
+#include "bitcoin/signature.h"
+#include <ccan/tal/tal.h>
+#include <ccan/typesafe_cb/typesafe_cb.h>
+#include <stdbool.h>
+
+struct sigverify;
+
+/* Start nthreads workers checking signatures: secpctx needs to have been
+ * created with SECP256K1_CONTEXT_VERIFY, whose precomputed tables they
+ * all share.  With 0 threads, checks are done inline (but answers are
+ * still delivered from io_loop).  Free it to stop them. */
+struct sigverify *new_sigverify(const tal_t *ctx,
+				secp256k1_context *secpctx,
+				unsigned int nthreads);
+
+/* Check sig is key's signature of digest on a worker thread: cb is
+ * called from io_loop with the answer, unless ctx is freed first. */
+#define sigverify_check(sv, ctx, digest, key, sig, cb, arg)		\
+	sigverify_check_((sv), (ctx), (digest), (key), (sig),		\
+			 typesafe_cb_preargs(void, void *, (cb), (arg),	\
+					     bool),			\
+			 (arg))
+
+void sigverify_check_(struct sigverify *sv,
+		      const tal_t *ctx,
+		      const struct sha256_double *digest,
+		      const struct pubkey *key,
+		      const struct signature *sig,
+		      void (*cb)(bool ok, void *arg),
+		      void *arg);
+
+/* How many checks are queued or running? */
+size_t sigverify_pending(const struct sigverify *sv);
+#endif /* LIGHTNING_DAEMON_SIGVERIFY_H */
@@ -1,6 +1,7 @@
 #include "sphinx.h"
 #include <assert.h>
 
+#include <ccan/build_assert/build_assert.h>
 #include <ccan/crypto/ripemd160/ripemd160.h>
 #include <ccan/crypto/sha256/sha256.h>
 #include <ccan/mem/mem.h>
@@ -12,8 +13,8 @@
 
 #define BLINDING_FACTOR_SIZE 32
 #define SHARED_SECRET_SIZE 32
-#define NUM_STREAM_BYTES (2 * NUM_MAX_HOPS + 2) * SECURITY_PARAMETER
 #define KEY_LEN 32
+#define CHACHA20_BLOCK 64
 
 struct hop_params {
 	u8 secret[SHARED_SECRET_SIZE];
@@ -110,27 +111,39 @@ static struct hoppayload *parse_hoppayload(const tal_t *ctx, u8 *src)
 	int p = 0;
 	struct hoppayload *result = talz(ctx, struct hoppayload);
 
-	read_buffer(&result->realm, src, sizeof(&result->realm), &p);
-	read_buffer(&result->amount, src, sizeof(&result->amount), &p);
-	read_buffer(&result->remainder, src, sizeof(&result->remainder), &p);
+	read_buffer(&result->realm, src, sizeof(result->realm), &p);
+	read_buffer(&result->amount, src, sizeof(result->amount), &p);
+	read_buffer(&result->remainder, src, sizeof(result->remainder), &p);
 	return result;
 }
 
-static void serialize_hoppayload(u8 *dst, struct hoppayload *hp)
+static void serialize_hoppayload(u8 *dst, const struct hoppayload *hp)
 {
 	int p = 0;
 
-	write_buffer(dst, &hp->realm, sizeof(&hp->realm), &p);
-	write_buffer(dst, &hp->amount, sizeof(&hp->amount), &p);
-	write_buffer(dst, &hp->remainder, sizeof(&hp->remainder), &p);
+	/* Exactly fills a row of sphinx_workspace.binhoppayloads. */
+	BUILD_ASSERT(sizeof(hp->realm) + sizeof(hp->amount)
+		     + sizeof(hp->remainder) == HOP_PAYLOAD_SIZE);
+	write_buffer(dst, &hp->realm, sizeof(hp->realm), &p);
+	write_buffer(dst, &hp->amount, sizeof(hp->amount), &p);
+	write_buffer(dst, &hp->remainder, sizeof(hp->remainder), &p);
 }
 
 
+/* A word at a time: these are hundreds of bytes long. */
 static void xorbytes(uint8_t *d, const uint8_t *a, const uint8_t *b, size_t len)
 {
-	size_t i = 0;
+	size_t i;
 
-	for (i = 0; i < len; i++)
+	for (i = 0; i + sizeof(u64) <= len; i += sizeof(u64)) {
+		u64 wa, wb;
+
+		memcpy(&wa, a + i, sizeof(wa));
+		memcpy(&wb, b + i, sizeof(wb));
+		wa ^= wb;
+		memcpy(d + i, &wa, sizeof(wa));
+	}
+	for (; i < len; i++)
 		d[i] = a[i] ^ b[i];
 }
 
@@ -181,14 +194,47 @@ static bool compute_hmac(
 	return true;
 }
 
-static void compute_packet_hmac(struct onionpacket *packet, u8 *mukey, u8 *hmac)
+/* MAC over routinginfo, hoppayloads and payload, truncated to
+ * SECURITY_PARAMETER bytes. */
+static void compute_packet_hmac(const struct onionpacket *packet,
+				const u8 *mukey, u8 *hmac)
 {
-	u8 mactemp[ROUTING_INFO_SIZE + TOTAL_HOP_PAYLOAD_SIZE + MESSAGE_SIZE];
+	crypto_auth_hmacsha256_state state;
+	u8 full[crypto_auth_hmacsha256_BYTES];
+
+	crypto_auth_hmacsha256_init(&state, mukey, KEY_LEN);
+	crypto_auth_hmacsha256_update(&state, packet->routinginfo,
+				      ROUTING_INFO_SIZE);
+	crypto_auth_hmacsha256_update(&state, packet->hoppayloads,
+				      TOTAL_HOP_PAYLOAD_SIZE);
+	crypto_auth_hmacsha256_update(&state, packet->payload,
+				      sizeof(packet->payload));
+	crypto_auth_hmacsha256_final(&state, full);
+	memcpy(hmac, full, SECURITY_PARAMETER);
+}
 
-	memcpy(mactemp, packet->routinginfo, ROUTING_INFO_SIZE);
-	memcpy(mactemp + ROUTING_INFO_SIZE, packet->hoppayloads, TOTAL_HOP_PAYLOAD_SIZE);
-	memcpy(mactemp + ROUTING_INFO_SIZE + TOTAL_HOP_PAYLOAD_SIZE, packet->payload, sizeof(packet->payload));
-	compute_hmac(hmac, mactemp, sizeof(mactemp), mukey, KEY_LEN);
+/*
+ * Strip one layer of a field `len` bytes long: decrypt `src` followed
+ * by `shift` bytes of zeroes with key `key`.  The first CHACHA20_BLOCK
+ * bytes of the result go in `block`; everything after the first `shift`
+ * bytes goes in `dst`, which we decrypt in place.
+ */
+static void unwrap_field(u8 block[CHACHA20_BLOCK], u8 *dst,
+			 const u8 *src, size_t len, size_t shift,
+			 const u8 *key)
+{
+	u8 nonce[8] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	size_t rest = CHACHA20_BLOCK - shift;
+
+	assert(shift < CHACHA20_BLOCK && len >= CHACHA20_BLOCK);
+	crypto_stream_chacha20_xor(block, src, CHACHA20_BLOCK, nonce, key);
+	memcpy(dst, block + shift, rest);
+	memcpy(dst + rest, src + CHACHA20_BLOCK, len - CHACHA20_BLOCK);
+	memset(dst + len - shift, 0, shift);
+
+	/* Keystream block 1 onwards: the zeroes become the filler. */
+	crypto_stream_chacha20_xor_ic(dst + rest, dst + rest, len - rest,
+				      nonce, 1, key);
 }
 
 static bool generate_key(void *k, const char *t, u8 tlen, const u8 *s)
@@ -202,11 +248,12 @@ static bool generate_header_padding(
 	const char *keytype,
 	size_t keytypelen,
 	const u8 numhops,
-	struct hop_params *params
+	const struct hop_params *params,
+	u8 *cipher_stream
 	)
 {
 	int i;
-	u8 cipher_stream[(NUM_MAX_HOPS + 1) * hopsize];
+	size_t streamlen = (NUM_MAX_HOPS + 1) * hopsize;
 	u8 key[KEY_LEN];
 
 	memset(dst, 0, dstlen);
@@ -214,9 +261,9 @@ static bool generate_header_padding(
 		if (!generate_key(&key, keytype, keytypelen, params[i - 1].secret))
 			return false;
 
-		generate_cipher_stream(cipher_stream, key, sizeof(cipher_stream));
+		generate_cipher_stream(cipher_stream, key, streamlen);
 		int pos = ((NUM_MAX_HOPS - i) + 1) * hopsize;
-		xorbytes(dst, dst, cipher_stream + pos, sizeof(cipher_stream) - pos);
+		xorbytes(dst, dst, cipher_stream + pos, streamlen - pos);
 	}
 	return true;
 }
@@ -308,99 +355,79 @@ static void generate_key_set(u8 secret[SHARED_SECRET_SIZE], struct keyset *keys)
 	generate_key(keys->gamma, "gamma", 5, secret);
 }
 
-static struct hop_params *generate_hop_params(
-	const tal_t *ctx,
+/* Everything create_onionpacket needs bar the packet itself: too big
+ * to put on the stack, so callers keep one around. */
+struct sphinx_workspace {
+	struct hop_params params[NUM_MAX_HOPS];
+	u8 filler[2 * (NUM_MAX_HOPS - 1) * SECURITY_PARAMETER];
+	u8 hopfiller[(NUM_MAX_HOPS - 1) * HOP_PAYLOAD_SIZE];
+	u8 binhoppayloads[NUM_MAX_HOPS][HOP_PAYLOAD_SIZE];
+	u8 cipher_stream[(NUM_MAX_HOPS + 1) * 2 * SECURITY_PARAMETER];
+};
+
+/* Hop i's ephemeral key is the sessionkey times the blinding factors
+ * of hops 0..i-1, so we keep that product as a scalar: one
+ * multiplication gets the shared secret, and multiplying the generator
+ * gets the ephemeral key, rather than reblinding from scratch. */
+static bool generate_hop_params(
 	secp256k1_context *secpctx,
 	const u8 *sessionkey,
-	struct pubkey path[])
+	const struct pubkey path[],
+	int num_hops,
+	struct hop_params *params)
 {
-	int i, j, num_hops = tal_count(path);
-	secp256k1_pubkey temp;
-	u8 blind[BLINDING_FACTOR_SIZE];
-	struct hop_params *params = tal_arr(ctx, struct hop_params, num_hops);
-
-	/* Initialize the first hop with the raw information */
-	if (secp256k1_ec_pubkey_create(
-		    secpctx, &params[0].ephemeralkey, sessionkey) != 1)
-		return NULL;
+	u8 acc[32];
+	int i;
 
-	if (!create_shared_secret(
-		    secpctx, params[0].secret, &path[0].pubkey, sessionkey))
-		return NULL;
+	memcpy(acc, sessionkey, sizeof(acc));
+	for (i = 0; i < num_hops; i++) {
+		if (secp256k1_ec_pubkey_create(
+			    secpctx, &params[i].ephemeralkey, acc) != 1)
+			return false;
 
-	compute_blinding_factor(
-		secpctx, &params[0].ephemeralkey, params[0].secret,
-		params[0].blind);
-
-	/* Recursively compute all following ephemeral public keys,
-	 * secrets and blinding factors
-	 */
-	for (i = 1; i < num_hops; i++) {
-		if (!blind_group_element(
-			    secpctx, &params[i].ephemeralkey,
-			    &params[i - 1].ephemeralkey,
-			    params[i - 1].blind))
-			return NULL;
-
-		/* Blind this hop's point with all previous blinding factors
-		 * Order is indifferent, multiplication is commutative.
-		 */
-		memcpy(&blind, sessionkey, 32);
-		memcpy(&temp, &path[i], sizeof(temp));
-		if (!blind_group_element(secpctx, &temp, &temp, blind))
-			return NULL;
-		for (j = 0; j < i; j++)
-			if (!blind_group_element(
-				    secpctx,
-				    &temp,
-				    &temp,
-				    params[j].blind))
-				return NULL;
-
-		/* Now hash temp and store it. This requires us to
-		 * DER-serialize first and then skip the sign byte.
-		 */
-		u8 der[33];
-		size_t outputlen = 33;
-		secp256k1_ec_pubkey_serialize(
-			secpctx, der, &outputlen, &temp,
-			SECP256K1_EC_COMPRESSED);
-		struct sha256 h;
-		sha256(&h, der + 1, sizeof(der) - 1);
-		memcpy(&params[i].secret, &h, sizeof(h));
+		if (!create_shared_secret(
+			    secpctx, params[i].secret, &path[i].pubkey, acc))
+			return false;
 
 		compute_blinding_factor(
-			secpctx, &params[i].ephemeralkey,
-			params[i].secret, params[i].blind);
+			secpctx, &params[i].ephemeralkey, params[i].secret,
+			params[i].blind);
+
+		if (secp256k1_ec_privkey_tweak_mul(secpctx, acc,
+						   params[i].blind) != 1)
+			return false;
 	}
-	return params;
+	return true;
 }
 
-struct onionpacket *create_onionpacket(
-	const tal_t *ctx,
+static bool build_onionpacket(
+	struct onionpacket *packet,
+	struct sphinx_workspace *ws,
 	secp256k1_context *secpctx,
-	struct pubkey *path,
-	struct hoppayload hoppayloads[],
+	const struct pubkey *path,
+	const struct hoppayload hoppayloads[],
 	const u8 *sessionkey,
 	const u8 *message,
 	const size_t messagelen
 	)
 {
-	struct onionpacket *packet = talz(ctx, struct onionpacket);
 	int i, num_hops = tal_count(path);
-	u8 filler[2 * (num_hops - 1) * SECURITY_PARAMETER];
-	u8 hopfiller[(num_hops - 1) * HOP_PAYLOAD_SIZE];
+	size_t fillerlen, hopfillerlen;
 	struct keyset keys;
 	u8 nextaddr[20], nexthmac[SECURITY_PARAMETER];
-	u8 stream[ROUTING_INFO_SIZE], hopstream[TOTAL_HOP_PAYLOAD_SIZE];
-	struct hop_params *params = generate_hop_params(ctx, secpctx, sessionkey, path);
-	u8 binhoppayloads[tal_count(path)][HOP_PAYLOAD_SIZE];
+	struct hop_params *params = ws->params;
+
+	if (num_hops == 0 || num_hops > NUM_MAX_HOPS)
+		return false;
+
+	fillerlen = 2 * (num_hops - 1) * SECURITY_PARAMETER;
+	hopfillerlen = (num_hops - 1) * HOP_PAYLOAD_SIZE;
 
 	for (i = 0; i < num_hops; i++)
-		serialize_hoppayload(binhoppayloads[i], &hoppayloads[i]);
+		serialize_hoppayload(ws->binhoppayloads[i], &hoppayloads[i]);
 
+	memset(packet, 0, sizeof(*packet));
 	if (MESSAGE_SIZE > messagelen) {
-		memset(&packet->hoppayloads, 0, TOTAL_HOP_PAYLOAD_SIZE);
 #if MESSAGE_SIZE != 0  /* Suppress GCC warning about 0-length memset */
 		memset(&packet->payload, 0xFF, MESSAGE_SIZE);
 #endif
@@ -408,42 +435,40 @@ struct onionpacket *create_onionpacket(
 		packet->payload[messagelen] = 0x7f;
 	}
 
-	if (!params)
-		return NULL;
+	if (!generate_hop_params(secpctx, sessionkey, path, num_hops, params))
+		return false;
 	packet->version = 1;
 	memset(nextaddr, 0, 20);
 	memset(nexthmac, 0, 20);
-	memset(packet->routinginfo, 0, ROUTING_INFO_SIZE);
 
-	generate_header_padding(filler, sizeof(filler), 2 * SECURITY_PARAMETER,
-				"rho", 3, num_hops, params);
-	generate_header_padding(hopfiller, sizeof(hopfiller), HOP_PAYLOAD_SIZE,
-				"gamma", 5, num_hops, params);
+	generate_header_padding(ws->filler, fillerlen, 2 * SECURITY_PARAMETER,
+				"rho", 3, num_hops, params, ws->cipher_stream);
+	generate_header_padding(ws->hopfiller, hopfillerlen, HOP_PAYLOAD_SIZE,
+				"gamma", 5, num_hops, params, ws->cipher_stream);
 
 	for (i = num_hops - 1; i >= 0; i--) {
 		generate_key_set(params[i].secret, &keys);
-		generate_cipher_stream(stream, keys.rho, ROUTING_INFO_SIZE);
 
 		/* Rightshift mix-header by 2*SECURITY_PARAMETER */
 		memmove(packet->routinginfo + 2 * SECURITY_PARAMETER, packet->routinginfo,
 			ROUTING_INFO_SIZE - 2 * SECURITY_PARAMETER);
 		memcpy(packet->routinginfo, nextaddr, SECURITY_PARAMETER);
 		memcpy(packet->routinginfo + SECURITY_PARAMETER, nexthmac, SECURITY_PARAMETER);
-		xorbytes(packet->routinginfo, packet->routinginfo, stream, ROUTING_INFO_SIZE);
+		stream_encrypt(packet->routinginfo, packet->routinginfo,
+			       ROUTING_INFO_SIZE, keys.rho);
 
 		/* Rightshift hop-payloads and obfuscate */
 		memmove(packet->hoppayloads + HOP_PAYLOAD_SIZE, packet->hoppayloads,
 			TOTAL_HOP_PAYLOAD_SIZE - HOP_PAYLOAD_SIZE);
-		memcpy(packet->hoppayloads, binhoppayloads[i], HOP_PAYLOAD_SIZE);
-		generate_cipher_stream(hopstream, keys.gamma, TOTAL_HOP_PAYLOAD_SIZE);
-		xorbytes(packet->hoppayloads, packet->hoppayloads, hopstream,
-			 TOTAL_HOP_PAYLOAD_SIZE);
+		memcpy(packet->hoppayloads, ws->binhoppayloads[i], HOP_PAYLOAD_SIZE);
+		stream_encrypt(packet->hoppayloads, packet->hoppayloads,
+			       TOTAL_HOP_PAYLOAD_SIZE, keys.gamma);
 
 		if (i == num_hops - 1) {
 			size_t len = (NUM_MAX_HOPS - num_hops + 1) * 2 * SECURITY_PARAMETER;
-			memcpy(packet->routinginfo + len, filler, sizeof(filler));
+			memcpy(packet->routinginfo + len, ws->filler, fillerlen);
 			len = (NUM_MAX_HOPS - num_hops + 1) * HOP_PAYLOAD_SIZE;
-			memcpy(packet->hoppayloads + len, hopfiller, sizeof(hopfiller));
+			memcpy(packet->hoppayloads + len, ws->hopfiller, hopfillerlen);
 		}
 
 		/* Obfuscate end-to-end payload */
@@ -454,6 +479,30 @@ struct onionpacket *create_onionpacket(
 	}
 	memcpy(packet->mac, nexthmac, sizeof(nexthmac));
 	memcpy(&packet->ephemeralkey, &params[0].ephemeralkey, sizeof(secp256k1_pubkey));
+	return true;
+}
+
+struct sphinx_workspace *new_sphinx_workspace(const tal_t *ctx)
+{
+	return tal(ctx, struct sphinx_workspace);
+}
+
+struct onionpacket *create_onionpacket(
+	const tal_t *ctx,
+	secp256k1_context *secpctx,
+	struct sphinx_workspace *ws,
+	struct pubkey *path,
+	struct hoppayload hoppayloads[],
+	const u8 *sessionkey,
+	const u8 *message,
+	const size_t messagelen
+	)
+{
+	struct onionpacket *packet = tal(ctx, struct onionpacket);
+
+	if (!build_onionpacket(packet, ws, secpctx, path, hoppayloads,
+			       sessionkey, message, messagelen))
+		return tal_free(packet);
 	return packet;
 }
 
@@ -472,11 +521,8 @@ struct route_step *process_onionpacket(
 	u8 secret[SHARED_SECRET_SIZE];
 	u8 hmac[20];
 	struct keyset keys;
-	u8 paddedhoppayloads[TOTAL_HOP_PAYLOAD_SIZE + HOP_PAYLOAD_SIZE];
-	u8 hopstream[TOTAL_HOP_PAYLOAD_SIZE + HOP_PAYLOAD_SIZE];
 	u8 blind[BLINDING_FACTOR_SIZE];
-	u8 stream[NUM_STREAM_BYTES];
-	u8 paddedheader[ROUTING_INFO_SIZE + 2 * SECURITY_PARAMETER];
+	u8 header[CHACHA20_BLOCK], hop[CHACHA20_BLOCK];
 
 	step->next = talz(ctx, struct onionpacket);
 	step->next->version = msg->version;
@@ -491,32 +537,22 @@ struct route_step *process_onionpacket(
 	}
 
 	//FIXME:store seen secrets to avoid replay attacks
-	generate_cipher_stream(stream, keys.rho, sizeof(stream));
-
-	memset(paddedheader, 0, sizeof(paddedheader));
-	memcpy(paddedheader, msg->routinginfo, ROUTING_INFO_SIZE);
-	xorbytes(paddedheader, paddedheader, stream, sizeof(stream));
+	unwrap_field(header, step->next->routinginfo, msg->routinginfo,
+		     ROUTING_INFO_SIZE, 2 * SECURITY_PARAMETER, keys.rho);
 
 	/* Extract the per-hop payload */
-	generate_cipher_stream(hopstream, keys.gamma, sizeof(hopstream));
-
-	memset(paddedhoppayloads, 0, sizeof(paddedhoppayloads));
-	memcpy(paddedhoppayloads, msg->hoppayloads, TOTAL_HOP_PAYLOAD_SIZE);
-	xorbytes(paddedhoppayloads, paddedhoppayloads, hopstream, sizeof(hopstream));
-	step->hoppayload = parse_hoppayload(step, paddedhoppayloads);
-	memcpy(&step->next->hoppayloads, paddedhoppayloads + HOP_PAYLOAD_SIZE,
-	       TOTAL_HOP_PAYLOAD_SIZE);
+	unwrap_field(hop, step->next->hoppayloads, msg->hoppayloads,
+		     TOTAL_HOP_PAYLOAD_SIZE, HOP_PAYLOAD_SIZE, keys.gamma);
+	step->hoppayload = parse_hoppayload(step, hop);
 
 	compute_blinding_factor(secpctx, &msg->ephemeralkey, secret, blind);
 	if (!blind_group_element(secpctx, &step->next->ephemeralkey, &msg->ephemeralkey, blind))
 		return NULL;
-	memcpy(&step->next->nexthop, paddedheader, SECURITY_PARAMETER);
-	memcpy(&step->next->mac,
-	       paddedheader + SECURITY_PARAMETER,
+	memcpy(&step->next->nexthop, header, SECURITY_PARAMETER);
+	memcpy(&step->next->mac, header + SECURITY_PARAMETER,
 	       SECURITY_PARAMETER);
 
 	stream_decrypt(step->next->payload, msg->payload, sizeof(msg->payload), keys.pi);
-	memcpy(&step->next->routinginfo, paddedheader + 2 * SECURITY_PARAMETER, ROUTING_INFO_SIZE);
 
 	if (memeqzero(step->next->mac, sizeof(&step->next->mac))) {
 		step->nextcase = ONION_END;
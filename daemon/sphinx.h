@@ -50,12 +50,23 @@ struct route_step {
 	struct hoppayload *hoppayload;
 };
 
+/**
+ * new_sphinx_workspace - Allocate scratch space for create_onionpacket.
+ *
+ * @ctx: tal context to allocate from
+ *
+ * It's several kilobytes, so keep one around rather than allocating it
+ * for every packet.
+ */
+struct sphinx_workspace *new_sphinx_workspace(const tal_t *ctx);
+
 /**
  * create_onionpacket - Create a new onionpacket that can be routed
  * over a path of intermediate nodes.
  *
  * @ctx: tal context to allocate from
  * @secpctx: the secp256k1_context for EC operations
+ * @ws: scratch space from new_sphinx_workspace()
  * @path: public keys of nodes along the path.
  * @hoppayloads: payloads destined for individual hosts (limited to
  *    HOP_PAYLOAD_SIZE bytes)
@@ -67,6 +78,7 @@ struct route_step {
 struct onionpacket *create_onionpacket(
 	const tal_t * ctx,
 	secp256k1_context * secpctx,
+	struct sphinx_workspace *ws,
 	struct pubkey path[],
 	struct hoppayload hoppayloads[],
 	const u8 * sessionkey,
@@ -0,0 +1,377 @@
+#include "daemon/bitcoind.c"
+#include "daemon/json.c"
+#include "daemon/jsmn/jsmn.c"
+#include "daemon/timeout.c"
+#include <ccan/str/str.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* AUTOGENERATED MOCKS START */
+/* AUTOGENERATED MOCKS END */
+
+/* We use these, so they can't abort. */
+static struct timeabs mock_time;
+
+struct timeabs controlled_time(void)
+{
+	if (mock_time.ts.tv_sec)
+		return mock_time;
+	return time_now();
+}
+
+void fatal(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	abort();
+}
+
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+bool log_enabled(struct log *log UNNEEDED, int level UNNEEDED)
+{
+	return true;
+}
+
+/* Regtest genesis block. */
+static const char genesis_hex[] =
+	"0100000000000000000000000000000000000000000000000000000000000000"
+	"000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa"
+	"4b1e5e4adae5494dffff7f200200000001010000000100000000000000000000"
+	"00000000000000000000000000000000000000000000ffffffff4d04ffff001d"
+	"0104455468652054696d65732030332f4a616e2f32303039204368616e63656c"
+	"6c6f72206f6e206272696e6b206f66207365636f6e64206261696c6f75742066"
+	"6f722062616e6b73ffffffff0100f2052a01000000434104678afdb0fe554827"
+	"1967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4"
+	"f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac00000000";
+
+#define TIP_HEX "0f9188f13cb7b2c71f2a335e3a4fc328bf5beb436012afca590b1a11466e2206"
+
+/* The mock bitcoind: answers canned responses, holding them back until
+ * mock_hold requests are outstanding. */
+struct mock_conn {
+	struct list_node list;
+	struct io_conn *conn;
+	char *buf;
+	size_t len, new;
+	char *reply;
+};
+
+static struct list_head mock_conns;
+static size_t mock_accepted, mock_pending, mock_max_pending, mock_hold;
+static size_t mock_stall;
+static const char *mock_auth;
+
+static void destroy_mock_conn(struct mock_conn *mc)
+{
+	list_del_from(&mock_conns, &mc->list);
+}
+
+static struct io_plan *mock_read(struct io_conn *conn, struct mock_conn *mc);
+
+static struct io_plan *mock_reply(struct io_conn *conn, struct mock_conn *mc)
+{
+	mock_pending--;
+	return io_write(conn, mc->reply, strlen(mc->reply), mock_read, mc);
+}
+
+static char *mock_answer(struct mock_conn *mc, const char *body, size_t len)
+{
+	const jsmntok_t *toks, *method, *params, *id;
+	const char *result;
+	char *buf = tal_strndup(mc, body, len);
+	unsigned int status = 200, num;
+	bool valid, verbose;
+
+	toks = json_parse_input(buf, len, &valid);
+	assert(toks);
+	method = json_get_member(buf, toks, "method");
+	params = json_get_member(buf, toks, "params");
+	id = json_get_member(buf, toks, "id");
+	assert(method && params && id);
+
+	if (json_tok_streq(buf, method, "getblockcount"))
+		result = "\"result\":102,\"error\":null";
+	else if (json_tok_streq(buf, method, "getblockhash")) {
+		assert(json_tok_number(buf, json_get_arr(params, 0), &num));
+		assert(num == 102);
+		result = "\"result\":\"" TIP_HEX "\",\"error\":null";
+	} else if (json_tok_streq(buf, method, "estimatefee")) {
+		assert(json_tok_number(buf, json_get_arr(params, 0), &num));
+		if (num == 2)
+			result = "\"result\":-1,\"error\":null";
+		else
+			result = "\"result\":0.00010000,\"error\":null";
+	} else if (json_tok_streq(buf, method, "getchaintips"))
+		result = "\"result\":["
+			"{\"height\":101,\"hash\":\"" TIP_HEX "\","
+			"\"branchlen\":1,\"status\":\"valid-fork\"},"
+			"{\"height\":102,\"hash\":\"" TIP_HEX "\","
+			"\"branchlen\":0,\"status\":\"active\"}],"
+			"\"error\":null";
+	else if (json_tok_streq(buf, method, "getblock")) {
+		assert(json_get_arr(params, 0)->type == JSMN_STRING);
+		assert(json_tok_bool(buf, json_get_arr(params, 1), &verbose));
+		assert(!verbose);
+		result = tal_fmt(mc, "\"result\":\"%s\",\"error\":null",
+				 genesis_hex);
+	} else if (json_tok_streq(buf, method, "sendrawtransaction")) {
+		status = 500;
+		result = "\"result\":null,\"error\":{\"code\":-26,"
+			"\"message\":\"txn-mempool-conflict\"}";
+	} else
+		abort();
+
+	body = tal_fmt(mc, "{%s,\"id\":%.*s}\n", result,
+		       json_tok_len(id), json_tok_contents(buf, id));
+	return tal_fmt(mc, "HTTP/1.1 %u %s\r\n"
+		       "Content-Type: application/json\r\n"
+		       "Date: Sat, 15 Oct 2016 00:00:00 GMT\r\n"
+		       "Content-Length: %zu\r\n"
+		       "\r\n%s",
+		       status, status == 200 ? "OK" : "Internal Server Error",
+		       strlen(body), body);
+}
+
+static struct io_plan *mock_read(struct io_conn *conn, struct mock_conn *mc)
+{
+	const char *end, *auth, *clen;
+	size_t hdrlen, bodylen;
+
+	mc->len += mc->new;
+	mc->new = 0;
+	end = memmem(mc->buf, mc->len, "\r\n\r\n", 4);
+	if (end) {
+		hdrlen = end + 4 - mc->buf;
+		clen = strstr(mc->buf, "Content-Length: ");
+		assert(clen && clen < end);
+		bodylen = atol(clen + strlen("Content-Length: "));
+		if (mc->len >= hdrlen + bodylen) {
+			assert(strstarts(mc->buf, "POST / HTTP/1.1\r\n"));
+			auth = strstr(mc->buf, "Authorization: Basic ");
+			assert(auth && auth < end);
+			assert(strstarts(auth + strlen("Authorization: Basic "),
+					 mock_auth));
+
+			mc->reply = mock_answer(mc, mc->buf + hdrlen, bodylen);
+			mc->len -= hdrlen + bodylen;
+			memmove(mc->buf, mc->buf + hdrlen + bodylen, mc->len);
+			mc->buf[mc->len] = '\0';
+
+			/* Never answer this one. */
+			if (mock_stall) {
+				mock_stall--;
+				return io_wait(conn, &mock_stall, mock_reply, mc);
+			}
+
+			if (++mock_pending > mock_max_pending)
+				mock_max_pending = mock_pending;
+			if (mock_pending < mock_hold)
+				return io_wait(conn, &mock_hold, mock_reply, mc);
+			io_wake(&mock_hold);
+			return mock_reply(conn, mc);
+		}
+	}
+
+	if (mc->len + 1 == tal_count(mc->buf))
+		tal_resize(&mc->buf, tal_count(mc->buf) * 2);
+	mc->buf[mc->len] = '\0';
+	return io_read_partial(conn, mc->buf + mc->len,
+			       tal_count(mc->buf) - mc->len - 1,
+			       &mc->new, mock_read, mc);
+}
+
+static struct io_plan *mock_connected(struct io_conn *conn, void *unused)
+{
+	struct mock_conn *mc = tal(conn, struct mock_conn);
+
+	mc->conn = conn;
+	mc->buf = tal_arr(mc, char, 100);
+	mc->len = mc->new = 0;
+	list_add_tail(&mock_conns, &mc->list);
+	tal_add_destructor(mc, destroy_mock_conn);
+	mock_accepted++;
+	return mock_read(conn, mc);
+}
+
+static int mock_bitcoind(const tal_t *ctx)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	    || listen(fd, 10) != 0
+	    || getsockname(fd, (struct sockaddr *)&addr, &len) != 0)
+		abort();
+	io_new_listener(ctx, fd, mock_connected, NULL);
+	return ntohs(addr.sin_port);
+}
+
+static size_t outstanding;
+
+/* As lightningd's main loop does, so requests can time out. */
+static void *run_loop(struct lightningd_state *dstate)
+{
+	for (;;) {
+		struct timer *expired;
+		void *v = io_loop(&dstate->timers, &expired);
+
+		if (!expired)
+			return v;
+		timer_expired(dstate, expired);
+	}
+}
+
+static void done(void)
+{
+	if (--outstanding == 0)
+		io_break(&outstanding);
+}
+
+static void got_blockcount(struct lightningd_state *dstate, u32 blockcount,
+			   void *unused)
+{
+	assert(blockcount == 102);
+	done();
+}
+
+static void got_blockhash(struct lightningd_state *dstate,
+			  const struct sha256_double *blkid, void *unused)
+{
+	char hex[hex_str_size(sizeof(*blkid))];
+
+	bitcoin_blkid_to_hex(blkid, hex, sizeof(hex));
+	assert(streq(hex, TIP_HEX));
+	done();
+}
+
+static void got_fee(struct lightningd_state *dstate, u64 rate, void *unused)
+{
+	/* 0.0001 BTC at 6 blocks, doubled. */
+	assert(rate == 20000);
+	done();
+}
+
+static void got_chaintip(struct lightningd_state *dstate,
+			 const struct sha256_double *tipid, void *unused)
+{
+	got_blockhash(dstate, tipid, unused);
+}
+
+static void got_block(struct lightningd_state *dstate,
+		      struct bitcoin_block *blk, void *unused)
+{
+	assert(blk->num_txs == 1);
+	assert(blk->hdr.nonce == 2);
+	done();
+}
+
+static void got_sendrawtx(struct lightningd_state *dstate,
+			  const char *msg, void *unused)
+{
+	assert(streq(msg, "txn-mempool-conflict"));
+	done();
+}
+
+int main(void)
+{
+	struct lightningd_state *dstate = tal(NULL, struct lightningd_state);
+	char dir[] = "/tmp/run-bitcoind.XXXXXX";
+	struct sha256_double blkid;
+	struct mock_conn *mc;
+	size_t i;
+	int port;
+	FILE *f;
+
+	signal(SIGPIPE, SIG_IGN);
+	list_head_init(&mock_conns);
+	port = mock_bitcoind(dstate);
+
+	if (!mkdtemp(dir))
+		abort();
+	bitcoin_datadir = tal_fmt(dstate, "%s", dir);
+	f = fopen(path_join(dstate, dir, "bitcoin.conf"), "w");
+	fprintf(f, "# Comment\nregtest=1\nrpcport=%u\n"
+		"rpcuser=user\nrpcpassword=pass\n", port);
+	fclose(f);
+	mock_auth = base64(dstate, "user:pass");
+
+	dstate->base_log = NULL;
+	dstate->testnet = true;
+	dstate->config.regtest = true;
+	dstate->config.bitcoind_max_requests = 4;
+	dstate->config.bitcoind_timeout = time_from_sec(60);
+	timers_init(&dstate->timers, controlled_time());
+	list_head_init(&dstate->bitcoin_req);
+	setup_bitcoind(dstate);
+	assert(strends(dstate->bitcoind->endpoint,
+		       tal_fmt(dstate, ":%u", port)));
+
+	/* Requests overlap, up to the limit, on kept-alive connections. */
+	mock_hold = 4;
+	for (i = 0; i < 20; i++) {
+		bitcoind_getblockcount(dstate, got_blockcount, NULL);
+		outstanding++;
+	}
+	assert(run_loop(dstate) == &outstanding);
+	assert(mock_max_pending == 4);
+	assert(mock_accepted == 4);
+	assert(dstate->bitcoind->num_conns == 4);
+
+	/* bitcoind times out idle connections: we have to reconnect. */
+	list_for_each(&mock_conns, mc, list)
+		io_close(mc->conn);
+
+	mock_hold = 1;
+	memset(&blkid, 0, sizeof(blkid));
+	bitcoind_getblockhash(dstate, 102, got_blockhash, NULL);
+	bitcoind_estimate_fee(dstate, got_fee, NULL);
+	bitcoind_get_chaintip(dstate, got_chaintip, NULL);
+	bitcoind_getrawblock(dstate, &blkid, got_block, NULL);
+	bitcoind_sendrawtx(dstate, "00", got_sendrawtx, NULL);
+	outstanding += 5;
+	assert(run_loop(dstate) == &outstanding);
+	assert(mock_accepted > 4 && mock_accepted <= 8);
+	assert(dstate->bitcoind->num_conns <= 4);
+
+	/* When bitcoind stalls, we drop that connection rather than
+	 * waiting for the late answer, and ask again.  That works on the
+	 * real clock: stopping the mock one doesn't stop it. */
+	dstate->config.bitcoind_timeout = time_from_msec(10);
+	mock_time = time_now();
+	mock_stall = 2;
+	bitcoind_getblockcount(dstate, got_blockcount, NULL);
+	bitcoind_sendrawtx(dstate, "00", got_sendrawtx, NULL);
+	outstanding += 2;
+	assert(run_loop(dstate) == &outstanding);
+	assert(mock_stall == 0);
+	assert(dstate->bitcoind->num_conns <= 4);
+	mock_time.ts.tv_sec = 0;
+
+	/* The endpoint is also the Host: header. */
+	tal_free(dstate->bitcoind);
+	f = fopen(path_join(dstate, dir, "bitcoin.conf"), "w");
+	fprintf(f, "rpcconnect=::1\nrpcport=%u\n"
+		"rpcuser=user\nrpcpassword=pass\n", port);
+	fclose(f);
+	setup_bitcoind(dstate);
+	assert(streq(dstate->bitcoind->endpoint,
+		     tal_fmt(dstate, "[::1]:%u", port)));
+
+	unlink(path_join(dstate, dir, "bitcoin.conf"));
+	rmdir(dir);
+	timers_cleanup(&dstate->timers);
+	tal_free(dstate);
+	return 0;
+}
@@ -0,0 +1,443 @@
+#include "bitcoin/pullpush.h"
+#include "bitcoin/test/fill.h"
+#include "daemon/chaintopology.c"
+#include "daemon/watch.c"
+#include <ccan/err/err.h>
+#include <ccan/str/hex/hex.h>
+#include <ccan/str/str.h>
+#include <ccan/tal/grab_file/grab_file.h>
+#include <ccan/time/time.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for bitcoind_get_chaintip_ */
+void bitcoind_get_chaintip_(struct lightningd_state *dstate UNNEEDED,
+			     void (*cb)(struct lightningd_state *dstate UNNEEDED,
+					const struct sha256_double *tipid UNNEEDED,
+					void *arg) UNNEEDED,
+			     void *arg UNNEEDED)
+{ fprintf(stderr, "bitcoind_get_chaintip_ called!\n"); abort(); }
+/* Generated stub for bitcoind_getblockcount_ */
+void bitcoind_getblockcount_(struct lightningd_state *dstate UNNEEDED,
+			     void (*cb)(struct lightningd_state *dstate UNNEEDED,
+					u32 blockcount UNNEEDED,
+					void *arg) UNNEEDED,
+			     void *arg UNNEEDED)
+{ fprintf(stderr, "bitcoind_getblockcount_ called!\n"); abort(); }
+/* Generated stub for bitcoind_getblockhash_ */
+void bitcoind_getblockhash_(struct lightningd_state *dstate UNNEEDED,
+			    u32 height UNNEEDED,
+			    void (*cb)(struct lightningd_state *dstate UNNEEDED,
+				       const struct sha256_double *blkid UNNEEDED,
+				       void *arg) UNNEEDED,
+			    void *arg UNNEEDED)
+{ fprintf(stderr, "bitcoind_getblockhash_ called!\n"); abort(); }
+/* Generated stub for bitcoind_getrawblock_ */
+void bitcoind_getrawblock_(struct lightningd_state *dstate UNNEEDED,
+			   const struct sha256_double *blockid UNNEEDED,
+			   void (*cb)(struct lightningd_state *dstate UNNEEDED,
+				      struct bitcoin_block *blk UNNEEDED,
+				      void *arg) UNNEEDED,
+			   void *arg UNNEEDED)
+{ fprintf(stderr, "bitcoind_getrawblock_ called!\n"); abort(); }
+/* Generated stub for bitcoind_sendrawtx_ */
+void bitcoind_sendrawtx_(struct lightningd_state *dstate UNNEEDED,
+			 const char *hextx UNNEEDED,
+			 void (*cb)(struct lightningd_state *dstate UNNEEDED,
+				    const char *msg UNNEEDED, void *) UNNEEDED,
+			 void *arg UNNEEDED)
+{ fprintf(stderr, "bitcoind_sendrawtx_ called!\n"); abort(); }
+/* Generated stub for fatal */
+void fatal(const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "fatal called!\n"); abort(); }
+/* Generated stub for new_reltimer_ */
+struct oneshot *new_reltimer_(struct lightningd_state *dstate UNNEEDED,
+			      const tal_t *ctx UNNEEDED,
+			      struct timerel expire UNNEEDED,
+			      void (*cb)(void *) UNNEEDED, void *arg UNNEEDED)
+{ fprintf(stderr, "new_reltimer_ called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* We use these, so they can't abort. */
+void bitcoind_estimate_fee_(struct lightningd_state *dstate UNNEEDED,
+			    void (*cb)(struct lightningd_state *dstate UNNEEDED,
+				       u64 rate UNNEEDED, void *) UNNEEDED,
+			    void *arg UNNEEDED)
+{
+}
+
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+bool log_enabled(struct log *log UNNEEDED, int level UNNEEDED)
+{
+	return true;
+}
+
+void log_blob_(struct log *log UNNEEDED, enum log_level level UNNEEDED, const char *fmt UNNEEDED,
+	       size_t len UNNEEDED, ...)
+{
+}
+
+void log_struct_(struct log *log UNNEEDED, int level UNNEEDED,
+		 const char *structname UNNEEDED,
+		 const char *fmt UNNEEDED, ...)
+{
+}
+
+const struct siphash_seed *siphash_seed(void)
+{
+	static struct siphash_seed seed;
+	return &seed;
+}
+
+/* Two p2wpkh spends, to two p2wpkh outputs. */
+static struct bitcoin_tx *random_tx(const tal_t *ctx)
+{
+	struct bitcoin_tx *tx = bitcoin_tx(ctx, 2, 2);
+	size_t i;
+
+	for (i = 0; i < tx->input_count; i++) {
+		fill(&tx->input[i].txid, sizeof(tx->input[i].txid));
+		tx->input[i].index = random() % 2;
+		tx->input[i].witness = tal_arr(tx, u8 *, 2);
+		tx->input[i].witness[0] = tal_arr(tx, u8, 72);
+		tx->input[i].witness[1] = tal_arr(tx, u8, 33);
+		fill(tx->input[i].witness[0], 72);
+		fill(tx->input[i].witness[1], 33);
+	}
+	for (i = 0; i < tx->output_count; i++) {
+		tx->output[i].amount = random();
+		tx->output[i].script_length = 22;
+		tx->output[i].script = tal_arr(tx, u8, 22);
+		fill(tx->output[i].script, 22);
+	}
+	return tx;
+}
+
+static char *block_hex(const tal_t *ctx, const struct sha256_double *prev,
+		       struct bitcoin_tx **txs)
+{
+	struct bitcoin_block_hdr hdr;
+	u8 varint[VARINT_MAX_LEN], *block = tal_arr(ctx, u8, 0);
+	size_t i, n = txs ? tal_count(txs) : 0;
+	char *hex;
+
+	fill(&hdr, sizeof(hdr));
+	hdr.prev_hash = *prev;
+	push(&hdr, sizeof(hdr), &block);
+	push(varint, varint_put(varint, n), &block);
+	for (i = 0; i < n; i++) {
+		u8 *lin = linearize_tx(block, txs[i]);
+		push(lin, tal_count(lin), &block);
+		tal_free(lin);
+	}
+	hex = tal_hexstr(ctx, block, tal_count(block));
+	tal_free(block);
+	return hex;
+}
+
+/* Block on top of prev, containing txs (may be NULL). */
+static struct bitcoin_block *make_block(const struct sha256_double *prev,
+					struct bitcoin_tx **txs)
+{
+	char *hex = block_hex(NULL, prev, txs);
+	struct bitcoin_block *blk = bitcoin_block_from_hex(NULL, hex,
+							   strlen(hex));
+
+	tal_free(hex);
+	return blk;
+}
+
+static struct lightningd_state *new_dstate(void)
+{
+	struct lightningd_state *dstate = talz(NULL, struct lightningd_state);
+	struct sha256_double zero;
+	struct topology *topo;
+
+	list_head_init(&dstate->peers);
+	txwatch_hash_init(&dstate->txwatches);
+	txowatch_hash_init(&dstate->txowatches);
+
+	topo = dstate->topology = tal(dstate, struct topology);
+	block_map_init(&topo->block_map);
+	tx_map_init(&topo->tx_map);
+	topo->feerate = 0;
+	topo->startup = false;
+
+	memset(&zero, 0, sizeof(zero));
+	topo->root = new_block(dstate, make_block(&zero, NULL), NULL);
+	topo->root->height = 0;
+	block_map_add(&topo->block_map, topo->root);
+	topo->tip = topo->root;
+	return dstate;
+}
+
+static void free_dstate(struct lightningd_state *dstate)
+{
+	struct topology *topo = dstate->topology;
+
+	free_blocks(dstate, topo->root);
+	block_map_clear(&topo->block_map);
+	tx_map_clear(&topo->tx_map);
+	txwatch_hash_clear(&dstate->txwatches);
+	txowatch_hash_clear(&dstate->txowatches);
+	tal_free(dstate);
+}
+
+/* Extend the chain from prev with these blocks, each containing a tx. */
+static void add_chain(struct lightningd_state *dstate, struct block *prev,
+		      struct bitcoin_tx **txs)
+{
+	struct block *b = NULL;
+	struct sha256_double *blkids;
+	size_t i, n = tal_count(txs);
+	struct bitcoin_block **blks;
+
+	/* We need the blkids to link them, so create them forwards... */
+	blks = tal_arr(dstate, struct bitcoin_block *, n);
+	blkids = tal_arr(blks, struct sha256_double, n);
+	for (i = 0; i < n; i++) {
+		struct bitcoin_tx **one = tal_arr(blks, struct bitcoin_tx *, 1);
+		one[0] = txs[i];
+		blks[i] = make_block(i ? &blkids[i-1] : &prev->blkid, one);
+		sha256_double(&blkids[i], &blks[i]->hdr, sizeof(blks[i]->hdr));
+	}
+
+	/* ... but new_block wants them backwards. */
+	for (i = n; i > 0; i--)
+		b = new_block(dstate, blks[i-1], b);
+	tal_free(blks);
+	topology_changed(dstate, prev, b);
+}
+
+static unsigned int last_depth;
+static size_t depth_calls, spend_calls;
+
+static enum watch_result tx_depth(struct peer *peer, unsigned int depth,
+				  const struct sha256_double *txid, void *unused)
+{
+	last_depth = depth;
+	depth_calls++;
+	return KEEP_WATCHING;
+}
+
+static enum watch_result txo_spent(struct peer *peer,
+				   const struct bitcoin_tx *tx,
+				   size_t input_num, void *unused)
+{
+	spend_calls++;
+	return KEEP_WATCHING;
+}
+
+static void test_reorg(void)
+{
+	struct lightningd_state *dstate = new_dstate();
+	struct topology *topo = dstate->topology;
+	struct peer *peer = talz(dstate, struct peer);
+	struct bitcoin_tx **txs = tal_arr(dstate, struct bitcoin_tx *, 3);
+	struct bitcoin_tx *watched;
+	struct sha256_double txid, txid2, old_blkid;
+	size_t i;
+
+	peer->dstate = dstate;
+	for (i = 0; i < tal_count(txs); i++)
+		txs[i] = random_tx(dstate);
+
+	/* Watch the tx in the first block, and output 1 of it. */
+	watched = txs[0];
+	bitcoin_txid(watched, &txid);
+	watch_txid(peer, peer, &txid, tx_depth, NULL);
+	watch_txo(peer, peer, &txid, 1, txo_spent, NULL);
+	txs[2]->input[1].txid = txid;
+	txs[2]->input[1].index = 1;
+
+	add_chain(dstate, topo->root, txs);
+	assert(topo->tip->height == 3);
+	assert(get_tx_depth(dstate, &txid) == 3);
+	assert(last_depth == 3 && depth_calls == 1);
+	assert(spend_calls == 1);
+
+	/* A tx we're not watching isn't indexed. */
+	bitcoin_txid(txs[1], &txid2);
+	assert(get_tx_depth(dstate, &txid2) == 0);
+
+	/* Another block: the confirmed watch goes deeper. */
+	tal_resize(&txs, 1);
+	txs[0] = random_tx(dstate);
+	add_chain(dstate, topo->tip, txs);
+	assert(last_depth == 4 && depth_calls == 2);
+
+	/* Reorg out from the root: tx is kicked out, old blocks forgotten. */
+	old_blkid = topo->root->next->blkid;
+	tal_resize(&txs, 5);
+	for (i = 0; i < tal_count(txs); i++)
+		txs[i] = random_tx(dstate);
+	add_chain(dstate, topo->root, txs);
+	assert(topo->tip->height == 5);
+	assert(get_tx_depth(dstate, &txid) == 0);
+	assert(last_depth == 0 && depth_calls == 3);
+	assert(!block_map_get(&topo->block_map, &old_blkid));
+	assert(topo->tx_map.raw.elems == 0);
+
+	/* More blocks don't bother the unconfirmed watch. */
+	tal_resize(&txs, 2);
+	txs[0] = random_tx(dstate);
+	txs[1] = random_tx(dstate);
+	add_chain(dstate, topo->tip, txs);
+	assert(depth_calls == 3);
+
+	/* Then it reappears. */
+	txs[0] = watched;
+	add_chain(dstate, topo->tip, txs);
+	assert(get_tx_depth(dstate, &txid) == 2);
+	assert(last_depth == 2 && depth_calls == 4);
+
+	free_dstate(dstate);
+}
+
+static struct sha256_double late_txid;
+static unsigned int late_depth;
+
+static enum watch_result late_depth_cb(struct peer *peer, unsigned int depth,
+				       const struct sha256_double *txid,
+				       void *unused)
+{
+	late_depth = depth;
+	return KEEP_WATCHING;
+}
+
+/* Watches another tx in the chain, once. */
+static enum watch_result add_watch(struct peer *peer, unsigned int depth,
+				   const struct sha256_double *txid,
+				   void *unused)
+{
+	watch_txid(peer, peer, &late_txid, late_depth_cb, NULL);
+	return DELETE_WATCH;
+}
+
+static void test_multiple_watches(void)
+{
+	struct lightningd_state *dstate = new_dstate();
+	struct topology *topo = dstate->topology;
+	struct peer *peer = talz(dstate, struct peer);
+	struct bitcoin_tx **txs = tal_arr(dstate, struct bitcoin_tx *, 2);
+	struct sha256_double txid;
+
+	peer->dstate = dstate;
+	txs[0] = random_tx(dstate);
+	txs[1] = random_tx(dstate);
+	bitcoin_txid(txs[0], &txid);
+	bitcoin_txid(txs[1], &late_txid);
+
+	/* Both watches on txs[0] fire; the one added by a callback catches
+	 * up immediately, whichever tx we went through first. */
+	last_depth = depth_calls = 0;
+	watch_txid(peer, peer, &txid, tx_depth, NULL);
+	watch_txid(peer, peer, &txid, add_watch, NULL);
+	watch_txid(peer, peer, &late_txid, tx_depth, NULL);
+	add_chain(dstate, topo->root, txs);
+	assert(depth_calls == 2);
+	assert(late_depth == 1);
+	assert(watching_txid(dstate, &txid));
+
+	/* Next block: the remaining watch on each tx fires, not the
+	 * deleted one. */
+	tal_resize(&txs, 1);
+	txs[0] = random_tx(dstate);
+	add_chain(dstate, topo->tip, txs);
+	assert(depth_calls == 4);
+	assert(late_depth == 2);
+
+	free_dstate(dstate);
+}
+
+/* Replays blk through connect_block; returns blocks per second. */
+static double replay(struct lightningd_state *dstate,
+		     struct bitcoin_block **blks, size_t runs)
+{
+	struct topology *topo = dstate->topology;
+	struct timeabs start = time_now();
+	size_t i, j;
+
+	for (i = 0; i < runs; i++) {
+		for (j = 0; j < tal_count(blks); j++) {
+			/* connect_block frees b->full: share the tx bytes. */
+			struct bitcoin_block *blk = tal_dup(NULL,
+							    struct bitcoin_block,
+							    blks[j]);
+			struct block *b = new_block(dstate, blk, NULL);
+
+			topo->root->next = b;
+			connect_block(dstate, topo->root, b);
+			free_blocks(dstate, b);
+			topo->root->next = NULL;
+		}
+	}
+	return runs * tal_count(blks) * 1000000.0
+		/ time_to_usec(time_between(time_now(), start));
+}
+
+/* With arguments, benchmarks connect_block on blocks in those files (as
+ * given by "bitcoin-cli getblock <hash> false"), or "gen" for a random
+ * 1MB one, with increasing numbers of txos watched. */
+int main(int argc, char *argv[])
+{
+	struct lightningd_state *dstate;
+	struct bitcoin_block **blks;
+	struct peer *peer;
+	size_t i, num_watches = 0;
+	static const size_t watches[] = { 1000, 100000, 1000000 };
+
+	srandom(1);
+	test_reorg();
+	test_multiple_watches();
+
+	if (argc == 1)
+		return 0;
+
+	dstate = new_dstate();
+	peer = talz(dstate, struct peer);
+	peer->dstate = dstate;
+	blks = tal_arr(dstate, struct bitcoin_block *, argc - 1);
+	for (i = 1; i < argc; i++) {
+		char *hex;
+
+		if (streq(argv[i], "gen")) {
+			struct bitcoin_tx **txs;
+			size_t j;
+
+			txs = tal_arr(NULL, struct bitcoin_tx *, 2600);
+			for (j = 0; j < tal_count(txs); j++)
+				txs[j] = random_tx(txs);
+			hex = block_hex(NULL, &dstate->topology->root->blkid, txs);
+			tal_free(txs);
+		} else {
+			hex = grab_file(NULL, argv[i]);
+			if (!hex)
+				err(1, "Reading %s", argv[i]);
+			hex[strcspn(hex, "\n")] = '\0';
+		}
+		blks[i-1] = bitcoin_block_from_hex(blks, hex, strlen(hex));
+		if (!blks[i-1])
+			errx(1, "%s: bad block", argv[i]);
+		tal_free(hex);
+	}
+
+	printf("%zu txowatches: %.1f blocks/sec\n",
+	       num_watches, replay(dstate, blks, 10));
+	for (i = 0; i < ARRAY_SIZE(watches); i++) {
+		while (num_watches < watches[i]) {
+			struct sha256_double txid;
+
+			fill(&txid, sizeof(txid));
+			watch_txo(peer, peer, &txid, random() % 2,
+				  txo_spent, NULL);
+			num_watches++;
+		}
+		printf("%zu txowatches: %.1f blocks/sec\n",
+		       num_watches, replay(dstate, blks, 10));
+	}
+	free_dstate(dstate);
+	return 0;
+}
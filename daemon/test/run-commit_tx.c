@@ -0,0 +1,426 @@
+#include "bitcoin/test/fill.h"
+#include "daemon/commit_tx.c"
+#include "daemon/htlc.c"
+#include "daemon/output_to_htlc.c"
+#include "permute_tx.c"
+#include <ccan/array_size/array_size.h>
+#include <ccan/time/time.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for db_new_htlc */
+void db_new_htlc(struct peer *peer UNNEEDED, const struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "db_new_htlc called!\n"); abort(); }
+/* Generated stub for db_update_htlc_state */
+void db_update_htlc_state(struct peer *peer UNNEEDED, const struct htlc *htlc UNNEEDED,
+				 enum htlc_state oldstate UNNEEDED)
+{ fprintf(stderr, "db_update_htlc_state called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* We use these, so they can't abort. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+bool log_enabled(struct log *log UNNEEDED, int level UNNEEDED)
+{
+	return true;
+}
+void log_struct_(struct log *log UNNEEDED, int level UNNEEDED,
+		 const char *structname UNNEEDED,
+		 const char *fmt UNNEEDED, ...)
+{
+}
+
+const struct siphash_seed *siphash_seed(void)
+{
+	static struct siphash_seed seed;
+	return &seed;
+}
+
+static secp256k1_context *secpctx;
+
+static void random_pubkey(struct pubkey *key)
+{
+	struct privkey privkey;
+
+	do
+		fill(&privkey, sizeof(privkey));
+	while (!pubkey_from_privkey(secpctx, &privkey, key));
+}
+
+static void destroy_test_peer(struct peer *peer)
+{
+	htlc_map_clear(&peer->htlcs);
+}
+
+static struct peer *new_test_peer(void)
+{
+	struct peer *peer = talz(NULL, struct peer);
+
+	peer->dstate = talz(peer, struct lightningd_state);
+	peer->dstate->secpctx = secpctx;
+	htlc_map_init(&peer->htlcs);
+	random_pubkey(&peer->local.finalkey);
+	random_pubkey(&peer->remote.finalkey);
+	blocks_to_rel_locktime(144, &peer->local.locktime);
+	blocks_to_rel_locktime(288, &peer->remote.locktime);
+	fill(&peer->anchor.txid, sizeof(peer->anchor.txid));
+	peer->anchor.satoshis = 1ULL << 50;
+	peer->local.commit = talz(peer, struct commit_info);
+	peer->local.commit->commit_num = 5;
+	peer->remote.commit = talz(peer, struct commit_info);
+	peer->remote.commit->commit_num = 5;
+	tal_add_destructor(peer, destroy_test_peer);
+	return peer;
+}
+
+static void destroy_htlc(struct htlc *h)
+{
+	htlc_map_del(&h->peer->htlcs, h);
+}
+
+/* Lots of equal amounts, and some dust. */
+static struct htlc *add_htlc(struct peer *peer, u64 id, enum htlc_state state)
+{
+	struct htlc *h = talz(peer, struct htlc);
+
+	h->peer = peer;
+	h->id = id;
+	h->state = state;
+	h->msatoshi = (id % 11 == 0) ? 1000 : 1000000 * (1 + id % 7);
+	blocks_to_abs_locktime(500000 + id % 3, &h->expiry);
+	fill(&h->rhash, sizeof(h->rhash));
+	htlc_map_add(&peer->htlcs, h);
+	tal_add_destructor(h, destroy_htlc);
+	return h;
+}
+
+/* How permute_outputs used to sort. */
+static void old_permute_outputs(struct bitcoin_tx_output *outputs, size_t num)
+{
+	size_t i, j, best;
+
+	for (i = 0; i < num; i++) {
+		struct bitcoin_tx_output tmp;
+
+		for (best = i, j = i + 1; j < num; j++)
+			if (output_cmp(&outputs[j], &outputs[best]) < 0)
+				best = j;
+		tmp = outputs[i];
+		outputs[i] = outputs[best];
+		outputs[best] = tmp;
+	}
+}
+
+/* How create_commit_tx used to do it: build everything, then sort. */
+static struct bitcoin_tx *old_commit_tx(const tal_t *ctx, struct peer *peer,
+					const struct sha256 *rhash,
+					const struct channel_state *cstate,
+					enum side side)
+{
+	struct bitcoin_tx *tx = bitcoin_tx(ctx, 1, 2 + htlc_map_count(&peer->htlcs));
+	struct htlc_map_iter it;
+	struct htlc *h;
+	u64 total = 0;
+
+	tx->input[0].txid = peer->anchor.txid;
+	tx->input[0].index = peer->anchor.index;
+	tx->input[0].amount = tal_dup(tx->input, u64, &peer->anchor.satoshis);
+
+	tx->output_count = 0;
+	add_output(tx, commit_output_to_us(tx, peer, rhash, side, NULL),
+		   cstate->side[LOCAL].pay_msat / 1000, &total);
+	add_output(tx, commit_output_to_them(tx, peer, rhash, side, NULL),
+		   cstate->side[REMOTE].pay_msat / 1000, &total);
+	for (h = htlc_map_first(&peer->htlcs, &it);
+	     h;
+	     h = htlc_map_next(&peer->htlcs, &it)) {
+		if (!htlc_has(h, HTLC_FLAG(side, HTLC_F_COMMITTED)))
+			continue;
+		add_output(tx, scriptpubkey_p2wsh(tx, wscript_for_htlc(tx, peer,
+								       h, rhash,
+								       side)),
+			   h->msatoshi / 1000, &total);
+	}
+	old_permute_outputs(tx->output, tx->output_count);
+	return tx;
+}
+
+static void check_same(struct peer *peer, const struct channel_state *cstate,
+		       enum side side)
+{
+	struct sha256 rhash;
+	struct bitcoin_tx *tx, *old;
+	u8 *a, *b;
+	bool otherside_only;
+
+	fill(&rhash, sizeof(rhash));
+	tx = create_commit_tx(peer, peer, &rhash, cstate, side,
+			      &otherside_only);
+	old = old_commit_tx(peer, peer, &rhash, cstate, side);
+	a = linearize_tx(tx, tx);
+	b = linearize_tx(old, old);
+	assert(memeq(a, tal_count(a), b, tal_count(b)));
+	tal_free(tx);
+	tal_free(old);
+}
+
+/* HTLCs come and go, and the tx is always what it used to be. */
+static void check_commit_tx(void)
+{
+	struct peer *peer = new_test_peer();
+	struct channel_state cstate;
+	struct htlc *h[100];
+	size_t i, round;
+	u64 id = 0;
+
+	cstate.side[LOCAL].pay_msat = 2000000;
+	cstate.side[REMOTE].pay_msat = 5000000;
+	for (i = 0; i < ARRAY_SIZE(h); i++)
+		h[i] = NULL;
+
+	for (round = 0; round < 50; round++) {
+		for (i = 0; i < 5; i++) {
+			size_t n = random() % ARRAY_SIZE(h);
+			if (h[n])
+				h[n] = tal_free(h[n]);
+			else
+				h[n] = add_htlc(peer, id++,
+						n % 2 ? SENT_ADD_ACK_REVOCATION
+						: RCVD_ADD_ACK_REVOCATION);
+		}
+		/* Dust to us or them sometimes. */
+		cstate.side[round % 2].pay_msat = (round % 3) ? 2000000 : 100;
+		check_same(peer, &cstate, LOCAL);
+		check_same(peer, &cstate, REMOTE);
+	}
+	tal_free(peer);
+}
+
+/* Returns usec for each of n commits with num HTLCs, one changing. */
+static double time_commit(size_t num, size_t n, bool old)
+{
+	struct peer *peer = new_test_peer();
+	struct channel_state cstate;
+	struct timeabs start;
+	struct sha256 rhash;
+	struct htlc *last = NULL;
+	size_t i;
+
+	cstate.side[LOCAL].pay_msat = 2000000;
+	cstate.side[REMOTE].pay_msat = 5000000;
+	for (i = 0; i < num; i++)
+		last = add_htlc(peer, i, SENT_ADD_ACK_REVOCATION);
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		bool otherside_only;
+
+		fill(&rhash, sizeof(rhash));
+		tal_free(last);
+		last = add_htlc(peer, num + i, SENT_ADD_ACK_REVOCATION);
+		if (old)
+			tal_free(old_commit_tx(peer, peer, &rhash, &cstate,
+					       LOCAL));
+		else
+			tal_free(create_commit_tx(peer, peer, &rhash, &cstate,
+						  LOCAL, &otherside_only));
+	}
+	tal_free(peer);
+	return (double)time_to_usec(time_between(time_now(), start)) / n;
+}
+
+static u8 *htlc_p2wsh(const tal_t *ctx, const struct peer *peer,
+		      const struct htlc *h, const struct sha256 *rhash)
+{
+	return scriptpubkey_p2wsh(ctx, wscript_for_htlc(ctx, peer, h, rhash,
+							LOCAL));
+}
+
+/* How many outputs the HTLCs in our commit tx get (dust gets none). */
+static size_t num_htlc_outputs(const struct peer *peer)
+{
+	struct htlc_map_iter it;
+	struct htlc *h;
+	size_t num = 0;
+
+	for (h = htlc_map_first(&peer->htlcs, &it);
+	     h;
+	     h = htlc_map_next(&peer->htlcs, &it)) {
+		if (htlc_has(h, HTLC_LOCAL_F_COMMITTED)
+		    && !is_dust(h->msatoshi / 1000))
+			num++;
+	}
+	return num;
+}
+
+/* Every HTLC output maps back to its HTLC, and only live ones are used. */
+static void check_output_map(void)
+{
+	struct peer *peer = new_test_peer();
+	struct htlc *pending, *removed;
+	struct channel_state cstate;
+	struct htlc_output_map *omap;
+	struct bitcoin_tx *tx;
+	struct sha256 rhash;
+	const u8 *wscript;
+	u8 *script;
+	bool otherside_only;
+	size_t i, num, found = 0;
+
+	for (i = 0; i < 50; i++)
+		add_htlc(peer, i, SENT_ADD_ACK_REVOCATION);
+	num = num_htlc_outputs(peer);
+	pending = add_htlc(peer, 50, SENT_ADD_HTLC);
+	removed = add_htlc(peer, 51, RCVD_REMOVE_ACK_REVOCATION);
+	cstate.side[LOCAL].pay_msat = 2000000;
+	cstate.side[REMOTE].pay_msat = 5000000;
+	fill(&rhash, sizeof(rhash));
+	tx = create_commit_tx(peer, peer, &rhash, &cstate, LOCAL,
+			      &otherside_only);
+
+	omap = get_htlc_output_map(peer, peer, &rhash, LOCAL, 5);
+	for (i = 0; i < tx->output_count; i++) {
+		struct htlc *h = txout_get_htlc(omap, tx->output[i].script,
+						tx->output[i].script_length,
+						&wscript);
+		if (!h)
+			continue;
+		assert(h->msatoshi / 1000 == tx->output[i].amount);
+		assert(htlc_has(h, HTLC_LOCAL_F_COMMITTED));
+		assert(memeq(tx->output[i].script, tx->output[i].script_length,
+			     htlc_p2wsh(tx, peer, h, &rhash), 34));
+		found++;
+	}
+	assert(found == num);
+
+	/* The removed one would have been in an older commit. */
+	script = htlc_p2wsh(tx, peer, removed, &rhash);
+	assert(!txout_get_htlc(omap, script, tal_count(script), &wscript));
+	tal_free(omap);
+	omap = get_htlc_output_map(peer, peer, &rhash, LOCAL, 4);
+	assert(txout_get_htlc(omap, script, tal_count(script), &wscript)
+	       == removed);
+
+	/* The pending one never was. */
+	script = htlc_p2wsh(tx, peer, pending, &rhash);
+	assert(!txout_get_htlc(omap, script, tal_count(script), &wscript));
+	tal_free(peer);
+}
+
+/* How it used to work: every HTLC's script in an array, searched each
+ * time. */
+struct old_wpkh {
+	struct htlc *h;
+	const u8 *wscript;
+	struct sha256 hash;
+};
+
+static struct old_wpkh *old_output_map(const tal_t *ctx,
+				       const struct peer *peer,
+				       const struct sha256 *rhash)
+{
+	struct old_wpkh *wpkh = tal_arr(ctx, struct old_wpkh,
+					htlc_map_count(&peer->htlcs));
+	struct htlc_map_iter it;
+	struct htlc *h;
+	size_t i;
+
+	for (i = 0, h = htlc_map_first(&peer->htlcs, &it);
+	     h;
+	     h = htlc_map_next(&peer->htlcs, &it), i++) {
+		wpkh[i].h = h;
+		wpkh[i].wscript = wscript_for_htlc(wpkh, peer, h, rhash, LOCAL);
+		sha256(&wpkh[i].hash, wpkh[i].wscript,
+		       tal_count(wpkh[i].wscript));
+	}
+	return wpkh;
+}
+
+static struct htlc *old_txout_get_htlc(struct old_wpkh *wpkh,
+				       const u8 *script, size_t script_len)
+{
+	size_t i;
+
+	if (!is_p2wsh(script, script_len))
+		return NULL;
+	for (i = 0; i < tal_count(wpkh); i++) {
+		if (!memcmp(script + 2, wpkh[i].hash.u.u8,
+			    sizeof(wpkh[i].hash)))
+			return wpkh[i].h;
+	}
+	return NULL;
+}
+
+/* Returns usec to map every output of a num HTLC unilateral close. */
+static u64 time_resolve(size_t num, bool old)
+{
+	struct peer *peer = new_test_peer();
+	struct channel_state cstate;
+	struct bitcoin_tx *tx;
+	struct sha256 rhash;
+	struct timeabs start;
+	const u8 *wscript;
+	bool otherside_only;
+	size_t i, found = 0;
+	u64 usec;
+
+	for (i = 0; i < num; i++)
+		add_htlc(peer, i, SENT_ADD_ACK_REVOCATION);
+	num = num_htlc_outputs(peer);
+	cstate.side[LOCAL].pay_msat = 2000000;
+	cstate.side[REMOTE].pay_msat = 5000000;
+	fill(&rhash, sizeof(rhash));
+	tx = create_commit_tx(peer, peer, &rhash, &cstate, LOCAL,
+			      &otherside_only);
+
+	start = time_now();
+	if (old) {
+		struct old_wpkh *wpkh = old_output_map(peer, peer, &rhash);
+		for (i = 0; i < tx->output_count; i++)
+			found += old_txout_get_htlc(wpkh, tx->output[i].script,
+						    tx->output[i].script_length)
+				!= NULL;
+		tal_free(wpkh);
+	} else {
+		struct htlc_output_map *omap;
+
+		omap = get_htlc_output_map(peer, peer, &rhash, LOCAL, 5);
+		for (i = 0; i < tx->output_count; i++)
+			found += txout_get_htlc(omap, tx->output[i].script,
+						tx->output[i].script_length,
+						&wscript) != NULL;
+		tal_free(omap);
+	}
+	usec = time_to_usec(time_between(time_now(), start));
+	assert(found == num);
+	tal_free(peer);
+	return usec;
+}
+
+/* With an argument, benchmarks that many commits of 10 to 1000 HTLCs,
+ * and resolving a 1000 HTLC unilateral close. */
+int main(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 10, 100, 1000 };
+	size_t i;
+
+	secpctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN
+					   | SECP256K1_CONTEXT_VERIFY);
+	srandom(1);
+	check_commit_tx();
+	check_output_map();
+
+	if (argc > 1) {
+		size_t n = atol(argv[1]);
+		for (i = 0; i < ARRAY_SIZE(sizes); i++)
+			printf("%zu htlcs: %.1f usec (was %.1f usec)\n",
+			       sizes[i],
+			       time_commit(sizes[i], n, false),
+			       time_commit(sizes[i], n, true));
+		printf("1000 htlcs resolved: %"PRIu64"usec (was %"PRIu64"usec)\n",
+		       time_resolve(1000, false), time_resolve(1000, true));
+	}
+	secp256k1_context_destroy(secpctx);
+	return 0;
+}
@@ -0,0 +1,318 @@
+#include "daemon/cryptopkt.c"
+#include "lightning.pb-c.c"
+#include "names.c"
+#include <ccan/array_size/array_size.h>
+#include <ccan/time/time.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for log_blob_ */
+void log_blob_(struct log *log UNNEEDED, enum log_level level UNNEEDED, const char *fmt UNNEEDED,
+	       size_t len UNNEEDED, ...)
+{ fprintf(stderr, "log_blob_ called!\n"); abort(); }
+/* Generated stub for privkey_sign */
+void privkey_sign(struct lightningd_state *dstate UNNEEDED, const void *src UNNEEDED, size_t len UNNEEDED,
+		  struct signature *sig UNNEEDED)
+{ fprintf(stderr, "privkey_sign called!\n"); abort(); }
+/* Generated stub for proto_to_pubkey */
+bool proto_to_pubkey(secp256k1_context *secpctx UNNEEDED,
+		     const BitcoinPubkey *pb UNNEEDED, struct pubkey *key UNNEEDED)
+{ fprintf(stderr, "proto_to_pubkey called!\n"); abort(); }
+/* Generated stub for proto_to_signature */
+bool proto_to_signature(secp256k1_context *secpctx UNNEEDED,
+			const Signature *pb UNNEEDED,
+			struct signature *sig UNNEEDED)
+{ fprintf(stderr, "proto_to_signature called!\n"); abort(); }
+/* Generated stub for pubkey_to_proto */
+BitcoinPubkey *pubkey_to_proto(const tal_t *ctx UNNEEDED,
+			       secp256k1_context *secpctx UNNEEDED,
+			       const struct pubkey *key UNNEEDED)
+{ fprintf(stderr, "pubkey_to_proto called!\n"); abort(); }
+/* Generated stub for signature_to_proto */
+Signature *signature_to_proto(const tal_t *ctx UNNEEDED,
+			      secp256k1_context *secpctx UNNEEDED,
+			      const struct signature *sig UNNEEDED)
+{ fprintf(stderr, "signature_to_proto called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* We use these, so they can't abort. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+bool log_enabled(struct log *log UNNEEDED, int level UNNEEDED)
+{
+	return true;
+}
+void log_io(struct log *log UNNEEDED, bool in UNNEEDED,
+	    const void *data UNNEEDED, size_t len UNNEEDED)
+{
+}
+
+/* Loopback of a stream of update_add_htlc packets, in batches. */
+static struct loopback {
+	size_t batch, total, sent, received, writes;
+	u8 onion[1254];
+} *lb;
+
+static Pkt *htlc_pkt(const tal_t *ctx, u64 id)
+{
+	Pkt *pkt = tal(ctx, Pkt);
+	UpdateAddHtlc *u = tal(pkt, UpdateAddHtlc);
+
+	update_add_htlc__init(u);
+	u->id = id;
+	u->amount_msat = 1000 + id;
+	u->r_hash = tal(u, Sha256Hash);
+	sha256_hash__init(u->r_hash);
+	u->r_hash->a = id;
+	u->expiry = tal(u, Locktime);
+	locktime__init(u->expiry);
+	u->expiry->locktime_case = LOCKTIME__LOCKTIME_BLOCKS;
+	u->expiry->blocks = 500000;
+	u->route = tal(u, Routing);
+	routing__init(u->route);
+	u->route->info.len = sizeof(lb->onion);
+	u->route->info.data = lb->onion;
+
+	pkt__init(pkt);
+	pkt->pkt_case = PKT__PKT_UPDATE_ADD_HTLC;
+	pkt->update_add_htlc = u;
+	return pkt;
+}
+
+/* What pkt_out sees: fill, drain some, wrap around, grow, drain all. */
+static void test_outpkt_ring(void)
+{
+	struct peer *peer = talz(NULL, struct peer);
+	Pkt *pkts[20], *pkt;
+	size_t i, in = 0, out = 0;
+
+	for (i = 0; i < ARRAY_SIZE(pkts); i++)
+		pkts[i] = tal(peer, Pkt);
+	peer->outpkt = tal_arr(peer, Pkt *, 8);
+
+	while (in < 8)
+		queue_outpkt(peer, pkts[in++]);
+	assert(tal_count(peer->outpkt) == 8);
+
+	while (out < 5) {
+		pkt = dequeue_outpkt(peer);
+		assert(pkt == pkts[out++]);
+	}
+
+	/* These go around the end. */
+	while (in < 13)
+		queue_outpkt(peer, pkts[in++]);
+	assert(tal_count(peer->outpkt) == 8);
+	assert(peer->outpkt_start == 5);
+	assert(peek_outpkt(peer, 0) == pkts[out]);
+	assert(peek_outpkt(peer, 7) == pkts[in-1]);
+
+	/* Full and wrapped: this one doubles it. */
+	while (in < ARRAY_SIZE(pkts))
+		queue_outpkt(peer, pkts[in++]);
+	assert(tal_count(peer->outpkt) == 16);
+	assert(peer->num_outpkt == in - out);
+
+	while (peer->num_outpkt) {
+		pkt = dequeue_outpkt(peer);
+		assert(pkt == pkts[out++]);
+	}
+	assert(out == in);
+
+	tal_free(peer);
+}
+
+static struct io_plan *send_batch(struct io_conn *conn, struct peer *peer)
+{
+	size_t i;
+
+	if (lb->sent == lb->total)
+		return io_wait(conn, lb, io_close_cb, NULL);
+
+	/* What pkt_out does with a queue this long. */
+	for (i = 0; i < lb->batch && lb->sent < lb->total; i++) {
+		Pkt *pkt = htlc_pkt(peer, lb->sent++);
+		peer_encrypt_packet(peer, pkt);
+		tal_free(pkt);
+	}
+	lb->writes++;
+	return peer_write_packets(conn, peer, send_batch);
+}
+
+static struct io_plan *recv_pkt(struct io_conn *conn, struct peer *peer)
+{
+	assert(peer->inpkt->pkt_case == PKT__PKT_UPDATE_ADD_HTLC);
+	assert(peer->inpkt->update_add_htlc->id == lb->received);
+	assert(peer->inpkt->update_add_htlc->route->info.len
+	       == sizeof(lb->onion));
+
+	if (++lb->received == lb->total) {
+		io_wake(lb);
+		return io_close(conn);
+	}
+	return peer_read_packet(conn, peer, recv_pkt);
+}
+
+static struct io_plan *recv_start(struct io_conn *conn, struct peer *peer)
+{
+	return peer_read_packet(conn, peer, recv_pkt);
+}
+
+/* Returns packets per second. */
+static double loopback(size_t total, size_t batch, size_t *writes)
+{
+	struct peer *sender, *receiver;
+	struct io_data *out, *in;
+	u8 secret[32], pubkey[33];
+	struct timeabs start;
+	int fds[2];
+
+	lb = talz(NULL, struct loopback);
+	memset(secret, 1, sizeof(secret));
+	memset(pubkey, 2, sizeof(pubkey));
+	memset(lb->onion, 3, sizeof(lb->onion));
+	lb->batch = batch;
+	lb->total = total;
+
+	/* The peers only need io_data (and a NULL log). */
+	sender = talz(lb, struct peer);
+	out = sender->io_data = talz(sender, struct io_data);
+	out->outbuf = tal_arr(out, u8, 0);
+	setup_crypto(&out->out, secret, pubkey);
+
+	receiver = talz(lb, struct peer);
+	in = receiver->io_data = talz(receiver, struct io_data);
+	arena_init(in, &in->arena);
+	setup_crypto(&in->in, secret, pubkey);
+
+	if (socketpair(AF_LOCAL, SOCK_STREAM, 0, fds) != 0)
+		abort();
+
+	start = time_now();
+	io_new_conn(lb, fds[0], send_batch, sender);
+	io_new_conn(lb, fds[1], recv_start, receiver);
+	io_loop(NULL, NULL);
+
+	assert(lb->received == total);
+	*writes = lb->writes;
+	tal_free(lb);
+	return total * 1000000.0
+		/ time_to_usec(time_between(time_now(), start));
+}
+
+static size_t num_allocs;
+
+static void *counting_malloc(size_t size)
+{
+	num_allocs++;
+	return malloc(size);
+}
+
+/* How we used to unpack: a tal allocation per field. */
+static void *proto_tal_alloc(void *allocator_data, size_t size)
+{
+	return tal_arr(allocator_data, char, size);
+}
+
+static void proto_tal_free(void *allocator_data, void *pointer)
+{
+	tal_free(pointer);
+}
+
+/* Unpacks n update_add_htlcs, returns usec; *allocs is tal allocations. */
+static u64 unpack_burst(size_t n, bool use_arena, size_t *allocs)
+{
+	struct io_data *iod = talz(NULL, struct io_data);
+	struct ProtobufCAllocator prototal;
+	u8 **packed = tal_arr(iod, u8 *, n);
+	struct timeabs start;
+	size_t i;
+
+	lb = talz(iod, struct loopback);
+	arena_init(iod, &iod->arena);
+	for (i = 0; i < n; i++) {
+		Pkt *pkt = htlc_pkt(packed, i);
+		packed[i] = tal_arr(packed, u8, pkt__get_packed_size(pkt));
+		pkt__pack(pkt, packed[i]);
+		tal_free(pkt);
+	}
+
+	if (use_arena) {
+		prototal.alloc = proto_arena_alloc;
+		prototal.free = proto_arena_free;
+		prototal.allocator_data = &iod->arena;
+	} else {
+		prototal.alloc = proto_tal_alloc;
+		prototal.free = proto_tal_free;
+	}
+
+	/* First one grows the arena to fit. */
+	if (use_arena) {
+		pkt__unpack(&prototal, tal_count(packed[0]), packed[0]);
+		arena_reset(&iod->arena);
+	}
+
+	num_allocs = 0;
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		Pkt *pkt;
+
+		if (!use_arena)
+			prototal.allocator_data = tal(iod, char);
+		pkt = pkt__unpack(&prototal, tal_count(packed[i]), packed[i]);
+		assert(pkt->update_add_htlc->id == i);
+		if (use_arena)
+			arena_reset(&iod->arena);
+		else
+			tal_free(prototal.allocator_data);
+	}
+	*allocs = num_allocs;
+	tal_free(iod);
+	return time_to_usec(time_between(time_now(), start));
+}
+
+/* With an argument, benchmarks that many packets each way, and
+ * unpacking them. */
+int main(int argc, char *argv[])
+{
+	static const size_t batches[] = { 1, 3, 8, 64 };
+	size_t i, total, writes, allocs;
+	double rate;
+	u64 usec;
+
+	tal_set_backend(counting_malloc, NULL, NULL, NULL);
+
+	test_outpkt_ring();
+
+	/* One at a time, as a commit round, and everything at once. */
+	loopback(100, 1, &writes);
+	assert(writes == 100);
+	loopback(99, 3, &writes);
+	assert(writes == 33);
+	loopback(100, 1000, &writes);
+	assert(writes == 1);
+
+	/* Once the arena has grown to fit, unpacking doesn't allocate. */
+	unpack_burst(100, true, &allocs);
+	assert(allocs == 0);
+
+	if (argc == 1)
+		return 0;
+
+	total = atol(argv[1]);
+	for (i = 0; i < ARRAY_SIZE(batches); i++) {
+		rate = loopback(total, batches[i], &writes);
+		printf("%zu packets, %zu per write: %zu writes, %.0f packets/sec\n",
+		       total, batches[i], writes, rate);
+	}
+
+	usec = unpack_burst(total, false, &allocs);
+	printf("unpack %zu with tal: %zu allocations, %.2f usec each\n",
+	       total, allocs, (double)usec / total);
+	usec = unpack_burst(total, true, &allocs);
+	printf("unpack %zu with arena: %zu allocations, %.2f usec each\n",
+	       total, allocs, (double)usec / total);
+	return 0;
+}
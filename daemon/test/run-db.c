@@ -0,0 +1,537 @@
+#include "daemon/db.c"
+#include "daemon/htlc.c"
+#include "names.c"
+#include <ccan/time/time.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for add_connection */
+struct node_connection *add_connection(struct lightningd_state *dstate UNNEEDED,
+				       const struct pubkey *from UNNEEDED,
+				       const struct pubkey *to UNNEEDED,
+				       u32 base_fee UNNEEDED, s32 proportional_fee UNNEEDED,
+				       u32 delay UNNEEDED, u32 min_blocks UNNEEDED)
+{ fprintf(stderr, "add_connection called!\n"); abort(); }
+/* Generated stub for fatal */
+void fatal(const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "fatal called!\n"); abort(); }
+/* Generated stub for feechange_state_from_name */
+enum feechange_state feechange_state_from_name(const char *name UNNEEDED)
+{ fprintf(stderr, "feechange_state_from_name called!\n"); abort(); }
+/* Generated stub for feechange_state_name */
+const char *feechange_state_name(enum feechange_state s UNNEEDED)
+{ fprintf(stderr, "feechange_state_name called!\n"); abort(); }
+/* Generated stub for invoice_add */
+void invoice_add(struct lightningd_state *dstate UNNEEDED,
+		 const struct rval *r UNNEEDED,
+		 u64 msatoshi UNNEEDED,
+		 const char *label UNNEEDED,
+		 u64 complete UNNEEDED)
+{ fprintf(stderr, "invoice_add called!\n"); abort(); }
+/* Generated stub for invoices_reserve */
+void invoices_reserve(struct lightningd_state *dstate UNNEEDED, size_t num UNNEEDED)
+{ fprintf(stderr, "invoices_reserve called!\n"); abort(); }
+/* Generated stub for netaddr_from_blob */
+bool netaddr_from_blob(const void *linear UNNEEDED, size_t len UNNEEDED, struct netaddr *a UNNEEDED)
+{ fprintf(stderr, "netaddr_from_blob called!\n"); abort(); }
+/* Generated stub for netaddr_to_blob */
+u8 *netaddr_to_blob(const tal_t *ctx UNNEEDED, const struct netaddr *a UNNEEDED)
+{ fprintf(stderr, "netaddr_to_blob called!\n"); abort(); }
+/* Generated stub for new_commit_info */
+struct commit_info *new_commit_info(const tal_t *ctx UNNEEDED, u64 commit_num UNNEEDED)
+{ fprintf(stderr, "new_commit_info called!\n"); abort(); }
+/* Generated stub for new_feechange */
+struct feechange *new_feechange(struct peer *peer UNNEEDED,
+				u64 fee_rate UNNEEDED,
+				enum feechange_state state UNNEEDED)
+{ fprintf(stderr, "new_feechange called!\n"); abort(); }
+/* Generated stub for new_log */
+struct log *new_log(const tal_t *ctx UNNEEDED, struct log_record *record UNNEEDED, const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "new_log called!\n"); abort(); }
+/* Generated stub for new_peer */
+struct peer *new_peer(struct lightningd_state *dstate UNNEEDED,
+		      struct log *log UNNEEDED,
+		      enum state state UNNEEDED,
+		      enum state_input offer_anchor UNNEEDED)
+{ fprintf(stderr, "new_peer called!\n"); abort(); }
+/* Generated stub for pay_add */
+bool pay_add(struct lightningd_state *dstate UNNEEDED,
+	     const struct sha256 *rhash UNNEEDED,
+	     u64 msatoshi UNNEEDED,
+	     const struct pubkey *ids UNNEEDED,
+	     struct htlc *htlc UNNEEDED,
+	     const u8 *fail UNNEEDED,
+	     const struct rval *r UNNEEDED)
+{ fprintf(stderr, "pay_add called!\n"); abort(); }
+/* Generated stub for peer_get_revocation_hash */
+void peer_get_revocation_hash(const struct peer *peer UNNEEDED, u64 index UNNEEDED,
+			      struct sha256 *rhash UNNEEDED)
+{ fprintf(stderr, "peer_get_revocation_hash called!\n"); abort(); }
+/* Generated stub for peer_set_id */
+void peer_set_id(struct peer *peer UNNEEDED, const struct pubkey *id UNNEEDED)
+{ fprintf(stderr, "peer_set_id called!\n"); abort(); }
+/* Generated stub for peer_set_secrets_from_db */
+void peer_set_secrets_from_db(struct peer *peer UNNEEDED,
+			      const void *commit_privkey UNNEEDED,
+			      size_t commit_privkey_len UNNEEDED,
+			      const void *final_privkey UNNEEDED,
+			      size_t final_privkey_len UNNEEDED,
+			      const void *revocation_seed UNNEEDED,
+			      size_t revocation_seed_len UNNEEDED)
+{ fprintf(stderr, "peer_set_secrets_from_db called!\n"); abort(); }
+/* Generated stub for peer_watch_anchor */
+void peer_watch_anchor(struct peer *peer UNNEEDED,
+		       int depth UNNEEDED,
+		       enum state_input depthok UNNEEDED,
+		       enum state_input timeout UNNEEDED)
+{ fprintf(stderr, "peer_watch_anchor called!\n"); abort(); }
+/* Generated stub for restore_wallet_address */
+bool restore_wallet_address(struct lightningd_state *dstate UNNEEDED,
+			    const struct privkey *privkey UNNEEDED)
+{ fprintf(stderr, "restore_wallet_address called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* We use these, so they can't abort. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+bool log_enabled(struct log *log UNNEEDED, int level UNNEEDED)
+{
+	return true;
+}
+
+void log_add_(struct log *log UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+
+void log_struct_(struct log *log UNNEEDED, int level UNNEEDED,
+		 const char *structname UNNEEDED,
+		 const char *fmt UNNEEDED, ...)
+{
+}
+
+void peer_secrets_for_db(const struct peer *peer UNNEEDED,
+			 const void **commit_privkey,
+			 size_t *commit_privkey_len,
+			 const void **final_privkey,
+			 size_t *final_privkey_len,
+			 const void **revocation_seed,
+			 size_t *revocation_seed_len)
+{
+	static u8 secret[32];
+
+	*commit_privkey = *final_privkey = *revocation_seed = secret;
+	*commit_privkey_len = *final_privkey_len = *revocation_seed_len
+		= sizeof(secret);
+}
+
+const struct siphash_seed *siphash_seed(void)
+{
+	static struct siphash_seed seed;
+	return &seed;
+}
+
+struct peer *find_peer(struct lightningd_state *dstate, const struct pubkey *id)
+{
+	struct peer *peer;
+
+	list_for_each(&dstate->peers, peer, list) {
+		if (pubkey_eq(peer->id, id))
+			return peer;
+	}
+	return NULL;
+}
+
+struct htlc *peer_new_htlc(struct peer *peer,
+			   u64 id,
+			   u64 msatoshi,
+			   const struct sha256 *rhash,
+			   u32 expiry,
+			   const u8 *route,
+			   size_t route_len,
+			   struct htlc *src,
+			   enum htlc_state state)
+{
+	struct htlc *h = tal(peer, struct htlc);
+
+	h->peer = peer;
+	h->state = state;
+	h->id = id;
+	h->msatoshi = msatoshi;
+	h->rhash = *rhash;
+	h->r = NULL;
+	h->fail = NULL;
+	h->expiry.locktime = expiry;
+	h->routing = tal_dup_arr(h, u8, route, route_len, 0);
+	h->src = src;
+	htlc_map_add(&peer->htlcs, h);
+	return h;
+}
+
+/* Reloading runs every HTLC through these: we don't check balances. */
+struct channel_state *initial_cstate(const tal_t *ctx,
+				     uint64_t anchor_satoshis UNNEEDED,
+				     uint64_t fee_rate UNNEEDED,
+				     enum side side UNNEEDED)
+{
+	return talz(ctx, struct channel_state);
+}
+
+struct channel_state *copy_cstate(const tal_t *ctx,
+				  const struct channel_state *cstate)
+{
+	return tal_dup(ctx, struct channel_state, cstate);
+}
+
+void force_add_htlc(struct channel_state *cstate UNNEEDED,
+		    const struct htlc *htlc UNNEEDED)
+{
+}
+
+void force_fail_htlc(struct channel_state *cstate UNNEEDED,
+		     const struct htlc *htlc UNNEEDED)
+{
+}
+
+void force_fulfill_htlc(struct channel_state *cstate UNNEEDED,
+			const struct htlc *htlc UNNEEDED)
+{
+}
+
+bool balance_after_force(struct channel_state *cstate UNNEEDED)
+{
+	return true;
+}
+
+struct bitcoin_tx *create_commit_tx(const tal_t *ctx,
+				    struct peer *peer UNNEEDED,
+				    const struct sha256 *rhash UNNEEDED,
+				    const struct channel_state *cstate UNNEEDED,
+				    enum side side UNNEEDED,
+				    bool *otherside_only)
+{
+	*otherside_only = false;
+	return bitcoin_tx(ctx, 0, 0);
+}
+
+struct oneshot *new_reltimer_(struct lightningd_state *dstate UNNEEDED,
+			      const tal_t *ctx UNNEEDED,
+			      struct timerel expire UNNEEDED,
+			      void (*cb)(void *) UNNEEDED, void *arg UNNEEDED)
+{
+	return NULL;
+}
+
+/* sqlite calls these to make things durable: count them. */
+static size_t num_syncs;
+
+int fsync(int fd)
+{
+	num_syncs++;
+	return syscall(SYS_fsync, fd);
+}
+
+int fdatasync(int fd)
+{
+	num_syncs++;
+	return syscall(SYS_fdatasync, fd);
+}
+
+/* The id is the first valid point from 0x02, @first onwards. */
+static struct peer *new_test_peer(struct lightningd_state *dstate, u8 first)
+{
+	struct peer *peer = talz(dstate, struct peer);
+	u8 key[PUBKEY_DER_LEN] = { 0x02, 1 };
+	size_t i;
+
+	/* Any valid point will do. */
+	for (i = first; i < 256; i++) {
+		key[1] = i;
+		peer->id = tal(peer, struct pubkey);
+		if (pubkey_from_der(dstate->secpctx, key, sizeof(key), peer->id))
+			break;
+	}
+	assert(i < 256);
+
+	peer->dstate = dstate;
+	peer->log = NULL;
+	peer->state = STATE_NORMAL;
+	peer->local.offer_anchor = CMD_OPEN_WITH_ANCHOR;
+	peer->local.commit_fee_rate = 10000;
+	peer->remote.commitkey = peer->remote.finalkey = *peer->id;
+	peer->remote.offer_anchor = CMD_OPEN_WITHOUT_ANCHOR;
+	peer->remote.locktime.locktime = 144;
+	peer->remote.mindepth = 1;
+	peer->remote.commit_fee_rate = 10000;
+	memset(&peer->remote.next_revocation_hash, 1,
+	       sizeof(peer->remote.next_revocation_hash));
+	memset(&peer->anchor, 0, sizeof(peer->anchor));
+	peer->anchor.satoshis = 1000000;
+	peer->anchor.ours = true;
+	peer->local.commit = tal(peer, struct commit_info);
+	peer->remote.commit = tal(peer, struct commit_info);
+	memset(peer->local.commit, 0, sizeof(*peer->local.commit));
+	memset(peer->remote.commit, 0, sizeof(*peer->remote.commit));
+	shachain_init(&peer->their_preimages);
+	htlc_map_init(&peer->htlcs);
+	list_add_tail(&dstate->peers, &peer->list);
+	return peer;
+}
+
+/* What peer.c does to the db as an HTLC is added, committed and revoked. */
+static void htlc_cycle(struct peer *peer, struct htlc *htlc)
+{
+	struct sha256_double txid;
+	struct sha256 prev;
+	const char *err;
+
+	htlc->state = SENT_ADD_HTLC;
+	db_start_transaction(peer);
+	db_new_htlc(peer, htlc);
+	err = db_commit_transaction(peer);
+	assert(!err);
+
+	db_start_transaction(peer);
+	htlc->state = SENT_ADD_COMMIT;
+	db_update_htlc_state(peer, htlc, SENT_ADD_HTLC);
+	peer->remote.commit->commit_num++;
+	prev = peer->remote.commit->revocation_hash;
+	memset(&txid, 0, sizeof(txid));
+	memcpy(&txid, &peer->remote.commit->commit_num,
+	       sizeof(peer->remote.commit->commit_num));
+	db_new_commit_info(peer, REMOTE, &prev);
+	db_add_commit_map(peer, &txid, peer->remote.commit->commit_num);
+	err = db_commit_transaction(peer);
+	assert(!err);
+
+	db_start_transaction(peer);
+	htlc->state = RCVD_ADD_REVOCATION;
+	db_update_htlc_state(peer, htlc, SENT_ADD_COMMIT);
+	db_save_shachain(peer);
+	db_remove_their_prev_revocation_hash(peer);
+	db_update_next_revocation_hash(peer);
+	err = db_commit_transaction(peer);
+	assert(!err);
+}
+
+static size_t count_rows(struct lightningd_state *dstate, const char *query)
+{
+	sqlite3_stmt *stmt;
+	size_t n;
+	int err;
+
+	err = sqlite3_prepare_v2(dstate->db->sql, query, -1, &stmt, NULL);
+	assert(err == SQLITE_OK);
+	err = sqlite3_step(stmt);
+	assert(err == SQLITE_ROW);
+	n = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return n;
+}
+
+static void run(size_t num_cycles, bool wal, const char *sync,
+		size_t group, bool bench)
+{
+	struct lightningd_state *dstate = tal(NULL, struct lightningd_state);
+	struct peer *peer;
+	struct htlc htlc;
+	struct timeabs start;
+	size_t i, syncs, rows;
+	const char *err;
+	bool ok;
+
+	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_NONE);
+	dstate->base_log = NULL;
+	list_head_init(&dstate->peers);
+	dstate->config.db_wal = wal;
+	dstate->config.db_synchronous = cast_const(char *, sync);
+	dstate->config.db_group_commit = (group != 0);
+	db_init(dstate);
+
+	peer = new_test_peer(dstate, 1);
+	ok = db_create_peer(peer);
+	assert(ok);
+	ok = db_set_visible_state(peer);
+	assert(ok);
+	db_start_transaction(peer);
+	db_set_anchor(peer);
+	err = db_commit_transaction(peer);
+	assert(!err);
+
+	memset(&htlc, 0, sizeof(htlc));
+	htlc.peer = peer;
+	htlc.msatoshi = 1000;
+	htlc.routing = tal_arrz(peer, u8, 100);
+
+	syncs = num_syncs;
+	start = time_now();
+	for (i = 0; i < num_cycles; i++) {
+		htlc.id = i;
+		memset(&htlc.rhash, i, sizeof(htlc.rhash));
+		htlc_cycle(peer, &htlc);
+
+		/* As if this many peers did a cycle in one loop iteration. */
+		if (group && (i + 1) % group == 0) {
+			assert(dstate->db->group_open);
+			db_group_commit(dstate);
+			assert(!dstate->db->group_open);
+		}
+	}
+
+	if (group) {
+		struct sha256_double txid;
+
+		/* Failing one transaction doesn't lose the rest of group. */
+		memset(&txid, 0xFF, sizeof(txid));
+		db_start_transaction(peer);
+		db_add_commit_map(peer, &txid, 0);
+		err = db_commit_transaction(peer);
+		assert(!err);
+
+		htlc.id = num_cycles;
+		htlc.state = SENT_ADD_HTLC;
+		db_start_transaction(peer);
+		db_new_htlc(peer, &htlc);
+		db_abort_transaction(peer);
+
+		assert(dstate->db->group_open);
+		db_group_commit(dstate);
+		rows = count_rows(dstate, "SELECT COUNT(*) FROM their_commitments;");
+		assert(rows == num_cycles + 1);
+	} else {
+		rows = count_rows(dstate, "SELECT COUNT(*) FROM their_commitments;");
+		assert(rows == num_cycles);
+	}
+
+	rows = count_rows(dstate, "SELECT COUNT(*) FROM htlcs WHERE state='RCVD_ADD_REVOCATION';");
+	assert(rows == num_cycles);
+	rows = count_rows(dstate, "SELECT COUNT(*) FROM htlcs;");
+	assert(rows == num_cycles);
+	rows = count_rows(dstate, "SELECT COUNT(*) FROM commit_info WHERE prev_revocation_hash IS NULL;");
+	assert(rows == 2);
+
+	if (bench)
+		printf("%zu cycles (%s, synchronous=%s, group %zu): %zu fsyncs, %"PRIu64"usec per cycle\n",
+		       num_cycles, wal ? "wal" : "journal", sync, group,
+		       num_syncs - syncs,
+		       time_to_usec(time_between(time_now(), start))
+		       / num_cycles);
+
+	secp256k1_context_destroy(dstate->secpctx);
+	tal_free(dstate);
+	unlink(DB_FILE);
+}
+
+/* A forwarded HTLC, a failure and their closing sig all read back as written. */
+static void check_reload(void)
+{
+	struct lightningd_state *dstate = tal(NULL, struct lightningd_state);
+	struct peer *in, *out;
+	struct htlc *src, *htlc;
+	struct bitcoin_signature sig;
+	u8 compact[64];
+	const u8 fail[] = { 1, 2, 3, 4, 5, 6, 7 };
+	const char *err;
+	bool ok;
+
+	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_NONE);
+	dstate->base_log = NULL;
+	list_head_init(&dstate->peers);
+	dstate->config.db_wal = false;
+	dstate->config.db_synchronous = "full";
+	dstate->config.db_group_commit = false;
+	db_init(dstate);
+
+	in = new_test_peer(dstate, 1);
+	out = new_test_peer(dstate, 100);
+	assert(!pubkey_eq(in->id, out->id));
+	ok = db_create_peer(in);
+	assert(ok);
+	ok = db_create_peer(out);
+	assert(ok);
+
+	memset(&sig, 0, sizeof(sig));
+	memset(compact, 1, sizeof(compact));
+	ok = secp256k1_ecdsa_signature_parse_compact(dstate->secpctx,
+						     &sig.sig.sig, compact);
+	assert(ok);
+	sig.stype = SIGHASH_ALL;
+
+	/* They offered us src, which made us offer htlc to out. */
+	src = peer_new_htlc(in, 7, 2000, &in->remote.next_revocation_hash,
+			    100, compact, sizeof(compact), NULL,
+			    RCVD_ADD_ACK_REVOCATION);
+	htlc = peer_new_htlc(out, 3, 1000, &src->rhash, 90,
+			     compact, sizeof(compact), src,
+			     SENT_ADD_ACK_REVOCATION);
+	htlc->fail = tal_dup_arr(htlc, u8, fail, sizeof(fail), 0);
+
+	db_start_transaction(in);
+	db_new_htlc(in, src);
+	db_new_htlc(out, htlc);
+	db_htlc_failed(out, htlc);
+	db_begin_shutdown(out);
+	err = db_commit_transaction(in);
+	assert(!err);
+
+	out->closing.their_fee = 1;
+	out->closing.their_sig = &sig;
+	out->closing.sigs_in = 1;
+	ok = db_update_their_closing(out);
+	assert(ok);
+
+	/* Forget them, and load them back. */
+	htlc_map_clear(&in->htlcs);
+	htlc_map_clear(&out->htlcs);
+	htlc_map_init(&in->htlcs);
+	htlc_map_init(&out->htlcs);
+	memset(&out->closing, 0, sizeof(out->closing));
+
+	load_peer_htlcs(in);
+	load_peer_htlcs(out);
+	connect_htlc_src(dstate);
+	load_peer_closing(out);
+
+	src = htlc_get(&in->htlcs, 7, REMOTE);
+	htlc = htlc_get(&out->htlcs, 3, LOCAL);
+	assert(src && htlc);
+	assert(htlc->src == src);
+	assert(tal_count(htlc->fail) == sizeof(fail));
+	assert(memcmp(htlc->fail, fail, sizeof(fail)) == 0);
+	assert(out->closing.their_sig);
+	assert(memcmp(&out->closing.their_sig->sig, &sig.sig,
+		      sizeof(sig.sig)) == 0);
+
+	htlc_map_clear(&in->htlcs);
+	htlc_map_clear(&out->htlcs);
+	secp256k1_context_destroy(dstate->secpctx);
+	tal_free(dstate);
+	unlink(DB_FILE);
+}
+
+/* With an argument, benchmarks that many HTLC cycles. */
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/run-db.XXXXXX";
+	size_t n = argc == 1 ? 10 : atol(argv[1]);
+	bool bench = argc != 1;
+	const char *tmpdir;
+	int err;
+
+	tmpdir = mkdtemp(dir);
+	assert(tmpdir);
+	err = chdir(dir);
+	assert(err == 0);
+
+	run(n, false, "full", 0, bench);
+	run(n, true, "full", 0, bench);
+	run(n, true, "normal", 0, bench);
+	run(n, false, "full", 10, bench);
+	run(n, true, "normal", 10, bench);
+	check_reload();
+
+	err = rmdir(dir);
+	assert(err == 0);
+	return 0;
+}
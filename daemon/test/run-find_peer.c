@@ -0,0 +1,685 @@
+#include "daemon/peer.c"
+#include "daemon/sphinx.c"
+#include <ccan/time/time.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for accept_pkt_close_shutdown */
+Pkt *accept_pkt_close_shutdown(struct peer *peer UNNEEDED, const Pkt *pkt UNNEEDED)
+{ fprintf(stderr, "accept_pkt_close_shutdown called!\n"); abort(); }
+/* Generated stub for accept_pkt_commit */
+Pkt *accept_pkt_commit(struct peer *peer UNNEEDED, const Pkt *pkt UNNEEDED,
+		       struct bitcoin_signature *sig UNNEEDED)
+{ fprintf(stderr, "accept_pkt_commit called!\n"); abort(); }
+/* Generated stub for accept_pkt_htlc_add */
+Pkt *accept_pkt_htlc_add(struct peer *peer UNNEEDED, const Pkt *pkt UNNEEDED, struct htlc **h UNNEEDED)
+{ fprintf(stderr, "accept_pkt_htlc_add called!\n"); abort(); }
+/* Generated stub for accept_pkt_htlc_fail */
+Pkt *accept_pkt_htlc_fail(struct peer *peer UNNEEDED, const Pkt *pkt UNNEEDED, struct htlc **h UNNEEDED,
+			  u8 **fail UNNEEDED)
+{ fprintf(stderr, "accept_pkt_htlc_fail called!\n"); abort(); }
+/* Generated stub for accept_pkt_htlc_fulfill */
+Pkt *accept_pkt_htlc_fulfill(struct peer *peer UNNEEDED, const Pkt *pkt UNNEEDED, struct htlc **h UNNEEDED,
+			     struct rval *r UNNEEDED)
+{ fprintf(stderr, "accept_pkt_htlc_fulfill called!\n"); abort(); }
+/* Generated stub for accept_pkt_revocation */
+Pkt *accept_pkt_revocation(struct peer *peer UNNEEDED, const Pkt *pkt UNNEEDED)
+{ fprintf(stderr, "accept_pkt_revocation called!\n"); abort(); }
+/* Generated stub for accept_pkt_update_fee */
+Pkt *accept_pkt_update_fee(struct peer *peer UNNEEDED, const Pkt *pkt UNNEEDED, u64 *feerate UNNEEDED)
+{ fprintf(stderr, "accept_pkt_update_fee called!\n"); abort(); }
+/* Generated stub for add_connection */
+struct node_connection *add_connection(struct lightningd_state *dstate UNNEEDED,
+				       const struct pubkey *from UNNEEDED,
+				       const struct pubkey *to UNNEEDED,
+				       u32 base_fee UNNEEDED, s32 proportional_fee UNNEEDED,
+				       u32 delay UNNEEDED, u32 min_blocks UNNEEDED)
+{ fprintf(stderr, "add_connection called!\n"); abort(); }
+/* Generated stub for adjust_fee */
+void adjust_fee(struct channel_state *cstate UNNEEDED, uint64_t fee_rate UNNEEDED)
+{ fprintf(stderr, "adjust_fee called!\n"); abort(); }
+/* Generated stub for anchor_too_large */
+bool anchor_too_large(uint64_t anchor_satoshis UNNEEDED)
+{ fprintf(stderr, "anchor_too_large called!\n"); abort(); }
+/* Generated stub for broadcast_tx */
+void broadcast_tx(struct peer *peer UNNEEDED, const struct bitcoin_tx *tx UNNEEDED)
+{ fprintf(stderr, "broadcast_tx called!\n"); abort(); }
+/* Generated stub for can_afford_feerate */
+bool can_afford_feerate(const struct channel_state *cstate UNNEEDED, uint64_t fee_rate UNNEEDED,
+			enum side side UNNEEDED)
+{ fprintf(stderr, "can_afford_feerate called!\n"); abort(); }
+/* Generated stub for command_fail */
+void command_fail(struct command *cmd UNNEEDED, const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "command_fail called!\n"); abort(); }
+/* Generated stub for command_success */
+void command_success(struct command *cmd UNNEEDED, struct json_result *response UNNEEDED)
+{ fprintf(stderr, "command_success called!\n"); abort(); }
+/* Generated stub for commit_output_to_them */
+u8 *commit_output_to_them(const tal_t *ctx UNNEEDED,
+			  const struct peer *peer UNNEEDED,
+			  const struct sha256 *rhash UNNEEDED,
+			  enum side side UNNEEDED,
+			  u8 **wscript UNNEEDED)
+{ fprintf(stderr, "commit_output_to_them called!\n"); abort(); }
+/* Generated stub for commit_output_to_us */
+u8 *commit_output_to_us(const tal_t *ctx UNNEEDED,
+			const struct peer *peer UNNEEDED,
+			const struct sha256 *rhash UNNEEDED,
+			enum side side UNNEEDED,
+			u8 **wscript UNNEEDED)
+{ fprintf(stderr, "commit_output_to_us called!\n"); abort(); }
+/* Generated stub for complete_pay_command */
+void complete_pay_command(struct lightningd_state *dstate UNNEEDED,
+			  const struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "complete_pay_command called!\n"); abort(); }
+/* Generated stub for connection_fee */
+s64 connection_fee(const struct node_connection *c UNNEEDED, u64 msatoshi UNNEEDED)
+{ fprintf(stderr, "connection_fee called!\n"); abort(); }
+/* Generated stub for copy_cstate */
+struct channel_state *copy_cstate(const tal_t *ctx UNNEEDED,
+				  const struct channel_state *cstate UNNEEDED)
+{ fprintf(stderr, "copy_cstate called!\n"); abort(); }
+/* Generated stub for create_close_tx */
+struct bitcoin_tx *create_close_tx(secp256k1_context *secpctx UNNEEDED,
+				   const tal_t *ctx UNNEEDED,
+				   const u8 *our_script UNNEEDED,
+				   const u8 *their_script UNNEEDED,
+				   const struct sha256_double *anchor_txid UNNEEDED,
+				   unsigned int anchor_index UNNEEDED,
+				   u64 anchor_satoshis UNNEEDED,
+				   uint64_t to_us UNNEEDED, uint64_t to_them UNNEEDED)
+{ fprintf(stderr, "create_close_tx called!\n"); abort(); }
+/* Generated stub for create_commit_tx */
+struct bitcoin_tx *create_commit_tx(const tal_t *ctx UNNEEDED,
+				    struct peer *peer UNNEEDED,
+				    const struct sha256 *rhash UNNEEDED,
+				    const struct channel_state *cstate UNNEEDED,
+				    enum side side UNNEEDED,
+				    bool *otherside_only UNNEEDED)
+{ fprintf(stderr, "create_commit_tx called!\n"); abort(); }
+/* Generated stub for cstate_add_htlc */
+bool cstate_add_htlc(struct channel_state *cstate UNNEEDED, const struct htlc *htlc UNNEEDED,
+		     bool must_afford_fee UNNEEDED)
+{ fprintf(stderr, "cstate_add_htlc called!\n"); abort(); }
+/* Generated stub for cstate_fail_htlc */
+void cstate_fail_htlc(struct channel_state *cstate UNNEEDED, const struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "cstate_fail_htlc called!\n"); abort(); }
+/* Generated stub for cstate_fulfill_htlc */
+void cstate_fulfill_htlc(struct channel_state *cstate UNNEEDED, const struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "cstate_fulfill_htlc called!\n"); abort(); }
+/* Generated stub for db_abort_transaction */
+void db_abort_transaction(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_abort_transaction called!\n"); abort(); }
+/* Generated stub for db_add_commit_map */
+void db_add_commit_map(struct peer *peer UNNEEDED,
+		       const struct sha256_double *txid UNNEEDED, u64 commit_num UNNEEDED)
+{ fprintf(stderr, "db_add_commit_map called!\n"); abort(); }
+/* Generated stub for db_add_peer_address */
+bool db_add_peer_address(struct lightningd_state *dstate UNNEEDED,
+			 const struct peer_address *addr UNNEEDED)
+{ fprintf(stderr, "db_add_peer_address called!\n"); abort(); }
+/* Generated stub for db_begin_shutdown */
+void db_begin_shutdown(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_begin_shutdown called!\n"); abort(); }
+/* Generated stub for db_commit_transaction */
+const char *db_commit_transaction(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_commit_transaction called!\n"); abort(); }
+/* Generated stub for db_create_peer */
+bool db_create_peer(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_create_peer called!\n"); abort(); }
+/* Generated stub for db_forget_peer */
+void db_forget_peer(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_forget_peer called!\n"); abort(); }
+/* Generated stub for db_htlc_failed */
+void db_htlc_failed(struct peer *peer UNNEEDED, const struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "db_htlc_failed called!\n"); abort(); }
+/* Generated stub for db_htlc_fulfilled */
+void db_htlc_fulfilled(struct peer *peer UNNEEDED, const struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "db_htlc_fulfilled called!\n"); abort(); }
+/* Generated stub for db_new_commit_info */
+void db_new_commit_info(struct peer *peer UNNEEDED, enum side side UNNEEDED,
+			const struct sha256 *prev_rhash UNNEEDED)
+{ fprintf(stderr, "db_new_commit_info called!\n"); abort(); }
+/* Generated stub for db_remove_their_prev_revocation_hash */
+void db_remove_their_prev_revocation_hash(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_remove_their_prev_revocation_hash called!\n"); abort(); }
+/* Generated stub for db_save_shachain */
+void db_save_shachain(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_save_shachain called!\n"); abort(); }
+/* Generated stub for db_set_our_closing_script */
+void db_set_our_closing_script(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_set_our_closing_script called!\n"); abort(); }
+/* Generated stub for db_set_their_closing_script */
+bool db_set_their_closing_script(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_set_their_closing_script called!\n"); abort(); }
+/* Generated stub for db_start_transaction */
+void db_start_transaction(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_start_transaction called!\n"); abort(); }
+/* Generated stub for db_update_next_revocation_hash */
+void db_update_next_revocation_hash(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_update_next_revocation_hash called!\n"); abort(); }
+/* Generated stub for db_update_our_closing */
+void db_update_our_closing(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_update_our_closing called!\n"); abort(); }
+/* Generated stub for db_update_state */
+void db_update_state(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_update_state called!\n"); abort(); }
+/* Generated stub for db_update_their_closing */
+bool db_update_their_closing(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "db_update_their_closing called!\n"); abort(); }
+/* Generated stub for dequeue_outpkt */
+Pkt *dequeue_outpkt(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "dequeue_outpkt called!\n"); abort(); }
+/* Generated stub for dns_resolve_and_connect_ */
+struct dns_async *dns_resolve_and_connect_(struct lightningd_state *dstate UNNEEDED,
+		  const char *name UNNEEDED, const char *port UNNEEDED,
+		  struct io_plan *(*init)(struct io_conn * UNNEEDED,
+					  struct lightningd_state * UNNEEDED,
+					  void *arg) UNNEEDED,
+		  void (*fail)(struct lightningd_state * UNNEEDED, void *arg) UNNEEDED,
+		  void *arg UNNEEDED)
+{ fprintf(stderr, "dns_resolve_and_connect_ called!\n"); abort(); }
+/* Generated stub for failinfo_create */
+const u8 *failinfo_create(const tal_t *ctx UNNEEDED,
+			  secp256k1_context *secpctx UNNEEDED,
+			  const struct pubkey *id UNNEEDED,
+			  enum fail_error error_code UNNEEDED,
+			  const char *reason UNNEEDED)
+{ fprintf(stderr, "failinfo_create called!\n"); abort(); }
+/* Generated stub for fatal */
+void fatal(const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "fatal called!\n"); abort(); }
+/* Generated stub for fee_by_feerate */
+uint64_t fee_by_feerate(size_t txsize UNNEEDED, uint64_t fee_rate UNNEEDED)
+{ fprintf(stderr, "fee_by_feerate called!\n"); abort(); }
+/* Generated stub for feechange_changestate */
+void feechange_changestate(struct peer *peer UNNEEDED,
+			   struct feechange *feechange UNNEEDED,
+			   enum feechange_state oldstate UNNEEDED,
+			   enum feechange_state newstate UNNEEDED,
+			   bool db_commit UNNEEDED)
+{ fprintf(stderr, "feechange_changestate called!\n"); abort(); }
+/* Generated stub for feechange_state_flags */
+int feechange_state_flags(enum feechange_state state UNNEEDED)
+{ fprintf(stderr, "feechange_state_flags called!\n"); abort(); }
+/* Generated stub for find_p2wsh_out */
+u32 find_p2wsh_out(const struct bitcoin_tx *tx UNNEEDED, const u8 *witnessscript UNNEEDED)
+{ fprintf(stderr, "find_p2wsh_out called!\n"); abort(); }
+/* Generated stub for find_unpaid */
+struct invoice *find_unpaid(struct lightningd_state *dstate UNNEEDED,
+			    const struct sha256 *rhash UNNEEDED)
+{ fprintf(stderr, "find_unpaid called!\n"); abort(); }
+/* Generated stub for force_fee */
+bool force_fee(struct channel_state *cstate UNNEEDED, uint64_t fee UNNEEDED)
+{ fprintf(stderr, "force_fee called!\n"); abort(); }
+/* Generated stub for get_block_height */
+u32 get_block_height(struct lightningd_state *dstate UNNEEDED)
+{ fprintf(stderr, "get_block_height called!\n"); abort(); }
+/* Generated stub for get_feerate */
+u64 get_feerate(struct lightningd_state *dstate UNNEEDED)
+{ fprintf(stderr, "get_feerate called!\n"); abort(); }
+/* Generated stub for get_htlc_output_map */
+struct htlc_output_map *get_htlc_output_map(const tal_t *ctx UNNEEDED,
+					    const struct peer *peer UNNEEDED,
+					    const struct sha256 *rhash UNNEEDED,
+					    enum side side UNNEEDED,
+					    unsigned int commit_num UNNEEDED)
+{ fprintf(stderr, "get_htlc_output_map called!\n"); abort(); }
+/* Generated stub for get_tx_depth */
+size_t get_tx_depth(struct lightningd_state *dstate UNNEEDED,
+		    const struct sha256_double *txid UNNEEDED)
+{ fprintf(stderr, "get_tx_depth called!\n"); abort(); }
+/* Generated stub for htlc_changestate */
+void htlc_changestate(struct htlc *h UNNEEDED,
+		      enum htlc_state oldstate UNNEEDED,
+		      enum htlc_state newstate UNNEEDED,
+		      bool db_commit UNNEEDED)
+{ fprintf(stderr, "htlc_changestate called!\n"); abort(); }
+/* Generated stub for htlc_state_flags */
+int htlc_state_flags(enum htlc_state state UNNEEDED)
+{ fprintf(stderr, "htlc_state_flags called!\n"); abort(); }
+/* Generated stub for htlc_state_name */
+const char *htlc_state_name(enum htlc_state s UNNEEDED)
+{ fprintf(stderr, "htlc_state_name called!\n"); abort(); }
+/* Generated stub for htlc_undostate */
+void htlc_undostate(struct htlc *h UNNEEDED,
+		    enum htlc_state oldstate UNNEEDED, enum htlc_state newstate UNNEEDED)
+{ fprintf(stderr, "htlc_undostate called!\n"); abort(); }
+/* Generated stub for initial_cstate */
+struct channel_state *initial_cstate(const tal_t *ctx UNNEEDED,
+				     uint64_t anchor_satoshis UNNEEDED,
+				     uint64_t fee_rate UNNEEDED,
+				     enum side side UNNEEDED)
+{ fprintf(stderr, "initial_cstate called!\n"); abort(); }
+/* Generated stub for input_name */
+const char *input_name(enum state_input in UNNEEDED)
+{ fprintf(stderr, "input_name called!\n"); abort(); }
+/* Generated stub for json_add_bool */
+void json_add_bool(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		   bool value UNNEEDED)
+{ fprintf(stderr, "json_add_bool called!\n"); abort(); }
+/* Generated stub for json_add_hex */
+void json_add_hex(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		  const void *data UNNEEDED, size_t len UNNEEDED)
+{ fprintf(stderr, "json_add_hex called!\n"); abort(); }
+/* Generated stub for json_add_num */
+void json_add_num(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		  unsigned int value UNNEEDED)
+{ fprintf(stderr, "json_add_num called!\n"); abort(); }
+/* Generated stub for json_add_pubkey */
+void json_add_pubkey(struct json_result *response UNNEEDED,
+		     secp256k1_context *secpctx UNNEEDED,
+		     const char *fieldname UNNEEDED,
+		     const struct pubkey *key UNNEEDED)
+{ fprintf(stderr, "json_add_pubkey called!\n"); abort(); }
+/* Generated stub for json_add_string */
+void json_add_string(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED, const char *value UNNEEDED)
+{ fprintf(stderr, "json_add_string called!\n"); abort(); }
+/* Generated stub for json_add_u64 */
+void json_add_u64(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		  uint64_t value UNNEEDED)
+{ fprintf(stderr, "json_add_u64 called!\n"); abort(); }
+/* Generated stub for json_array_end */
+void json_array_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_array_end called!\n"); abort(); }
+/* Generated stub for json_array_start */
+void json_array_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_array_start called!\n"); abort(); }
+/* Generated stub for json_get_params */
+bool json_get_params(const char *buffer UNNEEDED, const jsmntok_t param[] UNNEEDED, ...)
+{ fprintf(stderr, "json_get_params called!\n"); abort(); }
+/* Generated stub for json_object_end */
+void json_object_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_object_end called!\n"); abort(); }
+/* Generated stub for json_object_start */
+void json_object_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_object_start called!\n"); abort(); }
+/* Generated stub for json_tok_bool */
+bool json_tok_bool(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED, bool *b UNNEEDED)
+{ fprintf(stderr, "json_tok_bool called!\n"); abort(); }
+/* Generated stub for json_tok_number */
+bool json_tok_number(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED,
+		     unsigned int *num UNNEEDED)
+{ fprintf(stderr, "json_tok_number called!\n"); abort(); }
+/* Generated stub for json_tok_u64 */
+bool json_tok_u64(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED,
+		  uint64_t *num UNNEEDED)
+{ fprintf(stderr, "json_tok_u64 called!\n"); abort(); }
+/* Generated stub for log_add_ */
+void log_add_(struct log *log UNNEEDED, const char *fmt UNNEEDED, ...) 
+{ fprintf(stderr, "log_add_ called!\n"); abort(); }
+/* Generated stub for log_prefix */
+const char *log_prefix(const struct log *log UNNEEDED)
+{ fprintf(stderr, "log_prefix called!\n"); abort(); }
+/* Generated stub for log_struct_ */
+void log_struct_(struct log *log UNNEEDED, int level UNNEEDED,
+		 const char *structname UNNEEDED,
+		 const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "log_struct_ called!\n"); abort(); }
+/* Generated stub for netaddr_from_fd */
+bool netaddr_from_fd(int fd UNNEEDED, int type UNNEEDED, int protocol UNNEEDED, struct netaddr *a UNNEEDED)
+{ fprintf(stderr, "netaddr_from_fd called!\n"); abort(); }
+/* Generated stub for netaddr_name */
+char *netaddr_name(const tal_t *ctx UNNEEDED, const struct netaddr *a UNNEEDED)
+{ fprintf(stderr, "netaddr_name called!\n"); abort(); }
+/* Generated stub for netaddr_to_addrinfo */
+void netaddr_to_addrinfo(struct addrinfo *ai UNNEEDED, const struct netaddr *a UNNEEDED)
+{ fprintf(stderr, "netaddr_to_addrinfo called!\n"); abort(); }
+/* Generated stub for new_feechange */
+struct feechange *new_feechange(struct peer *peer UNNEEDED,
+				u64 fee_rate UNNEEDED,
+				enum feechange_state state UNNEEDED)
+{ fprintf(stderr, "new_feechange called!\n"); abort(); }
+/* Generated stub for new_json_result */
+struct json_result *new_json_result(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "new_json_result called!\n"); abort(); }
+/* Generated stub for new_log */
+struct log *new_log(const tal_t *ctx UNNEEDED, struct log_record *record UNNEEDED, const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "new_log called!\n"); abort(); }
+/* Generated stub for new_reltimer_ */
+struct oneshot *new_reltimer_(struct lightningd_state *dstate UNNEEDED,
+			      const tal_t *ctx UNNEEDED,
+			      struct timerel expire UNNEEDED,
+			      void (*cb)(void *) UNNEEDED, void *arg UNNEEDED)
+{ fprintf(stderr, "new_reltimer_ called!\n"); abort(); }
+/* Generated stub for null_response */
+struct json_result *null_response(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "null_response called!\n"); abort(); }
+/* Generated stub for peek_outpkt */
+Pkt *peek_outpkt(const struct peer *peer UNNEEDED, size_t i UNNEEDED)
+{ fprintf(stderr, "peek_outpkt called!\n"); abort(); }
+/* Generated stub for peer_crypto_setup_ */
+struct io_plan *peer_crypto_setup_(struct io_conn *conn UNNEEDED,
+				   struct lightningd_state *dstate UNNEEDED,
+				   const struct pubkey *id UNNEEDED,
+				   struct log *log UNNEEDED,
+				   struct io_plan *(*cb)(struct io_conn *conn UNNEEDED,
+						 struct lightningd_state *dstate UNNEEDED,
+						 struct io_data *iod UNNEEDED,
+						 struct log *log UNNEEDED,
+						 const struct pubkey *id UNNEEDED,
+						 void *arg) UNNEEDED,
+				   void *arg UNNEEDED)
+{ fprintf(stderr, "peer_crypto_setup_ called!\n"); abort(); }
+/* Generated stub for peer_encrypt_packet */
+void peer_encrypt_packet(struct peer *peer UNNEEDED, const Pkt *pkt UNNEEDED)
+{ fprintf(stderr, "peer_encrypt_packet called!\n"); abort(); }
+/* Generated stub for peer_get_revocation_hash */
+void peer_get_revocation_hash(const struct peer *peer UNNEEDED, u64 index UNNEEDED,
+			      struct sha256 *rhash UNNEEDED)
+{ fprintf(stderr, "peer_get_revocation_hash called!\n"); abort(); }
+/* Generated stub for peer_get_revocation_preimage */
+void peer_get_revocation_preimage(const struct peer *peer UNNEEDED, u64 index UNNEEDED,
+				  struct sha256 *preimage UNNEEDED)
+{ fprintf(stderr, "peer_get_revocation_preimage called!\n"); abort(); }
+/* Generated stub for peer_read_packet */
+struct io_plan *peer_read_packet(struct io_conn *conn UNNEEDED,
+				 struct peer *peer UNNEEDED,
+				 struct io_plan *(*cb)(struct io_conn * UNNEEDED,
+						       struct peer *))
+{ fprintf(stderr, "peer_read_packet called!\n"); abort(); }
+/* Generated stub for peer_secrets_init */
+void peer_secrets_init(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "peer_secrets_init called!\n"); abort(); }
+/* Generated stub for peer_sign_htlc_fulfill */
+void peer_sign_htlc_fulfill(const struct peer *peer UNNEEDED,
+			    struct bitcoin_tx *spend UNNEEDED,
+			    const u8 *htlc_witnessscript UNNEEDED,
+			    struct signature *sig UNNEEDED)
+{ fprintf(stderr, "peer_sign_htlc_fulfill called!\n"); abort(); }
+/* Generated stub for peer_sign_htlc_refund */
+void peer_sign_htlc_refund(const struct peer *peer UNNEEDED,
+			   struct bitcoin_tx *spend UNNEEDED,
+			   const u8 *htlc_witnessscript UNNEEDED,
+			   struct signature *sig UNNEEDED)
+{ fprintf(stderr, "peer_sign_htlc_refund called!\n"); abort(); }
+/* Generated stub for peer_sign_mutual_close */
+void peer_sign_mutual_close(const struct peer *peer UNNEEDED,
+			    struct bitcoin_tx *close UNNEEDED,
+			    struct signature *sig UNNEEDED)
+{ fprintf(stderr, "peer_sign_mutual_close called!\n"); abort(); }
+/* Generated stub for peer_sign_ourcommit */
+void peer_sign_ourcommit(const struct peer *peer UNNEEDED,
+			 struct bitcoin_tx *commit UNNEEDED,
+			 struct signature *sig UNNEEDED)
+{ fprintf(stderr, "peer_sign_ourcommit called!\n"); abort(); }
+/* Generated stub for peer_sign_spend */
+void peer_sign_spend(const struct peer *peer UNNEEDED,
+		     struct bitcoin_tx *spend UNNEEDED,
+		     const u8 *commit_witnessscript UNNEEDED,
+		     struct signature *sig UNNEEDED)
+{ fprintf(stderr, "peer_sign_spend called!\n"); abort(); }
+/* Generated stub for peer_sign_steal_input */
+void peer_sign_steal_input(const struct peer *peer UNNEEDED,
+			   const struct bitcoin_tx_sighash *sighash UNNEEDED,
+			   size_t i UNNEEDED,
+			   const u8 *witnessscript UNNEEDED,
+			   struct signature *sig UNNEEDED)
+{ fprintf(stderr, "peer_sign_steal_input called!\n"); abort(); }
+/* Generated stub for peer_sign_theircommit */
+void peer_sign_theircommit(const struct peer *peer UNNEEDED,
+			   struct bitcoin_tx *commit UNNEEDED,
+			   struct signature *sig UNNEEDED)
+{ fprintf(stderr, "peer_sign_theircommit called!\n"); abort(); }
+/* Generated stub for peer_write_packets */
+struct io_plan *peer_write_packets(struct io_conn *conn UNNEEDED,
+				   struct peer *peer UNNEEDED,
+				   struct io_plan *(*next)(struct io_conn * UNNEEDED,
+							   struct peer *))
+{ fprintf(stderr, "peer_write_packets called!\n"); abort(); }
+/* Generated stub for pkt_err */
+Pkt *pkt_err(struct peer *peer UNNEEDED, const char *msg UNNEEDED, ...)
+{ fprintf(stderr, "pkt_err called!\n"); abort(); }
+/* Generated stub for pkt_err_unexpected */
+Pkt *pkt_err_unexpected(struct peer *peer UNNEEDED, const Pkt *pkt UNNEEDED)
+{ fprintf(stderr, "pkt_err_unexpected called!\n"); abort(); }
+/* Generated stub for pkt_init */
+Pkt *pkt_init(struct peer *peer UNNEEDED, u64 ack UNNEEDED)
+{ fprintf(stderr, "pkt_init called!\n"); abort(); }
+/* Generated stub for pkt_name */
+const char *pkt_name(Pkt__PktCase pkt UNNEEDED)
+{ fprintf(stderr, "pkt_name called!\n"); abort(); }
+/* Generated stub for proto_to_signature */
+bool proto_to_signature(secp256k1_context *secpctx UNNEEDED,
+			const Signature *pb UNNEEDED,
+			struct signature *sig UNNEEDED)
+{ fprintf(stderr, "proto_to_signature called!\n"); abort(); }
+/* Generated stub for queue_pkt_close_shutdown */
+void queue_pkt_close_shutdown(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "queue_pkt_close_shutdown called!\n"); abort(); }
+/* Generated stub for queue_pkt_close_signature */
+void queue_pkt_close_signature(struct peer *peer UNNEEDED)
+{ fprintf(stderr, "queue_pkt_close_signature called!\n"); abort(); }
+/* Generated stub for queue_pkt_commit */
+void queue_pkt_commit(struct peer *peer UNNEEDED, const struct bitcoin_signature *sig UNNEEDED)
+{ fprintf(stderr, "queue_pkt_commit called!\n"); abort(); }
+/* Generated stub for queue_pkt_err */
+void queue_pkt_err(struct peer *peer UNNEEDED, Pkt *err UNNEEDED)
+{ fprintf(stderr, "queue_pkt_err called!\n"); abort(); }
+/* Generated stub for queue_pkt_htlc_add */
+void queue_pkt_htlc_add(struct peer *peer UNNEEDED, struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "queue_pkt_htlc_add called!\n"); abort(); }
+/* Generated stub for queue_pkt_htlc_fail */
+void queue_pkt_htlc_fail(struct peer *peer UNNEEDED, struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "queue_pkt_htlc_fail called!\n"); abort(); }
+/* Generated stub for queue_pkt_htlc_fulfill */
+void queue_pkt_htlc_fulfill(struct peer *peer UNNEEDED, struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "queue_pkt_htlc_fulfill called!\n"); abort(); }
+/* Generated stub for queue_pkt_revocation */
+void queue_pkt_revocation(struct peer *peer UNNEEDED,
+			  const struct sha256 *preimage UNNEEDED,
+			  const struct sha256 *next_hash UNNEEDED)
+{ fprintf(stderr, "queue_pkt_revocation called!\n"); abort(); }
+/* Generated stub for resolve_invoice */
+void resolve_invoice(struct lightningd_state *dstate UNNEEDED,
+		     struct invoice *invoice UNNEEDED)
+{ fprintf(stderr, "resolve_invoice called!\n"); abort(); }
+/* Generated stub for set_log_prefix */
+void set_log_prefix(struct log *log UNNEEDED, const char *prefix UNNEEDED)
+{ fprintf(stderr, "set_log_prefix called!\n"); abort(); }
+/* Generated stub for sigverify_check_ */
+void sigverify_check_(struct sigverify *sv UNNEEDED,
+		      const tal_t *ctx UNNEEDED,
+		      const struct sha256_double *digest UNNEEDED,
+		      const struct pubkey *key UNNEEDED,
+		      const struct signature *sig UNNEEDED,
+		      void (*cb)(bool ok UNNEEDED, void *arg) UNNEEDED,
+		      void *arg UNNEEDED)
+{ fprintf(stderr, "sigverify_check_ called!\n"); abort(); }
+/* Generated stub for state */
+enum state state(struct peer *peer UNNEEDED,
+		 const enum state_input input UNNEEDED,
+		 const Pkt *pkt UNNEEDED,
+		 const struct bitcoin_tx **broadcast UNNEEDED)
+{ fprintf(stderr, "state called!\n"); abort(); }
+/* Generated stub for state_name */
+const char *state_name(enum state s UNNEEDED)
+{ fprintf(stderr, "state_name called!\n"); abort(); }
+/* Generated stub for txout_get_htlc */
+struct htlc *txout_get_htlc(struct htlc_output_map *omap UNNEEDED,
+			    const u8 *script UNNEEDED, size_t script_len UNNEEDED,
+			    const u8 **wscript UNNEEDED)
+{ fprintf(stderr, "txout_get_htlc called!\n"); abort(); }
+/* Generated stub for wallet_add_signed_input */
+void wallet_add_signed_input(struct lightningd_state *dstate UNNEEDED,
+			     const struct wallet *w UNNEEDED,
+			     struct bitcoin_tx *tx UNNEEDED,
+			     unsigned int input_num UNNEEDED)
+{ fprintf(stderr, "wallet_add_signed_input called!\n"); abort(); }
+/* Generated stub for wallet_can_spend */
+struct wallet *wallet_can_spend(struct lightningd_state *dstate UNNEEDED,
+				const struct bitcoin_tx_output *output UNNEEDED)
+{ fprintf(stderr, "wallet_can_spend called!\n"); abort(); }
+/* Generated stub for watch_tx_ */
+struct txwatch *watch_tx_(const tal_t *ctx UNNEEDED,
+			  struct peer *peer UNNEEDED,
+			  const struct bitcoin_tx *tx UNNEEDED,
+			  enum watch_result (*cb)(struct peer *peer UNNEEDED,
+						  unsigned int depth UNNEEDED,
+						  const struct sha256_double * UNNEEDED,
+						  void *) UNNEEDED,
+			  void *cbdata UNNEEDED)
+{ fprintf(stderr, "watch_tx_ called!\n"); abort(); }
+/* Generated stub for watch_txid_ */
+struct txwatch *watch_txid_(const tal_t *ctx UNNEEDED,
+			    struct peer *peer UNNEEDED,
+			    const struct sha256_double *txid UNNEEDED,
+			    enum watch_result (*cb)(struct peer *peer UNNEEDED,
+						    unsigned int depth UNNEEDED,
+						    const struct sha256_double* UNNEEDED,
+						    void *) UNNEEDED,
+			    void *cbdata UNNEEDED)
+{ fprintf(stderr, "watch_txid_ called!\n"); abort(); }
+/* Generated stub for watch_txo_ */
+struct txowatch *watch_txo_(const tal_t *ctx UNNEEDED,
+			    struct peer *peer UNNEEDED,
+			    const struct sha256_double *txid UNNEEDED,
+			    unsigned int output UNNEEDED,
+			    enum watch_result (*cb)(struct peer *peer UNNEEDED,
+						    const struct bitcoin_tx *tx UNNEEDED,
+						    size_t input_num UNNEEDED,
+						    void *) UNNEEDED,
+			    void *cbdata UNNEEDED)
+{ fprintf(stderr, "watch_txo_ called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* We use these, so they can't abort. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+bool log_enabled(struct log *log UNNEEDED, int level UNNEEDED)
+{
+	return true;
+}
+
+const struct siphash_seed *siphash_seed(void)
+{
+	static struct siphash_seed seed;
+	return &seed;
+}
+
+/* The old ways, for comparison. */
+static struct peer *list_find_peer(struct lightningd_state *dstate,
+				   const struct pubkey *id)
+{
+	struct peer *peer;
+
+	list_for_each(&dstate->peers, peer, list) {
+		if (peer->id && pubkey_eq(peer->id, id))
+			return peer;
+	}
+	return NULL;
+}
+
+static struct peer *list_find_peer_by_pkhash(struct lightningd_state *dstate,
+					     const u8 *pkhash)
+{
+	struct peer *peer;
+	u8 addr[20];
+
+	list_for_each(&dstate->peers, peer, list) {
+		pubkey_hash160(dstate->secpctx, addr, peer->id);
+		if (memcmp(addr, pkhash, sizeof(addr)) == 0)
+			return peer;
+	}
+	return NULL;
+}
+
+static struct peer *new_test_peer(struct lightningd_state *dstate, size_t i)
+{
+	struct peer *peer = tal(dstate, struct peer);
+	struct privkey privkey;
+	struct pubkey id;
+
+	memset(&privkey, 0, sizeof(privkey));
+	memcpy(&privkey, &i, sizeof(i));
+	privkey.secret[31] = 1;
+	if (!pubkey_from_privkey(dstate->secpctx, &privkey, &id))
+		abort();
+
+	peer->dstate = dstate;
+	peer->conn = NULL;
+	peer->id = NULL;
+	list_add(&dstate->peers, &peer->list);
+	tal_add_destructor(peer, destroy_peer);
+	peer_set_id(peer, &id);
+	return peer;
+}
+
+static void run(size_t num_peers, size_t num_lookups, bool bench)
+{
+	struct lightningd_state *dstate = tal(NULL, struct lightningd_state);
+	struct peer **peers = tal_arr(dstate, struct peer *, num_peers);
+	struct peer **lookups = tal_arr(dstate, struct peer *, num_lookups);
+	struct timeabs start;
+	u64 map_time, list_time, map_pk_time, list_pk_time;
+	struct pubkey unknown;
+	size_t i;
+
+	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN);
+	list_head_init(&dstate->peers);
+	dstate->peers_by_id = empty_peer_id_map(dstate);
+	dstate->peers_by_pkhash = empty_peer_pkhash_map(dstate);
+
+	for (i = 0; i < num_peers; i++)
+		peers[i] = new_test_peer(dstate, i);
+	for (i = 0; i < num_lookups; i++)
+		lookups[i] = peers[random() % num_peers];
+
+	start = time_now();
+	for (i = 0; i < num_lookups; i++)
+		assert(find_peer(dstate, lookups[i]->id) == lookups[i]);
+	map_time = time_to_nsec(time_between(time_now(), start));
+
+	start = time_now();
+	for (i = 0; i < num_lookups; i++)
+		assert(find_peer_by_pkhash(dstate, lookups[i]->pkhash)
+		       == lookups[i]);
+	map_pk_time = time_to_nsec(time_between(time_now(), start));
+
+	if (bench) {
+		start = time_now();
+		for (i = 0; i < num_lookups; i++)
+			assert(list_find_peer(dstate, lookups[i]->id)
+			       == lookups[i]);
+		list_time = time_to_nsec(time_between(time_now(), start));
+
+		start = time_now();
+		for (i = 0; i < num_lookups; i++)
+			assert(list_find_peer_by_pkhash(dstate,
+							lookups[i]->pkhash)
+			       == lookups[i]);
+		list_pk_time = time_to_nsec(time_between(time_now(), start));
+
+		printf("%zu peers: find_peer %"PRIu64"/%"PRIu64"nsec, find_peer_by_pkhash %"PRIu64"/%"PRIu64"nsec (map/list)\n",
+		       num_peers,
+		       map_time / num_lookups, list_time / num_lookups,
+		       map_pk_time / num_lookups, list_pk_time / num_lookups);
+	}
+
+	/* Freed peers can't be found. */
+	unknown = *peers[0]->id;
+	tal_free(peers[0]);
+	assert(!find_peer(dstate, &unknown));
+	assert(find_peer(dstate, peers[num_peers-1]->id) == peers[num_peers-1]);
+
+	for (i = 1; i < num_peers; i++)
+		tal_free(peers[i]);
+	peer_id_map_clear(dstate->peers_by_id);
+	peer_pkhash_map_clear(dstate->peers_by_pkhash);
+	secp256k1_context_destroy(dstate->secpctx);
+	tal_free(dstate);
+}
+
+/* With arguments, benchmarks lookups among that many peers. */
+int main(int argc, char *argv[])
+{
+	int i;
+
+	srandom(1);
+	if (argc == 1)
+		run(100, 100, false);
+	for (i = 1; i < argc; i++)
+		run(atol(argv[i]), 100, true);
+	return 0;
+}
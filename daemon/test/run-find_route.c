@@ -0,0 +1,340 @@
+#include "daemon/routing.c"
+#include <ccan/time/time.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for command_fail */
+void command_fail(struct command *cmd UNNEEDED, const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "command_fail called!\n"); abort(); }
+/* Generated stub for command_success */
+void command_success(struct command *cmd UNNEEDED, struct json_result *response UNNEEDED)
+{ fprintf(stderr, "command_success called!\n"); abort(); }
+/* Generated stub for fatal */
+void fatal(const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "fatal called!\n"); abort(); }
+/* Generated stub for json_add_null */
+void json_add_null(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_add_null called!\n"); abort(); }
+/* Generated stub for json_add_num */
+void json_add_num(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		  unsigned int value UNNEEDED)
+{ fprintf(stderr, "json_add_num called!\n"); abort(); }
+/* Generated stub for json_add_pubkey */
+void json_add_pubkey(struct json_result *response UNNEEDED,
+		     secp256k1_context *secpctx UNNEEDED,
+		     const char *fieldname UNNEEDED,
+		     const struct pubkey *key UNNEEDED)
+{ fprintf(stderr, "json_add_pubkey called!\n"); abort(); }
+/* Generated stub for json_add_string */
+void json_add_string(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED, const char *value UNNEEDED)
+{ fprintf(stderr, "json_add_string called!\n"); abort(); }
+/* Generated stub for json_array_end */
+void json_array_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_array_end called!\n"); abort(); }
+/* Generated stub for json_array_start */
+void json_array_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_array_start called!\n"); abort(); }
+/* Generated stub for json_get_params */
+bool json_get_params(const char *buffer UNNEEDED, const jsmntok_t param[] UNNEEDED, ...)
+{ fprintf(stderr, "json_get_params called!\n"); abort(); }
+/* Generated stub for json_object_end */
+void json_object_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_object_end called!\n"); abort(); }
+/* Generated stub for json_object_start */
+void json_object_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_object_start called!\n"); abort(); }
+/* Generated stub for json_tok_bool */
+bool json_tok_bool(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED, bool *b UNNEEDED)
+{ fprintf(stderr, "json_tok_bool called!\n"); abort(); }
+/* Generated stub for json_tok_number */
+bool json_tok_number(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED,
+		     unsigned int *num UNNEEDED)
+{ fprintf(stderr, "json_tok_number called!\n"); abort(); }
+/* Generated stub for new_json_result */
+struct json_result *new_json_result(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "new_json_result called!\n"); abort(); }
+/* Generated stub for null_response */
+struct json_result *null_response(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "null_response called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* We use these, so they can't abort. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+bool log_enabled(struct log *log UNNEEDED, int level UNNEEDED)
+{
+	return true;
+}
+
+void log_add_(struct log *log UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+
+void log_struct_(struct log *log UNNEEDED, int level UNNEEDED,
+		 const char *structname UNNEEDED,
+		 const char *fmt UNNEEDED, ...)
+{
+}
+
+const struct siphash_seed *siphash_seed(void)
+{
+	static struct siphash_seed seed;
+	return &seed;
+}
+
+static struct peer fake_peer;
+
+struct peer *find_peer(struct lightningd_state *dstate UNNEEDED,
+		       const struct pubkey *id)
+{
+	fake_peer.id = (struct pubkey *)id;
+	return &fake_peer;
+}
+
+static struct pubkey *node_ids;
+
+static void make_graph(struct lightningd_state *dstate,
+		       size_t num_nodes, size_t edges_per_node)
+{
+	size_t i, j;
+
+	tal_free(node_ids);
+	node_ids = tal_arrz(NULL, struct pubkey, num_nodes);
+	for (i = 0; i < num_nodes; i++)
+		memcpy(&node_ids[i].pubkey, &i, sizeof(i));
+
+	dstate->id = node_ids[0];
+	for (i = 0; i < num_nodes; i++) {
+		for (j = 0; j < edges_per_node; j++) {
+			size_t dst = random() % num_nodes;
+			if (dst == i)
+				continue;
+			add_connection(dstate, &node_ids[i], &node_ids[dst],
+				       random() % 1000, random() % 1000,
+				       1 + random() % 144, 6);
+		}
+	}
+}
+
+/* The old Bellman-Ford-Gibson algorithm, for comparison: returns the
+ * cheapest total+risk over all path lengths. */
+struct bfg {
+	s64 total;
+	u64 risk;
+};
+
+static s64 bfg_route_cost(struct lightningd_state *dstate,
+			  const struct pubkey *to,
+			  u64 msatoshi, double riskfactor)
+{
+	const struct route_graph *g = route_graph_get(dstate);
+	size_t num = tal_count(g->nodes), runs, n, i, h;
+	struct bfg *bfg = tal_arr(NULL, struct bfg, num * (ROUTING_MAX_HOPS+1));
+	const struct node *src = get_node(dstate, to);
+	const struct node *dst = get_node(dstate, &dstate->id);
+	s64 best = INFINITE;
+
+	for (i = 0; i < tal_count(bfg); i++) {
+		bfg[i].total = INFINITE;
+		bfg[i].risk = 0;
+	}
+#define BFG(n, h) bfg[(n) * (ROUTING_MAX_HOPS+1) + (h)]
+	BFG(src->index, 0).total = msatoshi;
+
+	for (runs = 0; runs < ROUTING_MAX_HOPS; runs++) {
+		for (n = 0; n < num; n++) {
+			for (i = g->in_start[n]; i < g->in_start[n+1]; i++) {
+				const struct node_connection *c = g->edges[i].c;
+				u32 s = g->edges[i].src;
+				for (h = 0; h < ROUTING_MAX_HOPS; h++) {
+					s64 fee = connection_fee(c, BFG(n, h).total);
+					u64 risk = BFG(n, h).risk
+						+ risk_fee(BFG(n, h).total + fee,
+							   c->delay, riskfactor);
+					if (BFG(n, h).total + fee + (s64)risk
+					    < BFG(s, h+1).total + (s64)BFG(s, h+1).risk) {
+						BFG(s, h+1).total = BFG(n, h).total + fee;
+						BFG(s, h+1).risk = risk;
+					}
+				}
+			}
+		}
+	}
+
+	for (h = 1; h <= ROUTING_MAX_HOPS; h++) {
+		if (BFG(dst->index, h).total >= INFINITE)
+			continue;
+		if (BFG(dst->index, h).total + (s64)BFG(dst->index, h).risk < best)
+			best = BFG(dst->index, h).total + BFG(dst->index, h).risk;
+	}
+#undef BFG
+	tal_free(bfg);
+	return best;
+}
+
+/* Walk the route back from the target, checking it's connected. */
+static s64 route_cost(struct lightningd_state *dstate,
+		      const struct pubkey *to,
+		      const struct pubkey *first,
+		      struct node_connection **route,
+		      u64 msatoshi, double riskfactor, s64 *fee)
+{
+	s64 total = msatoshi;
+	u64 risk = 0;
+	int i;
+	struct node *us = get_node(dstate, &dstate->id);
+	struct node_connection *c = NULL;
+
+	assert(tal_count(route) < ROUTING_MAX_HOPS);
+	for (i = tal_count(route) - 1; i >= 0; i--) {
+		if (i == tal_count(route) - 1)
+			assert(pubkey_eq(&route[i]->dst->id, to));
+		else
+			assert(route[i]->dst == route[i+1]->src);
+		total += connection_fee(route[i], total);
+		risk += risk_fee(total, route[i]->delay, riskfactor);
+	}
+	*fee = total - msatoshi;
+
+	for (i = 0; i < tal_count(us->out); i++)
+		if (pubkey_eq(&us->out[i]->dst->id, first))
+			c = us->out[i];
+	assert(c);
+	if (tal_count(route))
+		assert(c->dst == route[0]->src);
+	else
+		assert(pubkey_eq(&c->dst->id, to));
+	total += connection_fee(c, total);
+	risk += risk_fee(total, c->delay, riskfactor);
+	return total + risk;
+}
+
+static void run(struct lightningd_state *dstate, size_t num_nodes,
+		size_t num_queries, bool bench)
+{
+	size_t i, found = 0;
+	struct timerel bfg_time = time_from_sec(0), dijkstra_time = bfg_time;
+
+	make_graph(dstate, num_nodes, 4);
+
+	for (i = 0; i < num_queries; i++) {
+		const struct pubkey *to = &node_ids[1 + random() % (num_nodes-1)];
+		u64 msatoshi = 1 + random() % 100000000;
+		double riskfactor = (random() % 100) / 10.0;
+		struct node_connection **route;
+		struct peer *first;
+		s64 fee, checkfee, cost, bfg_cost;
+		struct timeabs start = time_now();
+
+		first = find_route(dstate, to, msatoshi, riskfactor,
+				   &fee, &route);
+		dijkstra_time = timerel_add(dijkstra_time,
+					    time_between(time_now(), start));
+
+		start = time_now();
+		bfg_cost = bfg_route_cost(dstate, to, msatoshi, riskfactor);
+		bfg_time = timerel_add(bfg_time,
+				       time_between(time_now(), start));
+
+		if (!first) {
+			assert(bfg_cost == INFINITE);
+			continue;
+		}
+		found++;
+		cost = route_cost(dstate, to, first->id, route,
+				  msatoshi, riskfactor, &checkfee);
+		assert(checkfee == fee);
+		/* We explore a superset of what BFG keeps. */
+		assert(cost <= bfg_cost);
+		tal_free(route);
+	}
+
+	if (bench)
+		printf("%zu nodes: %zu/%zu routes, dijkstra %"PRIu64"usec, bfg %"PRIu64"usec per query\n",
+		       num_nodes, found, num_queries,
+		       time_to_usec(dijkstra_time) / num_queries,
+		       time_to_usec(bfg_time) / num_queries);
+}
+
+/* A negative fee on 3->4 would make 0->2->3->4 cheaper than 0->1->4;
+ * we clamp it, so the search (which assumes costs never fall) agrees
+ * with the fees we'll actually pay. */
+static void check_negative_fee(struct lightningd_state *dstate)
+{
+	struct node_connection *c, **route;
+	struct peer *first;
+	s64 fee;
+	size_t i;
+
+	tal_free(node_ids);
+	node_ids = tal_arrz(NULL, struct pubkey, 5);
+	for (i = 0; i < 5; i++)
+		memcpy(&node_ids[i].pubkey, &i, sizeof(i));
+	dstate->id = node_ids[0];
+
+	add_connection(dstate, &node_ids[0], &node_ids[1], 0, 0, 1, 6);
+	add_connection(dstate, &node_ids[1], &node_ids[4], 100, 0, 1, 6);
+	add_connection(dstate, &node_ids[0], &node_ids[2], 0, 0, 1, 6);
+	add_connection(dstate, &node_ids[2], &node_ids[3], 50, 0, 1, 6);
+	c = add_connection(dstate, &node_ids[3], &node_ids[4],
+			   60, -1000000, 1, 6);
+	assert(c->proportional_fee == -1000000);
+	assert(connection_fee(c, 1000000) == 60 - 1000000);
+
+	first = find_route(dstate, &node_ids[4], 1000000, 0, &fee, &route);
+	assert(first);
+	assert(pubkey_eq(first->id, &node_ids[1]));
+	assert(tal_count(route) == 1);
+	assert(fee == 100);
+	tal_free(route);
+}
+
+static void free_graph(struct lightningd_state *dstate)
+{
+	struct node_map_iter it;
+	struct node *n;
+
+	/* Connections point into both nodes, so free them first. */
+	for (n = node_map_first(dstate->nodes, &it);
+	     n;
+	     n = node_map_next(dstate->nodes, &it)) {
+		while (tal_count(n->out))
+			tal_free(n->out[0]);
+	}
+	node_map_clear(dstate->nodes);
+	tal_free(dstate);
+}
+
+/* With arguments, benchmarks against BFG on graphs of that many nodes. */
+int main(int argc, char *argv[])
+{
+	struct lightningd_state *dstate;
+	int i;
+
+	srandom(1);
+	for (i = 1; i < (argc == 1 ? 2 : argc); i++) {
+		dstate = tal(NULL, struct lightningd_state);
+		dstate->nodes = empty_node_map(dstate);
+		dstate->route_graph = NULL;
+		dstate->route_query = NULL;
+		dstate->base_log = NULL;
+
+		if (argc == 1)
+			run(dstate, 200, 50, false);
+		else
+			run(dstate, atol(argv[i]), 20, true);
+		free_graph(dstate);
+	}
+
+	dstate = tal(NULL, struct lightningd_state);
+	dstate->nodes = empty_node_map(dstate);
+	dstate->route_graph = NULL;
+	dstate->route_query = NULL;
+	dstate->base_log = NULL;
+	check_negative_fee(dstate);
+	free_graph(dstate);
+
+	tal_free(node_ids);
+	return 0;
+}
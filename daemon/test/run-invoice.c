@@ -0,0 +1,292 @@
+#include "daemon/invoice.c"
+#include "daemon/jsmn/jsmn.c"
+#include "daemon/json.c"
+#include <ccan/array_size/array_size.h>
+#include <ccan/time/time.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for command_fail */
+void command_fail(struct command *cmd UNNEEDED, const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "command_fail called!\n"); abort(); }
+/* Generated stub for command_success */
+void command_success(struct command *cmd UNNEEDED, struct json_result *response UNNEEDED)
+{ fprintf(stderr, "command_success called!\n"); abort(); }
+/* Generated stub for db_new_invoice */
+bool db_new_invoice(struct lightningd_state *dstate UNNEEDED,
+		    u64 msatoshi UNNEEDED,
+		    const char *label UNNEEDED,
+		    const struct rval *r UNNEEDED)
+{ fprintf(stderr, "db_new_invoice called!\n"); abort(); }
+/* Generated stub for db_remove_invoice */
+bool db_remove_invoice(struct lightningd_state *dstate UNNEEDED,
+		       const char *label UNNEEDED)
+{ fprintf(stderr, "db_remove_invoice called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* We use these, so they can't abort. */
+static struct json_result *(*stream_next)(struct command *cmd, void *arg);
+static void *stream_arg;
+static size_t num_more;
+
+void command_stream_(struct command *cmd UNNEEDED, struct json_result *result,
+		     const char *method UNNEEDED,
+		     struct json_result *(*next)(struct command *cmd,
+						 void *arg),
+		     void *arg)
+{
+	tal_free(result);
+	stream_next = next;
+	stream_arg = arg;
+}
+
+void command_stream_more(struct command *cmd UNNEEDED)
+{
+	num_more++;
+}
+
+struct json_result *null_response(const tal_t *ctx)
+{
+	return new_json_result(ctx);
+}
+
+void db_resolve_invoice(struct lightningd_state *dstate UNNEEDED,
+			const char *label UNNEEDED, u64 paid_num UNNEEDED)
+{
+}
+
+const struct siphash_seed *siphash_seed(void)
+{
+	static struct siphash_seed seed;
+	return &seed;
+}
+
+static void make_r(struct rval *r, u64 n)
+{
+	memset(r, 0, sizeof(*r));
+	memcpy(r->r, &n, sizeof(n));
+}
+
+static struct invoice *get_invoice(struct lightningd_state *dstate, u64 n)
+{
+	struct rval r;
+	struct sha256 rhash;
+
+	make_r(&r, n);
+	sha256(&rhash, r.r, sizeof(r.r));
+	return invoice_rhash_map_get(&dstate->invoices->by_rhash, &rhash);
+}
+
+static struct lightningd_state *new_dstate(void)
+{
+	struct lightningd_state *dstate = talz(NULL, struct lightningd_state);
+
+	dstate->invoices = invoices_init(dstate);
+	return dstate;
+}
+
+/* Lookups by rhash and label, and paid ones stay in paid_num order. */
+static void check_invoices(void)
+{
+	struct lightningd_state *dstate = new_dstate();
+	struct invoices *invs = dstate->invoices;
+	struct invoice *i;
+	struct rval r;
+	u64 n;
+
+	/* As if from the database, paid ones in any order and with one
+	 * missing. */
+	invoices_reserve(dstate, 10);
+	for (n = 0; n < 10; n++) {
+		const u64 paid[] = { 0, 3, 0, 1, 0, 5, 0, 0, 4, 0 };
+		char *label = tal_fmt(NULL, "label%"PRIu64, n);
+
+		make_r(&r, n);
+		invoice_add(dstate, &r, 1000 + n, label, paid[n]);
+		tal_free(label);
+	}
+	assert(invs->num_paid == 5);
+
+	for (n = 0; n < 10; n++) {
+		i = get_invoice(dstate, n);
+		assert(i->msatoshi == 1000 + n);
+		assert(find_unpaid(dstate, &i->rhash) == (i->paid_num ? NULL : i));
+		assert(find_invoice_by_label(invs, i->label) == i);
+	}
+	assert(!find_invoice_by_label(invs, "label10"));
+
+	assert(next_paid(invs, 0) == get_invoice(dstate, 3));
+	assert(next_paid(invs, 1) == get_invoice(dstate, 1));
+	assert(next_paid(invs, 2) == get_invoice(dstate, 1));
+	assert(next_paid(invs, 3) == get_invoice(dstate, 8));
+	assert(next_paid(invs, 4) == get_invoice(dstate, 5));
+	assert(!next_paid(invs, 5));
+
+	/* Newly paid ones go on the end. */
+	i = get_invoice(dstate, 6);
+	resolve_invoice(dstate, i);
+	assert(i->paid_num == 6);
+	assert(!find_unpaid(dstate, &i->rhash));
+	assert(next_paid(invs, 5) == i);
+
+	i = get_invoice(dstate, 0);
+	del_unpaid(invs, i);
+	tal_free(i);
+	assert(!get_invoice(dstate, 0));
+	assert(!find_invoice_by_label(invs, "label0"));
+	assert(list_top(&invs->unpaid, struct invoice, list));
+
+	tal_free(dstate);
+}
+
+static u64 stream_paid_num(struct command *cmd)
+{
+	struct json_result *result = stream_next(cmd, stream_arg);
+	const char *json;
+	const jsmntok_t *toks, *paid_num;
+	bool valid;
+	u64 n;
+
+	if (!result)
+		return 0;
+	json = tal_strdup(result, json_result_string(result));
+	toks = json_parse_input(json, strlen(json), &valid);
+	paid_num = json_get_member(json, toks, "paid_num");
+	assert(json_tok_u64(json, paid_num, &n));
+	tal_free(result);
+	return n;
+}
+
+/* Subscribers pick up from their cursor, and are only woken when they've
+ * caught up. */
+static void check_subscribe(void)
+{
+	struct lightningd_state *dstate = new_dstate();
+	struct command *cmd = talz(dstate, struct command);
+	const char *params = tal_strdup(dstate, "[ 2 ]");
+	const jsmntok_t *toks;
+	struct rval r;
+	bool valid;
+	u64 n;
+
+	for (n = 0; n < 8; n++) {
+		char *label = tal_fmt(NULL, "label%"PRIu64, n);
+
+		make_r(&r, n);
+		invoice_add(dstate, &r, 1000, label, n < 5 ? n + 1 : 0);
+		tal_free(label);
+	}
+
+	cmd->dstate = dstate;
+	toks = json_parse_input(params, strlen(params), &valid);
+	json_subscribeinvoices(cmd, params, toks);
+	tal_free(toks);
+
+	assert(stream_paid_num(cmd) == 3);
+	assert(stream_paid_num(cmd) == 4);
+	assert(stream_paid_num(cmd) == 5);
+	assert(stream_paid_num(cmd) == 0);
+	assert(!list_empty(&dstate->invoices->subscribers));
+
+	resolve_invoice(dstate, get_invoice(dstate, 5));
+	assert(num_more == 1);
+	assert(list_empty(&dstate->invoices->subscribers));
+	assert(stream_paid_num(cmd) == 6);
+	assert(stream_paid_num(cmd) == 0);
+
+	/* Once it's gone, it doesn't get woken. */
+	tal_free(cmd);
+	assert(list_empty(&dstate->invoices->subscribers));
+	resolve_invoice(dstate, get_invoice(dstate, 6));
+	assert(num_more == 1);
+
+	tal_free(dstate);
+}
+
+/* How it used to work: unpaid and paid lists. */
+static struct invoice *old_find_unpaid(struct list_head *unpaid,
+				       const struct sha256 *rhash)
+{
+	struct invoice *i;
+
+	list_for_each(unpaid, i, list) {
+		if (structeq(rhash, &i->rhash))
+			return i;
+	}
+	return NULL;
+}
+
+/* Returns usec for each HTLC paying one of num invoices. */
+static double time_accept(size_t num, size_t n, bool old)
+{
+	struct lightningd_state *dstate = new_dstate();
+	struct list_head unpaid, paid;
+	struct timeabs start;
+	struct rval r;
+	size_t i;
+	u64 usec;
+
+	list_head_init(&unpaid);
+	list_head_init(&paid);
+	if (!old)
+		invoices_reserve(dstate, num);
+	for (i = 0; i < num; i++) {
+		char label[sizeof("label") + 20];
+
+		make_r(&r, i);
+		sprintf(label, "label%zu", i);
+		if (old) {
+			struct invoice *inv = tal(dstate, struct invoice);
+			inv->r = r;
+			inv->paid_num = 0;
+			inv->label = tal_strdup(inv, label);
+			sha256(&inv->rhash, r.r, sizeof(r.r));
+			list_add(&unpaid, &inv->list);
+		} else
+			invoice_add(dstate, &r, 1000, label, 0);
+	}
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		struct sha256 rhash;
+		struct invoice *inv;
+
+		make_r(&r, random() % num);
+		sha256(&rhash, r.r, sizeof(r.r));
+		if (old) {
+			inv = old_find_unpaid(&unpaid, &rhash);
+			if (inv) {
+				list_del_from(&unpaid, &inv->list);
+				list_add_tail(&paid, &inv->list);
+			}
+		} else {
+			inv = find_unpaid(dstate, &rhash);
+			if (inv)
+				resolve_invoice(dstate, inv);
+		}
+	}
+	usec = time_to_usec(time_between(time_now(), start));
+	tal_free(dstate);
+	return (double)usec / n;
+}
+
+/* With an argument, times that many HTLCs against 1k to 1M invoices. */
+int main(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 1000, 100000, 1000000 };
+	size_t i;
+
+	check_invoices();
+	check_subscribe();
+
+	if (argc > 1) {
+		size_t n = atol(argv[1]);
+		for (i = 0; i < ARRAY_SIZE(sizes); i++)
+			printf("%zu invoices: %.2f usec (was %.2f usec)\n",
+			       sizes[i],
+			       time_accept(sizes[i], n, false),
+			       time_accept(sizes[i], n, true));
+	}
+	return 0;
+}
@@ -0,0 +1,212 @@
+#include "daemon/jsmn/jsmn.c"
+#include "daemon/json.c"
+#include <ccan/array_size/array_size.h>
+#include <ccan/mem/mem.h>
+#include <ccan/time/time.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* AUTOGENERATED MOCKS END */
+
+/* What getchannels says about each one. */
+static void add_channels(struct json_result *r, size_t n)
+{
+	u8 key[33];
+	size_t i;
+
+	memset(key, 0x02, sizeof(key));
+	json_object_start(r, NULL);
+	json_array_start(r, "channels");
+	for (i = 0; i < n; i++) {
+		key[1] = i;
+		json_object_start(r, NULL);
+		json_add_hex(r, "from", key, sizeof(key));
+		json_add_hex(r, "to", key, sizeof(key));
+		json_add_num(r, "base_fee", i);
+		json_add_num(r, "proportional_fee", 10);
+		json_add_num(r, "expiry", 144);
+		json_add_bool(r, "active", true);
+		json_object_end(r);
+	}
+	json_array_end(r);
+	json_object_end(r);
+}
+
+/* Same as it always was. */
+static void check_format(void)
+{
+	struct json_result *r = new_json_result(NULL);
+
+	json_object_start(r, NULL);
+	json_add_string(r, "a", "b");
+	json_array_start(r, "arr");
+	json_add_u64(r, NULL, 1);
+	json_object_start(r, NULL);
+	json_add_bool(r, "t", true);
+	json_object_end(r);
+	json_add_null(r, NULL);
+	json_array_end(r);
+	json_add_hex(r, "hex", "\x01\xff", 2);
+	json_add_num(r, "n", 7);
+	json_add_literal(r, "lit", "123abc", 3);
+	json_object_end(r);
+	assert(streq(json_result_string(r),
+		     "{ \"a\" : \"b\", \"arr\" : \n"
+		     "\t[ 1, \n"
+		     "\t\t{ \"t\" : true }, null ],"
+		     " \"hex\" : \"01ff\", \"n\" : 7, \"lit\" : 123 }"));
+	tal_free(r);
+}
+
+/* Big results come out in chunks, which add up to the whole thing. */
+static void check_chunks(void)
+{
+	struct json_result *r = new_json_result(NULL);
+	const jsmntok_t *toks;
+	char **chunks, *joined;
+	bool valid;
+	size_t i;
+
+	add_channels(r, 1000);
+	chunks = json_result_chunks(r, r);
+	assert(tal_count(chunks) > 1);
+	joined = tal_arr(r, char, 0);
+	for (i = 0; i < tal_count(chunks); i++) {
+		assert(tal_count(chunks[i]) == strlen(chunks[i]) + 1);
+		if (i != tal_count(chunks) - 1)
+			assert(strlen(chunks[i]) >= JSON_CHUNK_SIZE);
+		tal_expand(&joined, chunks[i], strlen(chunks[i]));
+	}
+	tal_expand(&joined, "", 1);
+	toks = json_parse_input(joined, strlen(joined), &valid);
+	assert(toks && valid);
+	assert(json_get_member(joined, toks, "channels"));
+	joined = tal_steal(NULL, joined);
+
+	/* json_result_string joins them up too. */
+	tal_free(r);
+	r = new_json_result(NULL);
+	add_channels(r, 1000);
+	assert(streq(json_result_string(r), joined));
+	tal_free(r);
+	tal_free(joined);
+}
+
+/* However the values arrive, and whenever the buffer moves, we get the
+ * same tokens as parsing each one alone. */
+static void check_parser(void)
+{
+	const char *values[] = {
+		"{ \"method\" : \"getinfo\", \"params\" : [], \"id\" : 1 }",
+		"[ 1, [ 2, { \"a\" : [ true, null ] } ], \"three\" ]",
+		"{ \"id\" : \"x\\\"y\", \"params\" : { \"n\" : 12345 } }",
+		"[]",
+		"{ \"big\" : [ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13,"
+		" 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25 ] }",
+	};
+	char *all = tal_arr(NULL, char, 0), *buf;
+	size_t i, step, used, fed, num;
+
+	for (i = 0; i < 20; i++) {
+		const char *v = values[i % ARRAY_SIZE(values)];
+		tal_expand(&all, v, strlen(v));
+		tal_expand(&all, "\n ", 1 + i % 2);
+	}
+
+	for (step = 1; step < 300; step += 7) {
+		struct json_parser *jp = new_json_parser(all);
+
+		buf = tal_arr(jp, char, 32);
+		used = fed = num = 0;
+		for (;;) {
+			const jsmntok_t *toks;
+			jsmntok_t *expect;
+			const char *v = values[num % ARRAY_SIZE(values)];
+			char *copy;
+			size_t start, j, n;
+			bool valid;
+
+			toks = json_parser_next(jp, buf, used, &valid);
+			assert(valid);
+			if (toks) {
+				copy = tal_strdup(jp, v);
+				expect = json_parse_input(copy, strlen(copy),
+							  &valid);
+				n = tal_count(expect) - 1;
+				assert(json_next(toks) == toks + n);
+				for (j = 0; j < n; j++) {
+					assert(toks[j].type == expect[j].type);
+					assert(toks[j].size == expect[j].size);
+					assert(toks[j].end - toks[j].start
+					       == expect[j].end - expect[j].start);
+					assert(memeq(buf + toks[j].start,
+						     toks[j].end - toks[j].start,
+						     copy + expect[j].start,
+						     expect[j].end
+						     - expect[j].start));
+				}
+				tal_free(copy);
+				json_parser_consume(jp);
+				num++;
+				continue;
+			}
+			if (fed == tal_count(all))
+				break;
+
+			/* Drop what's done with, as read_json would. */
+			start = json_parser_start(jp);
+			memmove(buf, buf + start, used - start);
+			json_parser_moved(jp, start);
+			used -= start;
+
+			n = step;
+			if (n > tal_count(all) - fed)
+				n = tal_count(all) - fed;
+			if (used + n > tal_count(buf))
+				tal_resize(&buf, used + n);
+			memcpy(buf + used, all + fed, n);
+			used += n;
+			fed += n;
+		}
+		assert(num == 20);
+		tal_free(jp);
+	}
+	tal_free(all);
+}
+
+/* Returns usec to produce a getchannels response for n channels. */
+static u64 time_channels(size_t n, size_t *len)
+{
+	struct json_result *r = new_json_result(NULL);
+	struct timeabs start;
+	char **chunks;
+	size_t i;
+	u64 usec;
+
+	start = time_now();
+	add_channels(r, n);
+	chunks = json_result_chunks(r, r);
+	usec = time_to_usec(time_between(time_now(), start));
+
+	*len = 0;
+	for (i = 0; i < tal_count(chunks); i++)
+		*len += tal_count(chunks[i]) - 1;
+	tal_free(r);
+	return usec;
+}
+
+/* With an argument, times responses with that many channels. */
+int main(int argc, char *argv[])
+{
+	check_format();
+	check_chunks();
+	check_parser();
+
+	if (argc > 1) {
+		size_t len, n = atol(argv[1]);
+		u64 usec = time_channels(n, &len);
+		printf("%zu channels: %"PRIu64"usec, %zu bytes\n",
+		       n, usec, len);
+	}
+	return 0;
+}
@@ -0,0 +1,544 @@
+#include "daemon/invoice.c"
+#include "daemon/jsmn/jsmn.c"
+#include "daemon/json.c"
+#include "daemon/jsonrpc.c"
+#include "bitcoin/privkey.h"
+#include "utils.h"
+#include <ccan/time/time.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for close_command */
+const struct json_command close_command;
+/* Generated stub for connect_command */
+const struct json_command connect_command;
+/* Generated stub for db_new_invoice */
+bool db_new_invoice(struct lightningd_state *dstate UNNEEDED,
+		    u64 msatoshi UNNEEDED,
+		    const char *label UNNEEDED,
+		    const struct rval *r UNNEEDED)
+{ fprintf(stderr, "db_new_invoice called!\n"); abort(); }
+/* Generated stub for db_remove_invoice */
+bool db_remove_invoice(struct lightningd_state *dstate UNNEEDED,
+		       const char *label UNNEEDED)
+{ fprintf(stderr, "db_remove_invoice called!\n"); abort(); }
+/* Generated stub for debug_dump_peers */
+void debug_dump_peers(struct lightningd_state *dstate UNNEEDED)
+{ fprintf(stderr, "debug_dump_peers called!\n"); abort(); }
+/* Generated stub for dev_add_route_command */
+const struct json_command dev_add_route_command;
+/* Generated stub for dev_commit_command */
+const struct json_command dev_commit_command;
+/* Generated stub for dev_disconnect_command */
+const struct json_command dev_disconnect_command;
+/* Generated stub for dev_failhtlc_command */
+const struct json_command dev_failhtlc_command;
+/* Generated stub for dev_feerate_command */
+const struct json_command dev_feerate_command;
+/* Generated stub for dev_fulfillhtlc_command */
+const struct json_command dev_fulfillhtlc_command;
+/* Generated stub for dev_mocktime_command */
+const struct json_command dev_mocktime_command;
+/* Generated stub for dev_newhtlc_command */
+const struct json_command dev_newhtlc_command;
+/* Generated stub for dev_output_command */
+const struct json_command dev_output_command;
+/* Generated stub for dev_reconnect_command */
+const struct json_command dev_reconnect_command;
+/* Generated stub for dev_routefail_command */
+const struct json_command dev_routefail_command;
+/* Generated stub for dev_signcommit_command */
+const struct json_command dev_signcommit_command;
+/* Generated stub for fatal */
+void fatal(const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "fatal called!\n"); abort(); }
+/* Generated stub for getchannels_command */
+const struct json_command getchannels_command;
+/* Generated stub for gethtlcs_command */
+const struct json_command gethtlcs_command;
+/* Generated stub for getnodes_command */
+const struct json_command getnodes_command;
+/* Generated stub for getpeers_command */
+const struct json_command getpeers_command;
+/* Generated stub for getroute_command */
+const struct json_command getroute_command;
+/* Generated stub for log_each_line_ */
+void log_each_line_(const struct log_record *lr UNNEEDED,
+		    void (*func)(unsigned int skipped UNNEEDED,
+				 struct timerel time UNNEEDED,
+				 enum log_level level UNNEEDED,
+				 const char *prefix UNNEEDED,
+				 const char *log UNNEEDED,
+				 void *arg) UNNEEDED,
+		    void *arg UNNEEDED)
+{ fprintf(stderr, "log_each_line_ called!\n"); abort(); }
+/* Generated stub for log_init_time */
+const struct timeabs *log_init_time(const struct log_record *lr UNNEEDED)
+{ fprintf(stderr, "log_init_time called!\n"); abort(); }
+/* Generated stub for log_max_mem */
+size_t log_max_mem(const struct log_record *lr UNNEEDED)
+{ fprintf(stderr, "log_max_mem called!\n"); abort(); }
+/* Generated stub for log_used */
+size_t log_used(const struct log_record *lr UNNEEDED)
+{ fprintf(stderr, "log_used called!\n"); abort(); }
+/* Generated stub for newaddr_command */
+const struct json_command newaddr_command;
+/* Generated stub for sendpay_command */
+const struct json_command sendpay_command;
+/* AUTOGENERATED MOCKS END */
+
+/* We use these, so they can't abort. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+bool log_enabled(struct log *log UNNEEDED, int level UNNEEDED)
+{
+	return false;
+}
+void log_io(struct log *log UNNEEDED, bool in UNNEEDED, const void *data UNNEEDED, size_t len UNNEEDED)
+{
+}
+const char *log_prefix(const struct log *log UNNEEDED)
+{
+	return "";
+}
+struct log *new_log(const tal_t *ctx UNNEEDED, struct log_record *record UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+	return NULL;
+}
+void db_resolve_invoice(struct lightningd_state *dstate UNNEEDED,
+			const char *label UNNEEDED, u64 paid_num UNNEEDED)
+{
+}
+u32 get_block_height(struct lightningd_state *dstate UNNEEDED)
+{
+	return 100;
+}
+const struct siphash_seed *siphash_seed(void)
+{
+	static struct siphash_seed seed;
+	return &seed;
+}
+
+static struct lightningd_state *dstate;
+
+/* How read_json used to work: reparse everything, every time. */
+static struct io_plan *old_read_json(struct io_conn *conn,
+				     struct json_connection *jcon)
+{
+	jsmntok_t *toks;
+	bool valid;
+
+	jcon->used += jcon->len_read;
+	if (jcon->used == tal_count(jcon->buffer))
+		tal_resize(&jcon->buffer, jcon->used * 2);
+
+again:
+	toks = json_parse_input(jcon->buffer, jcon->used, &valid);
+	if (!toks) {
+		if (!valid)
+			return io_close(conn);
+		goto read_more;
+	}
+
+	if (tal_count(toks) == 1) {
+		jcon->used = 0;
+		goto read_more;
+	}
+
+	parse_request(jcon, toks);
+	memmove(jcon->buffer, jcon->buffer + toks[0].end,
+		tal_count(jcon->buffer) - toks[0].end);
+	jcon->used -= toks[0].end;
+	tal_free(toks);
+	assert(!jcon->num_commands);
+	goto again;
+
+read_more:
+	tal_free(toks);
+	return io_read_partial(conn, jcon->buffer + jcon->used,
+			       tal_count(jcon->buffer) - jcon->used,
+			       &jcon->len_read, old_read_json, jcon);
+}
+
+static struct io_plan *old_jcon_connected(struct io_conn *conn,
+					  struct lightningd_state *dstate)
+{
+	struct json_connection *jcon;
+
+	jcon = tal(dstate, struct json_connection);
+	jcon->dstate = dstate;
+	jcon->used = 0;
+	jcon->buffer = tal_arr(jcon, char, 64);
+	jcon->stop = false;
+	list_head_init(&jcon->commands);
+	jcon->num_commands = 0;
+	jcon->outbuf = NULL;
+	jcon->log = NULL;
+	list_head_init(&jcon->output);
+	io_set_finish(conn, finish_jcon, jcon);
+
+	return io_duplex(conn,
+			 io_read_partial(conn, jcon->buffer,
+					 tal_count(jcon->buffer),
+					 &jcon->len_read, old_read_json, jcon),
+			 write_json(conn, jcon));
+}
+
+/* Writes each piece once enough responses have come back. */
+struct client {
+	const char **pieces;
+	size_t *wait;
+	size_t next;
+	size_t responses, expect;
+	/* What came back, unless NULL. */
+	char *output;
+	/* Called whenever more comes back. */
+	void (*got)(struct client *c);
+	char buf[65536];
+	size_t len;
+};
+
+static struct client *new_client(const tal_t *ctx, size_t expect)
+{
+	struct client *c = tal(ctx, struct client);
+
+	c->pieces = tal_arr(c, const char *, 0);
+	c->wait = tal_arr(c, size_t, 0);
+	c->next = c->responses = 0;
+	c->expect = expect;
+	c->output = tal_strdup(c, "");
+	c->got = NULL;
+	return c;
+}
+
+/* Write this once there have been wait responses. */
+static void client_send(struct client *c, const char *piece, size_t wait)
+{
+	size_t n = tal_count(c->pieces);
+
+	tal_resize(&c->pieces, n + 1);
+	tal_resize(&c->wait, n + 1);
+	c->pieces[n] = piece;
+	c->wait[n] = wait;
+	io_wake(c);
+}
+
+/* Everything written, and everything answered? */
+static bool client_done(const struct client *c)
+{
+	return c->next == tal_count(c->pieces) && c->responses == c->expect;
+}
+
+static struct io_plan *client_write(struct io_conn *conn, struct client *c)
+{
+	if (client_done(c))
+		return io_close(conn);
+	if (c->next < tal_count(c->pieces) && c->responses >= c->wait[c->next]) {
+		const char *p = c->pieces[c->next++];
+		return io_write(conn, p, strlen(p), client_write, c);
+	}
+	return io_out_wait(conn, c, client_write, c);
+}
+
+static struct io_plan *client_read(struct io_conn *conn, struct client *c)
+{
+	size_t i, old = c->responses;
+
+	for (i = 0; i < c->len; i++)
+		c->responses += (c->buf[i] == '\n');
+	if (c->output)
+		tal_append_fmt(&c->output, "%.*s", (int)c->len, c->buf);
+	if (c->got && c->responses != old)
+		c->got(c);
+	io_wake(c);
+
+	if (client_done(c))
+		return io_close(conn);
+	return io_read_partial(conn, c->buf, sizeof(c->buf), &c->len,
+			       client_read, c);
+}
+
+static struct io_plan *client_connected(struct io_conn *conn,
+					struct client *c)
+{
+	c->len = 0;
+	return io_duplex(conn, client_read(conn, c), client_write(conn, c));
+}
+
+static void connect_client(struct client *c, bool old)
+{
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		abort();
+	if (old)
+		io_new_conn(dstate, fds[0], old_jcon_connected, dstate);
+	else
+		io_new_conn(dstate, fds[0], jcon_connected, dstate);
+	io_new_conn(dstate, fds[1], client_connected, c);
+}
+
+/* Until it's written everything, and had every response. */
+static void run_client(struct client *c, bool old)
+{
+	connect_client(c, old);
+	io_loop(NULL, NULL);
+	assert(client_done(c));
+}
+
+static char *rhash_request(const tal_t *ctx, size_t id)
+{
+	return tal_fmt(ctx, "{ \"method\" : \"dev-rhash\", \"params\" : "
+		       "[ \"%064zx\" ], \"id\" : %zu }\n", id, id);
+}
+
+static char *request(const tal_t *ctx, const char *method,
+		     const char *params, const char *id)
+{
+	return tal_fmt(ctx, "{ \"method\" : \"%s\", \"params\" : %s,"
+		       " \"id\" : \"%s\" }\n", method, params, id);
+}
+
+/* Line n of what came back. */
+static const char *response(const struct client *c, size_t n)
+{
+	const char *p = c->output, *end;
+
+	while (n--)
+		p = strchr(p, '\n') + 1;
+	end = strchr(p, '\n');
+	return tal_strndup(c, p, end - p);
+}
+
+static bool response_has(const struct client *c, size_t n, const char *str)
+{
+	return strstr(response(c, n), str) != NULL;
+}
+
+/* A request arriving behind another shouldn't hold it up. */
+static void check_pipelined(void)
+{
+	struct client *c = new_client(dstate, 3);
+	char *req = rhash_request(c, 3);
+	size_t i, split = strlen(req) / 2;
+	struct sha256 h;
+	u8 secret[32];
+
+	/* Two, then half of the third: we want the first two answered. */
+	client_send(c, tal_fmt(c, "  %s\n%s%.*s",
+			       rhash_request(c, 1), rhash_request(c, 2),
+			       (int)split, req), 0);
+	client_send(c, req + split, 2);
+	/* And some whitespace, for luck. */
+	client_send(c, "\n \t", 3);
+	run_client(c, false);
+
+	for (i = 1; i <= 3; i++) {
+		memset(secret, 0, sizeof(secret));
+		secret[31] = i;
+		sha256(&h, secret, sizeof(secret));
+		assert(streq(response(c, i - 1),
+			     tal_fmt(c, "{ \"result\" : { \"rhash\" : \"%s\" },"
+				     " \"error\" : null, \"id\" : %zu }",
+				     tal_hexstr(c, &h, sizeof(h)), i)));
+	}
+	tal_free(c);
+}
+
+/* Garbage closes the connection, even after a valid request. */
+static void check_invalid(void)
+{
+	struct client *c = new_client(dstate, 0);
+
+	client_send(c, tal_fmt(c, "%s}", rhash_request(c, 1)), 0);
+	run_client(c, false);
+	assert(c->responses == 0);
+	tal_free(c);
+}
+
+static void pay_when_answered(struct client *c)
+{
+	/* getinfo came back first, while waitinvoice is still waiting. */
+	assert(c->responses == 1);
+	assert(response_has(c, 0, "\"id\" : \"getinfo\""));
+	resolve_invoice(dstate, find_invoice_by_label(dstate->invoices,
+						       "first"));
+	c->got = NULL;
+}
+
+/* A command which is waiting doesn't hold up the ones after it. */
+static void check_concurrent(void)
+{
+	struct client *c = new_client(dstate, 2);
+	struct rval r;
+
+	memset(&r, 1, sizeof(r));
+	invoice_add(dstate, &r, 1000, "first", 0);
+
+	client_send(c, tal_fmt(c, "%s%s",
+			       request(c, "waitinvoice", "[]", "wait"),
+			       request(c, "getinfo", "[]", "getinfo")), 0);
+	c->got = pay_when_answered;
+	run_client(c, false);
+	assert(response_has(c, 1, "\"label\" : \"first\""));
+	assert(response_has(c, 1, "\"id\" : \"wait\""));
+	tal_free(c);
+}
+
+static size_t num_waiters(void)
+{
+	struct invoice_waiter *w;
+	size_t n = 0;
+
+	list_for_each(&dstate->invoices->waiters, w, list)
+		n++;
+	return n;
+}
+
+static struct client *busy;
+static size_t pings_at_max;
+
+/* Keep pinging on another connection until busy has filled up. */
+static void ping(struct client *c)
+{
+	if (num_waiters() == JSONRPC_MAX_COMMANDS)
+		pings_at_max++;
+
+	/* Give it every chance to (wrongly) read more. */
+	if (pings_at_max < 10) {
+		assert(num_waiters() <= JSONRPC_MAX_COMMANDS);
+		client_send(c, request(c, "getinfo", "[]", "ping"),
+			    c->responses);
+		c->expect++;
+		return;
+	}
+
+	/* It didn't get to the last one. */
+	assert(busy->responses == 0);
+	resolve_invoice(dstate, find_invoice_by_label(dstate->invoices,
+						       "second"));
+}
+
+/* Once a connection has its fill of commands, we stop reading it. */
+static void check_max_commands(void)
+{
+	struct client *c = new_client(dstate, 1);
+	char *reqs;
+	size_t i;
+	struct rval r;
+
+	memset(&r, 2, sizeof(r));
+	invoice_add(dstate, &r, 1000, "second", 0);
+
+	busy = new_client(dstate, JSONRPC_MAX_COMMANDS + 1);
+	reqs = tal_strdup(busy, "");
+	for (i = 0; i < JSONRPC_MAX_COMMANDS; i++)
+		tal_append_fmt(&reqs, "%s", request(busy, "waitinvoice",
+						    "[ \"first\" ]", "wait"));
+	tal_append_fmt(&reqs, "%s", request(busy, "getinfo", "[]", "last"));
+	client_send(busy, reqs, 0);
+	connect_client(busy, false);
+
+	client_send(c, request(c, "getinfo", "[]", "ping"), 0);
+	c->got = ping;
+	run_client(c, false);
+
+	assert(client_done(busy));
+	for (i = 0; i < JSONRPC_MAX_COMMANDS; i++)
+		assert(response_has(busy, i, "\"label\" : \"second\""));
+	assert(response_has(busy, i, "\"id\" : \"last\""));
+	tal_free(busy);
+	tal_free(c);
+}
+
+static void pay_when_streaming(struct client *c)
+{
+	if (c->responses < 2)
+		return;
+	resolve_invoice(dstate, find_invoice_by_label(dstate->invoices,
+						       "third"));
+	c->got = NULL;
+}
+
+/* A stream answers its request, then sends notifications with no id. */
+static void check_subscribe(void)
+{
+	struct client *c = new_client(dstate, 3);
+	struct rval r;
+
+	memset(&r, 3, sizeof(r));
+	invoice_add(dstate, &r, 1000, "third", 0);
+
+	client_send(c, request(c, "subscribeinvoices", "[ 1 ]", "sub"), 0);
+	c->got = pay_when_streaming;
+	run_client(c, false);
+
+	assert(response_has(c, 0, "\"error\" : null, \"id\" : \"sub\""));
+	assert(response_has(c, 1, "\"method\" : \"invoice_paid\""));
+	assert(response_has(c, 1, "\"label\" : \"second\""));
+	assert(response_has(c, 1, "\"id\" : null"));
+	assert(response_has(c, 2, "\"label\" : \"third\""));
+	assert(response_has(c, 2, "\"id\" : null"));
+	tal_free(c);
+}
+
+/* Returns usec to answer n requests, written in 4k pieces. */
+static u64 time_requests(size_t n, bool old)
+{
+	char *all = tal_arr(dstate, char, 0);
+	struct client *c = new_client(all, n);
+	struct timeabs start;
+	size_t i, off;
+
+	for (i = 0; i < n; i++) {
+		char *req = rhash_request(all, i);
+		tal_expand(&all, req, strlen(req));
+	}
+
+	for (off = 0; off < tal_count(all); off += 4096) {
+		size_t len = tal_count(all) - off;
+		if (len > 4096)
+			len = 4096;
+		client_send(c, tal_strndup(c, all + off, len), 0);
+	}
+	c->output = tal_free(c->output);
+
+	start = time_now();
+	run_client(c, old);
+	tal_free(all);
+	return time_to_usec(time_between(time_now(), start));
+}
+
+/* With an argument, times that many requests down one socket. */
+int main(int argc, char *argv[])
+{
+	struct privkey privkey;
+
+	dstate = talz(NULL, struct lightningd_state);
+	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN
+						   | SECP256K1_CONTEXT_VERIFY);
+	memset(&privkey, 1, sizeof(privkey));
+	pubkey_from_privkey(dstate->secpctx, &privkey, &dstate->id);
+	dstate->invoices = invoices_init(dstate);
+
+	check_pipelined();
+	check_invalid();
+	check_concurrent();
+	check_max_commands();
+	check_subscribe();
+
+	if (argc > 1) {
+		size_t n = atol(argv[1]);
+		printf("%zu requests: %"PRIu64"usec\n", n,
+		       time_requests(n, false));
+		/* The old way is worse than quadratic: don't wait all day. */
+		n /= 100;
+		printf("%zu requests: %"PRIu64"usec (was %"PRIu64"usec)\n", n,
+		       time_requests(n, false),
+		       time_requests(n, true));
+	}
+	secp256k1_context_destroy(dstate->secpctx);
+	tal_free(dstate);
+	return 0;
+}
@@ -0,0 +1,299 @@
+#include "daemon/log.c"
+#include "bitcoin/privkey.h"
+#include <ccan/mem/mem.h>
+#include <ccan/time/time.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* AUTOGENERATED MOCKS END */
+
+static struct lightningd_state *dstate;
+
+struct lines {
+	size_t num;
+	unsigned int skipped;
+	char *last;
+	enum log_level last_level;
+};
+
+static void add_line(unsigned int skipped,
+		     struct timerel time,
+		     enum log_level level,
+		     const char *prefix,
+		     const char *log,
+		     struct lines *lines)
+{
+	lines->skipped += skipped;
+	lines->num++;
+	tal_free(lines->last);
+	if (level == LOG_IO)
+		lines->last = tal_dup_arr(NULL, char, log, tal_count(log), 0);
+	else
+		lines->last = tal_strdup(NULL, log);
+	lines->last_level = level;
+}
+
+static const char *last_line(const struct log_record *lr)
+{
+	static struct lines lines;
+
+	lines.num = 0;
+	lines.skipped = 0;
+	lines.last = tal_free(lines.last);
+	log_each_line(lr, add_line, &lines);
+	return lines.last;
+}
+
+/* Every format gives what printf would have. */
+#define check_fmt(log, fmt, ...)					\
+	do {								\
+		char *expect = tal_fmt(NULL, fmt, __VA_ARGS__);		\
+		log_debug((log), fmt, __VA_ARGS__);			\
+		assert(streq(last_line((log)->lr), expect));		\
+		tal_free(expect);					\
+	} while (0)
+
+static void check_formats(struct log *log)
+{
+	const char *str = "hello world";
+	int i = -17;
+
+	check_fmt(log, "%s", "plain");
+	check_fmt(log, "%d %i %u %x %X %o %c", i, i, 17U, 255, 255U, 8, 'c');
+	check_fmt(log, "%"PRIu64" %"PRIx64" %"PRIi64, (u64)-1, (u64)12345,
+		  (s64)-3);
+	check_fmt(log, "%zu %zi %ld %lld %hu %hhx", (size_t)7, (ssize_t)-7,
+		  -1L, 1LL << 40, (unsigned short)65535, (unsigned char)200);
+	check_fmt(log, "%5.2f %e %g %Lf", 3.14159, 1e10, 0.5, (long double)2);
+	check_fmt(log, "[%-10s] [%10s] [%.5s] [%.*s] [%*d] [%*.*s]",
+		  str, str, str, 3, str, 6, i, 8, 2, str);
+	check_fmt(log, "%p %% %s", &i, (const char *)NULL);
+	check_fmt(log, "%s%s%s", "", "a", "");
+	check_fmt(log, "no args%s", "");
+}
+
+static void check_structs(struct log *log)
+{
+	struct privkey privkey;
+	struct pubkey key;
+	struct sha256 sha;
+	struct abs_locktime abs;
+	struct rval r;
+	struct htlc h;
+	char *expect;
+
+	memset(&privkey, 1, sizeof(privkey));
+	pubkey_from_privkey(dstate->secpctx, &privkey, &key);
+	memset(&sha, 2, sizeof(sha));
+	memset(&r, 3, sizeof(r));
+	blocks_to_abs_locktime(500000, &abs);
+
+	log_debug_struct(log, "key %s!", struct pubkey, &key);
+	expect = tal_fmt(log, "key %s!",
+			 pubkey_to_hexstr(log, dstate->secpctx, &key));
+	assert(streq(last_line(log->lr), expect));
+
+	/* Changing it afterwards doesn't change the log. */
+	log_info_struct(log, "sha %s", struct sha256, &sha);
+	sha.u.u8[0] = 0;
+	expect = tal_fmt(log, "sha %s", tal_hexstr(log, "\2\2\2\2", 4));
+	assert(strstarts(last_line(log->lr), expect));
+
+	memset(&h, 0, sizeof(h));
+	h.id = 7;
+	h.msatoshi = 1000;
+	h.expiry = abs;
+	h.r = &r;
+	log_debug_struct(log, "%s", struct htlc, &h);
+	expect = tal_fmt(log, "{ id=7 msatoshi=1000 expiry=500000blocks"
+			 " rhash=%s rval=%s src=local }",
+			 tal_hexstr(log, &h.rhash, sizeof(h.rhash)),
+			 tal_hexstr(log, &r, sizeof(r)));
+	assert(streq(last_line(log->lr), expect));
+
+	log_debug_blob(log, "blob %s", "\1\2\3", 3);
+	assert(streq(last_line(log->lr), "blob 010203"));
+
+	/* log_add appends to the line. */
+	log_info(log, "first");
+	log_add(log, " then %u", 2);
+	log_add_struct(log, " then %s", struct abs_locktime, &abs);
+	log_add_blob(log, " then %s", "\xff", 1);
+	assert(streq(last_line(log->lr), "first then 2 then 500000blocks then ff"));
+
+}
+
+static unsigned int num_evaluated;
+
+static unsigned int evaluate(void)
+{
+	return num_evaluated++;
+}
+
+/* Below the level, arguments aren't even evaluated. */
+static void check_levels(void)
+{
+	struct log_record *lr = new_log_record(dstate, 4096, LOG_BROKEN);
+	struct log *log, *iolog;
+	struct sha256 sha;
+
+	set_log_record_level(lr, LOG_INFORM);
+	set_log_level_for(lr, "peer", LOG_IO);
+	log = new_log(lr, lr, "quiet");
+	iolog = new_log(lr, lr, "peer 1:");
+
+	log_debug(log, "%u", evaluate());
+	log_add(log, "%u", evaluate());
+	log_debug_struct(log, "%s", struct sha256,
+			 (evaluate(), &sha));
+	assert(num_evaluated == 0);
+	assert(!last_line(lr));
+
+	log_info(log, "%u", evaluate());
+	log_add(log, " %u", evaluate());
+	assert(num_evaluated == 2);
+	assert(streq(last_line(lr), "0 1"));
+
+	/* Only the peer gets IO logging, which is handed over raw. */
+	log_io(log, true, "\0\1", 2);
+	assert(streq(last_line(lr), "0 1"));
+	log_io(iolog, true, "\0\1", 2);
+	assert(tal_count(last_line(lr)) == 3);
+	assert(memeq(last_line(lr), 3, "\1\0\1", 3));
+
+	/* Until it's renamed. */
+	set_log_prefix(log, "peer 2:");
+	log_io(log, false, "\2", 1);
+	assert(memeq(last_line(lr), 2, "\0\2", 2));
+	set_log_prefix(iolog, "gone:");
+	log_io(iolog, true, "\3", 1);
+	assert(memeq(last_line(lr), 2, "\0\2", 2));
+
+	/* Compiled out is never kept, even if we'd print everything. */
+	set_log_level(lr, LOG_IO);
+	assert(log_enabled(log, LOG_IO));
+	assert(!log_compiled_out(log));
+	assert(!log_enabled(log, -1));
+	tal_free(lr);
+}
+
+static unsigned int num_printed;
+
+static void count_print(const char *prefix,
+			enum log_level level,
+			bool continued,
+			const char *str, void *arg)
+{
+	assert(level >= LOG_INFORM);
+	assert(streq(prefix, "test"));
+	num_printed++;
+}
+
+/* Only the newest entries survive, whole and in order. */
+static void check_wrap(void)
+{
+	struct log_record *lr = new_log_record(dstate, 4096, LOG_INFORM);
+	struct log *log = new_log(lr, lr, "test");
+	struct lines lines;
+	FILE *f;
+	char buf[8192];
+	size_t i, len;
+
+	set_log_outfn(lr, count_print, NULL);
+	for (i = 0; i < 1000; i++) {
+		log_debug(log, "record %zu", i);
+		if (i % 3 == 0)
+			log_add(log, " (%zu)", i / 3);
+		if (i % 100 == 0)
+			log_info(log, "info %zu", i);
+	}
+	assert(num_printed == 10);
+	assert(log_used(lr) <= log_max_mem(lr));
+
+	memset(&lines, 0, sizeof(lines));
+	log_each_line(lr, add_line, &lines);
+	assert(lines.skipped > 0);
+	assert(lines.skipped + lines.num == 1000 + 10);
+	assert(streq(lines.last, "record 999 (333)"));
+	tal_free(lines.last);
+
+	f = tmpfile();
+	log_dump_to_file(fileno(f), lr);
+	rewind(f);
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[len] = '\0';
+	fclose(f);
+	assert(strstr(buf, "skipped..."));
+	assert(strstr(buf, "testDEBUG: record 998\n"));
+	assert(strstr(buf, "testDEBUG: record 999 (333)\n\n"));
+	tal_free(lr);
+}
+
+/* With an argument, times that many log calls. */
+static void time_log(size_t n)
+{
+	struct log_record *lr = new_log_record(dstate, 20*1024*1024,
+					       LOG_INFORM);
+	struct log *log = new_log(lr, lr, "lightningd(1234):");
+	struct privkey privkey;
+	struct pubkey key;
+	struct lines lines;
+	struct timeabs start;
+	u64 usec, skipusec;
+	size_t i;
+
+	memset(&privkey, 1, sizeof(privkey));
+	pubkey_from_privkey(dstate->secpctx, &privkey, &key);
+
+	/* The sort of thing find_route says for every edge. */
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		log_debug(log, "Checking edge %zu: fee %"PRIu64" risk %"PRIu64,
+			  i, (u64)i * 1000, (u64)i * 3);
+		log_debug_struct(log, "-> %s", struct pubkey, &key);
+	}
+	usec = time_to_usec(time_between(time_now(), start));
+
+	/* And when we're not keeping debug at all. */
+	set_log_record_level(lr, LOG_INFORM);
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		log_debug(log, "Checking edge %zu: fee %"PRIu64" risk %"PRIu64,
+			  i, (u64)i * 1000, (u64)i * 3);
+		log_debug_struct(log, "-> %s", struct pubkey, &key);
+	}
+	skipusec = time_to_usec(time_between(time_now(), start));
+
+	memset(&lines, 0, sizeof(lines));
+	log_each_line(lr, add_line, &lines);
+	tal_free(lines.last);
+	printf("%.0f calls/sec, %.1f bytes per record"
+	       " (%.0f calls/sec below record level)\n",
+	       n * 2 * 1000000.0 / usec, (double)log_used(lr) / lines.num,
+	       n * 2 * 1000000.0 / skipusec);
+	tal_free(lr);
+}
+
+int main(int argc, char *argv[])
+{
+	struct log_record *lr;
+	struct log *log;
+
+	dstate = talz(NULL, struct lightningd_state);
+	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN
+						   | SECP256K1_CONTEXT_VERIFY);
+	lr = new_log_record(dstate, 1024*1024, LOG_BROKEN);
+	log = new_log(lr, lr, "test");
+
+	check_formats(log);
+	check_structs(log);
+	check_levels();
+	check_wrap();
+
+	if (argc > 1)
+		time_log(atol(argv[1]));
+
+	secp256k1_context_destroy(dstate->secpctx);
+	tal_free(dstate);
+	return 0;
+}
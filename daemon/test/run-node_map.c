@@ -0,0 +1,163 @@
+#include "daemon/routing.c"
+#include <ccan/time/time.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for command_fail */
+void command_fail(struct command *cmd UNNEEDED, const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "command_fail called!\n"); abort(); }
+/* Generated stub for command_success */
+void command_success(struct command *cmd UNNEEDED, struct json_result *response UNNEEDED)
+{ fprintf(stderr, "command_success called!\n"); abort(); }
+/* Generated stub for fatal */
+void fatal(const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "fatal called!\n"); abort(); }
+/* Generated stub for json_add_null */
+void json_add_null(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_add_null called!\n"); abort(); }
+/* Generated stub for json_add_num */
+void json_add_num(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		  unsigned int value UNNEEDED)
+{ fprintf(stderr, "json_add_num called!\n"); abort(); }
+/* Generated stub for json_add_pubkey */
+void json_add_pubkey(struct json_result *response UNNEEDED,
+		     secp256k1_context *secpctx UNNEEDED,
+		     const char *fieldname UNNEEDED,
+		     const struct pubkey *key UNNEEDED)
+{ fprintf(stderr, "json_add_pubkey called!\n"); abort(); }
+/* Generated stub for json_add_string */
+void json_add_string(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED, const char *value UNNEEDED)
+{ fprintf(stderr, "json_add_string called!\n"); abort(); }
+/* Generated stub for json_array_end */
+void json_array_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_array_end called!\n"); abort(); }
+/* Generated stub for json_array_start */
+void json_array_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_array_start called!\n"); abort(); }
+/* Generated stub for json_get_params */
+bool json_get_params(const char *buffer UNNEEDED, const jsmntok_t param[] UNNEEDED, ...)
+{ fprintf(stderr, "json_get_params called!\n"); abort(); }
+/* Generated stub for json_object_end */
+void json_object_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_object_end called!\n"); abort(); }
+/* Generated stub for json_object_start */
+void json_object_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_object_start called!\n"); abort(); }
+/* Generated stub for json_tok_bool */
+bool json_tok_bool(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED, bool *b UNNEEDED)
+{ fprintf(stderr, "json_tok_bool called!\n"); abort(); }
+/* Generated stub for json_tok_number */
+bool json_tok_number(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED,
+		     unsigned int *num UNNEEDED)
+{ fprintf(stderr, "json_tok_number called!\n"); abort(); }
+/* Generated stub for new_json_result */
+struct json_result *new_json_result(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "new_json_result called!\n"); abort(); }
+/* Generated stub for null_response */
+struct json_result *null_response(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "null_response called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* We use these, so they can't abort. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+bool log_enabled(struct log *log UNNEEDED, int level UNNEEDED)
+{
+	return true;
+}
+
+void log_add_(struct log *log UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+
+void log_struct_(struct log *log UNNEEDED, int level UNNEEDED,
+		 const char *structname UNNEEDED,
+		 const char *fmt UNNEEDED, ...)
+{
+}
+
+struct peer *find_peer(struct lightningd_state *dstate UNNEEDED,
+		       const struct pubkey *id UNNEEDED)
+{
+	return NULL;
+}
+
+const struct siphash_seed *siphash_seed(void)
+{
+	static struct siphash_seed seed;
+	return &seed;
+}
+
+/* Keys which only differ at the end: these all used to hash the same. */
+static void make_id(struct pubkey *id, size_t i)
+{
+	memset(id, 0x42, sizeof(*id));
+	memcpy((char *)&id->pubkey + sizeof(id->pubkey) - sizeof(i),
+	       &i, sizeof(i));
+}
+
+/* No connections, so nodes can be freed in any order. */
+static void free_nodes(struct lightningd_state *dstate)
+{
+	node_map_clear(dstate->nodes);
+	tal_free(dstate);
+}
+
+static void run(size_t num, bool bench)
+{
+	struct lightningd_state *dstate = tal(NULL, struct lightningd_state);
+	struct pubkey id;
+	struct timeabs start;
+	struct timerel add_time, get_time;
+	size_t i;
+
+	dstate->nodes = empty_node_map(dstate);
+	dstate->route_graph = NULL;
+	dstate->route_query = NULL;
+	dstate->base_log = NULL;
+
+	start = time_now();
+	for (i = 0; i < num; i++) {
+		make_id(&id, i);
+		add_node(dstate, &id, NULL, i);
+	}
+	add_time = time_between(time_now(), start);
+
+	/* Re-adding updates the existing node. */
+	make_id(&id, 0);
+	assert(add_node(dstate, &id, NULL, 7)->port == 7);
+	assert(dstate->nodes->raw.elems == num);
+
+	start = time_now();
+	for (i = 0; i < num; i++) {
+		struct node *n;
+		make_id(&id, i);
+		n = get_node(dstate, &id);
+		assert(n);
+		assert(pubkey_eq(&n->id, &id));
+	}
+	get_time = time_between(time_now(), start);
+
+	make_id(&id, num);
+	assert(!get_node(dstate, &id));
+
+	if (bench)
+		printf("%zu nodes: add_node %"PRIu64"nsec, get_node %"PRIu64"nsec\n",
+		       num,
+		       time_to_nsec(add_time) / num,
+		       time_to_nsec(get_time) / num);
+	free_nodes(dstate);
+}
+
+/* With arguments, benchmarks add_node/get_node with that many nodes. */
+int main(int argc, char *argv[])
+{
+	int i;
+
+	if (argc == 1)
+		run(1000, false);
+	for (i = 1; i < argc; i++)
+		run(atol(argv[i]), true);
+	return 0;
+}
@@ -0,0 +1,264 @@
+#include "daemon/sigverify.c"
+#include "bitcoin/privkey.h"
+#include <assert.h>
+#include <ccan/array_size/array_size.h>
+#include <ccan/time/time.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+/* AUTOGENERATED MOCKS START */
+/* AUTOGENERATED MOCKS END */
+
+static secp256k1_context *secpctx;
+static pthread_t main_thread;
+
+struct keysig {
+	struct privkey privkey;
+	struct pubkey key;
+	struct sha256_double digest;
+	struct signature sig;
+};
+
+static void make_keysig(struct keysig *ks, unsigned int i)
+{
+	memset(&ks->privkey, i + 1, sizeof(ks->privkey));
+	if (!pubkey_from_privkey(secpctx, &ks->privkey, &ks->key))
+		abort();
+	sha256_double(&ks->digest, &i, sizeof(i));
+	sign_hash(secpctx, &ks->privkey, &ks->digest, &ks->sig);
+}
+
+struct answers {
+	size_t expected, num;
+	bool ok[3];
+};
+
+static void got_answer(bool ok, struct answers *a)
+{
+	/* Always called back from io_loop. */
+	assert(pthread_equal(pthread_self(), main_thread));
+	a->ok[a->num++] = ok;
+	if (a->num == a->expected)
+		io_break(a);
+}
+
+static void never_called(bool ok, struct answers *a)
+{
+	abort();
+}
+
+static void check_sigverify(unsigned int nthreads)
+{
+	struct sigverify *sv = new_sigverify(NULL, secpctx, nthreads);
+	struct answers valid, invalid;
+	struct keysig ks;
+	void *cancelled = tal(NULL, char);
+	struct sha256_double wrong;
+
+	make_keysig(&ks, nthreads);
+	wrong = ks.digest;
+	wrong.sha.u.u8[0] ^= 1;
+
+	/* Freeing ctx first means no callback. */
+	sigverify_check(sv, cancelled, &ks.digest, &ks.key, &ks.sig,
+			never_called, &valid);
+	tal_free(cancelled);
+
+	valid.num = invalid.num = 0;
+	valid.expected = 1;
+	sigverify_check(sv, sv, &ks.digest, &ks.key, &ks.sig,
+			got_answer, &valid);
+	assert(io_loop(NULL, NULL) == &valid);
+	assert(valid.num == 1 && valid.ok[0]);
+
+	invalid.expected = 2;
+	sigverify_check(sv, sv, &wrong, &ks.key, &ks.sig,
+			got_answer, &invalid);
+	make_keysig(&ks, nthreads + 1);
+	sigverify_check(sv, sv, &wrong, &ks.key, &ks.sig,
+			got_answer, &invalid);
+	assert(io_loop(NULL, NULL) == &invalid);
+	assert(invalid.num == 2 && !invalid.ok[0] && !invalid.ok[1]);
+
+	/* Something still in flight gets thrown away. */
+	sigverify_check(sv, sv, &ks.digest, &ks.key, &ks.sig,
+			never_called, &valid);
+	tal_free(sv);
+}
+
+/* A quiet peer we echo for, while a busy one sends sigs to check. */
+struct echo {
+	u8 byte;
+};
+
+static struct io_plan *echo_read(struct io_conn *conn, struct echo *echo);
+
+static struct io_plan *echo_write(struct io_conn *conn, struct echo *echo)
+{
+	return io_write(conn, &echo->byte, 1, echo_read, echo);
+}
+
+static struct io_plan *echo_read(struct io_conn *conn, struct echo *echo)
+{
+	return io_read(conn, &echo->byte, 1, echo_write, echo);
+}
+
+struct pinger {
+	int fd;
+	size_t num;
+	u64 total_usec, max_usec;
+};
+
+static void *ping(void *arg)
+{
+	struct pinger *p = arg;
+	u8 byte = 0;
+
+	for (;;) {
+		struct timeabs start = time_now();
+		u64 usec;
+
+		if (write(p->fd, &byte, 1) != 1 || read(p->fd, &byte, 1) != 1)
+			break;
+		usec = time_to_usec(time_between(time_now(), start));
+		p->num++;
+		p->total_usec += usec;
+		if (usec > p->max_usec)
+			p->max_usec = usec;
+		usleep(1000);
+	}
+	return NULL;
+}
+
+/* The busy peer: every byte it sends is a batch of sigs to check. */
+struct load {
+	struct sigverify *sv;
+	const struct keysig *ks;
+	size_t batchsize, batches, outstanding;
+	u8 byte;
+};
+
+static struct io_plan *load_batch(struct io_conn *conn, struct load *load);
+
+static struct io_plan *load_read(struct io_conn *conn, struct load *load)
+{
+	if (load->batches-- == 0) {
+		io_break(load);
+		return io_close(conn);
+	}
+	return io_read(conn, &load->byte, 1, load_batch, load);
+}
+
+static void load_checked(bool ok, struct load *load)
+{
+	assert(ok);
+	if (--load->outstanding == 0)
+		io_wake(load);
+}
+
+static struct io_plan *load_batch(struct io_conn *conn, struct load *load)
+{
+	size_t i;
+
+	/* No pool?  Do it the old way, inline. */
+	if (!load->sv) {
+		for (i = 0; i < load->batchsize; i++)
+			assert(check_signed_hash(secpctx, &load->ks[i].digest,
+						 &load->ks[i].sig,
+						 &load->ks[i].key));
+		return load_read(conn, load);
+	}
+
+	load->outstanding = load->batchsize;
+	for (i = 0; i < load->batchsize; i++)
+		sigverify_check(load->sv, conn, &load->ks[i].digest,
+				&load->ks[i].key, &load->ks[i].sig,
+				load_checked, load);
+	return io_wait(conn, load, load_read, load);
+}
+
+/* Check batches of sigs as fast as possible, while measuring how long
+ * the quiet peer waits for its echo. */
+static void time_load(const struct keysig *ks, size_t batchsize,
+		      size_t batches, int nthreads)
+{
+	struct load load;
+	struct pinger p;
+	struct echo echo;
+	struct io_conn *echoconn;
+	pthread_t pinger;
+	struct timeabs start;
+	u64 usec;
+	size_t i;
+	int fds[2], loadfds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0
+	    || socketpair(AF_UNIX, SOCK_STREAM, 0, loadfds) != 0)
+		abort();
+
+	load.sv = nthreads < 0 ? NULL : new_sigverify(NULL, secpctx, nthreads);
+	load.ks = ks;
+	load.batchsize = batchsize;
+	load.batches = batches;
+	p.fd = fds[1];
+	p.num = p.total_usec = p.max_usec = 0;
+
+	echoconn = io_new_conn(NULL, fds[0], echo_read, &echo);
+	io_new_conn(NULL, loadfds[0], load_read, &load);
+	pthread_create(&pinger, NULL, ping, &p);
+
+	start = time_now();
+	for (i = 0; i < batches; i++)
+		if (write(loadfds[1], &load.byte, 1) != 1)
+			abort();
+	assert(io_loop(NULL, NULL) == &load);
+	usec = time_to_usec(time_between(time_now(), start));
+
+	/* Pinger sees EOF and stops. */
+	shutdown(fds[0], SHUT_RDWR);
+	pthread_join(pinger, NULL);
+	io_close(echoconn);
+	close(fds[1]);
+	close(loadfds[1]);
+	tal_free(load.sv);
+
+	if (nthreads < 0)
+		printf("inline:    ");
+	else
+		printf("%d threads: ", nthreads);
+	printf("%.0f sigs/sec, peer latency avg %"PRIu64"usec max %"PRIu64
+	       "usec\n",
+	       batchsize * batches * 1000000.0 / usec,
+	       p.num ? p.total_usec / p.num : 0, p.max_usec);
+}
+
+/* With an argument, benchmarks that many batches of 100 sigs. */
+int main(int argc, char *argv[])
+{
+	secpctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN
+					   | SECP256K1_CONTEXT_VERIFY);
+	main_thread = pthread_self();
+
+	check_sigverify(0);
+	check_sigverify(2);
+
+	if (argc > 1) {
+		struct keysig ks[100];
+		size_t i, batches = atol(argv[1]);
+
+		for (i = 0; i < ARRAY_SIZE(ks); i++)
+			make_keysig(&ks[i], i);
+
+		/* The pinger may write after we shut it down. */
+		signal(SIGPIPE, SIG_IGN);
+
+		time_load(ks, ARRAY_SIZE(ks), batches, -1);
+		time_load(ks, ARRAY_SIZE(ks), batches, 1);
+		time_load(ks, ARRAY_SIZE(ks), batches, 2);
+		time_load(ks, ARRAY_SIZE(ks), batches, 4);
+	}
+	secp256k1_context_destroy(secpctx);
+	return 0;
+}
@@ -0,0 +1,282 @@
+#include "daemon/sphinx.c"
+#include <ccan/structeq/structeq.h>
+#include <ccan/time/time.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* AUTOGENERATED MOCKS END */
+
+/* How generate_hop_params used to do it: hop i's point is blinded by the
+ * sessionkey and then by each of the i previous blinding factors. */
+static bool old_hop_params(secp256k1_context *secpctx,
+			   const u8 *sessionkey,
+			   const struct pubkey path[],
+			   int num_hops,
+			   struct hop_params *params)
+{
+	int i, j;
+	secp256k1_pubkey temp;
+
+	if (secp256k1_ec_pubkey_create(secpctx, &params[0].ephemeralkey,
+				       sessionkey) != 1)
+		return false;
+	if (!create_shared_secret(secpctx, params[0].secret, &path[0].pubkey,
+				  sessionkey))
+		return false;
+	compute_blinding_factor(secpctx, &params[0].ephemeralkey,
+				params[0].secret, params[0].blind);
+
+	for (i = 1; i < num_hops; i++) {
+		u8 blind[BLINDING_FACTOR_SIZE], der[33];
+		size_t outputlen = 33;
+		struct sha256 h;
+
+		if (!blind_group_element(secpctx, &params[i].ephemeralkey,
+					 &params[i - 1].ephemeralkey,
+					 params[i - 1].blind))
+			return false;
+
+		memcpy(blind, sessionkey, sizeof(blind));
+		temp = path[i].pubkey;
+		if (!blind_group_element(secpctx, &temp, &temp, blind))
+			return false;
+		for (j = 0; j < i; j++)
+			if (!blind_group_element(secpctx, &temp, &temp,
+						 params[j].blind))
+				return false;
+
+		secp256k1_ec_pubkey_serialize(secpctx, der, &outputlen, &temp,
+					      SECP256K1_EC_COMPRESSED);
+		sha256(&h, der + 1, sizeof(der) - 1);
+		memcpy(params[i].secret, &h, sizeof(h));
+		compute_blinding_factor(secpctx, &params[i].ephemeralkey,
+					params[i].secret, params[i].blind);
+	}
+	return true;
+}
+
+static void random_key(secp256k1_context *secpctx, u8 key[32])
+{
+	size_t i;
+
+	do {
+		for (i = 0; i < 32; i++)
+			key[i] = random();
+	} while (!secp256k1_ec_seckey_verify(secpctx, key));
+}
+
+static struct pubkey *random_path(const tal_t *ctx, secp256k1_context *secpctx,
+				  int num_hops, struct privkey **privkeys)
+{
+	struct pubkey *path = tal_arr(ctx, struct pubkey, num_hops);
+	int i;
+
+	*privkeys = tal_arr(path, struct privkey, num_hops);
+	for (i = 0; i < num_hops; i++) {
+		random_key(secpctx, (*privkeys)[i].secret);
+		if (!secp256k1_ec_pubkey_create(secpctx, &path[i].pubkey,
+						(*privkeys)[i].secret))
+			abort();
+	}
+	return path;
+}
+
+static struct hoppayload *hop_payloads(const tal_t *ctx, int num_hops)
+{
+	struct hoppayload *hp = tal_arrz(ctx, struct hoppayload, num_hops);
+	int i;
+
+	for (i = 0; i < num_hops; i++) {
+		hp[i].realm = i;
+		hp[i].amount = 1000 + i;
+		memset(hp[i].remainder, i, sizeof(hp[i].remainder));
+	}
+	return hp;
+}
+
+/* Every hop gets its own payload, and the last one knows it's last. */
+static void check_onion(secp256k1_context *secpctx, int num_hops)
+{
+	struct privkey *privkeys;
+	struct pubkey *path = random_path(NULL, secpctx, num_hops, &privkeys);
+	struct hoppayload *hp = hop_payloads(path, num_hops);
+	struct sphinx_workspace *ws = new_sphinx_workspace(path);
+	struct hop_params oldp[NUM_MAX_HOPS], newp[NUM_MAX_HOPS];
+	struct onionpacket *packet;
+	u8 sessionkey[32];
+	int i;
+
+	random_key(secpctx, sessionkey);
+	assert(old_hop_params(secpctx, sessionkey, path, num_hops, oldp));
+	assert(generate_hop_params(secpctx, sessionkey, path, num_hops, newp));
+	for (i = 0; i < num_hops; i++) {
+		assert(memeq(oldp[i].secret, sizeof(oldp[i].secret),
+			     newp[i].secret, sizeof(newp[i].secret)));
+		assert(memeq(oldp[i].blind, sizeof(oldp[i].blind),
+			     newp[i].blind, sizeof(newp[i].blind)));
+		assert(structeq(&oldp[i].ephemeralkey, &newp[i].ephemeralkey));
+	}
+
+	packet = create_onionpacket(path, secpctx, ws, path, hp, sessionkey,
+				    (u8 *)"", 0);
+	for (i = 0; i < num_hops; i++) {
+		struct route_step *step;
+		u8 *ser = serialize_onionpacket(path, secpctx, packet);
+
+		packet = parse_onionpacket(path, secpctx, ser, tal_count(ser));
+		assert(packet);
+		step = process_onionpacket(path, secpctx, packet, &privkeys[i]);
+		assert(step);
+		assert(step->hoppayload->realm == i);
+		assert(step->hoppayload->amount == 1000 + i);
+		assert(memeq(step->hoppayload->remainder,
+			     sizeof(step->hoppayload->remainder),
+			     hp[i].remainder, sizeof(hp[i].remainder)));
+		assert(step->nextcase
+		       == (i == num_hops - 1 ? ONION_END : ONION_FORWARD));
+		packet = step->next;
+	}
+	tal_free(path);
+}
+
+/* We can't fit more than NUM_MAX_HOPS in the routing info. */
+static void check_too_long(secp256k1_context *secpctx)
+{
+	struct privkey *privkeys;
+	struct pubkey *path = random_path(NULL, secpctx, NUM_MAX_HOPS + 1,
+					  &privkeys);
+	struct hoppayload *hp = hop_payloads(path, NUM_MAX_HOPS + 1);
+	struct sphinx_workspace *ws = new_sphinx_workspace(path);
+	u8 sessionkey[32];
+
+	random_key(secpctx, sessionkey);
+	assert(!create_onionpacket(path, secpctx, ws, path, hp, sessionkey,
+				   (u8 *)"", 0));
+	tal_free(path);
+}
+
+/* Returns usec for each of n hop-param derivations over num_hops. */
+static double time_params(secp256k1_context *secpctx, int num_hops, size_t n,
+			  bool old)
+{
+	struct privkey *privkeys;
+	struct pubkey *path = random_path(NULL, secpctx, num_hops, &privkeys);
+	struct hop_params params[NUM_MAX_HOPS];
+	struct timeabs start;
+	u8 sessionkey[32];
+	size_t i;
+
+	random_key(secpctx, sessionkey);
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		if (old)
+			old_hop_params(secpctx, sessionkey, path, num_hops,
+				       params);
+		else
+			generate_hop_params(secpctx, sessionkey, path,
+					    num_hops, params);
+	}
+	tal_free(path);
+	return (double)time_to_usec(time_between(time_now(), start)) / n;
+}
+
+/* Returns usec for each of n onions over num_hops. */
+static double time_onion(secp256k1_context *secpctx, int num_hops, size_t n)
+{
+	struct privkey *privkeys;
+	struct pubkey *path = random_path(NULL, secpctx, num_hops, &privkeys);
+	struct hoppayload *hp = hop_payloads(path, num_hops);
+	struct sphinx_workspace *ws = new_sphinx_workspace(path);
+	struct timeabs start;
+	u8 sessionkey[32];
+	size_t i;
+
+	random_key(secpctx, sessionkey);
+	start = time_now();
+	for (i = 0; i < n; i++)
+		tal_free(create_onionpacket(path, secpctx, ws, path, hp,
+					    sessionkey, (u8 *)"", 0));
+	tal_free(path);
+	return (double)time_to_usec(time_between(time_now(), start)) / n;
+}
+
+/* Returns onions per second the first hop of a 20 hop route unwraps;
+ * *symmetric is the usec of each spent on MAC and decryption. */
+static double unwrap_rate(secp256k1_context *secpctx, size_t n,
+			  double *symmetric)
+{
+	struct privkey *privkeys;
+	struct pubkey *path = random_path(NULL, secpctx, NUM_MAX_HOPS,
+					  &privkeys);
+	struct hoppayload *hp = hop_payloads(path, NUM_MAX_HOPS);
+	struct sphinx_workspace *ws = new_sphinx_workspace(path);
+	struct onionpacket *packet, next;
+	struct timeabs start;
+	struct timerel total;
+	struct keyset keys;
+	u8 sessionkey[32], secret[SHARED_SECRET_SIZE], hmac[SECURITY_PARAMETER];
+	u8 block[CHACHA20_BLOCK];
+	size_t i;
+
+	random_key(secpctx, sessionkey);
+	packet = create_onionpacket(path, secpctx, ws, path, hp, sessionkey,
+				    (u8 *)"", 0);
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		struct route_step *step;
+
+		step = process_onionpacket(path, secpctx, packet, &privkeys[0]);
+		tal_free(step->next);
+		tal_free(step);
+	}
+	total = time_between(time_now(), start);
+
+	create_shared_secret(secpctx, secret, &packet->ephemeralkey,
+			     privkeys[0].secret);
+	generate_key_set(secret, &keys);
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		compute_packet_hmac(packet, keys.mu, hmac);
+		unwrap_field(block, next.routinginfo, packet->routinginfo,
+			     ROUTING_INFO_SIZE, 2 * SECURITY_PARAMETER,
+			     keys.rho);
+		unwrap_field(block, next.hoppayloads, packet->hoppayloads,
+			     TOTAL_HOP_PAYLOAD_SIZE, HOP_PAYLOAD_SIZE,
+			     keys.gamma);
+	}
+	*symmetric = (double)time_to_usec(time_between(time_now(), start)) / n;
+	tal_free(path);
+	return n * 1000000.0 / time_to_usec(total);
+}
+
+/* With an argument, benchmarks that many onions for 1 to 20 hops. */
+int main(int argc, char *argv[])
+{
+	secp256k1_context *secpctx = secp256k1_context_create(
+		SECP256K1_CONTEXT_VERIFY | SECP256K1_CONTEXT_SIGN);
+	int num_hops;
+	double symmetric;
+	size_t n;
+
+	srandom(1);
+	for (num_hops = 1; num_hops <= NUM_MAX_HOPS; num_hops++)
+		check_onion(secpctx, num_hops);
+	check_too_long(secpctx);
+
+	if (argc > 1) {
+		n = atol(argv[1]);
+		for (num_hops = 1; num_hops <= NUM_MAX_HOPS; num_hops++)
+			printf("%2d hops: params %.1f usec (was %.1f),"
+			       " onion %.1f usec\n",
+			       num_hops,
+			       time_params(secpctx, num_hops, n, false),
+			       time_params(secpctx, num_hops, n, true),
+			       time_onion(secpctx, num_hops, n));
+		printf("unwrap: %.0f onions/sec",
+		       unwrap_rate(secpctx, n, &symmetric));
+		printf(", %.2f usec each in MAC and decryption\n", symmetric);
+	}
+	secp256k1_context_destroy(secpctx);
+	return 0;
+}
@@ -107,6 +107,14 @@ struct txwatch *watch_txid_(const tal_t *ctx,
 	txwatch_hash_add(&w->dstate->txwatches, w);
 	tal_add_destructor(w, destroy_txwatch);
 
+	/* A callback from watch_topology_changed: it may be in the chain. */
+	if (w->dstate->txwatches_added) {
+		size_t n = tal_count(w->dstate->txwatches_added);
+
+		tal_resize(&w->dstate->txwatches_added, n+1);
+		w->dstate->txwatches_added[n] = *txid;
+	}
+
 	return w;
 }
 
@@ -155,14 +163,23 @@ struct txowatch *watch_txo_(const tal_t *ctx,
 	return w;
 }
 
-void txwatch_fire(struct lightningd_state *dstate,
+bool txwatch_fire(struct lightningd_state *dstate,
 		  const struct sha256_double *txid,
 		  unsigned int depth)
 {
-	struct txwatch *txw = txwatch_hash_get(&dstate->txwatches, txid);
+	struct txwatch_hash_iter i;
+	struct txwatch *txw;
+	bool fired = false;
 
-	if (txw && depth != txw->depth) {
+again:
+	for (txw = txwatch_hash_getfirst(&dstate->txwatches, txid, &i);
+	     txw;
+	     txw = txwatch_hash_getnext(&dstate->txwatches, txid, &i)) {
 		enum watch_result r;
+
+		if (depth == txw->depth)
+			continue;
+
 		log_debug(txw->peer->log,
 			  "Got depth change %u for %02x%02x%02x...\n",
 			  txw->depth,
@@ -170,16 +187,19 @@ void txwatch_fire(struct lightningd_state *dstate,
 			  txw->txid.sha.u.u8[1],
 			  txw->txid.sha.u.u8[2]);
 		txw->depth = depth;
+		fired = true;
 		r = txw->cb(txw->peer, txw->depth, &txw->txid, txw->cbdata);
 		switch (r) {
 		case DELETE_WATCH:
 			tal_free(txw);
-			return;
+			/* Callback may have added or freed watches, too. */
+			goto again;
 		case KEEP_WATCHING:
-			return;
+			goto again;
 		}
 		fatal("txwatch callback %p returned %i\n", txw->cb, r);
 	}
+	return fired;
 }
 
 void txowatch_fire(struct lightningd_state *dstate,
@@ -214,34 +234,35 @@ void txowatch_fire(struct lightningd_state *dstate,
 
 void watch_topology_changed(struct lightningd_state *dstate)
 {
-	struct txwatch_hash_iter i;
+	struct txwatch_hash_iter it;
 	struct txwatch *w;
-	bool needs_rerun;
+	struct sha256_double *txids;
+	size_t i, n = 0;
 
-again:
-	/* Iterating a htable during deletes is safe, but might skip entries. */
-	needs_rerun = false;
-	for (w = txwatch_hash_first(&dstate->txwatches, &i);
+	/* Kicked-out txs were already fired by free_blocks, and a watch
+	 * on a tx which isn't in the main chain stays at depth 0.  So we
+	 * only want the watches whose block now puts them at a new depth:
+	 * collect them first, as callbacks can add and free watches. */
+	txids = tal_arr(dstate, struct sha256_double, 0);
+	for (w = txwatch_hash_first(&dstate->txwatches, &it);
 	     w;
-	     w = txwatch_hash_next(&dstate->txwatches, &i)) {
-		size_t depth;
-
-		depth = get_tx_depth(dstate, &w->txid);
-		if (depth != w->depth) {
-			enum watch_result r;
-			w->depth = depth;
-			needs_rerun = true;
-			r = w->cb(w->peer, w->depth, &w->txid, w->cbdata);
-			switch (r) {
-			case DELETE_WATCH:
-				tal_free(w);
-				continue;
-			case KEEP_WATCHING:
-				continue;
-			}
-			fatal("txwatch callback %p returned %i\n", w->cb, r);
-		}
+	     w = txwatch_hash_next(&dstate->txwatches, &it)) {
+		if (get_tx_depth(dstate, &w->txid) == w->depth)
+			continue;
+		tal_resize(&txids, n+1);
+		txids[n++] = w->txid;
+	}
+
+	/* Then go through any watches the callbacks added, and so on. */
+	while (tal_count(txids)) {
+		dstate->txwatches_added = tal_arr(dstate,
+						  struct sha256_double, 0);
+		for (i = 0; i < tal_count(txids); i++)
+			txwatch_fire(dstate, &txids[i],
+				     get_tx_depth(dstate, &txids[i]));
+		tal_free(txids);
+		txids = dstate->txwatches_added;
 	}
-	if (needs_rerun)
-		goto again;
+	dstate->txwatches_added = NULL;
+	tal_free(txids);
 }
@@ -124,7 +124,8 @@ struct txowatch *watch_txo_(const tal_t *ctx,
 				      size_t),				\
 		  (cbdata))
 
-void txwatch_fire(struct lightningd_state *dstate,
+/* Fires every watch on txid not already at depth; false if none. */
+bool txwatch_fire(struct lightningd_state *dstate,
 		  const struct sha256_double *txid,
 		  unsigned int depth);
 
@@ -135,5 +136,6 @@ void txowatch_fire(struct lightningd_state *dstate,
 bool watching_txid(struct lightningd_state *dstate,
 		   const struct sha256_double *txid);
 
+/* The main chain changed: fire watches whose tx's depth changed. */
 void watch_topology_changed(struct lightningd_state *dstate);
 #endif /* LIGHTNING_DAEMON_WATCH_H */
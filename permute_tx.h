@@ -7,4 +7,8 @@
 void permute_inputs(struct bitcoin_tx_input *inputs, size_t num_inputs);
 
 void permute_outputs(struct bitcoin_tx_output *outputs, size_t num_outputs);
+
+/* BIP69 output order: negative if a goes before b. */
+int output_cmp(const struct bitcoin_tx_output *a,
+	       const struct bitcoin_tx_output *b);
 #endif /* LIGHTNING_PERMUTE_TX_H */